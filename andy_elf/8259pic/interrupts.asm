@@ -15,6 +15,11 @@ extern PMPrintChar
 extern IKeyboard
 extern CreateIA32IDTEntry
 extern ICmosRTC
+extern scheduler_timer_tick ;defined in scheduler/scheduler.c
+extern switch_out_process   ;defined in scheduler/lowlevel.asm
+extern idle_loop            ;defined in kickoff.s. NOT a function, this is where preempted processes return to
+extern kernel_lock          ;defined in smp/smp.c
+extern kernel_unlock
 
 ;Registers our interrupt handlers in the IDT
 configure_pic_interrupts:
@@ -103,8 +108,12 @@ configure_pic_interrupts:
   pop ebp
   ret
 
-ITimer:     ;timer interrupt handler
-  pushf
+ITimer:     ;timer interrupt handler. Counts the tick, and switches out the running process once its quantum is used up
+  push ebp
+  mov ebp, esp
+  push eax
+  push ecx
+  push edx
   push ebx
   push ds
   push es
@@ -117,19 +126,51 @@ ITimer:     ;timer interrupt handler
   mov fs, ax
   mov gs, ax
 
-  xor bx, bx
-
   mov ebx, 0
   push ebx
 	call pic_send_eoi
   add esp, 4
 
+  call kernel_lock      ;kept hold of if we preempt, idle_loop expects to have it
+  mov eax, [ebp+8]      ;CS of the interrupted code
+  push eax
+  call scheduler_timer_tick
+  add esp, 4
+  test al, al
+  jnz .preempt
+  call kernel_unlock
+
   pop gs
   pop fs
   pop es
   pop ds
   pop ebx
-  popf
+  pop edx
+  pop ecx
+  pop eax
+  pop ebp
+  iret
+
+  .preempt:
+  ;Put the process's registers back the way they were, so that switch_out_process saves them into its process table entry,
+  ;then go back to the idle loop and let enter_next_process pick who runs next.
+  pop gs
+  pop fs
+  pop es
+  pop ds
+  pop ebx
+  pop edx
+  pop ecx
+  pop eax
+  pop ebp
+  call switch_out_process
+  ;set up a stack frame that gets us back to the kernel idle loop
+  pushf
+  xor eax, eax
+  mov eax, cs
+  push eax
+  mov eax, idle_loop
+  push eax
   iret
 
 ISerial2:             ;IRQ3 serial port 2 interrupt handler. Just sends EOI at present
@@ -421,10 +462,12 @@ IPrimaryATA:             ;IRQ14 Primary IDE
   mov fs, ax
   mov gs, ax
 
+  call kernel_lock
   mov ebx, 0
   push ebx
   call ata_service_interrupt  ;tell the ATA driver that this cane from bus 0 (primary)
   add esp, 4                  ;all pushes are 32 bits
+  call kernel_unlock
 
   mov ebx, 14
   push ebx
@@ -465,10 +508,12 @@ ISecondaryATA:             ;IRQ15 Secondary IDE
   mov fs, ax
   mov gs, ax
 
+  call kernel_lock
   mov ebx, 1
   push ebx
   call ata_service_interrupt ;tell the ATA driver that this cane from bus 1 (secondary)
   add esp, 4                  ;all pushes are 32 bits
+  call kernel_unlock
 
   mov ebx, 15
   push ebx
@@ -5,8 +5,13 @@
 #include <cfuncs.h>
 #include <stdio.h>
 #include <memops.h>
+#include <sys/ioports.h>
+#include <sys/smp.h>
+#include <acpi/lapic.h>
 #include "apic.h"
 
+static vaddr plapic_base = PLAPIC_DEFAULT_ADDRESS;
+
 /*
 works out how many pages we need to store the given number of bytes
 */
@@ -31,7 +36,8 @@ void* apic_io_identity_mapping(vaddr apic_base)
   kprintf("      DEBUG pointer 0x%x is at 0x%x,0x%x\r\n", apic_base, directory_number, entry_number);
 
   //the memory pointer 0xFEC00000 should be on the page 0x0 of directory 0x3FB (1019)
-  return k_map_page(NULL, (void *)apic_base, directory_number, entry_number, MP_READWRITE);
+  //these are device registers, so they must never be cached
+  return k_map_page(NULL, (void *)apic_base, directory_number, entry_number, MP_READWRITE|MP_PCD);
 }
 
 /*
@@ -55,9 +61,43 @@ uint32_t _read_mmapped_reg(vaddr apic_base, uint16_t reg)
   return v;
 }
 
+void plapic_set_address(uint32_t phys_address)
+{
+  plapic_base = (vaddr)phys_address;
+}
+
+uint8_t plapic_map()
+{
+  if(apic_io_identity_mapping(plapic_base)==NULL) {
+    kputs("ERROR unable to memory-map processor-local APIC\r\n");
+    return 1;
+  }
+  return 0;
+}
+
+vaddr plapic_get_base()
+{
+  return plapic_base;
+}
+
+uint8_t plapic_get_id()
+{
+  return (uint8_t)(_read_mmapped_reg(plapic_base, LAPIC_REG_ID) >> 24);
+}
+
 void plapic_send_eoi()
 {
-  k_panic("plapic_send_eoi not implemented yet");
+  _write_mmapped_reg(plapic_base, LAPIC_REG_EOI, 0);
+}
+
+void plapic_send_ipi(uint8_t apic_id, uint32_t command)
+{
+  //an interrupt handler on this processor that sent an IPI in between the two writes would change the destination
+  uint32_t flags = irq_save();
+  while(_read_mmapped_reg(plapic_base, LAPIC_REG_ICR_LOW) & ICR_SEND_PENDING) asm volatile("pause");
+  _write_mmapped_reg(plapic_base, LAPIC_REG_ICR_HIGH, (uint32_t)apic_id << 24);
+  _write_mmapped_reg(plapic_base, LAPIC_REG_ICR_LOW, command);
+  irq_restore(flags);
 }
 /*
 Enables the processor-local apic on this processor.
@@ -70,11 +110,15 @@ Returns:
 */
 int16_t enable_plapic(vaddr apic_base, uint8_t apic_id, uint16_t interrupt_base)
 {
-  //set up lapic timer
-  _write_mmapped_reg(apic_base, 0x320, (LAPIC_TIMER_CHOSEN_VECTOR & LVT_VECTOR_MASK));
+  //the lapic timer stays masked. The PIT on the boot processor drives the scheduler, and the other processors are told
+  //to switch processes by IPI, see scheduler_timer_tick.
+  _write_mmapped_reg(apic_base, LAPIC_REG_LVT_TIMER, LVT_INTERRUPT_MASK | (LAPIC_TIMER_CHOSEN_VECTOR & LVT_VECTOR_MASK));
+
+  //accept interrupts of every priority
+  _write_mmapped_reg(apic_base, LAPIC_REG_TPR, 0);
 
-  //set up spurious interrupt to 0xFF
-  _write_mmapped_reg(apic_base, 0xF0, 0xFF | SPV_APIC_ENABLED);
+  //set up spurious interrupt to 0xFF, and switch the whole thing on
+  _write_mmapped_reg(apic_base, LAPIC_REG_SPURIOUS, LAPIC_SPURIOUS_VECTOR | SPV_APIC_ENABLED);
 
   return 1;
 }
@@ -117,13 +161,10 @@ void read_madt_info(char *madt_ptr)
   APICGeneralInformation *apic_general = (APICGeneralInformation *)&madt_ptr[ctr];
 
   kprintf("  Local APIC physical address is 0x%x\r\n", apic_general->local_apic_address);
-  return;
+  plapic_set_address(apic_general->local_apic_address);
 
-  if(apic_general->legacy_flags & APIC_GENERAL_LEGACY_PIC_PRESENT) {
-    kputs("  Legacy APIC is present, disabling\r\n");
-    legacy_pic_remap(0x20, 0x28);
-    disable_legacy_pic();
-  }
+  //the IOAPIC is not driven yet, so interrupts still come in through the 8259 and it must stay enabled even if
+  //APIC_GENERAL_LEGACY_PIC_PRESENT is set.
   ctr += sizeof(APICGeneralInformation);
   while(ctr<table_header->Length) {
     MADTEntryHeader *h = (MADTEntryHeader *)&madt_ptr[ctr];
@@ -132,11 +173,8 @@ void read_madt_info(char *madt_ptr)
       case 0:
         apic = (ProcessorLocalAPIC *)&madt_ptr[ctr+2];  //skip over the type and length fields
         kprintf("      Processor ID %d with apic ID %d flags 0x%x\r\n", apic->acpi_processor_id, apic->apic_id, apic->apic_flags);
-        if(apic_io_identity_mapping(PLAPIC_DEFAULT_ADDRESS)==NULL){
-          kputs("    ERROR unable to memory-map processor-local APIC\r\n");
-        } else {
-          enable_plapic(PLAPIC_DEFAULT_ADDRESS, apic->apic_id, 0x20);
-        }; //processor-local APIC defaults to this range, always local to the prcoessor you're running on
+        //the processors are started up later on by smp_initialise, once the scheduler is running
+        if(apic->apic_flags & (PROCESSOR_LOCAL_APIC_PROCESSOR_ENABLED|PROCESSOR_LOCAL_APIC_CAN_ONLINE)) smp_add_processor(apic->apic_id);
         break;
       case 1:
         ioapic = (IOAPIC *)&madt_ptr[ctr+2]; //skip over the type and length fields
@@ -173,8 +211,12 @@ void read_madt_info(char *madt_ptr)
         //ctr += sizeof(ProcessorLocalX2Apic);
         break;
       default:
-        kprintf("ERROR Unrecognised MADT entry type %d, this will break parsing\r\n", h->type);
-        return;
+        kprintf("      Skipping MADT entry type %d\r\n", (uint32_t)h->type);
+        break;
+    }
+    if(h->length==0) {
+      kputs("ERROR MADT entry with zero length, giving up parsing it\r\n");
+      return;
     }
     ctr += h->length;
     i++;
@@ -33,6 +33,7 @@ uint32_t c_except_pagefault(uint32_t pf_load_addr, uint32_t error_code, uint32_t
 {
   uint8_t rc = handle_allocation_fault(pf_load_addr, error_code, faulting_addr, faulting_codeseg, eflags);
   if(rc==0) return 0; //page fault was handled!
+  if(rc==PAGEFAULT_BLOCKED) return rc;  //the process is waiting for its page, the assembly handler switches it out
   
   dump_stack();
   
@@ -79,7 +79,8 @@ struct ParsedCommandLine *parse_command_line(const char *cmdline) {
                 param_split = param_start;
                 continue;
             }
-            struct ParsedCommandLine *next = cmdline_extract_param(cmdline, param_start, param_split, i);
+            //the last parameter has no space after it, so its final character is part of the value
+            struct ParsedCommandLine *next = cmdline_extract_param(cmdline, param_start, param_split, cmdline[i]==' ' ? i : i+1);
             if(next==NULL) {
                 kputs("WARNING Could not extract command line parameter: out of memory or invalid params\r\n");
                 continue;
@@ -125,6 +126,25 @@ const char* config_commandline_param(struct KernelConfig* cfg, const char *key)
     return NULL;
 }
 
+/**
+ * Returns the value of the given command line parameter as an unsigned decimal number, or `default_value` if it was not given.
+ * A warning is printed if it was given but is not a number.
+ */
+uint32_t config_commandline_uint(struct KernelConfig* cfg, const char *key, uint32_t default_value) {
+    const char *str = config_commandline_param(cfg, key);
+    if(str==NULL || str[0]==0) return default_value;
+
+    uint32_t value = 0;
+    for(const char *p=str; *p!=0; p++) {
+        if(*p<'0' || *p>'9' || value > 0x19999998) {    //0x19999998 * 10 + 9 still fits
+            kprintf("WARNING %s=%s is not a number, using %d\r\n", key, str, default_value);
+            return default_value;
+        }
+        value = value*10 + (*p - '0');
+    }
+    return value;
+}
+
 /**
  * Uses the kernel configuration to try to obtain a boot device string.
  * The returned string is dynamically allocated and should be freed by the caller.
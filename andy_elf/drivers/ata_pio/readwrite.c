@@ -6,6 +6,7 @@
 #include <memops.h>
 #include <errors.h>
 #include <panic.h>
+#include <sys/smp.h>
 #include "ata_pio.h"
 #include "ata_readwrite.h"
 
@@ -242,7 +243,7 @@ void ata_complete_read_lowerhalf(SchedulerTask *t)
 
   //need to make sure interrupts are disabled, otherwise we trigger the next data packet
   //before we stored the last word of this one, meaning that we miss data.
-  cli();
+  uint32_t flags = irq_save();
   //each sector is 512 bytes (or 256 words)
   uint16_t *buf = (uint16_t *)op->buffer;
   
@@ -271,15 +272,25 @@ void ata_complete_read_lowerhalf(SchedulerTask *t)
   op->buffer_loc += 256;
   ++op->sectors_read;
   ++op->current_lba;
+  //the sector is safely stored, so the next interrupt can come in. Everything from here on, including the completion
+  //callback and whatever it goes on to do, runs with interrupts on.
+  irq_restore(flags);
   
   if(op->sectors_read>=op->sector_count) {
-    //All sectors completed - finish the operation
+    //All sectors completed - finish the operation. This runs on a task worker without the kernel lock, and the slot is
+    //free for ata_pio_start_read as soon as the type is cleared, so take the lock before that and keep it until the
+    //callback (which usually starts the next read in the same slot) has returned.
+    kernel_lock();
+    void (*completed_func)(uint8_t, void *, void *) = op->completed_func;
+    void *buffer = op->buffer;
+    void *extradata = op->extradata;
     op->type = ATA_OP_NONE;
-    if(!op->completed_func) {
+    if(!completed_func) {
       kprintf("ERROR disk operation with NULL callback, this causes a memory leak\r\n");
     } else {
-      op->completed_func(ATA_STATUS_OK, op->buffer, op->extradata);
+      completed_func(ATA_STATUS_OK, buffer, extradata);
     }
+    kernel_unlock();
   } else {
     //Check if we need to issue another read command for remaining sectors
     uint16_t remaining_sectors = op->sector_count - op->sectors_read;
@@ -288,7 +299,6 @@ void ata_complete_read_lowerhalf(SchedulerTask *t)
     if(op->continuation_pending) {
       kprintf("WARNING: Continuation already pending for sectors_read=%d\r\n", (uint16_t)op->sectors_read);
       if(old_pd!=0) switch_paging_directory_if_required(old_pd);
-      sti();
       return;
     }
     
@@ -313,9 +323,6 @@ void ata_complete_read_lowerhalf(SchedulerTask *t)
   }
 
   if(old_pd!=0) switch_paging_directory_if_required(old_pd);
-
-  sti();
-
 }
 
 /*
@@ -327,7 +334,9 @@ Returns: Nothing
 void ata_continue_read_chunk(SchedulerTask *t)
 {
   ATAPendingOperation *op = (ATAPendingOperation *)t->data;
-  
+
+  //task workers run this without the kernel lock, and the controller is shared with ata_service_interrupt
+  kernel_lock();
   if(op == NULL || op->type != ATA_OP_READ) {
     k_panic("Invalid operation in ata_continue_read_chunk");
   }
@@ -357,6 +366,7 @@ void ata_continue_read_chunk(SchedulerTask *t)
   
   // Restore the original paging directory
   if(old_pd != 0) switch_paging_directory_if_required(old_pd);
+  kernel_unlock();
 }
 
 /*
@@ -380,7 +390,7 @@ void ata_continue_write(ATAPendingOperation *op)
 
   //need to make sure interrupts are disabled, otherwise we trigger the next data packet
   //before we stored the last word of this one, meaning that we miss data.
-  cli();
+  uint32_t flags = irq_save();
 
   // Check for potential buffer overrun before writing
   size_t words_needed = op->buffer_loc + 256;
@@ -389,7 +399,7 @@ void ata_continue_write(ATAPendingOperation *op)
     kprintf("ERROR: About to overrun buffer in write! words_needed=%d, buffer_words=%d\r\n", 
             (uint32_t)words_needed, (uint32_t)buffer_words);
     if(old_pd!=0) switch_paging_directory_if_required(old_pd);
-    sti();
+    irq_restore(flags);
     k_panic("Buffer overrun detected before sector write");
   }
 
@@ -405,11 +415,9 @@ void ata_continue_write(ATAPendingOperation *op)
 
   op->buffer_loc += 256;
   ++op->sectors_read;
-
+  irq_restore(flags);
 
   if(old_pd!=0) switch_paging_directory_if_required(old_pd);
-
-  sti();
 }
 
 
@@ -427,10 +435,12 @@ void ata_complete_write_lowerhalf(SchedulerTask *t)
   ATAPendingOperation *op = (ATAPendingOperation *)t->data;
 
   if(op->sectors_read>=op->sector_count) {
-    //the operation is now completed
+    //the operation is now completed. As for reads, the callback needs the kernel lock that the task worker does not have.
+    kernel_lock();
     op->completed_func(ATA_STATUS_OK, op->buffer, op->extradata);
     //reset the "pending operation" block for the next operation
     op->type = ATA_OP_NONE;
+    kernel_unlock();
   } else {
       ata_continue_write(op);
   }
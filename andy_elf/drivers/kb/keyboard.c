@@ -1,14 +1,15 @@
 #include <types.h>
 #include <drivers/kb_buffer.h>
 #include <process.h>
+#include <scheduler/runqueue.h>
+#include <scheduler/waitqueue.h>
 #include "../ps2_controller/controller.h"
-#include "pending_operation_list.h"
 
-PendingOperationList *kb_pending_ops;
+//processes that are blocked reading from the console, in the order that they asked
+static WaitQueue kb_waiters;
 
 void init_keyboard() {
-    kb_pending_ops = NULL;
-    init_kb_pending_ops();
+    wait_queue_init(&kb_waiters);
 }
 
 /**
@@ -21,16 +22,14 @@ uint8_t kb_read_to_file(struct ProcessTableEntry *process, struct FilePointer *f
 
     ring_buffer_ref(fp->read_buffer);
     if(ring_buffer_empty(fp->read_buffer)) {
-        //Nothing in the buffer, go to wait state
+        //Nothing in the buffer, go to wait state. kb_notify_activity hands the next character straight to us.
         //kputs("DEBUG kb buffer empty, going to wait\r\n");
-        process->status = PROCESS_IOWAIT;
         fp->status = FP_STATUS_WAIT;
-        kb_push_pending_operation(&kb_pending_ops, process, fp);
+        wait_queue_wait(&kb_waiters, process, WAIT_FOREVER, 0, (void *)fp);
     } else {
         //We have something
         //kputs("DEBUG kb buffer has data, going to return\r\n");
         ch = ring_buffer_pop(fp->read_buffer);
-        if(process->status==PROCESS_IOWAIT) process->status = PROCESS_READY;
     }
     ring_buffer_unref(fp->read_buffer);
     return ch;
@@ -40,21 +39,10 @@ uint8_t kb_read_to_file(struct ProcessTableEntry *process, struct FilePointer *f
  * Called by the low-level driver to notify us of activity (possibly in an interrupt context, careful)
  */
 void kb_notify_activity() {
-    PendingOperationList *next_op = kb_pop_pending_operation(&kb_pending_ops);
-    if(next_op && next_op->fp && next_op->fp->read_buffer) {
-        char ch = ps2_get_buffer();
-        ring_buffer_ref(next_op->fp->read_buffer);
-        ring_buffer_push(next_op->fp->read_buffer, ch);
-        ring_buffer_unref(next_op->fp->read_buffer);
-        if(next_op->process->status == PROCESS_IOWAIT) next_op->process->status = PROCESS_READY;
-        next_op->fp->status = FP_STATUS_READY;
-    }
-}
+    //if nobody is reading then the character stays in the controller's buffer until somebody does
+    if(wait_queue_empty(&kb_waiters)) return;
 
-/**
- * Clean up any pending keyboard operations for a process that is being terminated
- */
-void kb_cleanup_process_operations(struct ProcessTableEntry *process) {
-    kprintf("DEBUG kb_cleanup_process_operations for process 0x%x\r\n", process);
-    kb_pending_ops = kb_cancel_pending_ops_for_process(kb_pending_ops, process);
-}
\ No newline at end of file
+    char ch = ps2_get_buffer();
+    struct ProcessTableEntry *process = wait_queue_wake_one(&kb_waiters, (uint32_t)(uint8_t)ch);
+    if(process) ((struct FilePointer *)wait_queue_entry(process)->data)->status = FP_STATUS_READY;
+}
@@ -0,0 +1,52 @@
+#include <types.h>
+#include <stdio.h>
+#include <sys/ioports.h>
+#include <kernel_config.h>
+#include "pit.h"
+
+static uint32_t pit_hz = PIT_DEFAULT_HZ;
+static uint16_t pit_oneshot_clocks = 0; //what channel 0 was last loaded with
+
+void pit_initialise()
+{
+  uint32_t hz = config_commandline_uint((struct KernelConfig *)get_kernel_config(), "hz", PIT_HZ);
+
+  if(hz < PIT_MIN_HZ) {
+    kprintf("WARNING hz=%d is too slow, using %d\r\n", hz, PIT_MIN_HZ);
+    hz = PIT_MIN_HZ;
+  } else if(hz > PIT_MAX_HZ) {
+    kprintf("WARNING hz=%d is too fast, using %d\r\n", hz, PIT_MAX_HZ);
+    hz = PIT_MAX_HZ;
+  }
+
+  pit_hz = hz;
+  kprintf("INFO Scheduler tick is %d Hz\r\n", hz);
+}
+
+uint32_t pit_get_hz()
+{
+  return pit_hz;
+}
+
+void pit_start_oneshot(uint16_t clocks)
+{
+  outb(PIT_COMMAND, PIT_CMD_CHANNEL0_ONESHOT);
+  outb(PIT_CHANNEL0_DATA, (uint8_t)(clocks & 0xFF));
+  outb(PIT_CHANNEL0_DATA, (uint8_t)(clocks >> 8));
+  pit_oneshot_clocks = clocks;
+}
+
+uint32_t pit_oneshot_elapsed()
+{
+  outb(PIT_COMMAND, PIT_CMD_READBACK_CHANNEL0);
+  uint8_t status = inb(PIT_CHANNEL0_DATA);
+  uint16_t count = inb(PIT_CHANNEL0_DATA);
+  count |= (uint16_t)inb(PIT_CHANNEL0_DATA) << 8;
+
+  if(status & PIT_STATUS_NULL_COUNT) return 0;  //not even started yet
+  if(status & PIT_STATUS_OUTPUT) {
+    //it has fired, and the counter has wrapped round to 0xFFFF and carried on going down from there
+    return (uint32_t)pit_oneshot_clocks + ((0x10000 - (uint32_t)count) & 0xFFFF);
+  }
+  return (uint32_t)(pit_oneshot_clocks - count);
+}
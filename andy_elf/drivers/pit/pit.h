@@ -0,0 +1,65 @@
+#include <types.h>
+
+#ifndef __PIT_H
+#define __PIT_H
+
+#define PIT_BASE_FREQUENCY  1193182 //input clock of the 8253/8254, in Hz
+#define PIT_CHANNEL0_DATA   0x40
+#define PIT_COMMAND         0x43
+
+//channel 0, lobyte then hibyte, mode 0 (interrupt on terminal count), binary counting
+#define PIT_CMD_CHANNEL0_ONESHOT  0x30
+//8254 read-back: latch both the status and the count of channel 0
+#define PIT_CMD_READBACK_CHANNEL0 0xC2
+
+#define PIT_STATUS_OUTPUT     0x80  //state of the OUT pin. In mode 0 it goes high when the count runs out, which is what raises IRQ0
+#define PIT_STATUS_NULL_COUNT 0x40  //a new count has been written but not loaded yet
+
+#define PIT_MIN_ONESHOT_CLOCKS  24      //about 20us. Anything shorter is over before we have got out of the interrupt handler.
+#define PIT_MAX_ONESHOT_CLOCKS  0xFFFF  //about 55ms
+
+//fixed-point conversions between PIT clocks and nanoseconds, so that we don't need 64-bit division
+#define PIT_NS_PER_CLOCK_FP16   54925401  //838.095ns, shifted left 16 bits
+#define PIT_CLOCKS_PER_NS_FP32  5124678   //rounded up, so that a one-shot never ends early
+
+#define PIT_DEFAULT_HZ      18      //what the BIOS leaves it at, a divisor of 65536
+#define PIT_HZ              100     //what we use if nothing is given on the command line
+#define PIT_MIN_HZ          19      //a tick has to fit into a single one-shot
+#define PIT_MAX_HZ          1000    //faster than this and we spend all our time in the timer interrupt
+
+/**
+Works out the scheduler tick rate from the `hz` kernel command line parameter, or uses PIT_HZ if there isn't one.
+The PIT itself is not started until the timer core arms it, see scheduler/timer.c.
+*/
+void pit_initialise();
+
+/**
+Returns the scheduler tick rate. This is PIT_DEFAULT_HZ until pit_initialise has been called.
+*/
+uint32_t pit_get_hz();
+
+/**
+Starts channel 0 counting down from `clocks`, raising IRQ0 once when it gets to 0. Must be called with interrupts off.
+*/
+void pit_start_oneshot(uint16_t clocks);
+
+/**
+Returns the number of PIT clocks since pit_start_oneshot was last called. This carries on counting after the one-shot has
+fired, but only for another 65536 clocks. Must be called with interrupts off.
+*/
+uint32_t pit_oneshot_elapsed();
+
+static inline uint64_t pit_clocks_to_ns(uint32_t clocks)
+{
+  return ((uint64_t)clocks * PIT_NS_PER_CLOCK_FP16) >> 16;
+}
+
+/**
+Converts a delay to PIT clocks, rounding up. Only good for delays of up to a few seconds.
+*/
+static inline uint32_t pit_ns_to_clocks(uint32_t ns)
+{
+  return (uint32_t)(((uint64_t)ns * PIT_CLOCKS_PER_NS_FP32 + 0xFFFFFFFFULL) >> 32);
+}
+
+#endif
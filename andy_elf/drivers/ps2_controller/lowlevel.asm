@@ -4,6 +4,8 @@
 extern pic_send_eoi
 extern PMPrintChar  ;temporary
 extern ps2_put_buffer
+extern kernel_lock    ;defined in smp/smp.c
+extern kernel_unlock
 
 ;function exports
 global ps2_lowlevel_init
@@ -295,6 +297,8 @@ ps2_send:
 IKeyboard:	;keyboard interrupt handler
 	push eax
     push ebx
+    push ecx
+    push edx
     push ds
     push es
     push fs
@@ -309,6 +313,7 @@ IKeyboard:	;keyboard interrupt handler
     xor eax, eax
     in al, PS2_DATA ;get the current character from the buffer. If the buffer is not flushed then no more interrupts occur.
 
+    call kernel_lock
     push eax
     call ps2_put_buffer
     pop eax
@@ -316,6 +321,7 @@ IKeyboard:	;keyboard interrupt handler
     xor ebx, ebx
 	mov bl, '.'
 	call PMPrintChar
+    call kernel_unlock
 
     mov ebx, 1
     push ebx
@@ -326,6 +332,8 @@ IKeyboard:	;keyboard interrupt handler
     pop fs
     pop es
     pop ds
+    pop edx
+    pop ecx
     pop ebx
     pop eax
 	iret
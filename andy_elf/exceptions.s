@@ -34,6 +34,11 @@ extern c_except_div0
 extern c_except_gpf
 extern c_except_invalidop
 extern c_except_pagefault
+extern switch_out_process	;scheduler/lowlevel.asm
+extern idle_loop			;kickoff.s. NOT a function, this is where we go when a process has to wait
+extern kernel_lock			;smp/smp.c
+extern fpu_device_not_available	;scheduler/fpu.c
+extern kernel_unlock
 
 ;Create an IDT (Interrupt Descriptor Table) entry
 ;The entry is created at ds:esi. esi is incremented to point to the next entry
@@ -149,9 +154,64 @@ IOpcodeInval:
 	mov eax, InvalidOpcodeMsg
 	call FatalMsg
 
-IDevNotAvail:
+IDevNotAvail:	;a process used the FPU with CR0.TS set, so its registers have to be loaded. See scheduler/fpu.h
+	push ebp
+	mov ebp, esp
+	push eax
+	push ecx
+	push edx
+	push ds
+	push es
+	push fs
+	push gs
+
 	mov ax, 0x10
 	mov ds, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+
+	mov eax, [ebp+8]		;CS of the faulting code
+	test eax, 0x03
+	jz .kernel				;the kernel never uses the FPU
+
+	call kernel_lock
+	call fpu_device_not_available
+	test al, al
+	jnz .terminated
+	call kernel_unlock
+
+	pop gs
+	pop fs
+	pop es
+	pop ds
+	pop edx
+	pop ecx
+	pop eax
+	pop ebp
+	iret
+
+	.terminated:
+	;the process has been terminated, so switch it out and go back to the idle loop still holding the kernel lock
+	cli
+	pop gs
+	pop fs
+	pop es
+	pop ds
+	pop edx
+	pop ecx
+	pop eax
+	pop ebp
+	call switch_out_process
+	pushf
+	xor eax, eax
+	mov eax, cs
+	push eax
+	mov eax, idle_loop
+	push eax
+	iret
+
+	.kernel:
 	mov eax, DevNotAvailMsg
 	call FatalMsg
 
@@ -225,6 +285,8 @@ IPageFault:	;leaves error code
 	mov fs, ax
 	mov gs, ax
 
+	call kernel_lock			;kept hold of if the process blocks, idle_loop expects to have it
+
 	;When we entered, our stack frame looked like this: uint32_t error_code, uint32_t faulting_addr, uint32_t faulting_codeseg, uint32_t eflags
 	;we need to add the faulting address
 	;but since we have messed with the stack already we must recover the previous values and copy them to the top of the stack
@@ -241,11 +303,14 @@ IPageFault:	;leaves error code
 	call c_except_pagefault
 	cmp eax, 0
 	jz .recovered
+	cmp eax, 2					;PAGEFAULT_BLOCKED, see include/sys/pagefault.h
+	je .blocked
 
 	mov eax, PageFaultMsg
 	call FatalMsg
 	.recovered:
 	add esp, 20					;reset stack-frame to before the C call
+	call kernel_unlock
 	
 	;now restore registers
 	pop gs
@@ -261,6 +326,33 @@ IPageFault:	;leaves error code
 	pop ebp
 	add esp, 4					;the topmost value coming in was the error_code, we must drop this so iret has a valid stack-frame to return
 	iret
+
+	.blocked:
+	;The process has to wait for the page to be read in. Put its registers back the way they were when it faulted, so that
+	;switch_out_process saves them into its process table entry, then go back to the idle loop. The faulting instruction
+	;is retried when the process is next scheduled.
+	add esp, 20
+	pop gs
+	pop fs
+	pop es
+	pop ds
+	pop edi
+	pop esi
+	pop edx
+	pop ecx
+	pop ebx
+	pop eax
+	pop ebp
+	add esp, 4					;drop the error_code, so the stack frame is the one that switch_out_process expects
+	call switch_out_process
+	;set up a stack frame that gets us back to the kernel idle loop
+	pushf
+	xor eax, eax
+	mov eax, cs
+	push eax
+	mov eax, idle_loop
+	push eax
+	iret
 	
 IFloatingPointExcept:
 	mov eax, FPExceptMsg
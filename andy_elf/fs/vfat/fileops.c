@@ -1,5 +1,6 @@
 #include <types.h>
 #include <malloc.h>
+#include <slab.h>
 #include <memops.h>
 #include <fs/fat_fs.h>
 #include <fs/fat_fileops.h>
@@ -93,6 +94,19 @@ struct vfat_read_transient_data {
   size_t disk_read_offset;
 };
 
+//every read needs one of these and a sector buffer, so they come from slab caches rather than the heap
+static SlabCache *vfat_transient_cache = NULL;
+static SlabCache *vfat_sector_buffer_cache = NULL;
+
+void vfat_init_caches()
+{
+  vfat_transient_cache = slab_cache_create("vfat_read_transient_data", sizeof(struct vfat_read_transient_data));
+  vfat_sector_buffer_cache = slab_cache_create("vfat_sector_buffer", ATA_SECTOR_SIZE);
+  if(!vfat_transient_cache || !vfat_sector_buffer_cache) {
+    k_panic("Unable to create vfat read caches\r\n");
+  }
+}
+
 void _vfat_next_block_read(uint8_t status, void *buffer, void *extradata)
 {
   #ifdef VFAT_VERBOSE
@@ -103,10 +117,10 @@ void _vfat_next_block_read(uint8_t status, void *buffer, void *extradata)
 
   if(status!=0) {
     kprintf("ERROR reading from file 0x%x at offset 0x%d.\r\n", t->fp, t->buffer_write_offset);
-    if(buffer) free(buffer);
+    if(buffer) slab_free(vfat_sector_buffer_cache, buffer);
     t->fp->busy = 0;
     t->callback(t->fp, status, t->buffer_write_offset, t->real_buffer, t->cb_extradata);
-    free(t);
+    slab_free(vfat_transient_cache, t);
     return;
   }
 
@@ -124,19 +138,20 @@ void _vfat_next_block_read(uint8_t status, void *buffer, void *extradata)
     #endif
     memcpy(t->real_buffer + t->buffer_write_offset, buffer + t->disk_read_offset, bytes_to_copy);
     t->buffer_write_offset += bytes_to_copy;
+    t->disk_read_offset = 0;  //only the first sector starts part-way through
   }
 
   VFatOpenFile *fp = t->fp;
 
-  if(bytes_to_copy>=t->requested_length) {
+  if(t->buffer_write_offset>=t->requested_length) {
     //we are done!
-    free(buffer);
+    slab_free(vfat_sector_buffer_cache, buffer);
     #ifdef VFAT_VERBOSE
     kprintf("DEBUG finishing read because output buffer is full.\r\n");
     #endif
     t->fp->busy = 0;
     t->callback(t->fp, status, t->buffer_write_offset, t->real_buffer, t->cb_extradata);
-    free(t);
+    slab_free(vfat_transient_cache, t);
     return;
   } else {
     //read in the next sector
@@ -149,18 +164,18 @@ void _vfat_next_block_read(uint8_t status, void *buffer, void *extradata)
     if(fp->current_cluster_number==-1) {
       //we failed
       kputs("ERROR Could not get next cluster number during load.\r\n");
-      free(buffer);
+      slab_free(vfat_sector_buffer_cache, buffer);
       t->fp->busy = 0;
       t->callback(t->fp, -1, t->buffer_write_offset, t->real_buffer, t->cb_extradata);
-      free(t);
       validate_pointer(t->fp->parent_fs->bpb, 1);
+      slab_free(vfat_transient_cache, t);
       return;     
     } else if(fp->current_cluster_number==CLUSTER_MAP_EOF_MARKER) {
       //we are done!
-      free(buffer);
+      slab_free(vfat_sector_buffer_cache, buffer);
       t->fp->busy = 0;
       t->callback(t->fp, status, t->buffer_write_offset, t->real_buffer, t->cb_extradata);
-      free(t);
+      slab_free(vfat_transient_cache, t);
       return;
     } else {
       fp->byte_offset_in_sector = 0;
@@ -168,10 +183,10 @@ void _vfat_next_block_read(uint8_t status, void *buffer, void *extradata)
       int8_t rc = volmgr_vol_start_read(fp->parent_fs->volume, next_sector_number, 1, buffer, (void *)t, &_vfat_next_block_read);
       if(rc!=E_OK) {
         kprintf("ERROR volmgr_vol_start_read returned error %d\r\n", rc);
-        free(buffer);
+        slab_free(vfat_sector_buffer_cache, buffer);
         t->fp->busy = 0;
         t->callback(t->fp, rc, t->buffer_write_offset, t->real_buffer, t->cb_extradata);
-        free(t);
+        slab_free(vfat_transient_cache, t);
         return;
       }
     }
@@ -189,9 +204,11 @@ void vfat_read_async(VFatOpenFile *fp, void* buf, size_t length, void* extradata
   }
 
   fp->busy = 1;
-  struct vfat_read_transient_data *t = (struct vfat_read_transient_data *)malloc(sizeof(struct vfat_read_transient_data));
+  struct vfat_read_transient_data *t = (struct vfat_read_transient_data *)slab_alloc(vfat_transient_cache);
   if(!t) {
     kprintf("ERROR Could not allocate space for vfat transient data\r\n");
+    fp->busy = 0;
+    callback(fp, E_NOMEM, 0, NULL, extradata);
     return;
   }
   t->callback = callback;
@@ -202,15 +219,22 @@ void vfat_read_async(VFatOpenFile *fp, void* buf, size_t length, void* extradata
   t->buffer_write_offset = 0;
   t->disk_read_offset = fp->byte_offset_in_sector;
 
-  void* sector_buffer = malloc(ATA_SECTOR_SIZE);
+  void* sector_buffer = slab_alloc(vfat_sector_buffer_cache);
+  if(!sector_buffer) {
+    kprintf("ERROR Could not allocate vfat sector buffer\r\n");
+    slab_free(vfat_transient_cache, t);
+    fp->busy = 0;
+    callback(fp, E_NOMEM, 0, NULL, extradata);
+    return;
+  }
 
   uint64_t initial_sector = (fp->current_cluster_number * fp->parent_fs->bpb->logical_sectors_per_cluster) + fp->sector_offset_in_cluster + fp->fs_sector_offset;
 
   int8_t rc = volmgr_vol_start_read(fp->parent_fs->volume, initial_sector, 1, sector_buffer, (void*) t, &_vfat_next_block_read);
   if(rc!=E_OK) {
     kprintf("ERROR volmgr_vol_start_read returned error %d\r\n", rc);
-    free(sector_buffer);
-    free(t);
+    slab_free(vfat_sector_buffer_cache, sector_buffer);
+    slab_free(vfat_transient_cache, t);
     fp->busy = 0;
     callback(fp, rc, 0, NULL, extradata);
     return;
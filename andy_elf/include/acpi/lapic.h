@@ -0,0 +1,64 @@
+#include <types.h>
+
+#ifndef __ACPI_LAPIC_H
+#define __ACPI_LAPIC_H
+
+/*
+The processor-local APIC. Every processor has its own, and they all appear at the same physical address, so each processor
+only ever talks to its own. It is what we use to send inter-processor interrupts.
+See https://wiki.osdev.org/APIC
+*/
+
+#define LAPIC_REG_ID          0x20
+#define LAPIC_REG_TPR         0x80    //task priority, interrupts at or below this priority class are held back
+#define LAPIC_REG_EOI         0xB0
+#define LAPIC_REG_SPURIOUS    0xF0
+#define LAPIC_REG_ICR_LOW     0x300   //interrupt command register. Writing the low half sends the IPI.
+#define LAPIC_REG_ICR_HIGH    0x310   //destination APIC ID in bits 24-31
+#define LAPIC_REG_LVT_TIMER   0x320
+
+//values for the low half of the interrupt command register
+#define ICR_DELIVERY_FIXED    (0 << 8)
+#define ICR_DELIVERY_INIT     (5 << 8)
+#define ICR_DELIVERY_STARTUP  (6 << 8)  //the vector is the page number of the real-mode code to start at
+#define ICR_SEND_PENDING      (1 << 12) //set while the previous IPI is still on its way
+#define ICR_LEVEL_ASSERT      (1 << 14)
+#define ICR_TRIGGER_LEVEL     (1 << 15)
+
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+/**
+Records the physical address of the local APICs, from the MADT. If this is never called then the standard address is used.
+*/
+void plapic_set_address(uint32_t phys_address);
+
+/**
+Maps the local APIC registers into kernel space. Must be done before any of the other functions are used, and before any
+process is created so that every address space gets the mapping. Returns 0 on success or 1 on failure.
+*/
+uint8_t plapic_map();
+
+/**
+Returns the APIC ID of the processor that calls it.
+*/
+uint8_t plapic_get_id();
+
+/**
+Enables the local APIC of the processor that calls it, see apic.c
+*/
+int16_t enable_plapic(vaddr apic_base, uint8_t apic_id, uint16_t interrupt_base);
+
+vaddr plapic_get_base();
+
+/**
+Signals the end of the interrupt that is being handled. Every IPI handler must do this, apart from the spurious one.
+*/
+void plapic_send_eoi();
+
+/**
+Sends an IPI to the processor with the given APIC ID. `command` is the low half of the interrupt command register,
+i.e. the vector and the ICR_ flags.
+*/
+void plapic_send_ipi(uint8_t apic_id, uint32_t command);
+
+#endif
@@ -14,31 +14,4 @@ void init_keyboard();
  */
 void kb_notify_activity();
 
-/**
- * Clean up any pending keyboard operations for a process that is being terminated
- */
-void kb_cleanup_process_operations(struct ProcessTableEntry *process);
-
-typedef struct PendingOperationList {
-    struct PendingOperationList *next;
-
-    struct ProcessTableEntry *process;
-    struct FilePointer *fp;
-} PendingOperationList;
-
-/**
- * Removes any pending operations for the given process (as part of the process shutdown)
- * Returns a new start-pointer if the first item in the list changes
- */
-PendingOperationList* kb_cancel_pending_ops_for_process(PendingOperationList *start, struct ProcessTableEntry *process);
-/**
- * Removes any pending operations for the given file-pointer (as part of the file close)
- * Returns a new start-pointer if the first item in the list changes
- */
-PendingOperationList* kb_cancel_pending_ops_for_file(PendingOperationList *start, struct FilePointer *fp);
-/**
- * Return the first pending operation, if there is one
- */
-PendingOperationList *kb_pop_pending_operation(PendingOperationList **start);
-
 #endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <types.h>
+#include <sys/shared_image.h>
 
 #ifndef EXEC_ELF_FORMAT_H
 #define EXEC_ELF_FORMAT_H
@@ -155,6 +156,9 @@ typedef struct elf_parsed_data {
   size_t program_headers_count;
   struct LoadList *loaded_segments;
   size_t loaded_segment_count;
+  struct SharedImageKey image_key;    //identifies the file this was loaded from
+  struct SharedImage *shared_image;   //if set, the read-only segments were already in memory and were not loaded again. Holds a reference.
+  uint32_t lazy_segments;             //bitmask of program headers whose segments were too big to read up front. The process maps them from the file instead.
 } ElfParsedData;
 
 #endif
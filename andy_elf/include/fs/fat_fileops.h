@@ -16,9 +16,20 @@ typedef struct vfat_open_file {
   uint8_t busy : 1;
 } VFatOpenFile;
 
+/**
+Returns the sector offset that turns a cluster number on the given filesystem into a sector number on its volume,
+for vfat_open_by_location.
+*/
+size_t vfat_get_sector_offset(struct fat_fs *fs_ptr);
+
 void vfat_close(VFatOpenFile *fp);
 VFatOpenFile* vfat_open(struct fat_fs *fs_ptr, struct directory_entry* entry_to_open);
 VFatOpenFile* vfat_open_by_location(struct fat_fs *fs_ptr, size_t cluster_location_start, size_t file_size, size_t cluster_offset);
+/**
+Creates the slab caches that vfat_read_async allocates from. Must be called once, before the first read.
+*/
+void vfat_init_caches();
+
 void vfat_read_async(VFatOpenFile *fp, void* buf, size_t length, void* extradata, void(*callback)(VFatOpenFile *fp, uint8_t status, size_t bytes_read, void *buf, void* extradata));
 
 /**
@@ -21,6 +21,7 @@ struct KernelConfig *new_kernel_config();
 struct ParsedCommandLine *parse_command_line(const char *cmdline);
 void free_command_line(struct ParsedCommandLine *cmdline);
 const char* config_commandline_param(struct KernelConfig* cfg, const char *key);
+uint32_t config_commandline_uint(struct KernelConfig* cfg, const char *key, uint32_t default_value);
 const char* config_root_device(struct KernelConfig* cfg);
 
 /* Functions in multiboot.c */
@@ -0,0 +1,23 @@
+#ifndef __NATIVE_API_APICODES_H
+#define __NATIVE_API_APICODES_H
+
+//These must be kept in-sync with native_api/apicodes.asm
+#define API_NONE            0x0
+
+#define API_EXIT            0x00000001
+#define API_CREATE_PROCESS  0x00000002
+#define API_SLEEP           0x00000003    //Sleep for the number of microseconds in EBX
+
+#define API_CLOSE           0x00000008
+#define API_OPEN            0x00000009
+#define API_READ            0x0000000A
+#define API_WRITE           0x0000000B
+#define API_DUP             0x0000000C
+#define API_IOCTL           0x0000000D
+
+#define API_GET_TIME        0x00000010    //Return time as number of seconds since Jan 1, 2000
+#define API_MMAP            0x00000011    //Map part of an open file into memory, it is read in as it is touched
+#define API_MUNMAP          0x00000012    //Remove a mapping made by API_MMAP
+#define API_NICE            0x00000013    //Change the calling process's scheduling priority
+#define API_CALL_INFO       0x00000014    //Get the counters for the API code in EBX, see native_api/dispatch.h
+#endif
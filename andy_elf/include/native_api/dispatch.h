@@ -0,0 +1,89 @@
+#include <types.h>
+
+#ifndef __NATIVE_API_DISPATCH_H
+#define __NATIVE_API_DISPATCH_H
+
+/*
+The native API dispatch table. native_api_landing_pad saves the caller's registers and hands them to native_api_dispatch,
+which looks the API code in EAX up in the table and calls whatever has been registered for it. Each call is counted, and
+if the processor has a TSC the time that the handler took goes into a histogram as well. These can be read back with
+API_CALL_INFO.
+*/
+
+#define NATIVE_API_MAX_CALLS        0x40  //API codes from 0 up to this can be registered
+#define NATIVE_API_NAME_LENGTH      16
+
+//latency histogram buckets. Bucket 0 is anything under 2^NATIVE_API_HISTOGRAM_SHIFT TSC cycles, each bucket after that
+//covers twice the range of the one before, and the last one has everything that is left over.
+#define NATIVE_API_HISTOGRAM_BUCKETS  16
+#define NATIVE_API_HISTOGRAM_SHIFT    8
+
+//what the landing pad should do once the handler has returned
+#define NAPI_RETURN           0   //go straight back to the caller with the handler's result in EAX
+#define NAPI_SWITCH_OUT       1   //the call has changed the caller's status (exit, sleep), go back to the idle loop
+#define NAPI_SWITCH_IF_ZERO   2   //the caller is waiting for something if the handler returned 0, otherwise as NAPI_RETURN
+
+/**
+The caller's registers, in the order that pushad leaves them. Handlers get their arguments from here; the landing pad
+gives the caller back whatever is in here afterwards, apart from EAX which gets the handler's return value.
+*/
+struct NativeApiRegs {
+  uint32_t edi;
+  uint32_t esi;
+  uint32_t ebp;
+  uint32_t esp;   //the kernel stack, not the caller's
+  uint32_t ebx;
+  uint32_t edx;
+  uint32_t ecx;
+  uint32_t eax;
+} __attribute__((packed));
+
+typedef uint32_t (*native_api_handler)(struct NativeApiRegs *regs);
+
+struct NativeApiCall {
+  native_api_handler handler;   //NULL if nothing is registered for this code
+  uint8_t return_mode;          //one of the NAPI_ values above
+  char name[NATIVE_API_NAME_LENGTH];
+  uint32_t count;
+  uint64_t total_cycles;
+  uint64_t max_cycles;
+  uint32_t histogram[NATIVE_API_HISTOGRAM_BUCKETS];
+};
+
+/**
+What API_CALL_INFO copies out to the buffer in ESI, which must be at least this big (ECX). EBX is the API code to ask about.
+It returns 0, API_ERR_NOTFOUND if nothing is registered for the code, or API_ERR_NOTSUPP if the buffer is too small.
+The cycle counts are all 0 if the processor has no TSC.
+*/
+struct NativeApiCallInfo {
+  uint32_t code;
+  char name[NATIVE_API_NAME_LENGTH];
+  uint32_t count;
+  uint64_t total_cycles;
+  uint64_t max_cycles;
+  uint32_t histogram[NATIVE_API_HISTOGRAM_BUCKETS];
+} __attribute__((packed));
+
+/**
+Registers `handler` for the API code `code`. `name` is only for API_CALL_INFO and is cut short if it is too long.
+Returns 0 on success, or 1 if the code is out of range or already has a handler.
+*/
+uint8_t native_api_register(uint32_t code, const char *name, native_api_handler handler, uint8_t return_mode);
+
+/**
+Removes the handler for `code`, so that calling it returns API_ERR_NOTFOUND again. Its counters are reset.
+*/
+void native_api_unregister(uint32_t code);
+
+/**
+Registers the kernel's own API calls. Called by init_native_api.
+*/
+void native_api_register_builtins();
+
+/**
+Called by native_api_landing_pad with the kernel lock held. Returns 1 if the landing pad should go straight back to
+the caller or 0 if it should switch the caller out.
+*/
+uint8_t native_api_dispatch(struct NativeApiRegs *regs);
+
+#endif
@@ -4,4 +4,6 @@
 #define API_ERR_NOTFOUND    0x80000001      //invalid api code
 #define API_ERR_NOTSUPP     0x80000002      //this operation is not supported. Check your arguments.
 #define API_ERR_CONSISTENCY 0x80000003      //internal inconsistency detected
+#define API_ERR_IO          0x80000004      //the device reported an error
+#define API_ERR_NOMEM       0x80000005      //the kernel could not allocate the memory needed for the operation
 #endif
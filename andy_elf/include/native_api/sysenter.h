@@ -0,0 +1,32 @@
+#include <types.h>
+
+#ifndef __NATIVE_API_SYSENTER_H
+#define __NATIVE_API_SYSENTER_H
+
+/*
+The SYSENTER way into the native API. It does the same job as int 0x60, see native_api.asm, but without the IDT lookup and
+privilege checks of an interrupt gate on the way in or the iret on the way out. Userland checks cpuid for SEP and uses
+int 0x60 if it isn't there, so the kernel only has to set up the MSRs when it is.
+
+The calling convention is the same as int 0x60 apart from the return address, because SYSENTER doesn't save one:
+the caller pushes the address to come back to and then puts its stack pointer into EBP. SYSEXIT uses ECX and EDX
+for the return, so neither of those survive the call.
+*/
+
+#define MSR_IA32_SYSENTER_CS  0x174
+#define MSR_IA32_SYSENTER_ESP 0x175
+#define MSR_IA32_SYSENTER_EIP 0x176
+
+/**
+Checks whether the processor supports SYSENTER and if so sets it up on the boot processor. Called once at startup, after
+init_native_api.
+*/
+void init_sysenter();
+
+/**
+Points this processor's SYSENTER MSRs at the landing pad and its own kernel stack. Does nothing if init_sysenter found
+that SYSENTER isn't supported.
+*/
+void sysenter_initialise_cpu();
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <types.h>
 #include <utils/ringbuffer.h>
+#include <scheduler/waitqueue.h>
 
 #define PID_MAX 256
 #define FILE_MAX 512
@@ -87,6 +88,23 @@ struct ProcessTableEntry {
   //open files
   struct FilePointer files[FILE_MAX];
   pid_t pid;
+  struct VaSpace *va_space;         //free virtual address ranges in the process's own address space
+  struct SharedImage *shared_image; //read-only segments shared with other processes running the same file, or NULL. Holds a reference.
+  struct FileMapping *file_mappings; //ranges of files that are mapped into the process and loaded on demand, see sys/filemap.h
+
+  //scheduling, see scheduler/scheduler.c
+  uint64_t runtime_ticks;           //timer ticks that the process has spent running in user mode
+  uint32_t quantum_remaining;       //timer ticks left before it is preempted. Topped up every time it is entered.
+  uint32_t preempt_count;           //number of times it has been preempted because its quantum ran out
+  uint8_t priority;                 //run queue level, 0 is the highest. See scheduler/runqueue.h
+  uint8_t runq_state;               //which run queue set it is on, or RUNQ_NONE
+  uint8_t cpu;                      //index of the processor that it is running on, only meaningful while PROCESS_BUSY
+  struct ProcessTableEntry *runq_next;
+  struct ProcessTableEntry *runq_prev;
+
+  //FPU and SSE registers, see scheduler/fpu.h
+  void *fpu_state;                  //where they are saved, or NULL if it has never used the FPU
+  uint8_t fpu_cpu;                  //the processor that they were last loaded on
 } __attribute__((packed));
 
 
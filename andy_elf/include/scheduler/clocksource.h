@@ -0,0 +1,75 @@
+#include <types.h>
+
+#ifndef __SCHEDULER_CLOCKSOURCE_H
+#define __SCHEDULER_CLOCKSOURCE_H
+
+/*
+The clocksource. This gives a nanosecond monotonic clock and a wall clock that are cheap enough to read for latency
+measurements. If the processor has a TSC, it is calibrated at boot against the RTC's 512Hz periodic interrupt, or against
+the PIT if the RTC doesn't seem to be ticking, and then reading the clock is just an rdtsc and a multiply. Without a TSC, or
+with `tsc=0` on the command line, it falls back to timer_now_ns, which counts PIT clocks.
+
+The TSC is assumed to tick at the same rate on every processor, and to have been started at close enough to the same
+time that the difference doesn't matter. Processors without an invariant TSC can change its rate when they save power.
+*/
+
+#define CLOCKSOURCE_PIT   0
+#define CLOCKSOURCE_TSC   1
+
+#define CLOCKSOURCE_SHIFT             22    //ns = (cycles * mult) >> CLOCKSOURCE_SHIFT
+#define CLOCKSOURCE_CALIBRATE_TICKS   64    //RTC ticks to calibrate over, 125ms
+#define CLOCKSOURCE_CALIBRATE_PIT_MS  50    //how long to calibrate against the PIT instead
+
+/**
+Detects and calibrates the TSC. Must be called once, with interrupts on, after initialise_timers and cmos_init_rtc_interrupt.
+*/
+void initialise_clocksource();
+
+/**
+Returns CLOCKSOURCE_TSC or CLOCKSOURCE_PIT.
+*/
+uint8_t clocksource_type();
+
+/**
+Returns 1 if the processor has a TSC, whether or not it is being used as the clocksource.
+*/
+uint8_t clocksource_tsc_present();
+
+/**
+Reads the TSC. Only call this if clocksource_tsc_present() returned 1.
+*/
+static inline uint64_t clocksource_read_tsc()
+{
+  uint32_t low, high;
+  asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+}
+
+/**
+Returns the TSC frequency in kHz, or 0 if it isn't the clocksource. mult is for CLOCKSOURCE_SHIFT.
+*/
+uint32_t clocksource_tsc_khz();
+uint32_t clocksource_tsc_mult();
+
+/**
+Turns a TSC value into nanoseconds on the monotonic clock. Only meaningful if the TSC is the clocksource.
+*/
+uint64_t clocksource_tsc_to_ns(uint64_t tsc);
+
+/**
+Returns the number of nanoseconds since the timer was started. Never goes backwards on any one processor.
+*/
+uint64_t clock_monotonic_ns();
+
+/**
+Turns a value from clock_monotonic_ns into the wall clock time, as seconds since Jan 1st 2000 (see rtc_get_epoch_time)
+and nanoseconds.
+*/
+void clock_wall_from_monotonic(uint64_t monotonic_ns, uint32_t *seconds, uint32_t *nsec);
+
+/**
+Gets the current wall clock time, as clock_wall_from_monotonic.
+*/
+void clock_wall_time(uint32_t *seconds, uint32_t *nsec);
+
+#endif
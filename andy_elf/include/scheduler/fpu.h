@@ -0,0 +1,47 @@
+#include <types.h>
+
+#ifndef __SCHEDULER_FPU_H
+#define __SCHEDULER_FPU_H
+
+/*
+FPU and SSE registers are switched lazily. Every process is entered with CR0.TS set, so the first FPU or SSE instruction that
+it runs traps to IDevNotAvail, and only then are its registers loaded - or set up from scratch, the first time that it
+ever uses them. If it has used them by the time it is switched out then they are saved into its process table entry.
+Processes that never touch the FPU cost nothing, and the kernel itself never uses it.
+*/
+
+#define FPU_FXSAVE_SIZE   512   //FXSAVE/FXRSTOR area, must be 16-byte aligned
+#define FPU_FNSAVE_SIZE   108   //FNSAVE/FRSTOR area, for processors without FXSR
+#define FPU_MXCSR_DEFAULT 0x1F80  //every SIMD exception masked, round to nearest
+
+struct ProcessTableEntry;
+
+/**
+Works out what the processor supports and sets the BSP up. Called once at boot.
+*/
+void initialise_fpu();
+
+/**
+Sets up CR0 and CR4 for FPU switching on the processor that calls it. Called by initialise_fpu for the BSP and by
+smp_ap_main for the others.
+*/
+void fpu_initialise_cpu();
+
+/**
+Called from IDevNotAvail, with the kernel lock held, when a process uses the FPU while CR0.TS is set. Loads the process's
+registers, setting them up first if it has never used the FPU before. Returns 0 if it can carry on, or 1 if it could not
+be given an FPU and has been terminated, in which case the handler must switch it out.
+*/
+uint8_t fpu_device_not_available();
+
+/**
+Called from switch_out_process. Saves the process's FPU registers if it has used them since it was entered, and sets CR0.TS.
+*/
+void fpu_switch_out(struct ProcessTableEntry *p);
+
+/**
+Frees a process's saved FPU registers. Called when the process is removed.
+*/
+void fpu_release(struct ProcessTableEntry *p);
+
+#endif
@@ -0,0 +1,82 @@
+#include <types.h>
+
+#ifndef __SCHEDULER_KTHREAD_H
+#define __SCHEDULER_KTHREAD_H
+
+/*
+Kernel threads. These run kernel code on a stack of their own, so that they can stop part-way through something and carry on
+later without holding up the idle loop that they were entered from. They are run by kthread_run_ready from the idle loop
+on whichever processor gets there first, and keep going until they give the processor back with kthread_yield or
+kthread_sleep. Interrupts can be on while they run; an interrupt taken in a kernel thread is handled on the thread's own stack.
+Like everything else in the kernel they are entered with the kernel lock held, see sys/smp.h, and must hold it again when they
+give the processor back. A thread can let go of it in between, and while it has done so it can mark itself preemptible; the
+timer interrupt then sends it back to the idle loop once it has had a quantum, so that it can't keep processes off the
+processor however long its work takes.
+*/
+
+#define KTHREAD_MAX           8
+#define KTHREAD_STACK_PAGES   16  //64k, the same order as the idle loop's own stack
+
+#define KTHREAD_SLEEPING  0 //waiting for kthread_wake
+#define KTHREAD_READY     1 //will be run the next time round the idle loop
+#define KTHREAD_RUNNING   2
+
+typedef struct kernel_thread {
+  const char *name;
+  void (*entry)(struct kernel_thread *self);  //must never return
+  void *data;
+  volatile uint8_t state;
+  volatile uint8_t wake_pending;  //kthread_wake was called while it was running, so it must not go to sleep
+  volatile uint8_t preemptible;   //set by the thread itself while it is not holding the kernel lock, see kthread_preempt
+  uint8_t cpu;                //the processor that it is running on, only meaningful while KTHREAD_RUNNING
+  vaddr saved_esp;            //while it is not running
+  vaddr return_esp;           //the idle loop that it was entered from, while it is running
+  void *stack_base;
+  uint64_t entered_ns;        //timer_now_ns() when it was last entered
+  uint32_t switches;          //number of times that it has been entered
+  uint32_t yields;            //number of times that it gave the processor back with work still to do
+  uint32_t preemptions;       //number of times that the timer interrupt sent it back to the idle loop
+} KernelThread;
+
+/**
+Creates a kernel thread that starts at `entry`. It is created asleep; call kthread_wake to start it off.
+Returns NULL if there is no memory for it or KTHREAD_MAX threads already exist.
+*/
+KernelThread *kthread_create(const char *name, void (*entry)(KernelThread *self), void *data);
+
+/**
+Makes a sleeping thread ready to run. Safe to call from interrupt handlers, and does nothing if it is already awake.
+*/
+void kthread_wake(KernelThread *t);
+
+/**
+Called from the idle loop. Runs every thread that is ready, one after another, until each one gives the processor back.
+*/
+void kthread_run_ready();
+
+/**
+Returns the kernel thread that is running on this processor, or NULL if it is not running one.
+*/
+KernelThread *kthread_current();
+
+/**
+Gives the processor back to the idle loop, staying ready so that it carries on from here next time round. Must be called
+from a kernel thread and not from an interrupt handler.
+*/
+void kthread_yield();
+
+/**
+Gives the processor back to the idle loop until something calls kthread_wake. Must be called from a kernel thread with
+interrupts off, after checking that there is nothing to do. If it is woken in between then it stays ready instead.
+*/
+void kthread_sleep();
+
+/**
+Called from the timer interrupt, with the kernel lock taken by the interrupt handler. If the interrupt came in on a kernel
+thread that is preemptible, has had `quantum_ns` since it was entered and holds no locks of its own, this gives the processor
+back to the idle loop with the thread still ready. The thread carries on from the interrupt, on whichever processor picks
+it up, when it is next entered.
+*/
+void kthread_preempt(uint64_t quantum_ns);
+
+#endif
@@ -0,0 +1,47 @@
+#include <types.h>
+
+#ifndef __SCHEDULER_RUNQUEUE_H
+#define __SCHEDULER_RUNQUEUE_H
+
+struct ProcessTableEntry;
+
+/*
+Run queues. Every process that is PROCESS_READY is on exactly one of them, so picking the next process to run doesn't mean
+scanning the process table.
+There is a FIFO queue for each priority level and a bitmap of the levels that have something on them, so the highest-priority
+ready process is found with a single bit scan. The queues come in two sets, active and expired, in the same way as the
+Linux O(1) scheduler: a process that uses up its whole quantum goes onto the expired set, and it only gets to run again once
+everything on the active set has had a go, at which point the two are swapped. Processes that give up the CPU early, by
+waiting for I/O, go back onto the active set when they wake, so interactive processes like the shell stay responsive even
+when something else is hogging the CPU.
+*/
+
+#define SCHED_PRIORITY_LEVELS   32  //has to fit in the bitmap
+#define SCHED_PRIORITY_DEFAULT  16  //nice value 0. Level 0 is the highest priority.
+
+#define RUNQ_NONE   0   //not on a run queue
+//anything else is the index of the queue set plus one
+
+/**
+Changes a process's status, putting it onto the active run queues if it is now PROCESS_READY and taking it off them if it
+is not. All status changes for processes other than the kernel must go through here. Safe to call from interrupt handlers.
+*/
+void process_set_status(struct ProcessTableEntry *p, uint8_t status);
+
+/**
+Like process_set_status(p, PROCESS_READY), but for a process that has used up its quantum; it goes on the expired queues.
+*/
+void process_quantum_expired(struct ProcessTableEntry *p);
+
+/**
+Returns the ready process that should run next, or NULL if there isn't one. It stays on the queue until its status is
+changed with process_set_status. Must be called with interrupts off.
+*/
+struct ProcessTableEntry *runqueue_next();
+
+/**
+Moves a process to a different priority level, 0 being the highest. Out-of-range values are clamped.
+*/
+void process_set_priority(struct ProcessTableEntry *p, int32_t priority);
+
+#endif
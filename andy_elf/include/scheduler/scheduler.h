@@ -1,48 +1,115 @@
 #include <types.h>
+#include <scheduler/timer.h>
 
 #ifndef __SCHEDULER_H
 #define __SCHEDULER_H
 
 #define TASK_NONE       0 //invalid (null) task
 #define TASK_ASAP       1 //deferred execution to be run as soon as we can
-#define TASK_DEADLINE   2
-#define TASK_AFTERTIME  3
+#define TASK_DEADLINE   2 //has to be run by time_val. These go before any ASAP tasks, earliest deadline first.
+#define TASK_AFTERTIME  3 //must not be run until time_val has passed, then it is treated like an ASAP task
 
-#define BUFFER_COUNT    4
+#define SCHEDULER_QUANTUM_MS  20  //how long a process can run for before something else gets a go
+
+#define SCHEDULER_DRAIN_BUDGET_US     2000    //how long a task worker can spend running tasks in one go. Set with taskbudget= on the command line.
+#define SCHEDULER_MAX_DRAIN_BUDGET_US 1000000
+
+#define SCHEDULER_DEFAULT_WORKERS     1       //kernel threads that run the deferred tasks. Set with kworkers= on the command line.
+#define SCHEDULER_MAX_WORKERS         4
 
 typedef struct scheduler_task {
   struct scheduler_task *next;
 
-  uint8_t task_type;  //must be one of the TASK_ types listed above
+  uint8_t task_type;  //must be one of the TASK_ types listed above. TASK_NONE while the task is free.
+  uint16_t pool_next; //next free task in the pool, only meaningful while this one is free
 
   void (*task_proc)(struct scheduler_task *t);  //pointer to the service routine, in kernel CS
   void *data;                                   //generic data pointer for required data, in kernel DS
 
   uint32_t process_id;
-  uint64_t time_val;  //only used for TASK_DEADLINE or TASK_AFTERTIME types
+  uint64_t time_val;  //only used for TASK_DEADLINE or TASK_AFTERTIME types. Nanoseconds on the timer_now_ns() clock.
 } SchedulerTask;
 
+/**
+Figures for the runs through the deferred task queues by the task workers, see scheduler.c.
+*/
+typedef struct scheduler_drain_stats {
+  uint32_t last_tasks_run;    //tasks run by the most recent drain that ran any
+  uint32_t last_drain_ns;     //and how long it took
+  uint32_t max_tasks_run;     //most tasks run by a single drain
+  uint32_t budget_exceeded;   //number of drains that ran out of time with tasks still waiting
+  uint64_t drains;            //number of drains that ran at least one task
+  uint64_t tasks_run;
+  uint64_t drain_ns;          //total time spent running tasks
+} SchedulerDrainStats;
+
+/**
+Figures for the pool that SchedulerTask objects come from.
+*/
+typedef struct scheduler_task_pool_stats {
+  uint32_t capacity;
+  uint32_t in_use;
+  uint32_t high_water;  //most tasks that have ever been in use at once
+  uint32_t exhausted;   //number of times that the pool was found empty
+} SchedulerTaskPoolStats;
+
 typedef struct scheduler_state {
-  uint64_t ticks_elapsed;
+  uint64_t ticks_elapsed;         //passes through scheduler_tick
+  uint64_t timer_ticks;           //IRQ0 interrupts, at pit_get_hz() per second
 
   SchedulerTask *task_asap_list;  //tasks for running now
-  SchedulerTask *task_deadline_list;  //ordered list of deadline tasks
-  SchedulerTask *task_aftertime_list; //ordered list of "after time" tasks
+  SchedulerTask *task_asap_tail;  //last task on task_asap_list, so that adding one doesn't mean walking the list
+  TimerHeap task_deadline_list;   //deadline tasks, earliest deadline first
+  TimerHeap task_aftertime_list;  //"after time" tasks, earliest first. The timer is kept armed for the first one.
+  //the three lists and drain_stats are protected by task_queue_lock in scheduler.c rather than by the kernel lock
 
-  struct scheduler_task_buffer *buffers[BUFFER_COUNT];
-  uint32_t current_buffer;
-  uint32_t tasks_in_progress;
+  struct scheduler_task_pool *task_pool;  //lock-free, see scheduler_task_internals.h
+  volatile uint32_t tasks_in_progress;    //tasks that the workers are part-way through
 
+  uint32_t drain_budget_ns;
+  SchedulerDrainStats drain_stats;
 } SchedulerState;
 
 void initialise_scheduler();
 void scheduler_tick();
 
+/**
+Called from the IRQ0 handler with the code segment that was interrupted. Accounts any ticks that have passed to the running
+process, and returns 1 if it should be switched out, either because it has used up its quantum or because an after-time task
+has come due; in that case it has already been set back to PROCESS_READY. Returns 0 otherwise.
+If it interrupted a task worker that has had its quantum then it preempts that instead, see kthread_preempt; this returns
+0 once the worker is entered again.
+*/
+uint8_t scheduler_timer_tick(uint32_t interrupted_cs);
+
+/**
+Called from the IPI_VECTOR_RESCHEDULE handler on the processor that got it, with the kernel lock held. Returns 1 if the
+process that it interrupted has used up its quantum and should be switched out; it has already been put back on the run
+queues in that case. Returns 0 otherwise.
+*/
+uint8_t scheduler_reschedule_ipi(uint32_t interrupted_cs);
+
 SchedulerTask *new_scheduler_task(uint8_t task_type, void (*task_proc)(struct scheduler_task *t), void *data);
 void schedule_task(SchedulerTask *t); //pushes the task onto the relevant queue and takes ownership of the ptr
 
+/**
+Gives a task back to the pool. The scheduler does this itself once task_proc has returned, so this is only needed for a task
+that was never given to schedule_task. Safe to call from an interrupt handler.
+*/
+void release_scheduler_task(SchedulerTask *t);
+
+/**
+Copies the task pool statistics into `out`.
+*/
+void scheduler_get_task_pool_stats(SchedulerTaskPoolStats *out);
+
 uint64_t get_scheduler_ticks();
 
+/**
+Copies the deferred task statistics into `out`.
+*/
+void scheduler_get_drain_stats(SchedulerDrainStats *out);
+
 //return PID of the currently active task
 pid_t get_active_pid();
 
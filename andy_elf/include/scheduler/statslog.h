@@ -0,0 +1,18 @@
+#include <types.h>
+
+#ifndef __SCHEDULER_STATSLOG_H
+#define __SCHEDULER_STATSLOG_H
+
+#define STATS_LOG_MAX_INTERVAL  3600  //seconds
+
+/*
+The statistics log. If the kernel is started with statslog=<seconds> then the figures that the various subsystems keep
+about themselves are written to the console every so many seconds, from an after-time task. It is off by default.
+*/
+
+/**
+Reads statslog= from the command line and schedules the first log if it is set. Needs the scheduler and timer running.
+*/
+void initialise_stats_log();
+
+#endif
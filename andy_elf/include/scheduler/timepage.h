@@ -0,0 +1,61 @@
+#include <types.h>
+
+#ifndef __SCHEDULER_TIMEPAGE_H
+#define __SCHEDULER_TIMEPAGE_H
+
+/*
+The time page. This is one page that every process can read but not write, at TIME_PAGE_ADDRESS, so that userland can
+find out the time without a native API call. The kernel updates it from the timer interrupt.
+
+initialise_app_pagingdir puts it into the first slot of each new process's stack page table, marked MPC_SHARED so that
+it isn't freed along with the process. The kernel writes to it through a supervisor-only mapping of its own.
+
+To read it consistently, read `seq`, read the fields, then read `seq` again. Start again if the two don't match or the
+first one was odd, because the kernel was part-way through an update. If TIME_PAGE_TSC_VALID is set in `flags`, then the
+time since the update is ((TSC - tsc_at_update) * tsc_mult) >> tsc_shift nanoseconds, and can be added to both clocks.
+Otherwise they are only as fine-grained as the timer interrupt.
+*/
+
+#define TIME_PAGE_ADDRESS     0xFFC00000  //the bottom of the stack's page table, well below APP_STACK_LIMIT
+#define TIME_PAGE_VERSION     1
+
+#define TIME_PAGE_TSC_VALID   1 << 0      //tsc_mult and tsc_shift can be used
+
+#define TIME_PAGE_UNIX_OFFSET 946684800   //seconds from the Unix epoch to Jan 1st 2000
+
+struct TimePage {
+  volatile uint32_t seq;      //odd while the kernel is updating the page
+  uint32_t version;           //TIME_PAGE_VERSION
+  uint32_t flags;
+  uint32_t epoch_seconds;     //wall clock, seconds since Jan 1st 2000 as rtc_get_epoch_time gives
+  uint32_t epoch_nsec;        //and nanoseconds on top of that
+  uint32_t reserved;
+  uint64_t monotonic_ns;      //timer_now_ns() at the update
+  uint64_t ticks;             //scheduler ticks since the timer was started
+  uint64_t tsc_at_update;     //only meaningful with TIME_PAGE_TSC_VALID
+  uint32_t tsc_mult;
+  uint32_t tsc_shift;
+} __attribute__((packed));
+
+/**
+Sets up the time page. Must be called before the first process is started, after initialise_clocksource.
+*/
+void initialise_time_page();
+
+/**
+Returns the page table entry that maps the time page into a process at TIME_PAGE_ADDRESS, or 0 if there isn't one yet.
+*/
+uint32_t time_page_entry();
+
+/**
+Brings the time page up to date. Called by scheduler_timer_tick with the number of ticks that timer_interrupt returned.
+*/
+void time_page_update(uint32_t ticks);
+
+/**
+Tells userland how to turn TSC cycles into nanoseconds: ns = (cycles * mult) >> shift. Pass a mult of 0 if the TSC
+can't be used. initialise_time_page does this itself if the TSC is the clocksource.
+*/
+void time_page_set_tsc_scale(uint32_t mult, uint32_t shift);
+
+#endif
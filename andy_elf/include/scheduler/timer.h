@@ -0,0 +1,84 @@
+#include <types.h>
+
+#ifndef __SCHEDULER_TIMER_H
+#define __SCHEDULER_TIMER_H
+
+/*
+The timer core. Time is kept in nanoseconds since the timer was started, and everything that needs an interrupt at a
+particular time - the scheduler tick, and TASK_AFTERTIME tasks - gets one from a single one-shot on PIT channel 0. That is
+re-armed every time it fires for whichever of them is due first, so there is no fixed-rate interrupt, and nothing has to
+poll to find out whether its time has come.
+*/
+
+#define NS_PER_SECOND   1000000000
+#define NS_PER_MS       1000000
+#define NS_PER_US       1000
+
+#define TIMER_NEVER     0xFFFFFFFFFFFFFFFFULL
+
+struct scheduler_task;
+
+/**
+Divides n by base in place and returns the remainder, e.g. to turn a nanosecond count into something coarser.
+A plain 64-bit division would need __udivdi3, which we don't have.
+*/
+static inline uint32_t timer_div64(uint64_t *n, uint32_t base)
+{
+  uint32_t high = (uint32_t)(*n >> 32);
+  uint32_t q_high = high / base;
+  uint32_t rem = high % base;
+  uint32_t q_low;
+  //rem < base, so the quotient fits into 32 bits and divl can't fault
+  asm("divl %4" : "=a"(q_low), "=d"(rem) : "a"((uint32_t)*n), "d"(rem), "rm"(base));
+  *n = ((uint64_t)q_high << 32) | q_low;
+  return rem;
+}
+
+/**
+A binary min-heap of tasks, ordered by time_val. The earliest is always at entries[0].
+*/
+typedef struct timer_heap {
+  struct scheduler_task **entries;
+  uint32_t count;
+  uint32_t capacity;
+} TimerHeap;
+
+/**
+Starts the one-shot timer at the rate given by pit_get_hz(). Must be called once, with interrupts off, after pit_initialise.
+*/
+void initialise_timers();
+
+/**
+Returns the number of nanoseconds since initialise_timers was called. The resolution is one PIT clock, about 838ns.
+*/
+uint64_t timer_now_ns();
+
+/**
+Asks for an interrupt at or just after `expiry_ns`. Only the earliest request is remembered, and it is forgotten once it has
+fired, so the caller has to ask again for anything later than that.
+*/
+void timer_arm(uint64_t expiry_ns);
+
+/**
+Called from the IRQ0 handler, with interrupts off. Brings the clock up to date and arms the next one-shot.
+Returns the number of scheduler ticks that have passed since the last call, which is usually 0 or 1.
+*/
+uint32_t timer_interrupt();
+
+/**
+Allocates space for a heap of at least `capacity` tasks. Returns 0 on success or 1 if there is no memory.
+*/
+uint8_t timer_heap_init(TimerHeap *h, uint32_t capacity);
+
+/**
+Adds a task to the heap. Returns 0 on success or 1 if the heap is full.
+*/
+uint8_t timer_heap_push(TimerHeap *h, struct scheduler_task *t);
+
+/**
+Returns the task with the lowest time_val, or NULL if the heap is empty. timer_heap_pop also removes it.
+*/
+struct scheduler_task *timer_heap_peek(TimerHeap *h);
+struct scheduler_task *timer_heap_pop(TimerHeap *h);
+
+#endif
@@ -0,0 +1,78 @@
+#include <types.h>
+
+#ifndef __SCHEDULER_WAITQUEUE_H
+#define __SCHEDULER_WAITQUEUE_H
+
+/*
+Wait queues. A process that has to wait for something - keyboard input, a disk read, or just the passage of time - is put
+on a wait queue in PROCESS_IOWAIT, which takes it off the run queues so it uses no CPU at all. Whatever it is waiting for
+then wakes it with a result, which puts it straight back on the run queue; the result turns up in EAX when it next runs,
+i.e. as the return value of the native API call that it blocked in.
+A process can only wait for one thing at once, so each PID has exactly one queue entry. These are kept in a table of their
+own rather than in the process table entry, which is packed and so would leave them misaligned.
+*/
+
+#define WAIT_FOREVER    0xFFFFFFFFFFFFFFFFULL
+
+struct ProcessTableEntry;
+struct wait_queue;
+
+typedef struct wait_queue_entry {
+  struct wait_queue_entry *next;
+  struct wait_queue *queue;         //the queue it is on, or NULL. It can wait on no queue at all if it is only waiting for the timeout.
+  struct ProcessTableEntry *process;
+  void *data;                       //whatever the waker needs to know about the wait, e.g. the file being read
+  uint32_t result;                  //set to the timeout result when it starts waiting, and overwritten by a wake
+  uint32_t sequence;                //identifies this particular wait, so that a timeout for an earlier one is ignored
+  uint8_t waiting;
+  uint8_t deliver;                  //woken, but the result has not been put into the process's EAX yet
+} WaitQueueEntry;
+
+typedef struct wait_queue {
+  WaitQueueEntry *head;
+  WaitQueueEntry *tail;
+} WaitQueue;
+
+void wait_queue_init(WaitQueue *q);
+
+/**
+Returns the wait queue entry that belongs to the process, e.g. to get at the `data` that it is waiting with once it has been woken.
+*/
+WaitQueueEntry *wait_queue_entry(struct ProcessTableEntry *p);
+uint8_t wait_queue_empty(WaitQueue *q);
+
+/**
+Puts the process to sleep on `q`, which can be NULL if it is only waiting for the timeout. If `timeout_ns` is not WAIT_FOREVER
+then it is woken with `timeout_result` once that many nanoseconds have gone by, if nothing else has woken it first.
+This only changes the process's state; the native API call must then leave through .napi_rtn_to_kern so that the process
+is switched out. It is safe for the wake to happen before that.
+*/
+void wait_queue_wait(WaitQueue *q, struct ProcessTableEntry *p, uint64_t timeout_ns, uint32_t timeout_result, void *data);
+
+/**
+Wakes the process that has been waiting longest on `q`, giving it `result`. Returns the process, or NULL if nobody was waiting.
+Safe to call from interrupt handlers.
+*/
+struct ProcessTableEntry *wait_queue_wake_one(WaitQueue *q, uint32_t result);
+
+/**
+Wakes the first process on `q` that is waiting with the given `data`. Returns the process, or NULL if there is none.
+*/
+struct ProcessTableEntry *wait_queue_wake_data(WaitQueue *q, void *data, uint32_t result);
+
+/**
+Wakes everybody waiting on `q`. Returns the number of processes that were woken.
+*/
+uint32_t wait_queue_wake_all(WaitQueue *q, uint32_t result);
+
+/**
+Takes the process off whatever it is waiting on without waking it, e.g. because it is being terminated.
+*/
+void wait_queue_cancel(struct ProcessTableEntry *p);
+
+/**
+Called just before a process is entered. If it has been woken since it last ran, this puts the result into its saved EAX.
+*/
+void wait_queue_deliver_result(struct ProcessTableEntry *p);
+
+#endif
@@ -0,0 +1,75 @@
+#include <types.h>
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <spinlock.h>
+#include <sys/mmgr.h>
+
+#define SLAB_CACHE_SIG  0x48434c53  //"SLCH"
+#define SLAB_SIG        0x42414c53  //"SLAB"
+
+#define SLAB_CACHE_LINE     64  //objects are aligned so that they don't straddle cache lines unnecessarily
+#define SLAB_MAX_OBJECT     (PAGE_SIZE/4) //each slab is a single page, so don't allow objects that would waste most of it
+#define SLAB_MAX_EMPTY      1   //number of completely empty slabs a cache keeps hold of before giving pages back
+
+/**
+Every slab is a single page of kernel memory, starting with this header.
+The objects follow it, and free objects are chained through their first word.
+*/
+typedef struct SlabHeader {
+  uint32_t magic; //must be SLAB_SIG
+  struct SlabCache *cache;
+  struct SlabHeader *next_slab;
+  struct SlabHeader *prev_slab;
+  void *free_list;
+  size_t in_use;
+} SlabHeader;
+
+typedef struct SlabCacheStats {
+  size_t object_size;       //size of each object, after alignment
+  size_t objects_per_slab;
+  size_t slab_count;        //number of pages currently owned by the cache
+  size_t objects_in_use;
+  size_t high_water_mark;   //largest value that objects_in_use has reached
+  uint32_t alloc_count;
+  uint32_t free_count;
+} SlabCacheStats;
+
+typedef struct SlabCache {
+  uint32_t magic; //must be SLAB_CACHE_SIG
+  const char *name;
+  size_t first_object_offset;
+  SlabHeader *partial_slabs;  //slabs with some objects free
+  SlabHeader *full_slabs;     //slabs with no objects free
+  SlabHeader *empty_slabs;    //slabs with all objects free
+  size_t empty_count;
+  spinlock_t lock;
+  SlabCacheStats stats;
+} SlabCache;
+
+/**
+ * Creates a new cache for objects of the given size. The name is only used for diagnostics and must remain valid
+ * for the lifetime of the cache.
+ * Returns NULL if the object size is not supported or there is no memory.
+*/
+SlabCache *slab_cache_create(const char *name, size_t object_size);
+/**
+ * Destroys the given cache and gives all of its pages back. This fails (returning 1) if any objects are still in use,
+ * otherwise it returns 0 and the cache pointer must not be used again.
+*/
+uint8_t slab_cache_destroy(SlabCache *cache);
+/**
+ * Allocates an object from the cache. The contents are undefined. Returns NULL if there is no memory.
+*/
+void *slab_alloc(SlabCache *cache);
+/**
+ * Returns an object to the cache it was allocated from.
+*/
+void slab_free(SlabCache *cache, void *ptr);
+/**
+ * Copies the current statistics for the cache into the given buffer
+*/
+void slab_cache_stats(SlabCache *cache, SlabCacheStats *stats);
+
+#endif
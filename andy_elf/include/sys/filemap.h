@@ -0,0 +1,87 @@
+#include <types.h>
+#include <fs/fat_fileops.h>
+
+#ifndef __SYS_FILEMAP_H
+#define __SYS_FILEMAP_H
+
+#define FILE_MAPPING_SIG  0x50414D46  //"FMAP"
+
+#define MMAP_FLAG_WRITE   (1 << 0) //the pages can be written to. Changes are private to the process and are never written back to the file.
+
+struct ProcessTableEntry;
+
+/**
+A page read that was started by a fault on a file-backed page. The faulting process sleeps in PROCESS_IOWAIT until the read
+completes, and then retries the access. The retry finds the data here and maps it in, from inside the process's own address space.
+*/
+struct FileMappingRead {
+  vaddr page;             //page-aligned address that faulted
+  pid_t pid;              //process that is waiting for it
+  void *buffer;           //kernel heap buffer that the data is read into
+  size_t page_offset;     //where in the page the data goes; anything else in the page is zero
+  size_t length;          //number of bytes requested
+  size_t bytes_read;
+  uint8_t status;         //status from vfat_read_async, only valid once `done` is set
+  uint8_t done;
+  uint8_t orphaned;       //the mapping went away while the read was in flight, so the completion must tidy everything up
+  VFatOpenFile *fp;       //only used if orphaned, so that the file can be closed afterwards
+};
+
+/**
+A range of a VFAT file that is mapped into a process. The page table entries are marked MPC_DEMANDZERO|MPC_FILEBACKED, so no RAM
+is used until a page is touched; then the page fault handler reads that page in from the file.
+File byte `file_offset + n` appears at `base + data_offset + n`, for n < data_length. Everything else in the range reads as zero,
+which is what an ELF segment that does not start on a page boundary needs.
+*/
+struct FileMapping {
+  uint32_t magic;               //must be FILE_MAPPING_SIG
+  struct FileMapping *next;
+  vaddr base;                   //page-aligned start of the mapping, in process space
+  size_t page_count;
+  VFatOpenFile *fp;             //each mapping has its own open file, so that seeking it can't upset anybody else. Owned by the mapping.
+  size_t file_offset;
+  size_t data_offset;
+  size_t data_length;
+  uint32_t page_flags;          //MP_* flags that the pages get once they are loaded
+  struct FileMappingRead *pending;  //the read in flight for this mapping, or NULL. A process can only wait for one page at once.
+};
+
+/**
+Creates a mapping description. The mapping takes ownership of `fp`. Nothing is mapped into any address space yet,
+see file_mapping_attach. Returns NULL if there is no memory.
+*/
+struct FileMapping *file_mapping_new(VFatOpenFile *fp, size_t file_offset, size_t data_offset, size_t data_length, uint32_t page_flags);
+
+/**
+Sets up the not-present page table entries for the mapping in the process's address space and adds it to the process's list.
+`mapped_pagedirs` is either the process's directory as mapped by map_app_pagingdir, or its physical address if it is the one that is loaded.
+If `base` is 0 then free address space is found for it, otherwise it goes there.
+Returns the base address, or 0 on failure; in that case the mapping has not been freed.
+*/
+vaddr file_mapping_attach(struct ProcessTableEntry *process, uint32_t *mapped_pagedirs, struct FileMapping *m, vaddr base, size_t page_count);
+
+/**
+Disposes of a mapping that is not in any process's list, closing its file. If a page is still being read for it then the
+read can't be cancelled, so the completion is left to free it along with the open file.
+*/
+void file_mapping_free(struct FileMapping *m);
+
+/**
+Removes the mapping that starts at `base` from the currently loaded process, freeing any pages that had been read in.
+Returns 0 on success or 1 if there is no mapping there.
+*/
+uint8_t file_mapping_remove(struct ProcessTableEntry *process, vaddr base);
+
+/**
+Forgets every mapping belonging to the process, e.g. when it exits. The pages themselves are freed along with the rest of
+the process's memory by free_app_memory.
+*/
+void file_mapping_release_all(struct ProcessTableEntry *process);
+
+/**
+Called by handle_allocation_fault for a not-present page marked MPC_FILEBACKED, in the address space of the current process.
+Returns 0 if the page is now mapped, PAGEFAULT_BLOCKED if the process has to wait for it to be read, or 1 if it can't be handled.
+*/
+uint8_t file_mapping_fault(vaddr pf_load_addr, uint32_t error_code);
+
+#endif
@@ -1,3 +1,5 @@
+#include <types.h>
+
 #ifndef __SYS_GDT_H
 #define __SYS_GDT_H
 
@@ -10,5 +12,52 @@
 #define GDT_TSS       0x20
 #define GDT_USER_CS   0x28
 #define GDT_USER_DS   0x30
+//SYSENTER takes its CS from IA32_SYSENTER_CS and its SS from the next entry; SYSEXIT takes the user CS and SS from the two
+//after that. These are flat segments like the ones above.
+#define GDT_SYSENTER_CS 0x38
+#define GDT_SYSENTER_SS 0x40
+#define GDT_SYSEXIT_CS  0x48
+#define GDT_SYSEXIT_SS  0x50
+
+#define GDT_ENTRY_COUNT   11      //including the null descriptor
+#define FULL_GDT_ADDRESS  0xe08   //FullGDT in memlayout.asm, which the boot processor uses
+#define IDT_POINTER_ADDRESS 0x1000  //IDTPtr in memlayout.asm. Every processor shares the one IDT.
+
+//access byte for an available (not busy) 32-bit TSS descriptor
+#define GDT_TSS_AVAILABLE 0x89
+
+/**
+The hardware task state segment. We don't use hardware task switching, this is only here so the processor knows which
+stack to use when an interrupt arrives in ring 3.
+*/
+struct TaskStateSegment {
+  uint32_t link;
+  uint32_t esp0;
+  uint32_t ss0;
+  uint32_t esp1;
+  uint32_t ss1;
+  uint32_t esp2;
+  uint32_t ss2;
+  uint32_t cr3;
+  uint32_t eip;
+  uint32_t eflags;
+  uint32_t eax;
+  uint32_t ecx;
+  uint32_t edx;
+  uint32_t ebx;
+  uint32_t esp;
+  uint32_t ebp;
+  uint32_t esi;
+  uint32_t edi;
+  uint32_t es;
+  uint32_t cs;
+  uint32_t ss;
+  uint32_t ds;
+  uint32_t fs;
+  uint32_t gs;
+  uint32_t ldt;
+  uint16_t trap;
+  uint16_t iomap_base;  //if this is beyond the end of the segment then ring 3 can't use any I/O ports
+} __attribute__((packed));
 
 #endif
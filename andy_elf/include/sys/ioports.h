@@ -55,4 +55,17 @@ static inline void sti() {
     asm volatile ( "sti" : : : "memory" );
 }
 
+/*
+Purpose: Disable interrupts, for code that can be called both with them on and with them off.
+Returns: the previous EFLAGS, to be given to irq_restore afterwards so that interrupts only come back on if they were on before.
+*/
+static inline uint32_t irq_save() {
+    uint32_t flags;
+    asm volatile ( "pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory" );
+    return flags;
+}
+static inline void irq_restore(uint32_t flags) {
+    if(flags & 0x200) sti();  //IF
+}
+
 #endif
@@ -39,13 +39,23 @@ struct BiosMemoryMap {
   //this is followed by `entries` x MemoryMapEntry structures
 };
 
-/** our own physical memory map, unconstrained by hardware requirements
+/** our own physical memory map, unconstrained by hardware requirements.
+It also doubles as the storage for the buddy allocator's free lists; a free block of 2^order pages
+is represented by its first page having free_head set and being linked into the list for that order.
 */
 struct PhysMapEntry {
   int present:1;
   int in_use:1;
+  unsigned int usable:1;      //page lies within a "usable" E820 range, so the allocator may hand it out
+  unsigned int free_head:1;   //page is the first page of a free block on the free list for `order`
+  unsigned int order:4;       //log2 of the page count of the free block starting here. Only valid if free_head is set.
+  uint32_t next_free;         //page index of the next free block of the same order, or PHYS_NO_PAGE
+  uint32_t prev_free;         //page index of the previous free block of the same order, or PHYS_NO_PAGE
 } __attribute__((packed));
 
+#define PHYS_NO_PAGE    0xFFFFFFFF  //list terminator for the physical free lists
+#define PHYS_MAX_ORDER  10          //largest buddy block is 2^10 pages, i.e. 4Mb
+
 #define MP_PRESENT    1 << 0  //if this is 0 then accessing the page raises a page fault for swap-in
 #define MP_READWRITE  1 << 1  //if this is 0 then page is read-only, if it's 1 then read-write
 #define MP_USER       1 << 2  //if this is 0 then supervisor access only, if it's 1 then any ring
@@ -57,6 +67,10 @@ struct PhysMapEntry {
 #define MP_GLOBAL     1 << 8  //don't invalidate when CR3 changes if set
 
 #define MPC_PAGINGDIR    1 << 9  //custom attribute - if this is 1 then the page is a paging directory, i.e. not present but can be mapped in
+#define MPC_ZEROED       (1 << 10) //custom attribute - only valid as a request to vm_alloc_pages, the pages are zeroed before they are returned
+#define MPC_DEMANDZERO   (1 << 11) //custom attribute - the page is not present, but a zeroed page is mapped in with the entry's flags the first time it is touched
+#define MPC_SHARED       (1 << 11) //custom attribute - on a present page, the RAM belongs to a SharedImage so must not be freed with the process. Only present pages use it, so it shares a bit with MPC_DEMANDZERO
+#define MPC_FILEBACKED   (1 << 10) //custom attribute - on a demand-zero page, the contents come from a FileMapping rather than being blank. Only non-present pages use it, so it shares a bit with MPC_ZEROED
 #define MP_PAGEATTRIBUTE 1 << 12 //if Page Attribute Table is supported, forms a 3-bit index value with MP_PWT and MP_PCD
 
 #define MP_OSBITS_MASK 0xF00  //bitmask for the 3 os-dependent bits
@@ -65,10 +79,21 @@ struct PhysMapEntry {
 #define PAGE_SIZE         0x1000  //4k pages
 #define PAGE_SIZE_DWORDS  0x400
 
+#define LARGE_PAGE_SIZE         0x400000    //a 4Mb page, as mapped by a directory entry with MP_PAGESIZE set (needs PSE)
+#define LARGE_PAGE_PAGES        0x400       //number of 4k pages in a large page
+#define LARGE_PAGE_ADDRESS_MASK 0xFFC00000
+
+
+//The kernel's root paging directory lives at this physical (and identity-mapped) address
+#define ROOT_PAGE_DIR_LOCATION  0x3000
 
 //We only create mapped app pagedirs in this region.
 #define APP_PAGEDIRS_BASE (vaddr)0xC0000000
 
+//App stacks grow down from the top of the address space. Pages are added by the page-fault handler as they are touched,
+//down to this limit (1Mb of stack).
+#define APP_STACK_LIMIT   (vaddr)0xFFF00000
+
 /* external facing functions */
 /**
 initialise the memory manager, applying protections as per the BiosMemoryMap pointed to
@@ -86,9 +111,16 @@ void *vm_alloc_pages(uint32_t *root_page_dir, size_t page_count, uint32_t flags)
 */
 void *vm_alloc_lowmem(uint32_t *root_page_dir, size_t page_count, uint32_t flags);
 
+/**
+allocates the given number of 4Mb pages of physical RAM and maps each one with a single directory entry.
+This only works if the CPU supports PSE; otherwise, or if there is no suitably aligned RAM or address space, NULL is returned.
+vm_alloc_pages calls this automatically when asked for a whole number of large pages.
+*/
+void *vm_alloc_large_pages(uint32_t *root_page_dir, size_t large_page_count, uint32_t flags);
+
 /**
 unmaps the physical ram pages pointed to but the vmem_ptr and marks them as "free" in the physical
-ram map
+ram map. If part of a 4Mb page is unmapped then it is first split into 4k pages.
 */
 void vm_deallocate_physical_pages(uint32_t *root_page_dir, void *vmem_ptr, size_t page_count);
 
@@ -129,6 +161,22 @@ virtual memory to complete or `pages` was 0.
 */
 void * vm_map_next_unallocated_pages(uint32_t *root_page_dir, uint32_t flags, void **phys_addr, size_t pages);
 
+/**
+Sets up page_count demand-zero pages. No RAM is allocated now; the first access to each page maps in a zeroed page with the given flags.
+If vmem_ptr is NULL then free address space is found for them, otherwise they go at vmem_ptr (e.g. for an app's .bss). Anything that is already
+mapped in that range is left alone.
+vm_alloc_pages calls this if MPC_DEMANDZERO is in the flags. If MPC_FILEBACKED is in the flags, then the pages are filled from a FileMapping
+instead, see sys/filemap.h.
+Returns the address of the first page, or NULL if there was no space.
+*/
+void *vm_map_demand_zero_pages(uint32_t *root_page_dir, void *vmem_ptr, size_t page_count, uint32_t flags);
+
+/**
+Called while handling a fault in the current address space, to map a zeroed page at `page` with the given flags and copy `length` bytes
+of `data` into it at `offset`. Returns 0 on success or 1 if there was no RAM.
+*/
+uint8_t vm_fill_faulted_page(vaddr page, void *data, size_t offset, size_t length, uint32_t flags);
+
 /**
  * Maps the contents of the given paging dir into memory, on a 4mb boundary
 */
@@ -180,7 +228,14 @@ uint8_t _resolve_vptr(void *vmem_ptr, uint16_t *dir, uint16_t *off);
 
 uint32_t *initialise_app_pagingdir(void **phys_ptr_list, size_t phys_ptr_count);
 
-/** called from the page-fault handler for JIT allocation*/
+/**
+Checks that every byte of [start, start+length) in the current address space is app memory that the kernel may write to on the app's
+behalf: mapped user-writable, demand-zero user-writable, or app stack that will be grown on touch. The time page is always refused.
+Returns 1 if the whole range is writable or 0 otherwise.
+*/
+uint8_t vm_user_range_writable(vaddr start, size_t length);
+
+/** called from the page-fault handler for JIT allocation of kernel page tables, demand-zero and file-backed pages and app stack growth*/
 uint8_t handle_allocation_fault(uint32_t pf_load_addr, uint32_t error_code, uint32_t faulting_addr, uint32_t faulting_codeseg, uint32_t eflags);
 
 void idpaging(uint32_t *first_pte, vaddr from, int size);
@@ -191,6 +246,51 @@ void apply_memory_map_protections(struct MemoryMapEntry memmap[], uint32_t entri
 void* vm_add_dir(uint32_t *root_page_dir, uint16_t idx, uint32_t flags);
 uint32_t allocate_free_physical_pages(uint32_t page_count, void **blocks);
 uint32_t deallocate_physical_pages(uint32_t page_count, void **blocks);
+void initialise_physical_allocator(struct MemoryMapEntry memmap[], uint32_t entries);
+void reserve_physical_page(void *phys_addr);
+/**
+ * Allocates a physically contiguous run of pages whose base is aligned to (at least) align_pages pages.
+ * align_pages is rounded up to a power of two; pass 0 or 1 for no particular alignment.
+ * Returns the physical address of the first page, or NULL if no suitable run is available.
+*/
+void *allocate_contiguous_physical_pages(size_t page_count, size_t align_pages);
+/**
+ * Frees a run of pages previously obtained from allocate_contiguous_physical_pages
+*/
+void deallocate_contiguous_physical_pages(void *phys_base, size_t page_count);
+/**
+ * Returns the number of pages of physical RAM that are currently free
+*/
+size_t physical_pages_free();
+
+/**
+ * Zeroes a page of physical RAM, which does not need to be mapped anywhere
+*/
+void zero_physical_page(void *phys_addr);
+
+/**
+ * Pool of physical pages that have already been zeroed, topped up from the idle loop
+*/
+#define ZEROED_POOL_CAPACITY      64  //maximum number of pages held in the pool
+#define ZEROED_POOL_REFILL_BATCH  4   //maximum number of pages zeroed on each pass of the idle loop
+
+struct ZeroedPoolStats {
+  size_t depth;     //pages currently in the pool
+  size_t capacity;
+  uint32_t hits;    //pages handed out straight from the pool
+  uint32_t misses;  //pages that had to be zeroed at the point of allocation
+};
+
+/**
+ * Works like allocate_free_physical_pages, but the pages are guaranteed to be zeroed.
+ * They are taken from the pre-zeroed pool where possible.
+*/
+uint32_t allocate_zeroed_physical_pages(uint32_t page_count, void **blocks);
+/**
+ * Zeroes up to ZEROED_POOL_REFILL_BATCH more pages into the pool. Called from the idle loop.
+*/
+void refill_zeroed_page_pool();
+void zeroed_page_pool_stats(struct ZeroedPoolStats *stats);
 void *k_map_page_bytes(uint32_t *root_page_dir, void *phys_addr, void *target_virt_addr, uint32_t flags);
 vaddr _mmgr_get_pd();
 #endif
@@ -9,4 +9,9 @@ Pagefault error code bitfield
 #define PAGEFAULT_ERR_PKEY 1<< 5    // 	When set, the page fault was caused by a protection-key violation. The PKRU register (for user-mode accesses) or PKRS MSR (for supervisor-mode accesses) specifies the protection key rights.
 #define PAGEFAULT_ERR_SS 1<< 6      // When set, the page fault was caused by a shadow stack access.
 #define PAGEFAULT_ERR_SGX 1<< 15    //When set, the fault was due to an SGX violaton. The fault is unrelated to ordinary paging.
-#define PAGEFAULT_ERR_PRESENT 1<< 0
\ No newline at end of file
+#define PAGEFAULT_ERR_PRESENT 1<< 0
+/*
+Extra return value from handle_allocation_fault. The faulting process has been put to sleep while its page is read in, so the
+fault handler must switch it out rather than returning to it. Once the page is ready the process is woken and retries the access.
+*/
+#define PAGEFAULT_BLOCKED 2
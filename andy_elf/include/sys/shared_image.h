@@ -0,0 +1,70 @@
+#include <types.h>
+
+#ifndef __SYS_SHARED_IMAGE_H
+#define __SYS_SHARED_IMAGE_H
+
+#define SHARED_IMAGE_SIG          0x474D4953  //"SIMG"
+#define SHARED_IMAGE_MAX_SEGMENTS 4           //maximum number of read-only segments that can be shared from one file
+
+/**
+Identifies an executable file on disk. If any of this changes then the file is treated as a different one.
+*/
+struct SharedImageKey {
+  void *fs;                 //FATFS the file is on
+  uint32_t first_cluster;
+  uint32_t file_size;
+  uint16_t last_mod_time;
+  uint16_t last_mod_date;
+};
+
+/**
+The physical pages holding one read-only PT_LOAD segment, and the (page-aligned) address that they get mapped to in every process.
+*/
+struct SharedSegment {
+  vaddr base;
+  size_t page_count;
+  void **phys_pages;
+};
+
+/**
+The read-only segments of an executable, loaded once and mapped into every process that runs it.
+The pages are mapped with MPC_SHARED, so free_app_memory leaves them alone. Instead the image is reference-counted; every process
+running it holds a reference, as does an elf_parsed_data that was loaded without them. The pages are freed when the last reference goes.
+*/
+struct SharedImage {
+  uint32_t magic;           //must be SHARED_IMAGE_SIG
+  struct SharedImage *next;
+  struct SharedImageKey key;
+  uint32_t refcount;
+  uint8_t published;        //set once the image is complete and can be found by shared_image_find
+  size_t segment_count;
+  struct SharedSegment segments[SHARED_IMAGE_MAX_SEGMENTS];
+};
+
+/**
+Looks for a complete image of the given file. If one is found then a reference is taken on it, which must be released with shared_image_unref.
+*/
+struct SharedImage *shared_image_find(struct SharedImageKey *key);
+
+/**
+Creates an empty image for the given file, with a single reference. Segments are added as they are loaded and then the image is
+published so that later loads of the same file can find it. Returns NULL if there is no memory.
+*/
+struct SharedImage *shared_image_new(struct SharedImageKey *key);
+
+/**
+Adds a segment to an image that has not been published yet. The image takes ownership of phys_pages, which must have been malloc'd.
+Returns 0 on success, or 1 if the image already has SHARED_IMAGE_MAX_SEGMENTS segments.
+*/
+uint8_t shared_image_add_segment(struct SharedImage *image, vaddr base, size_t page_count, void **phys_pages);
+
+/**
+Returns the segment that is mapped at the given page-aligned address, or NULL if this image does not have it.
+*/
+struct SharedSegment *shared_image_find_segment(struct SharedImage *image, vaddr base);
+
+void shared_image_publish(struct SharedImage *image);
+void shared_image_ref(struct SharedImage *image);
+void shared_image_unref(struct SharedImage *image);
+
+#endif
@@ -0,0 +1,114 @@
+#include <types.h>
+#include <sys/gdt.h>
+
+#ifndef __SYS_SMP_H
+#define __SYS_SMP_H
+
+/*
+Multi-processor support. The processors listed in the MADT are started up by smp_initialise, and from then on every one of
+them runs idle_loop and can enter user processes.
+
+Most of the kernel was written for a single processor, and keeps other code out of its data structures by turning interrupts
+off. That doesn't stop another processor, so the kernel as a whole is covered by one lock, the kernel lock. It is taken on
+every way into the kernel - interrupt handlers, exceptions and native API calls - and idle_loop holds it whenever it is
+not halted. It is only let go of by the entry points when they return, by exit_to_process when it goes into a process, and
+by idle_loop while it waits for an interrupt. It can be taken again by the processor that holds it, so an interrupt that
+arrives while the kernel is running still works as it always did. User processes are what run in parallel, along with
+the deferred tasks: the task workers let go of the lock while they run a task, so the scheduler's task lists, the run queues,
+the wait queues and the timer have spinlocks of their own. See scheduler/kthread.h.
+*/
+
+#define SMP_MAX_CPUS          8
+#define SMP_NO_CPU            0xFF
+#define SMP_AP_STACK_PAGES    4         //kernel stack for each application processor
+#define SMP_TRAMPOLINE_ADDRESS  0x60000 //APTrampolinePage in memlayout.asm. Must be page-aligned and below 1Mb.
+#define SMP_STARTUP_TIMEOUT_MS  100     //how long to wait for an application processor to say that it is up
+
+#define IPI_VECTOR_RESCHEDULE     0x40  //look at the run queues again, see scheduler_reschedule_ipi
+#define IPI_VECTOR_TLB_SHOOTDOWN  0x41  //drop cached translations, see smp_tlb_shootdown
+
+struct kernel_thread;
+
+/**
+Everything that a processor needs of its own.
+*/
+struct CpuState {
+  uint64_t gdt[GDT_ENTRY_COUNT];  //must be the first thing in here, see this_cpu(). Not used by the BSP, which keeps the GDT from kickoff.s.
+  struct TaskStateSegment tss;    //not used by the BSP either
+  uint8_t index;                  //position in the CPU table. The BSP is always 0.
+  uint8_t apic_id;
+  volatile uint8_t online;        //set by the processor itself once it is running
+  volatile uint8_t idle;          //halted in idle_loop. Only changed with the kernel lock held.
+  pid_t current_pid;              //the process that it last entered, see get_current_processid
+  struct kernel_thread *current_kthread;  //the kernel thread that it is running, or NULL. See scheduler/kthread.h
+  pid_t fpu_owner;                //the process whose registers are in the FPU, or 0. See scheduler/fpu.h
+  vaddr kernel_stack;             //the stack pointer that switch_out_process goes back to when it leaves a process
+  void *stack_base;               //from vm_alloc_pages. NULL for the BSP, whose stack is in low memory.
+  uint32_t ipis_received;
+  uint32_t spinlocks_held;        //only changed by the processor itself, see utils/spinlock.c
+} __attribute__((aligned(64)));
+
+/**
+Called while the MADT is read, for each processor that is listed as usable.
+*/
+void smp_add_processor(uint8_t apic_id);
+
+/**
+Starts up the other processors. The caller must be holding the kernel lock. `maxcpus=` on the command line limits how many
+processors are used, so `maxcpus=1` keeps everything on the BSP.
+*/
+void smp_initialise();
+
+/**
+Returns the state for the processor that calls it.
+*/
+struct CpuState *this_cpu();
+
+/**
+Returns the number of processors in the CPU table, whether or not they managed to start.
+*/
+uint8_t smp_cpu_count();
+
+/**
+Returns the given processor's state, or NULL if there is no such processor.
+*/
+struct CpuState *smp_get_cpu(uint8_t index);
+
+/**
+Sends the given IPI vector to another processor.
+*/
+void smp_send_ipi(uint8_t index, uint8_t vector);
+
+/**
+Wakes up a processor that is halted in idle_loop, if there is one, so that it can look for a process to run.
+Called when a process is put onto a run queue. Safe to call without the kernel lock.
+*/
+void smp_kick_idle_cpu();
+
+/**
+Makes every other running processor drop its cached translations for the given pages, or for everything if `page_count`
+is 0, and waits until they have done so. Does nothing if there is only one processor. Must be called with the kernel lock held.
+*/
+void smp_tlb_shootdown(const vaddr *pages, size_t page_count, uint8_t include_global);
+
+/**
+Returns the kernel stack pointer that switch_out_process should go back to on this processor.
+*/
+vaddr smp_kernel_stack();
+
+void kernel_lock();
+void kernel_unlock();
+
+/**
+Returns the number of times that this processor has taken the kernel lock, or 0 if it does not have it.
+*/
+uint32_t smp_kernel_lock_depth();
+
+/**
+Called by idle_loop on either side of halting the processor. smp_idle_enter lets go of the kernel lock, and smp_idle_exit
+takes it back.
+*/
+void smp_idle_enter();
+void smp_idle_exit();
+
+#endif
@@ -0,0 +1,83 @@
+#include <types.h>
+
+#ifndef __SYS_TLB_H
+#define __SYS_TLB_H
+
+#define TLB_BATCH_MAX   32  //beyond this many pages, reloading CR3 is cheaper than invalidating them one at a time
+
+/**
+Counters for the TLB management layer. Everything here only ever counts up.
+The assembly language context-switch code increments cr3_loads and cr3_loads_skipped directly,
+so don't re-order this struct without updating the TlbStats offsets in memlayout.asm.
+*/
+struct TlbStats {
+  uint32_t pages_invalidated;   //0x00 individual invlpg instructions issued
+  uint32_t batches_flushed;     //0x04 batches that had something in them when they were flushed
+  uint32_t full_flushes;        //0x08 CR3 reloads done to drop every non-global translation
+  uint32_t global_flushes;      //0x0C CR4.PGE toggles done to drop every translation, including global ones
+  uint32_t cr3_loads;           //0x10 paging directory switches
+  uint32_t cr3_loads_skipped;   //0x14 paging directory switches that were avoided because CR3 already had the right value
+};
+
+/**
+A set of virtual pages whose translations need to be invalidated. Changes to the page tables are queued up into one of
+these and then flushed together once the paging structures are consistent, rather than doing an invlpg for every entry
+as it is changed. If too many pages are queued then the whole TLB is flushed instead.
+Batches live on the caller's stack and are not locked; flush them before releasing the lock that covers the page tables,
+and before giving any unmapped physical pages back to the allocator.
+*/
+struct TlbBatch {
+  size_t page_count;
+  uint8_t flush_all;      //set once the batch has overflowed
+  uint8_t flush_global;   //set if anything queued might be a global mapping
+  vaddr pages[TLB_BATCH_MAX];
+};
+
+/**
+Turns on global pages (CR4.PGE) if the CPU supports them. `cpuid_edx` is the value from cpuid_edx_features().
+Once this is done, kernel-space mappings are marked with MP_GLOBAL so they survive CR3 reloads when switching between
+the kernel and apps.
+*/
+void initialise_tlb(uint32_t cpuid_edx);
+
+/**
+Returns MP_GLOBAL if global pages are enabled, or 0 if not. OR this into the flags for page table entries that are the same
+in every address space. It must not be used for directory entries, because the directory doubles as the page table for
+the flat page tables view and that is different for every address space.
+*/
+uint32_t tlb_global_flag();
+
+/**
+Invalidates the translation for a single page immediately.
+*/
+void tlb_invalidate_page(vaddr vptr);
+
+/**
+Invalidates every non-global translation, or every translation at all if `include_global` is set.
+*/
+void tlb_flush_all(uint8_t include_global);
+
+/**
+Does a shootdown that another processor asked for, see smp_tlb_shootdown. Only touches this processor's TLB.
+`page_count` of 0 means flush everything.
+*/
+void tlb_apply_shootdown(const vaddr *pages, size_t page_count, uint8_t include_global);
+
+void tlb_batch_init(struct TlbBatch *batch);
+/**
+Queues `page_count` pages starting at `vptr` for invalidation. Set `global` if any of them might have been mapped with MP_GLOBAL.
+*/
+void tlb_batch_add(struct TlbBatch *batch, vaddr vptr, size_t page_count, uint8_t global);
+/**
+Invalidates everything in the batch and empties it, so that it can be re-used.
+*/
+void tlb_batch_flush(struct TlbBatch *batch);
+
+/**
+Loads the given physical paging directory into CR3, unless it is already there.
+*/
+void tlb_switch_pd(vaddr pd_phys);
+
+void tlb_get_stats(struct TlbStats *stats);
+
+#endif
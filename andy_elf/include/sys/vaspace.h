@@ -0,0 +1,94 @@
+#include <types.h>
+
+#ifndef __SYS_VASPACE_H
+#define __SYS_VASPACE_H
+
+#define VA_SPACE_SIG        0x53504156  //"VAPS"
+#define VA_SPACE_INITIAL_RANGES 32      //free ranges that fit in the VaSpace itself, before it needs to grow
+#define VA_SPACE_SPARE_RANGES   8       //va_space_wants_room is true once there are fewer unused slots than this
+
+//the kernel hands out virtual memory from this window. Page directories below KERNEL_VA_END are copied into
+//every app's paging directory, so anything mapped here is visible (though not necessarily accessible) to apps.
+#define KERNEL_VA_START     0x00100000
+#define KERNEL_VA_END       0x40000000
+//apps get their own heap / mapping space here. Nothing in this window is shared with the kernel's page tables.
+#define APP_VA_START        0x40000000
+#define APP_VA_END          0xC0000000
+
+/**
+A run of free virtual pages. Both values are in pages, not bytes.
+*/
+struct VaRange {
+  size_t base_page;
+  size_t page_count;
+};
+
+/**
+Tracks the free parts of a virtual address space as a list of ranges sorted by address, so that finding space
+does not require probing the page tables. Adjacent free ranges are always merged.
+Allocation is next-fit from `cursor_page`, and freeing and reserving locate their neighbours by binary search.
+The array of ranges starts off inside the VaSpace and is moved to a bigger one on the heap as it fills up. That can't
+happen with the lock held, so the memory manager checks va_space_wants_room before taking it and grows the array
+first. If an operation still finds the array full it fails rather than losing track of the pages.
+None of these functions lock; the caller is expected to be holding the memory manager's lock.
+*/
+struct VaSpace {
+  uint32_t magic; //must be VA_SPACE_SIG
+  size_t start_page;
+  size_t end_page;            //first page beyond the managed window
+  size_t cursor_page;         //next-fit position; the search for free space starts from here
+  size_t free_pages;
+  size_t range_count;
+  size_t range_capacity;
+  uint8_t growing;            //set while the array is being replaced, so that allocating the new one doesn't try again
+  struct VaRange *ranges;     //initial_ranges, or a bigger array from the heap
+  struct VaRange initial_ranges[VA_SPACE_INITIAL_RANGES];
+};
+
+/**
+Initialises the given space so that the whole window from start to end (byte addresses, page-aligned) is free.
+*/
+void va_space_init(struct VaSpace *space, vaddr start, vaddr end);
+
+/**
+Gives back the heap memory used by the given space, if it has grown. The space can't be used again afterwards.
+*/
+void va_space_destroy(struct VaSpace *space);
+
+/**
+Returns 1 if the given space is running short of range slots and isn't already being grown, or 0 otherwise.
+*/
+uint8_t va_space_wants_room(struct VaSpace *space);
+
+/**
+Moves the ranges into `new_ranges`, which has room for `new_capacity` of them, and returns the heap array that was in use
+before so that the caller can free it. Returns NULL if that was the built-in array. If `new_capacity` is no bigger than
+what the space already has, then nothing changes and `new_ranges` itself is returned.
+*/
+struct VaRange *va_space_swap_ranges(struct VaSpace *space, struct VaRange *new_ranges, size_t new_capacity);
+
+/**
+Finds `page_count` continuous free pages, removes them from the free set and returns the virtual address of the first one.
+Returns 0 if there is no run of free pages long enough, or no room to record what is left.
+*/
+vaddr va_space_alloc(struct VaSpace *space, size_t page_count);
+
+/**
+Works like va_space_alloc, but the returned address is a multiple of `align_pages` pages. align_pages must be a power of two.
+*/
+vaddr va_space_alloc_aligned(struct VaSpace *space, size_t page_count, size_t align_pages);
+
+/**
+Returns the given pages to the free set. Pages outside the managed window, or that are already free, are ignored.
+Returns 1 on success, or 0 if there was no room to record them, in which case they stay allocated.
+*/
+uint8_t va_space_free(struct VaSpace *space, vaddr base, size_t page_count);
+
+/**
+Removes the given pages from the free set, if they are in it. Use this when something gets mapped to a fixed address.
+Returns 1 on success, or 0 if the free range that they are in would have to split and there is no room, in which case
+nothing changes.
+*/
+uint8_t va_space_reserve(struct VaSpace *space, vaddr base, size_t page_count);
+
+#endif
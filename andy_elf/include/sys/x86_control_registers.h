@@ -13,4 +13,17 @@
 #define CR0_NW  1<<29 //Globally enables/disable write-through caching
 #define CR0_CD  1<<30 //Globally enables/disable the memory cache
 #define CR0_PG  1<<31 //If 1, enable paging and use the § CR3 register, else disable paging. 
+
+//CR4 values
+#define CR4_VME         (1<<0)  //virtual-8086 mode extensions
+#define CR4_PVI         (1<<1)  //protected-mode virtual interrupts
+#define CR4_TSD         (1<<2)  //if set, RDTSC is only allowed in ring 0
+#define CR4_DE          (1<<3)  //debugging extensions
+#define CR4_PSE         (1<<4)  //if set, directory entries with MP_PAGESIZE map a 4Mb page
+#define CR4_PAE         (1<<5)  //physical address extension
+#define CR4_MCE         (1<<6)  //machine-check exception
+#define CR4_PGE         (1<<7)  //if set, MP_GLOBAL translations survive a CR3 reload
+#define CR4_PCE         (1<<8)  //if set, RDPMC is allowed in any ring
+#define CR4_OSFXSR      (1<<9)  //OS supports FXSAVE/FXRSTOR and SSE
+#define CR4_OSXMMEXCPT  (1<<10) //OS supports unmasked SIMD floating-point exceptions
 #endif
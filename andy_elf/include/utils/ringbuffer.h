@@ -11,7 +11,10 @@ typedef struct RingBuffer {
     size_t refcount;
 } RingBuffer;
 
-
+/**
+ * Creates the slab cache that ring buffer headers come from. Called once at boot.
+ */
+void ring_buffer_init();
 RingBuffer* ring_buffer_new(size_t len);
 void ring_buffer_unref(RingBuffer *rb);
 void ring_buffer_ref(RingBuffer *rb);
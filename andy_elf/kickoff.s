@@ -101,10 +101,24 @@ mov byte [edi+20],  0x00		;base bits 16-23. Start from 0meg.
 mov byte [edi+21],  0xF2		;access byte. Set Pr, Privl=3, S=1, Ex=0, DC=0, RW=1, Ac=0
 mov byte [edi+22], 0xCf		;limit bits 16-19 [lower], flags [higher]. Set Gr=1 [page addressing], Sz=1 [32-bit sector]
 mov byte [edi+23], 0x00		;base bits 24-31
+;entries 7-10 (segments 0x38-0x50): the same four again for SYSENTER/SYSEXIT, which insist on finding kernel CS, kernel SS,
+;user CS and user SS one after the other starting from IA32_SYSENTER_CS. See native_api/sysenter.c.
+;entry 7 (segment 0x38): SYSENTER kernel CS
+mov dword [edi+24], 0x0000FFFF	;limit bits 0-15, base bits 0-15
+mov dword [edi+28], 0x00CF9A00	;base bits 16-23, access byte 0x9A as entry 1, limit bits 16-19 and flags 0xC, base bits 24-31
+;entry 8 (segment 0x40): SYSENTER kernel SS
+mov dword [edi+32], 0x0000FFFF
+mov dword [edi+36], 0x00CF9200	;access byte 0x92 as entry 2
+;entry 9 (segment 0x48): SYSEXIT user CS
+mov dword [edi+40], 0x0000FFFF
+mov dword [edi+44], 0x00CFFA00	;access byte 0xFA as entry 5
+;entry 10 (segment 0x50): SYSEXIT user SS
+mov dword [edi+48], 0x0000FFFF
+mov dword [edi+52], 0x00CFF200	;access byte 0xF2 as entry 6
 
 ;OK, that's set up, now tell the processor
 mov edi, FullGDTPtr
-mov word [edi], 0x38				;length in bytes
+mov word [edi], 0x57				;limit, i.e. length in bytes - 1
 mov dword [edi+2], FullGDT	;memory location
 lgdt [edi]
 
@@ -292,12 +306,32 @@ call volmgr_init
 add esp, 4
 
 .post_mbt:
+;object caches that come from the slab allocator, needs the kernel heap
+extern ring_buffer_init
+call ring_buffer_init
+extern elf_loader_init
+call elf_loader_init
+
 extern setup_pic
 call setup_pic
 
 extern initialise_scheduler
 call initialise_scheduler
 
+;processes' FPU registers are switched lazily, see scheduler/fpu.h
+extern initialise_fpu
+call initialise_fpu
+
+;work out the scheduler's tick rate and start the one-shot timer on IRQ0
+extern pit_initialise
+call pit_initialise
+extern initialise_timers
+call initialise_timers
+
+;from here on the kernel is only let go of by exit_to_process and the idle loop, see sys/smp.h
+extern kernel_lock
+call kernel_lock
+
 ;need to reprogram the PIC before enabling interrupts or a double-fault happens
 ;specifically, the timer needs somewhere to go
 sti
@@ -306,6 +340,18 @@ sti
 extern cmos_init_rtc_interrupt
 call cmos_init_rtc_interrupt
 
+;calibrates the TSC against the RTC, so that needs to be running first
+extern initialise_clocksource
+call initialise_clocksource
+
+;needs the clocksource, and must be there before the first process is
+extern initialise_time_page
+call initialise_time_page
+
+;writes out the kernel statistics every so often, if statslog= is on the command line
+extern initialise_stats_log
+call initialise_stats_log
+
 extern ps2_initialise
 call ps2_initialise
 
@@ -315,6 +361,13 @@ call initialise_ata_driver
 extern init_native_api
 call init_native_api
 
+extern init_sysenter
+call init_sysenter
+
+;start up the other processors, if there are any in the MADT. Needs the timer running.
+extern smp_initialise
+call smp_initialise
+
 extern defer_launch_shell
 call defer_launch_shell
 
@@ -326,13 +379,20 @@ call defer_launch_shell
 
 extern scheduler_tick
 extern enter_next_process
+extern refill_zeroed_page_pool
+extern smp_idle_enter
+extern smp_idle_exit
 
-idle_loop:
+idle_loop:	;every processor ends up here, holding the kernel lock
 
 call scheduler_tick	;check if we have any work to do
 call enter_next_process	;check if there is another process we need to go to
+call refill_zeroed_page_pool	;nothing else to do, so top up the pool of zeroed pages
+call smp_idle_enter	;let go of the kernel lock while we wait
 sti
-hlt									;pause processor until an interrupt comes along. We will be regularly woken by the timer interrupt.
+hlt									;pause processor until an interrupt comes along. The BSP is regularly woken by the timer interrupt, the others by IPIs.
+cli
+call smp_idle_exit	;and take the kernel lock back again
 jmp idle_loop
 
 global __stack_chk_fail_local
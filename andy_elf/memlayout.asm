@@ -8,6 +8,10 @@
 %define FullGDTPtr   0xe00
 %define FullTSS      0x1e40
 
+%define APTrampolinePage 0x60000	;application processors start up here, see smp/lowlevel.asm. Bottom page of the kernel stack area.
+
+%define AppVaStart   0x40000000	;lowest address that belongs to a user process, APP_VA_START in sys/vaspace.h
+
 %define TSS_Selector 0x20	;TSS starts at offset 0 in this selector
 %define CursorRowPtr 0xd08	;where we store screen cursor row in kernel data segment
 %define CursorColPtr 0xd09	;where we store cursor col in kernel data segment
@@ -18,6 +22,10 @@
 %define CurrentProcessRegisterScratch     0x1A000 ;temporary storage location for process's register state when context-switching
 %define CurrentProcessRegisterScratchSize 0x90    ;this region follows the format of SavedRegisterStates32 in process.h
 
+;offsets of the counters in struct TlbStats (sys/tlb.h) that the assembly language paging directory switches update directly
+%define TlbStatsCr3Loads        0x10
+%define TlbStatsCr3LoadsSkipped 0x14
+
 ;real-mode segment pointers for place to store bios ram information
 %define TemporaryMemInfoBufferSeg 0x250
 %define TemporaryMemInfoBufferOffset 0x0
@@ -9,6 +9,10 @@ global memcmp
 global mb       ;memory barrier
 global get_current_paging_directory
 global switch_paging_directory_if_required
+extern tlb_counters     ;defined in mmgr/tlb.c. struct TlbStats, we update the CR3 counters, see memlayout.asm
+
+%include "memlayout.asm"
+
 ;this module contains basic memset, memcpy implementations.
 
 mb:
@@ -209,11 +213,13 @@ switch_paging_directory_if_required:
   push ebx
   mov ebx, dword [ebp+8]
   mov cr3, ebx
+  inc dword [tlb_counters + TlbStatsCr3Loads]
   pop ebx
   pop ebp
   ret                       ;eax (return value) is still the old cr3 value
 
   _pg_switch_not_reqd:
+  inc dword [tlb_counters + TlbStatsCr3LoadsSkipped]
   xor eax,eax               ;return zero
   pop ebp
   ret
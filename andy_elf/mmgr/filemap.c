@@ -0,0 +1,245 @@
+#include <types.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <errors.h>
+#include <memops.h>
+#include <spinlock.h>
+#include <sys/ioports.h>
+#include <sys/mmgr.h>
+#include <sys/pagefault.h>
+#include <sys/filemap.h>
+#include <fs/fat_fileops.h>
+#include <scheduler/runqueue.h>
+#include "process.h"
+
+vaddr _mmgr_get_pd();
+
+/*
+The mapping lists belong to their process. They are only changed from its own native API calls, its faults and its cleanup,
+which can't overlap. The read completions can run on any processor at any time though, so everything that a FileMappingRead
+shares between the two (m->pending while a read is in flight, `done` and `orphaned`) is only touched with readlock held.
+*/
+static spinlock_t readlock = 0;
+
+struct FileMapping *file_mapping_new(VFatOpenFile *fp, size_t file_offset, size_t data_offset, size_t data_length, uint32_t page_flags)
+{
+  struct FileMapping *m = (struct FileMapping *)malloc(sizeof(struct FileMapping));
+  if(!m) return NULL;
+  memset(m, 0, sizeof(struct FileMapping));
+  m->magic = FILE_MAPPING_SIG;
+  m->fp = fp;
+  m->file_offset = file_offset;
+  m->data_offset = data_offset;
+  m->data_length = data_length;
+  m->page_flags = page_flags;
+  return m;
+}
+
+vaddr file_mapping_attach(struct ProcessTableEntry *process, uint32_t *mapped_pagedirs, struct FileMapping *m, vaddr base, size_t page_count)
+{
+  void *ptr = vm_map_demand_zero_pages(mapped_pagedirs, (void *)base, page_count, m->page_flags | MPC_FILEBACKED);
+  if(!ptr) return 0;
+
+  m->base = (vaddr)ptr;
+  m->page_count = page_count;
+  m->next = process->file_mappings;
+  process->file_mappings = m;
+  #ifdef MMGR_VERBOSE
+  kprintf("DEBUG file_mapping_attach process %d has 0x%x bytes of file at 0x%x, 0x%x pages\r\n", process->pid, m->data_length, m->base, m->page_count);
+  #endif
+  return m->base;
+}
+
+void file_mapping_free(struct FileMapping *m)
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&readlock);
+  struct FileMappingRead *r = m->pending;
+  uint8_t in_flight = r && !r->done;
+  if(in_flight) {
+    r->orphaned = 1;
+    r->fp = m->fp;
+  }
+  release_spinlock(&readlock);
+  irq_restore(flags);
+
+  if(!in_flight) {
+    if(r) {
+      free(r->buffer);
+      free(r);
+    }
+    vfat_close(m->fp);
+  }
+  m->magic = 0;
+  free(m);
+}
+
+uint8_t file_mapping_remove(struct ProcessTableEntry *process, vaddr base)
+{
+  struct FileMapping *prev = NULL;
+  struct FileMapping *m = process->file_mappings;
+  while(m && m->base!=base) {
+    prev = m;
+    m = m->next;
+  }
+  if(!m) return 1;
+
+  if(prev) {
+    prev->next = m->next;
+  } else {
+    process->file_mappings = m->next;
+  }
+  //this gives back any pages that were read in, and clears the not-present entries for the ones that weren't
+  vm_deallocate_physical_pages((uint32_t *)process->root_paging_directory_phys, (void *)m->base, m->page_count);
+  file_mapping_free(m);
+  return 0;
+}
+
+void file_mapping_release_all(struct ProcessTableEntry *process)
+{
+  struct FileMapping *m = process->file_mappings;
+  while(m) {
+    struct FileMapping *next = m->next;
+    file_mapping_free(m);
+    m = next;
+  }
+  process->file_mappings = NULL;
+}
+
+static struct FileMapping *_find_mapping(struct ProcessTableEntry *process, vaddr page)
+{
+  for(struct FileMapping *m=process->file_mappings; m!=NULL; m=m->next) {
+    if(m->magic!=FILE_MAPPING_SIG) {
+      kprintf("ERROR file mapping list for process %d is corrupted\r\n", process->pid);
+      return NULL;
+    }
+    if(page >= m->base && page < m->base + m->page_count*PAGE_SIZE) return m;
+  }
+  return NULL;
+}
+
+static void _file_mapping_read_completed(VFatOpenFile *fp, uint8_t status, size_t bytes_read, void *buf, void *extradata)
+{
+  struct FileMappingRead *r = (struct FileMappingRead *)extradata;
+
+  uint32_t flags = irq_save();
+  acquire_spinlock(&readlock);
+  uint8_t orphaned = r->orphaned;
+  if(!orphaned) {
+    r->status = status;
+    r->bytes_read = bytes_read > r->length ? r->length : bytes_read;
+    r->done = 1;
+  }
+  release_spinlock(&readlock);
+  irq_restore(flags);
+
+  if(orphaned) {
+    //nothing else can see it now
+    vfat_close(r->fp);
+    free(r->buffer);
+    free(r);
+    return;
+  }
+
+  //the process retries the access when it next runs, and that fault maps the data in
+  struct ProcessTableEntry *process = get_process(r->pid);
+  if(process && process->status==PROCESS_IOWAIT) process_set_status(process, PROCESS_READY);
+}
+
+uint8_t file_mapping_fault(vaddr pf_load_addr, uint32_t error_code)
+{
+  vaddr page = pf_load_addr & MP_ADDRESS_MASK;
+
+  struct ProcessTableEntry *process = get_current_process();
+  if(!process || process->pid==0 || (vaddr)process->root_paging_directory_phys != _mmgr_get_pd()) {
+    kprintf("ERROR File-backed page 0x%x touched outside of its process\r\n", pf_load_addr);
+    return 1;
+  }
+
+  struct FileMapping *m = _find_mapping(process, page);
+  if(!m) {
+    kprintf("ERROR Process %d has no file mapping for 0x%x\r\n", process->pid, pf_load_addr);
+    return 1;
+  }
+
+  //take a finished read off the mapping; one that is still in flight stays where the completion can find it
+  acquire_spinlock(&readlock);
+  struct FileMappingRead *r = m->pending;
+  uint8_t in_flight = r && !r->done;
+  if(in_flight && r->page==page) process_set_status(process, PROCESS_IOWAIT);  //woken up early, keep waiting
+  if(r && !in_flight) m->pending = NULL;
+  release_spinlock(&readlock);
+
+  if(in_flight) {
+    if(r->page==page) return PAGEFAULT_BLOCKED;
+    kprintf("ERROR Process %d faulted on 0x%x while still waiting for 0x%x\r\n", process->pid, page, r->page);
+    return 1;
+  }
+
+  if(r && r->page==page) {
+    uint8_t rc;
+    if(r->status!=E_OK) {
+      kprintf("ERROR Could not read page 0x%x of process %d from its file, code %d. Terminating the process.\r\n", page, process->pid, (uint32_t)r->status);
+      process_set_status(process, PROCESS_TERMINATING);
+      schedule_cleanup_task(process->pid);
+      rc = PAGEFAULT_BLOCKED; //never to be woken
+    } else {
+      rc = vm_fill_faulted_page(page, r->buffer, r->page_offset, r->bytes_read, m->page_flags);
+    }
+    free(r->buffer);
+    free(r);
+    return rc;
+  } else if(r) {
+    //a finished read for some other page, that was never collected
+    free(r->buffer);
+    free(r);
+  }
+
+  //work out which part of the page has file data in it
+  size_t page_start = page - m->base;
+  size_t start = page_start > m->data_offset ? page_start : m->data_offset;
+  size_t end = page_start + PAGE_SIZE;
+  if(end > m->data_offset + m->data_length) end = m->data_offset + m->data_length;
+  if(start >= end) return vm_fill_faulted_page(page, NULL, 0, 0, m->page_flags);  //nothing from the file in this one
+
+  if(!(error_code & PAGEFAULT_ERR_USER)) {
+    //the kernel can't go to sleep part-way through, e.g. a native API call that was given a buffer in a mapped file
+    kprintf("ERROR Kernel touched file-backed page 0x%x of process %d before it was loaded\r\n", page, process->pid);
+    return 1;
+  }
+
+  r = (struct FileMappingRead *)malloc(sizeof(struct FileMappingRead));
+  if(!r) {
+    kputs("ERROR Out of memory reading file-backed page\r\n");
+    return 1;
+  }
+  memset(r, 0, sizeof(struct FileMappingRead));
+  r->page = page;
+  r->pid = process->pid;
+  r->page_offset = start - page_start;
+  r->length = end - start;
+  r->buffer = malloc(r->length);
+  if(!r->buffer) {
+    kputs("ERROR Out of memory reading file-backed page\r\n");
+    free(r);
+    return 1;
+  }
+
+  if(vfat_seek(m->fp, m->file_offset + (start - m->data_offset), SEEK_SET)!=0) {
+    kprintf("ERROR Page 0x%x of process %d is beyond the end of its file\r\n", page, process->pid);
+    free(r->buffer);
+    free(r);
+    return 1;
+  }
+
+  #ifdef MMGR_VERBOSE
+  kprintf("DEBUG file_mapping_fault process %d reading 0x%x bytes for page 0x%x\r\n", process->pid, r->length, page);
+  #endif
+  //status has to be set first, because if the read fails straight away then the completion runs before vfat_read_async returns
+  acquire_spinlock(&readlock);
+  m->pending = r;
+  process_set_status(process, PROCESS_IOWAIT);
+  release_spinlock(&readlock);
+  vfat_read_async(m->fp, r->buffer, r->length, (void *)r, &_file_mapping_read_completed);
+  return PAGEFAULT_BLOCKED;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <sys/mmgr.h>
 #include <panic.h>
+#include <memops.h>
 #include "process.h"
 
 /**
@@ -17,6 +18,228 @@ MMGR_PARANOID - combines MMGR_VALIDATE_PRE and MMGR_VALIDATE_POST to validate be
 #define MMGR_VERBOSE
 #endif
 
+#define HEAP_ZONE_HEADER_SIZE ((sizeof(struct HeapZoneStart) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
+
+static inline struct PointerHeader *_next_block(struct PointerHeader *p)
+{
+  return (struct PointerHeader *)((char *)p + sizeof(struct PointerHeader) + p->block_length);
+}
+
+static inline size_t _round_block_length(size_t bytes)
+{
+  size_t len = (bytes + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+  return len < HEAP_MIN_BLOCK ? HEAP_MIN_BLOCK : len;
+}
+
+/**
+Returns the free list index for a block of the given length
+*/
+static inline size_t _size_class(size_t block_length)
+{
+  size_t c = (31 - __builtin_clz(block_length)) - 4;
+  return c >= HEAP_SIZE_CLASSES ? HEAP_SIZE_CLASSES - 1 : c;
+}
+
+static void _write_footer(struct PointerHeader *p)
+{
+  struct PointerFooter *f = (struct PointerFooter *)((char *)_next_block(p) - sizeof(struct PointerFooter));
+  f->magic = HEAP_PTR_SIG;
+  f->block_length = p->block_length;
+}
+
+static void _free_list_insert(struct HeapZoneStart *heap, struct PointerHeader *p)
+{
+  size_t c = _size_class(p->block_length);
+  struct FreeBlockLinks *links = (struct FreeBlockLinks *)((char *)p + sizeof(struct PointerHeader));
+  links->prev_free = NULL;
+  links->next_free = heap->free_lists[c];
+  if(heap->free_lists[c]) {
+    ((struct FreeBlockLinks *)((char *)heap->free_lists[c] + sizeof(struct PointerHeader)))->prev_free = p;
+  }
+  heap->free_lists[c] = p;
+  heap->free_list_bitmap |= (1 << c);
+}
+
+static void _free_list_remove(struct HeapZoneStart *heap, struct PointerHeader *p)
+{
+  size_t c = _size_class(p->block_length);
+  struct FreeBlockLinks *links = (struct FreeBlockLinks *)((char *)p + sizeof(struct PointerHeader));
+  if(links->prev_free) {
+    ((struct FreeBlockLinks *)((char *)links->prev_free + sizeof(struct PointerHeader)))->next_free = links->next_free;
+  } else {
+    heap->free_lists[c] = links->next_free;
+    if(heap->free_lists[c]==NULL) heap->free_list_bitmap &= ~(1 << c);
+  }
+  if(links->next_free) {
+    ((struct FreeBlockLinks *)((char *)links->next_free + sizeof(struct PointerHeader)))->prev_free = links->prev_free;
+  }
+}
+
+/**
+Returns the header of the free block immediately in front of p, or NULL if that block is in use.
+*/
+static struct PointerHeader *_prev_free_block(struct PointerHeader *p)
+{
+  if(p->prev_in_use) return NULL;
+  struct PointerFooter *f = (struct PointerFooter *)((char *)p - sizeof(struct PointerFooter));
+  if(f->magic != HEAP_PTR_SIG) {
+    kprintf("ERROR Footer in front of block 0x%x is corrupted\r\n", p);
+    k_panic("Heap corruption detected\r\n");
+  }
+  struct PointerHeader *prev = (struct PointerHeader *)((char *)p - f->block_length - sizeof(struct PointerHeader));
+  if(prev->magic != HEAP_PTR_SIG || prev->in_use || prev->zone != p->zone) {
+    kprintf("ERROR Block 0x%x in front of 0x%x is corrupted\r\n", prev, p);
+    k_panic("Heap corruption detected\r\n");
+  }
+  return prev;
+}
+
+/**
+Marks the given block as free and merges it with the free blocks on either side of it, if there are any.
+The block must be in use when this is called. Returns the (possibly merged) free block.
+*/
+static struct PointerHeader *_block_free(struct HeapZoneStart *heap, struct PointerHeader *p)
+{
+  struct HeapZoneStart *zone = p->zone;
+  p->in_use = 0;
+  zone->allocated -= p->block_length;
+
+  struct PointerHeader *next = _next_block(p);
+  if(next->magic != HEAP_PTR_SIG) {
+    kprintf("ERROR Pointer at 0x%x following 0x%x appears corrupted\r\n", next, p);
+    k_panic("Heap corruption detected\r\n");
+  }
+  if(!next->in_use) {
+    #ifdef MMGR_VERBOSE
+    kprintf("DEBUG Pointer 0x%x following 0x%x is free too, coalescing\r\n", next, p);
+    #endif
+    _free_list_remove(heap, next);
+    p->block_length += sizeof(struct PointerHeader) + next->block_length;
+    next->magic = 0;
+  }
+
+  struct PointerHeader *prev = _prev_free_block(p);
+  if(prev) {
+    #ifdef MMGR_VERBOSE
+    kprintf("DEBUG Pointer 0x%x preceding 0x%x is free too, coalescing\r\n", prev, p);
+    #endif
+    _free_list_remove(heap, prev);
+    prev->block_length += sizeof(struct PointerHeader) + p->block_length;
+    p->magic = 0;
+    p = prev;
+  }
+
+  _write_footer(p);
+  _free_list_insert(heap, p);
+  _next_block(p)->prev_in_use = 0;
+  return p;
+}
+
+/**
+Shrinks the given in-use block to block_length bytes, returning the remainder to the free lists if it is
+big enough to be a block in its own right.
+*/
+static void _split_block(struct HeapZoneStart *heap, struct PointerHeader *p, size_t block_length)
+{
+  if(p->block_length < block_length + sizeof(struct PointerHeader) + HEAP_MIN_BLOCK) return;
+
+  struct PointerHeader *tail = (struct PointerHeader *)((char *)p + sizeof(struct PointerHeader) + block_length);
+  tail->magic = HEAP_PTR_SIG;
+  tail->block_length = p->block_length - block_length - sizeof(struct PointerHeader);
+  tail->in_use = 1;
+  tail->prev_in_use = 1;
+  tail->zone = p->zone;
+  p->block_length = block_length;
+  p->zone->allocated -= sizeof(struct PointerHeader); //the tail's length is still counted until _block_free removes it
+  _block_free(heap, tail);
+}
+
+/**
+Takes the given free block off the free lists and marks it as in use, splitting off whatever is not needed.
+*/
+static void *_block_alloc(struct HeapZoneStart *heap, struct PointerHeader *p, size_t block_length)
+{
+  _free_list_remove(heap, p);
+  p->in_use = 1;
+  p->zone->allocated += p->block_length;
+  p->zone->dirty = 1;
+  _next_block(p)->prev_in_use = 1;
+  _split_block(heap, p, block_length);
+  return (void *)((char *)p + sizeof(struct PointerHeader));
+}
+
+/**
+Finds a free block of at least block_length bytes. The free list for the block's own size class is searched
+first-fit; failing that, the head of any larger class is guaranteed to be big enough.
+Returns NULL if there is nothing suitable in the heap.
+*/
+static struct PointerHeader *_find_free_block(struct HeapZoneStart *heap, size_t block_length)
+{
+  size_t c = _size_class(block_length);
+
+  for(struct PointerHeader *p = heap->free_lists[c]; p!=NULL; p=((struct FreeBlockLinks *)((char *)p + sizeof(struct PointerHeader)))->next_free) {
+    if(p->magic!=HEAP_PTR_SIG) k_panic("Kernel heap corrupted\r\n");
+    if(p->block_length >= block_length) return p;
+  }
+
+  if(c+1 >= HEAP_SIZE_CLASSES) return NULL;
+  uint32_t larger = heap->free_list_bitmap & ~((2 << c) - 1);
+  if(larger==0) return NULL;
+  c = __builtin_ctz(larger);
+  if(c < HEAP_SIZE_CLASSES - 1) return heap->free_lists[c];
+
+  //the last class is unbounded, so we do still need to check
+  for(struct PointerHeader *p = heap->free_lists[c]; p!=NULL; p=((struct FreeBlockLinks *)((char *)p + sizeof(struct PointerHeader)))->next_free) {
+    if(p->block_length >= block_length) return p;
+  }
+  return NULL;
+}
+
+/**
+Sets up a fresh zone of zone_length bytes at the given location, containing a single free block and the
+end sentinel, and puts the free block onto the heap's free lists.
+*/
+static struct HeapZoneStart *_init_zone(struct HeapZoneStart *heap, void *slab, size_t zone_length)
+{
+  struct HeapZoneStart* zone = (struct HeapZoneStart *)slab;
+  zone->magic = HEAP_ZONE_SIG;
+  zone->zone_length = zone_length;
+  zone->allocated = 0;
+  zone->dirty = 0;
+  zone->next_zone = NULL;
+  zone->prev_zone = NULL;
+
+  struct PointerHeader* sentinel = (struct PointerHeader *)((char *)slab + zone_length - sizeof(struct PointerHeader));
+  sentinel->magic = HEAP_PTR_SIG;
+  sentinel->block_length = 0;
+  sentinel->in_use = 1;
+  sentinel->prev_in_use = 1;
+  sentinel->zone = zone;
+
+  struct PointerHeader* ptr = (struct PointerHeader *)((char *)slab + HEAP_ZONE_HEADER_SIZE);
+  ptr->magic = HEAP_PTR_SIG;
+  ptr->block_length = (size_t)sentinel - (size_t)ptr - sizeof(struct PointerHeader);
+  ptr->in_use = 1;
+  ptr->prev_in_use = 1;
+  ptr->zone = zone;
+  zone->first_ptr = ptr;
+  zone->allocated = ptr->block_length;
+
+  if(heap==NULL) {
+    //this is the first zone of a new heap, so it gets the free lists
+    heap = zone;
+    heap->free_list_bitmap = 0;
+    for(register size_t i=0;i<HEAP_SIZE_CLASSES;i++) heap->free_lists[i] = NULL;
+    heap->heap_length = zone_length;
+    heap->in_use = 0;
+    heap->high_water = 0;
+  } else {
+    heap->heap_length += zone_length;
+  }
+  _block_free(heap, ptr);
+  return zone;
+}
+
 struct HeapZoneStart * initialise_heap(struct ProcessTableEntry *process, size_t initial_pages)
 {
   kprintf("Initialising heap at %l pages....\r\n", initial_pages);
@@ -40,7 +263,7 @@ struct HeapZoneStart * initialise_heap(struct ProcessTableEntry *process, size_t
   }
   
   // Ensure we have enough space for headers
-  if(zone_size < sizeof(struct HeapZoneStart) + sizeof(struct PointerHeader)) {
+  if(zone_size < HEAP_ZONE_HEADER_SIZE + 2*sizeof(struct PointerHeader) + HEAP_MIN_BLOCK) {
     kprintf("ERROR Zone too small for required headers\r\n");
     return NULL;
   }
@@ -53,20 +276,7 @@ struct HeapZoneStart * initialise_heap(struct ProcessTableEntry *process, size_t
 
   kprintf("INFO Heap start at 0x%x\r\n", slab);
 
-  struct HeapZoneStart* zone = (struct HeapZoneStart *)slab;
-  zone->magic = HEAP_ZONE_SIG;
-  zone->zone_length = zone_size;
-  zone->allocated = 0;
-  zone->dirty = 0;
-  zone->next_zone=NULL;
-
-  struct PointerHeader* ptr = (struct PointerHeader *)((char *)slab + sizeof(struct HeapZoneStart));
-  ptr->magic = HEAP_PTR_SIG;
-  ptr->block_length = zone->zone_length - sizeof(struct HeapZoneStart) - sizeof(struct PointerHeader);
-  ptr->in_use=0;
-  ptr->next_ptr = NULL;
-
-  zone->first_ptr = ptr;
+  struct HeapZoneStart* zone = _init_zone(NULL, slab, zone_size);
 
   process->heap_start = zone;
   process->heap_allocated = zone->zone_length;
@@ -74,18 +284,6 @@ struct HeapZoneStart * initialise_heap(struct ProcessTableEntry *process, size_t
   return zone;
 }
 
-struct PointerHeader* _last_pointer_of_zone(struct HeapZoneStart* zone)
-{
-  if(zone->magic != HEAP_ZONE_SIG) k_panic("Kernel heap is corrupted\r\n");
-
-  struct PointerHeader *ptr = zone->first_ptr;
-  while(ptr->next_ptr!=NULL) {
-    if(ptr->magic != HEAP_PTR_SIG) k_panic("Kernel heap is corrupted\r\n");
-    ptr=ptr->next_ptr;
-  }
-  return ptr;
-}
-
 uint8_t validate_pointer(void *ptr, uint8_t panic)
 {
   #ifdef MMGR_VERBOSE
@@ -131,7 +329,8 @@ void validate_zone(struct HeapZoneStart* zone)
   }
   
   struct PointerHeader *ptr = zone->first_ptr;
-  struct PointerHeader *prev_ptr = NULL;
+  struct PointerHeader *sentinel = (struct PointerHeader *)((char *)zone + zone->zone_length - sizeof(struct PointerHeader));
+  uint8_t prev_in_use = 1;
   
   // Validate that first_ptr is within zone bounds
   if((void*)ptr < (void*)zone || (void*)ptr >= (void*)((char*)zone + zone->zone_length)) {
@@ -140,11 +339,12 @@ void validate_zone(struct HeapZoneStart* zone)
   }
 
   size_t i=0;
-  size_t total_accounted = sizeof(struct HeapZoneStart);
+  size_t total_accounted = HEAP_ZONE_HEADER_SIZE + sizeof(struct PointerHeader);
+  size_t total_allocated = 0;
   #ifdef MMGR_VERBOSE
   kprintf("> START OF ZONE 0x%x length 0x%x\r\n", zone, zone->zone_length);
   #endif
-  while(ptr!=NULL) {
+  while(ptr!=sentinel) {
     // Validate pointer magic number
     if(ptr->magic != HEAP_PTR_SIG) {
       kprintf("!!!!! POINTER MAGIC NUMBER INVALID at 0x%x: expected 0x%x, got 0x%x\r\n", ptr, HEAP_PTR_SIG, ptr->magic);
@@ -152,79 +352,89 @@ void validate_zone(struct HeapZoneStart* zone)
     }
     
     // Validate pointer is within zone bounds
-    if((void*)ptr < (void*)zone || (void*)ptr >= (void*)((char*)zone + zone->zone_length)) {
+    if((void*)ptr < (void*)zone || (void*)ptr >= (void*)sentinel) {
       kprintf("!!!!! POINTER 0x%x OUT OF ZONE BOUNDS\r\n", ptr);
       k_panic("Heap corruption detected.\r\n");
     }
+
+    if(ptr->zone != zone) {
+      kprintf("!!!!! POINTER 0x%x BELONGS TO ZONE 0x%x NOT 0x%x\r\n", ptr, ptr->zone, zone);
+      k_panic("Heap corruption detected.\r\n");
+    }
     
     #ifdef MMGR_VERBOSE
     kprintf(">    Zone 0x%x block index %l at 0x%x block length is 0x%x in_use %d\r\n", zone, i, ptr, ptr->block_length, (uint16_t)ptr->in_use);
     #endif
     
-    if(prev_ptr!=NULL) {
-      // Calculate end of previous block including its header and data
-      size_t prev_block_end = (size_t)prev_ptr + sizeof(struct PointerHeader) + prev_ptr->block_length;
-      // Check for integer overflow
-      if(prev_block_end < (size_t)prev_ptr || prev_block_end < prev_ptr->block_length) {
-        kprintf("!!!!! INTEGER OVERFLOW in previous block end calculation\r\n");
-        k_panic("Heap corruption detected.\r\n");
-      }
-      // Check that blocks don't overlap and are properly aligned
-      if(prev_block_end > (size_t)ptr) {
-        kprintf("!!!!! OVERLAPPING BLOCK DETECTED: prev ends at 0x%x, current starts at 0x%x\r\n", prev_block_end, ptr);
-        k_panic("Heap corruption detected.\r\n");
-      }
+    if(ptr->prev_in_use != prev_in_use) {
+      kprintf("!!!!! BLOCK 0x%x HAS STALE PREV_IN_USE FLAG\r\n", ptr);
+      k_panic("Heap corruption detected.\r\n");
     }
-    
-    // Validate block length is reasonable
-    if(ptr->block_length == 0) {
-      kprintf("!!!!! ZERO-SIZED BLOCK DETECTED at 0x%x\r\n", ptr);
+    if(!ptr->in_use && !prev_in_use) {
+      kprintf("!!!!! ADJACENT FREE BLOCKS NOT COALESCED at 0x%x\r\n", ptr);
       k_panic("Heap corruption detected.\r\n");
     }
     
-    if(ptr->block_length > zone->zone_length) {
-      kprintf("!!!   OVERLARGE BLOCK DETECTED, block 0x%x zone length 0x%x\r\n", ptr->block_length, zone->zone_length);
+    // Validate block length is reasonable
+    if(ptr->block_length < HEAP_MIN_BLOCK) {
+      kprintf("!!!!! UNDERSIZED BLOCK DETECTED at 0x%x\r\n", ptr);
       k_panic("Heap corruption detected.\r\n");
     }
     
     // Validate that block + header doesn't extend beyond zone
     size_t block_end = (size_t)ptr + sizeof(struct PointerHeader) + ptr->block_length;
-    if(block_end < (size_t)ptr || block_end < ptr->block_length) {
-      kprintf("!!!!! INTEGER OVERFLOW in block end calculation\r\n");
-      k_panic("Heap corruption detected.\r\n");
-    }
-    if(block_end > (size_t)zone + zone->zone_length) {
+    if(block_end < (size_t)ptr || block_end > (size_t)sentinel) {
       kprintf("!!!!! BLOCK EXTENDS BEYOND ZONE: block ends at 0x%x, zone ends at 0x%x\r\n", 
               block_end, (size_t)zone + zone->zone_length);
       k_panic("Heap corruption detected.\r\n");
     }
+
+    if(!ptr->in_use) {
+      struct PointerFooter *f = (struct PointerFooter *)(block_end - sizeof(struct PointerFooter));
+      if(f->magic != HEAP_PTR_SIG || f->block_length != ptr->block_length) {
+        kprintf("!!!!! FOOTER OF FREE BLOCK 0x%x IS INVALID\r\n", ptr);
+        k_panic("Heap corruption detected.\r\n");
+      }
+    } else {
+      total_allocated += ptr->block_length;
+    }
     
     // Keep track of total accounted space
     total_accounted += sizeof(struct PointerHeader) + ptr->block_length;
     
     i++;
-    prev_ptr = ptr;
-    ptr=ptr->next_ptr;
+    prev_in_use = ptr->in_use;
+    ptr=_next_block(ptr);
+  }
+
+  if(sentinel->magic != HEAP_PTR_SIG || !sentinel->in_use || sentinel->block_length!=0 || sentinel->prev_in_use != prev_in_use) {
+    kprintf("!!!!! ZONE SENTINEL AT 0x%x IS INVALID\r\n", sentinel);
+    k_panic("Heap corruption detected.\r\n");
   }
   
   // Validate that we've accounted for all space in the zone
-  if(total_accounted > zone->zone_length) {
-    kprintf("!!!!! ACCOUNTING ERROR: total accounted 0x%x > zone length 0x%x\r\n", 
+  if(total_accounted != zone->zone_length) {
+    kprintf("!!!!! ACCOUNTING ERROR: total accounted 0x%x != zone length 0x%x\r\n", 
             total_accounted, zone->zone_length);
     k_panic("Heap corruption detected.\r\n");
   }
+  if(total_allocated != zone->allocated) {
+    kprintf("!!!!! ACCOUNTING ERROR: blocks in use 0x%x != zone allocated 0x%x\r\n", total_allocated, zone->allocated);
+    k_panic("Heap corruption detected.\r\n");
+  }
   
   #ifdef MMGR_VERBOSE
   kprintf("> END OF ZONE, validated %l blocks, accounted 0x%x / 0x%x bytes\r\n", i, total_accounted, zone->zone_length);
   #endif
 }
+
 /**
 Allocates page_count more RAM pages. If they are continuous with the given heap zone,
 then they are added onto it.  Otherwise, a new heap zone is created.
 Whichever zone the new memory is in is then returned.
 Can return NULL if allocation fails.
 */
-struct HeapZoneStart* _expand_zone(struct HeapZoneStart* zone, size_t page_count)
+struct HeapZoneStart* _expand_zone(struct HeapZoneStart* heap, struct HeapZoneStart* zone, size_t page_count)
 {
   if(zone->magic!=HEAP_ZONE_SIG) k_panic("Kernel memory heap is corrupted\r\n");
 
@@ -250,234 +460,119 @@ struct HeapZoneStart* _expand_zone(struct HeapZoneStart* zone, size_t page_count
       kprintf("ERROR Zone length expansion would overflow\r\n");
       return NULL;
     }
+    #ifdef MMGR_VERBOSE
+    kprintf("DEBUG _expand_zone new pages are continuous with zone 0x%x, extending it\r\n", zone);
+    #endif
+    //the old sentinel becomes the header for the new space, and a new sentinel goes at the new end of the zone
+    struct PointerHeader* ptr = (struct PointerHeader *)((char*)zone + zone->zone_length - sizeof(struct PointerHeader));
     zone->zone_length += expansion_size;
     zone->dirty=1;
-    struct PointerHeader* ptr = _last_pointer_of_zone(zone);
-    if(ptr->in_use) { 
-      // End of the zone is in use, we should add another PointerHeader after it.
-      // Calculate where the new header would go
-      struct PointerHeader* new_ptr = (struct PointerHeader *)((char*)ptr + sizeof(struct PointerHeader) + ptr->block_length);
-      
-      // Validate the new header location
-      if((char*)new_ptr + sizeof(struct PointerHeader) > (char*)zone + zone->zone_length) {
-        kprintf("ERROR New header would extend beyond zone boundary\r\n");
-        return NULL;
-      }
-      
-      new_ptr->magic = HEAP_PTR_SIG;
-      new_ptr->block_length = expansion_size - sizeof(struct PointerHeader);
-      new_ptr->in_use = 0;
-      new_ptr->next_ptr = NULL;
-      ptr->next_ptr = new_ptr;
-      return zone;
-    } else { //end of the zone is not in use, we should expand the free pointer region
-      #ifdef MMGR_VERBOSE
-      kprintf("DEBUG _expand_zone last block not in use, expanding");
-      #endif
-      // Check for overflow when expanding block length
-      if(ptr->block_length > (size_t)-1 - expansion_size) {
-        kprintf("ERROR Block length expansion would overflow\r\n");
-        return NULL;
-      }
-      ptr->block_length += expansion_size;
-      return zone;
-    }
+
+    struct PointerHeader* sentinel = (struct PointerHeader *)((char*)zone + zone->zone_length - sizeof(struct PointerHeader));
+    sentinel->magic = HEAP_PTR_SIG;
+    sentinel->block_length = 0;
+    sentinel->in_use = 1;
+    sentinel->prev_in_use = 1;
+    sentinel->zone = zone;
+
+    ptr->block_length = expansion_size - sizeof(struct PointerHeader);
+    zone->allocated += ptr->block_length;
+    heap->heap_length += expansion_size;
+    _block_free(heap, ptr); //merges with the last block of the zone if that is free
+    return zone;
   } else {
     #ifdef MMGR_VERBOSE
     kputs("DEBUG _expand_zone memory blocks are not continous, creating a new zone\r\n");
     #endif
-    struct HeapZoneStart *new_zone = (struct HeapZoneStart*)slab;
-    new_zone->magic = HEAP_ZONE_SIG;
-    new_zone->zone_length = expansion_size;
-    new_zone->allocated = 0;
-    new_zone->dirty = 0;
-    new_zone->next_zone=NULL;
+    struct HeapZoneStart *new_zone = _init_zone(heap, slab, expansion_size);
+    new_zone->prev_zone = zone;
     zone->next_zone = new_zone;
-
-    struct PointerHeader* ptr = (struct PointerHeader *)((char *)slab + sizeof(struct HeapZoneStart));
-    ptr->magic = HEAP_PTR_SIG;
-    
-    // Validate that we have space for both the zone header and pointer header
-    if(new_zone->zone_length < sizeof(struct HeapZoneStart) + sizeof(struct PointerHeader)) {
-      kprintf("ERROR New zone too small for headers\r\n");
-      return NULL;
-    }
-    
-    ptr->block_length = new_zone->zone_length - sizeof(struct HeapZoneStart) - sizeof(struct PointerHeader);
-    ptr->in_use=0;
-    ptr->next_ptr = NULL;
-
-    new_zone->first_ptr = ptr;
     kprintf("DEBUG _expand_zone new zone is at 0x%x and size is 0x%x\r\n", new_zone, new_zone->zone_length);
     return new_zone;
   }
 }
+
 /**
-Allocate a new pointer into the given zone.
-This assumes that there is sufficient space in the given zone.
+Find the zone that this ptr belongs to.
+Every block header records its zone, so this is just a matter of checking that the header is sane.
 */
-void* _zone_alloc(struct HeapZoneStart *zone, size_t bytes)
+struct HeapZoneStart* _zone_for_ptr(struct HeapZoneStart *heap,void* ptr)
 {
-  size_t remaining_length = 0;
-  struct PointerHeader* new_ptr=NULL;
-
-  #ifdef MMGR_VERBOSE
-  kprintf("DEBUG _zone_alloc request for %l (0x%x) bytes in zone 0x%x\r\n", bytes, bytes, zone);
-  #endif
-
-  struct PointerHeader *p=zone->first_ptr;
-  while(1) {
-    if(p->magic!=HEAP_PTR_SIG) k_panic("Kernel heap corrupted\r\n");
-
-    if(p->in_use) {
-      p=p->next_ptr;
-      if(p==NULL) break; else continue;
-    }
-
-    #ifdef MMGR_VERBOSE
-    kprintf("DEBUG Block at 0x%x of zone 0x%x not in use.\r\n", p, zone);
-    kprintf("DEBUG Free block length is 0x%x\r\n", p->block_length);
-    #endif
-
-    //ok, this block is not in use, can we fit this alloc into it?
-    if(p->block_length<bytes){
-      p = p->next_ptr;
-      if(p==NULL) break; else continue;
-    }
-
-    //great, this alloc fits.
-    //remaining_length takes us right up to the next block so we must make sure we have enough space for the buffer and the new header to go with it.
-
-    remaining_length = p->block_length - bytes;
-    p->block_length = bytes;
-    p->in_use = 1;
-    zone->allocated += bytes;
-    zone->dirty = 1;
-
-    if(remaining_length > 2*sizeof(struct PointerHeader)) {
-      //we can fit another block in the remaining space.
-      new_ptr = (struct PointerHeader *)((size_t)p + sizeof(struct PointerHeader) + p->block_length);
-      if((size_t)new_ptr < (size_t)p) { //check for integer overflow
-        kprintf("ERROR calculated new pointer 0x%x is before the existing pointer 0x%x\r\n", new_ptr, p);
-        k_panic("Heap corruption detected\r\n");
-      }
-      if((size_t)new_ptr + sizeof(struct PointerHeader) > (size_t)zone + zone->zone_length) {
-        kprintf("ERROR calculated new pointer 0x%x + header size would extend outside zone 0x%x + 0x%x\r\n", new_ptr, zone, zone->zone_length);
-        k_panic("Heap corruption detected\r\n");
-      }
-      new_ptr->magic = HEAP_PTR_SIG;
-      //the existing remaining_length does NOT include the existing header, so we should subtract 2* the header size from it
-      if(remaining_length < 2*sizeof(struct PointerHeader)) {
-        kprintf("ERROR insufficient remaining space 0x%x for two headers 0x%x\r\n", remaining_length, 2*sizeof(struct PointerHeader));
-        k_panic("Heap corruption detected\r\n");
-      }
-      new_ptr->block_length = remaining_length - 2*sizeof(struct PointerHeader);
-      if(new_ptr->block_length == 0 || new_ptr->block_length > remaining_length) { //check for underflow or overflow
-        kprintf("ERROR calculated new pointer 0x%x has invalid block length 0x%x - integer over/underflow\r\n", new_ptr, new_ptr->block_length);
-        k_panic("Heap corruption detected\r\n");
-      }
-      new_ptr->in_use = 0;
-      new_ptr->next_ptr = p->next_ptr;
-      p->next_ptr = new_ptr;
-    }
+  // Protect against NULL pointer
+  if(!heap || !ptr) return NULL;
+  
+  if(heap->magic != HEAP_ZONE_SIG) k_panic("Kernel heap corrupted\r\n");
 
-    //return pointer to the data zone
-    void *ptr= (void *)((size_t)p + sizeof(struct PointerHeader));
-    #ifdef MMGR_VERBOSE
-    kprintf("DEBUG Success, block start is 0x%x and ptr is 0x%x\r\n", p, ptr);
-    #endif
-    
-    // Extra validation for large allocations
-    // if(bytes > 0x100000) { // 1MB+
-    //   kprintf("DEBUG Large allocation: ptr=0x%x, size=0x%x, zone=0x%x\r\n", ptr, bytes, zone);
-    //   kprintf("DEBUG Block header at 0x%x: magic=0x%x, block_length=0x%x, in_use=%d\r\n", 
-    //           p, p->magic, p->block_length, p->in_use);
-    //   if(new_ptr) {
-    //     kprintf("DEBUG Next block header at 0x%x: magic=0x%x, block_length=0x%x, in_use=%d\r\n",
-    //             new_ptr, new_ptr->magic, new_ptr->block_length, new_ptr->in_use);
-    //   }
-    // }
+  struct PointerHeader* ptr_info = (struct PointerHeader*)((char*) ptr - sizeof(struct PointerHeader));
+  if(ptr_info->magic != HEAP_PTR_SIG) return NULL;
 
-    return ptr;
-  }
-  kputs("ERROR ran out of space in the zone, this should not happen\r\n");
+  struct HeapZoneStart* zone = ptr_info->zone;
+  if(!zone || zone->magic != HEAP_ZONE_SIG) return NULL;
+  
+  // Use inclusive boundaries for proper zone checking
+  if((void*)ptr_info >= (void*)zone->first_ptr && ptr < (void*)((char*)zone + zone->zone_length)) return zone;
   return NULL;
 }
 
 /**
-De-allocate the pointer in the given zone.
+Gives memory back to the physical allocator if the given free block allows it, according to the policy described
+in heap.h. If the block fills an entire zone (other than the first one, which holds the free lists) then the whole zone
+is released; if it is at the end of its zone then the zone is shortened.
+Returns 1 if a whole zone was released, 0 otherwise.
 */
-void _zone_dealloc(struct HeapZoneStart *zone, void* ptr)
+static uint8_t _heap_trim(struct HeapZoneStart *heap, struct PointerHeader *p)
 {
-  // Validate that the pointer is within the zone boundaries
-  if(ptr <= (void*)zone || ptr >= (void*)((char*)zone + zone->zone_length)) {
-    kprintf("ERROR Pointer 0x%x is not within zone boundaries 0x%x to 0x%x\r\n", ptr, zone, (char*)zone + zone->zone_length);
-    k_panic("Heap corruption detected\r\n");
-  }
-  
-  struct PointerHeader* ptr_info = (struct PointerHeader*)((char*) ptr - sizeof(struct PointerHeader));
-  
-  // Ensure the header is also within zone boundaries
-  if((void*)ptr_info < (void*)zone || (void*)ptr_info >= (void*)((char*)zone + zone->zone_length)) {
-    kprintf("ERROR Pointer header 0x%x is not within zone boundaries\r\n", ptr_info);
-    k_panic("Heap corruption detected\r\n");
-  }
-  
-  if(ptr_info->magic != HEAP_PTR_SIG) {
-    kprintf("ERROR Could not free pointer at 0x%x in zone 0x%x, heap may be corrupted\r\n", ptr, zone);
-    k_panic("Heap corruption detected\r\n");
-  }
-  
-  if(ptr_info->in_use == 0) {
-    kprintf("ERROR Double-free detected: pointer 0x%x is already free\r\n", ptr);
-    k_panic("Heap corruption detected\r\n");
-  }
+  if(heap->in_use >= heap->high_water/2) return 0;
+
+  size_t keep = heap->high_water/2 + HEAP_TOP_PAD_PAGES*PAGE_SIZE;
+  if(heap->heap_length <= keep) return 0;
+  size_t allowance = (heap->heap_length - keep) & ~(PAGE_SIZE-1);
+  if(allowance < HEAP_TRIM_THRESHOLD_PAGES*PAGE_SIZE) return 0;
 
-  ptr_info->in_use = 0;
-  zone->allocated -= ptr_info->block_length;
+  struct HeapZoneStart *zone = p->zone;
+  struct PointerHeader *sentinel = _next_block(p);
+  if(sentinel->block_length!=0 || (char *)sentinel != (char *)zone + zone->zone_length - sizeof(struct PointerHeader)) return 0;  //not at the end of the zone
 
-  if(ptr_info->next_ptr && ptr_info->next_ptr->in_use==0) {
-    //there is a following block. If this is also free, then we should coalesce them to fight fragmentation.
+  if(zone!=heap && p==zone->first_ptr && zone->zone_length <= allowance) {
     #ifdef MMGR_VERBOSE
-    kprintf("DEBUG Pointer 0x%x following 0x%x is free too, coalescing\r\n", ptr_info->next_ptr, ptr_info);
+    kprintf("DEBUG _heap_trim releasing empty zone 0x%x of 0x%x bytes\r\n", zone, zone->zone_length);
     #endif
-    if(ptr_info->next_ptr->magic != HEAP_PTR_SIG) {
-      kprintf("ERROR Pointer at 0x%x following 0x%x appears corrupted\r\n", ptr_info->next_ptr, ptr_info);
-      return;
-    }
-    struct PointerHeader* ptr_to_remove = ptr_info->next_ptr;
-    
-    // Check for overflow when adding block lengths
-    size_t total_block_length = ptr_info->block_length + ptr_to_remove->block_length + sizeof(struct PointerHeader);
-    if(total_block_length < ptr_info->block_length || total_block_length < ptr_to_remove->block_length) {
-      kprintf("ERROR Integer overflow when coalescing blocks 0x%x + 0x%x + 0x%x\r\n", 
-              ptr_info->block_length, ptr_to_remove->block_length, sizeof(struct PointerHeader));
-      k_panic("Heap corruption detected\r\n");
-    }
-    
-    ptr_info->next_ptr = ptr_to_remove->next_ptr;
-    ptr_info->block_length = total_block_length;
-    memset(ptr_to_remove, 0, sizeof(struct PointerHeader));
+    _free_list_remove(heap, p);
+    zone->prev_zone->next_zone = zone->next_zone;
+    if(zone->next_zone) zone->next_zone->prev_zone = zone->prev_zone;
+    heap->heap_length -= zone->zone_length;
+    heap->high_water = heap->high_water/2 > heap->in_use ? heap->high_water/2 : heap->in_use;
+    zone->magic = 0;
+    vm_deallocate_physical_pages(NULL, (void *)zone, zone->zone_length / PAGE_SIZE);
+    return 1;
   }
-}
 
-/**
-Find the zone that this ptr belongs to.
-*/
-struct HeapZoneStart* _zone_for_ptr(struct HeapZoneStart *heap,void* ptr)
-{
-  // Protect against NULL pointer
-  if(!heap || !ptr) return NULL;
-  
-  if(heap->magic != HEAP_ZONE_SIG) k_panic("Kernel heap corrupted\r\n");
-  void* zone_start = (void*)heap;
-  void* zone_end = (char*)heap + heap->zone_length;
-  
-  // Use inclusive boundaries for proper zone checking
-  if(ptr >= zone_start && ptr < zone_end) return heap; //this is the zone that contains the pointer
-  
-  if(heap->next_zone) return _zone_for_ptr(heap->next_zone, ptr); //recurse on to the next zone
-  return NULL;  //we reached the end of the whole heap and did not find it.
+  //otherwise cut pages off the end, leaving room for a minimum-sized block plus the new sentinel
+  vaddr zone_end = (vaddr)zone + zone->zone_length;
+  vaddr min_end = ((vaddr)p + 2*sizeof(struct PointerHeader) + HEAP_MIN_BLOCK + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+  size_t release = zone_end - min_end;
+  if(release > allowance) release = allowance;
+  if(release < HEAP_TRIM_THRESHOLD_PAGES*PAGE_SIZE) return 0;
+
+  #ifdef MMGR_VERBOSE
+  kprintf("DEBUG _heap_trim releasing 0x%x bytes from the end of zone 0x%x\r\n", release, zone);
+  #endif
+  _free_list_remove(heap, p);
+  p->block_length -= release;
+  zone->zone_length -= release;
+  sentinel = _next_block(p);
+  sentinel->magic = HEAP_PTR_SIG;
+  sentinel->block_length = 0;
+  sentinel->in_use = 1;
+  sentinel->prev_in_use = 0;
+  sentinel->zone = zone;
+  _write_footer(p);
+  _free_list_insert(heap, p);
+
+  heap->heap_length -= release;
+  heap->high_water = heap->high_water/2 > heap->in_use ? heap->high_water/2 : heap->in_use;
+  vm_deallocate_physical_pages(NULL, (void *)(zone_end - release), release / PAGE_SIZE);
+  return 0;
 }
 
 /**
@@ -490,71 +585,72 @@ void heap_free(struct HeapZoneStart *heap, void* ptr)
     kprintf("ERROR Attempted to free pointer 0x%x from heap 0x%x which it does not belong to\r\n", ptr, heap);
     return;
   }
-  _zone_dealloc(zone, ptr);
+  #ifdef MMGR_VALIDATE_PRE
+  validate_zone(zone);
+  #endif
+
+  struct PointerHeader* ptr_info = (struct PointerHeader*)((char*) ptr - sizeof(struct PointerHeader));
+  if(ptr_info->in_use == 0) {
+    kprintf("ERROR Double-free detected: pointer 0x%x is already free\r\n", ptr);
+    k_panic("Heap corruption detected\r\n");
+  }
+  heap->in_use -= ptr_info->block_length;
+  struct PointerHeader *free_block = _block_free(heap, ptr_info);
   #ifdef MMGR_VERBOSE
   kprintf("INFO Freed block 0x%x\r\n", ptr - sizeof(struct PointerHeader));
   #endif
+  if(_heap_trim(heap, free_block)) zone = NULL; //the zone may not exist any more
   #ifdef MMGR_VALIDATE_POST
-  validate_zone(zone);
+  if(zone) validate_zone(zone);
   #endif
 }
 
 /**
 Allocate a new pointer in the given heap.
-This will try to find a zone with enough space in it, and if not
+This takes a block from the heap's segregated free lists, and if there is nothing big enough
 will try to expand the heap.
 */
 void* heap_alloc(struct HeapZoneStart *heap, size_t bytes)
 {
-  struct HeapZoneStart* z=heap;
-  while(1) {
-    if(z->magic!=HEAP_ZONE_SIG) k_panic("Kernel heap corrupted\r\n");
+  if(heap->magic!=HEAP_ZONE_SIG) k_panic("Kernel heap corrupted\r\n");
+  size_t block_length = _round_block_length(bytes);
+
+  struct PointerHeader *p = _find_free_block(heap, block_length);
+  if(!p) {
     #ifdef MMGR_VERBOSE
-    kprintf("DEBUG heap_alloc space is %l / %l for zone 0x%x\r\n", z->allocated, z->zone_length, z);
+    kprintf("DEBUG No existing heap zones had space to allocate %l (0x%x) bytes, expanding last zone\r\n", bytes, bytes);
     #endif
-
-    if(z->zone_length - z->allocated > bytes) {
-      #ifdef MMGR_VALIDATE_PRE
-      kprintf("DEBUG !! Pre-alloc\r\n");
-      validate_zone(z);
-      #endif
-      void* result = _zone_alloc(z, bytes);
-      #ifdef MMGR_VALIDATE_POST
-      kprintf("DEBUG !! Post-alloc\r\n");
-      validate_zone(z);
-      #endif
-      #ifdef MMGR_VERBOSE
-      kprintf("INFO heap_alloc used space in zone 0x%x is now 0x%x (%l) out of 0x%x\r\n", z, z->allocated, z->allocated, z->zone_length);
-      #endif
-      return result;
+    struct HeapZoneStart* z=heap;
+    while(z->next_zone) {
+      if(z->magic!=HEAP_ZONE_SIG) k_panic("Kernel heap corrupted\r\n");
+      z=z->next_zone;
+    }
+    size_t pages_required = (block_length / PAGE_SIZE) +1; //if bytes is an exact page size, we'll need more space for zone and block headers.
+    //always allocate at least MIN_ZONE_SIZE_PAGES
+    size_t pages_to_alloc = pages_required > MIN_ZONE_SIZE_PAGES ? pages_required : MIN_ZONE_SIZE_PAGES;
+    //vm_alloc_pages can only hand out this much as whole 4Mb pages, so round up (allowing for the zone header page) to use them
+    if(pages_to_alloc+1 > 512) pages_to_alloc = ((pages_to_alloc + LARGE_PAGE_PAGES) & ~(LARGE_PAGE_PAGES-1)) - 1;
+    if(!_expand_zone(heap, z, pages_to_alloc)) return NULL;
+    p = _find_free_block(heap, block_length);
+    if(!p) {
+      kputs("ERROR ran out of space in the heap after expanding it, this should not happen\r\n");
+      return NULL;
     }
-    if(z->next_zone==NULL) break;
-    z=z->next_zone;
   }
 
-  #ifdef MMGR_VERBOSE
-  kprintf("DEBUG No existing heap zones had space to allocate %l (0x%x) bytes, expanding last zone\r\n", bytes, bytes);
-  #endif
-  //if we get here, then no zones had available space. z should be set to the last zone.
-  size_t pages_required = (bytes / PAGE_SIZE) +1; //if bytes is an exact page size, we'll need more space for zone and block headers.
-  //always allocate at least MIN_ZONE_SIZE_PAGES
-  size_t pages_to_alloc = pages_required > MIN_ZONE_SIZE_PAGES ? pages_required : MIN_ZONE_SIZE_PAGES;
-  z = _expand_zone(z, pages_to_alloc);
-  //at this point, z might be the previous zone; it might be a new one; or it might be NULL if something went wrong.
-  if(!z) return NULL;
-  void* result = _zone_alloc(z, bytes);
-  #ifdef MMGR_VERBOSE
-  if(result) {
-    kprintf("INFO Allocated block 0x%x\r\n", (char*)result - sizeof(struct PointerHeader));
-  } else {
-    kprintf("INFO Allocation failed\r\n");
-  }
+  #ifdef MMGR_VALIDATE_PRE
+  kprintf("DEBUG !! Pre-alloc\r\n");
+  validate_zone(p->zone);
   #endif
+  void *result = _block_alloc(heap, p, block_length);
+  heap->in_use += p->block_length;
+  if(heap->in_use > heap->high_water) heap->high_water = heap->in_use;
   #ifdef MMGR_VALIDATE_POST
-  validate_zone(z);
+  kprintf("DEBUG !! Post-alloc\r\n");
+  validate_zone(p->zone);
   #endif
   #ifdef MMGR_VERBOSE
-  kprintf("INFO heap_alloc used space in zone 0x%x is now 0x%x (%l) out of 0x%x\r\n", z, z->allocated, z->allocated, z->zone_length);
+  kprintf("INFO heap_alloc used space in zone 0x%x is now 0x%x (%l) out of 0x%x\r\n", p->zone, p->zone->allocated, p->zone->allocated, p->zone->zone_length);
   #endif
   return result;
 }
@@ -604,106 +700,62 @@ void *realloc(void *ptr, size_t new_size)
     return NULL;
   }
 
+  struct HeapZoneStart *heap = get_process(0)->heap_start;
   #ifdef MMGR_VALIDATE_PRE
-  void *z = _zone_for_ptr(get_process(0)->heap_start, ptr);
-  if(z) {
-    kprintf("DEBUG !! Pre-realloc\r\n");
-    validate_zone((struct HeapZoneStart*)z);
-  }
+  kprintf("DEBUG !! Pre-realloc\r\n");
+  validate_zone(hdr->zone);
   #endif
 
   size_t old_len = hdr->block_length;
+  size_t block_length = _round_block_length(new_size);
 
-  if(old_len > new_size) {
-    // SHRINK CASE
-    size_t remaining = old_len - new_size;
-    if(remaining >= sizeof(struct PointerHeader) + 1) {
-      kprintf("DEBUG realloc: shrinking block to %l and creating new free block of %l\r\n", new_size, remaining - sizeof(struct PointerHeader));
-      struct PointerHeader* new_ptr = (struct PointerHeader *)((char*)ptr + new_size);
-      new_ptr->magic = HEAP_PTR_SIG;
-      new_ptr->block_length = remaining - sizeof(struct PointerHeader);
-      new_ptr->in_use = 0;
-      new_ptr->next_ptr = hdr->next_ptr;
-      hdr->next_ptr = new_ptr;
-    } else {
-      kputs("DEBUG realloc: shrinking block but not enough space to create new free block\r\n");
-    }
-    hdr->block_length = new_size;
-    
+  if(old_len >= block_length) {
+    // SHRINK CASE - give back the tail if it's big enough to be a block in its own right
+    _split_block(heap, hdr, block_length);
+    heap->in_use -= old_len - hdr->block_length;
     #ifdef MMGR_VALIDATE_POST
-    void *z = _zone_for_ptr(get_process(0)->heap_start, ptr);
-    if(z) {
-      kprintf("DEBUG !! Post-realloc\r\n");
-      validate_zone((struct HeapZoneStart*)z);
-    }
+    kprintf("DEBUG !! Post-realloc\r\n");
+    validate_zone(hdr->zone);
     #endif
     return ptr;
-    
-  } else if(old_len < new_size) {
-    // EXPAND CASE
-    // Try to expand in place if next block is free and large enough
-    if(hdr->next_ptr && hdr->next_ptr->in_use == 0) {
-      kprintf("DEBUG realloc: trying to expand block in place from %l to %l\r\n", old_len, new_size);
-      size_t combined_length = old_len + sizeof(struct PointerHeader) + hdr->next_ptr->block_length;
-      
-      if(combined_length >= new_size) {
-        kprintf("DEBUG realloc: expanding block in place from %l to %l\r\n", old_len, new_size);
-        size_t remaining = combined_length - new_size;
-        
-        if(remaining > sizeof(struct PointerHeader)) {
-          // Create new free block in remaining space
-          struct PointerHeader* new_ptr = (struct PointerHeader *)((char*)hdr + sizeof(struct PointerHeader) + new_size);
-          new_ptr->magic = HEAP_PTR_SIG;
-          new_ptr->block_length = remaining - sizeof(struct PointerHeader);
-          new_ptr->in_use = 0;
-          new_ptr->next_ptr = hdr->next_ptr->next_ptr;
-          hdr->next_ptr = new_ptr;
-          hdr->block_length = new_size;
-        } else {
-          kprintf("DEBUG realloc: absorbing entire next block (%l bytes leftover)\r\n", remaining);
-          // Absorb the whole next block
-          hdr->block_length = combined_length;
-          hdr->next_ptr = hdr->next_ptr->next_ptr;
-        }
-        
-        kprintf("DEBUG realloc: expanded block in place to %l\r\n", hdr->block_length);
-        #ifdef MMGR_VALIDATE_POST
-        void *z = _zone_for_ptr(get_process(0)->heap_start, ptr);
-        if(z) {
-          kprintf("DEBUG !! Post-realloc\r\n");
-          validate_zone((struct HeapZoneStart*)z);
-        }
-        #endif
-        return ptr;
-      }
-    }
-    
-    // Cannot expand in place: allocate new block, copy, and free old
-    kprintf("DEBUG realloc: cannot expand in place, allocating new block\r\n");
-    void *new_ptr = malloc(new_size);
-    if(!new_ptr) {
-      kprintf("ERROR realloc: allocation of new block of size %l failed\r\n", new_size);
-      return NULL;
-    }
-    
-    // Copy old data (only copy old_len bytes, not more)
-    memcpy(new_ptr, ptr, old_len);
-    free(ptr);
-    
+  }
+
+  // EXPAND CASE
+  // Try to expand in place if next block is free and large enough
+  struct PointerHeader *next = _next_block(hdr);
+  if(!next->in_use && old_len + sizeof(struct PointerHeader) + next->block_length >= block_length) {
+    #ifdef MMGR_VERBOSE
+    kprintf("DEBUG realloc: expanding block in place from %l to %l\r\n", old_len, new_size);
+    #endif
+    _free_list_remove(heap, next);
+    hdr->block_length += sizeof(struct PointerHeader) + next->block_length;
+    hdr->zone->allocated += sizeof(struct PointerHeader) + next->block_length;
+    next->magic = 0;
+    _next_block(hdr)->prev_in_use = 1;
+    _split_block(heap, hdr, block_length);
+    heap->in_use += hdr->block_length - old_len;
+    if(heap->in_use > heap->high_water) heap->high_water = heap->in_use;
     #ifdef MMGR_VALIDATE_POST
-    void *z = _zone_for_ptr(get_process(0)->heap_start, new_ptr);
-    if(z) {
-      kprintf("DEBUG !! Post-realloc\r\n");
-      validate_zone((struct HeapZoneStart*)z);
-    }
+    kprintf("DEBUG !! Post-realloc\r\n");
+    validate_zone(hdr->zone);
     #endif
-    return new_ptr;
-    
-  } else {
-    // SAME SIZE - no-op
-    kprintf("DEBUG realloc: requested size is same as current size %l, nothing to do\r\n", new_size);
     return ptr;
   }
+
+  // Cannot expand in place: allocate new block, copy, and free old
+  #ifdef MMGR_VERBOSE
+  kprintf("DEBUG realloc: cannot expand in place, allocating new block\r\n");
+  #endif
+  void *new_ptr = malloc(new_size);
+  if(!new_ptr) {
+    kprintf("ERROR realloc: allocation of new block of size %l failed\r\n", new_size);
+    return NULL;
+  }
+
+  // Copy old data (only copy old_len bytes, not more)
+  memcpy(new_ptr, ptr, old_len);
+  free(ptr);
+  return new_ptr;
 }
 
 void free_for_process(uint16_t pid, void *ptr)
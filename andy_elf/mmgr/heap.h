@@ -11,22 +11,64 @@
 #define MIN_ZONE_SIZE_PAGES 50
 #define MIN_ZONE_SIZE_BYTES MIN_ZONE_SIZE_PAGES*PAGE_SIZE
 
+#define HEAP_ALIGN          8   //all block lengths are a multiple of this
+#define HEAP_SIZE_CLASSES   24  //free list n holds blocks of 2^(n+4) up to 2^(n+5)-1 bytes; the last one holds everything bigger
+
+/**
+Trimming policy. Memory is only handed back to the physical allocator once the bytes in use have dropped below half
+of the heap's high-water mark, and even then the heap is kept at least half as big as that mark plus HEAP_TOP_PAD_PAGES
+so that a workload which repeatedly grows and shrinks does not spend its time remapping pages.
+Nothing smaller than HEAP_TRIM_THRESHOLD_PAGES is released.
+*/
+#define HEAP_TRIM_THRESHOLD_PAGES 16
+#define HEAP_TOP_PAD_PAGES        16
+
+/**
+A heap is a chain of zones. Each zone is a contiguous run of pages laid out like this:
+  [HeapZoneStart] [PointerHeader][data] [PointerHeader][data] ... [sentinel PointerHeader]
+Blocks are found by adjacency (the next header follows the data) and the sentinel is a zero-length block that is
+always marked in use, so that coalescing never runs off the end of the zone.
+*/
 typedef struct HeapZoneStart {
   uint32_t magic; //must be 0x4f5a454e = "ZONE"
   size_t zone_length; //zone length DOES include all headers
   size_t allocated;
   uint8_t dirty : 1;
   struct HeapZoneStart* next_zone;
+  struct HeapZoneStart* prev_zone;
   struct PointerHeader* first_ptr;
+  //the segregated free lists for the whole heap are kept in its first zone
+  uint32_t free_list_bitmap;    //bit n is set if free_lists[n] is not empty
+  struct PointerHeader* free_lists[HEAP_SIZE_CLASSES];
+  size_t heap_length;           //total length of all zones in the heap
+  size_t in_use;                //total block length allocated across all zones
+  size_t high_water;            //peak value of in_use, halved each time the heap is trimmed
 } HeapZoneStart;
 
 typedef struct PointerHeader {
   uint32_t magic; //must be 0x54505220 = "PTR "
   size_t block_length;  //block length does NOT include this header.
   uint8_t in_use : 1;
-  struct PointerHeader* next_ptr;
+  uint8_t prev_in_use : 1;    //if this is 0 then the block in front of this one is free and ends with a PointerFooter
+  struct HeapZoneStart* zone; //the zone that contains this block, so that free() does not need to search for it
 } PointerHeader;
 
+/**
+A free block keeps its free-list links at the start of its data area and a footer at the end, so that
+the block after it can find its header when coalescing.
+*/
+typedef struct FreeBlockLinks {
+  struct PointerHeader* next_free;
+  struct PointerHeader* prev_free;
+} FreeBlockLinks;
+
+typedef struct PointerFooter {
+  uint32_t magic; //must be HEAP_PTR_SIG
+  size_t block_length;
+} PointerFooter;
+
+#define HEAP_MIN_BLOCK (sizeof(FreeBlockLinks) + sizeof(PointerFooter))
+
 struct HeapZoneStart* initialise_heap(struct ProcessTableEntry *process, size_t initial_pages);
 
 //allocates onto the heap of the given process, which must exist.
@@ -13,12 +13,16 @@
 #include <cfuncs.h>
 #include <cpuid.h>
 #include <spinlock.h>
+#include <sys/vaspace.h>
+#include <sys/x86_control_registers.h>
+#include <sys/tlb.h>
+#include <sys/filemap.h>
+#include <scheduler/timepage.h>
 #include "panic.h"
 
 #include "heap.h"
 #include "process.h"
 
-#define ROOT_PAGE_DIR_LOCATION        0x3000
 #define KERNEL_PAGETABLES_LOCATION    0xF03C0000 //the kernel root paging dir is remapped here in the flat pagetables area
 #define FIRST_PAGEDIR_ENTRY_LOCATION  0x4000
 #define PAGEDIR_ROOT_OFFSET           0x03C0000
@@ -40,7 +44,46 @@ static uint32_t *flat_pagetables_ptr  = 0xF0000000;
 struct PhysMapEntry *physical_memory_map = NULL;
 static size_t physical_page_count = 0;
 
-#define __invalidate_vptr(vptr_to_invalidate) __asm__ __volatile__("invlpg (%0)" : : "r" (vptr_to_invalidate) : "memory")
+#define PHYS_ALLOC_FIRST_PAGE 0x30      //nothing below this is ever handed out by the physical allocator
+//heads of the buddy allocator free lists, one per block order. These are page indices into physical_memory_map.
+static uint32_t phys_free_lists[PHYS_MAX_ORDER+1];
+static size_t phys_free_page_count = 0;
+
+//a single page of kernel vmem that physical pages get temporarily mapped onto so that they can be zeroed.
+//when not in use it points to its own scratch page, so that the virtual address is never handed out to anyone else.
+static void *zeroing_window = NULL;
+static uint32_t zeroing_window_idle_pte = 0;
+static spinlock_t zerolock = 0;
+
+//free virtual address ranges in kernel-space. App address spaces are tracked in their process table entries.
+static struct VaSpace kernel_va_space;
+//address space tracking for the app directories that map_app_pagingdir has mapped in, by kernel directory index
+static struct VaSpace *mapped_app_va_spaces[1024];
+static uint8_t kernel_heap_ready = 0;  //the address space tracking can't grow until there is a heap to grow into
+
+//set if the CPU supports 4Mb pages and they have been switched on in CR4
+static uint8_t pse_enabled = 0;
+
+/**
+ * internal function to get the root directory entries that go with the given page tables area
+*/
+static inline uint32_t *_root_dir_for(uint32_t *pagetables)
+{
+  return pagetables==flat_pagetables_ptr ? kernel_paging_directory : (uint32_t *)((vaddr)pagetables + PAGEDIR_ROOT_OFFSET);
+}
+
+/**
+ * internal function to get the MP_GLOBAL flag for a new mapping, if it should have one.
+ * Only kernel mappings that every app's directory shares get it. The flat pagetables area, the mapped app directories
+ * and the app stack area are different in every address space, so they must never be global.
+*/
+static inline uint32_t _global_flag_for(uint32_t *pagetables, vaddr vptr, uint32_t flags)
+{
+  if(pagetables!=flat_pagetables_ptr || (flags & MP_USER)) return 0;
+  if(vptr < KERNEL_VA_END) return tlb_global_flag();
+  if(vptr >= (vaddr)flat_pagetables_ptr + LARGE_PAGE_SIZE && vptr < PHYSICAL_MAP_VMM_LIMIT) return tlb_global_flag();
+  return 0;
+}
 
 
 /**
@@ -58,6 +101,7 @@ void initialise_mmgr(struct MemoryMapEntry memmap[], uint32_t entries, void *mul
   memlock = 0;
   physlock = 0;
   pagefault_depth_ctr = 0;
+  va_space_init(&kernel_va_space, KERNEL_VA_START, KERNEL_VA_END);
 
   kprintf("DEBUG memlock at 0x%x\r\n", &memlock);
   kprintf("DEBUG physlock at 0x%x\r\n", &physlock);
@@ -69,18 +113,86 @@ void initialise_mmgr(struct MemoryMapEntry memmap[], uint32_t entries, void *mul
 
   kputs("Setup paging....\r\n");
   setup_paging();
+  if(flags & CPUID_FEAT_EDX_PSE) {
+    kputs("CPU supports 4Mb pages, enabling PSE.\r\n");
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PSE;
+    asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    pse_enabled = 1;
+  }
+  initialise_tlb(flags);
   kputs("Initialising pagetables area");
   initialise_flat_pagetables();
   map_physical_memory_map_area(physical_map_start, physical_map_pages);
+  initialise_physical_allocator(memmap, entries);
   idmap_multiboot_data(multiboot_ptr, multiboot_length); //the multiboot data contains our memory map, so we need to be able to access it!
   kputs("Applying memory map protections...\r\n");
   apply_memory_map_protections(memmap, entries);
   kputs("Memory manager initialised.\r\n");
   initialise_process_table(kernel_paging_directory);
+  get_process(0)->va_space = &kernel_va_space;
   void *heap_ptr = initialise_heap(get_process(0), MIN_ZONE_SIZE_PAGES*4);
   if(heap_ptr==NULL) {
     k_panic("Unable to allocate initial heap");
   }
+  kernel_heap_ready = 1;
+  zerolock = 0;
+  zeroing_window = vm_alloc_pages(NULL, 1, MP_READWRITE);
+  if(zeroing_window==NULL) {
+    k_panic("Unable to allocate page zeroing window");
+  }
+  zeroing_window_idle_pte = flat_pagetables_ptr[(vaddr)zeroing_window >> 12];
+}
+
+/**
+ * Zeroes the given page of physical RAM, by temporarily mapping it into the kernel's zeroing window.
+ * The page does not need to be mapped anywhere else.
+*/
+void zero_physical_page(void *phys_addr)
+{
+  size_t window_idx = (vaddr)zeroing_window >> 12;
+
+  acquire_spinlock(&zerolock);
+  flat_pagetables_ptr[window_idx] = ((vaddr)phys_addr & MP_ADDRESS_MASK) | MP_PRESENT | MP_READWRITE;
+  tlb_invalidate_page((vaddr)zeroing_window);
+  mb();
+  memset_dw(zeroing_window, 0, PAGE_SIZE_DWORDS);
+  mb();
+  flat_pagetables_ptr[window_idx] = zeroing_window_idle_pte;
+  tlb_invalidate_page((vaddr)zeroing_window);
+  release_spinlock(&zerolock);
+}
+
+/**
+ * internal callback for _propagate_kernel_pde. Writes the kernel's directory entry into one app's root directory,
+ * through the zeroing window as the directory doesn't need to be mapped anywhere else.
+*/
+static void _copy_kernel_pde(void *root_paging_directory_phys, void *extradata)
+{
+  size_t dir = (size_t)extradata;
+  size_t window_idx = (vaddr)zeroing_window >> 12;
+
+  acquire_spinlock(&zerolock);
+  flat_pagetables_ptr[window_idx] = ((vaddr)root_paging_directory_phys & MP_ADDRESS_MASK) | MP_PRESENT | MP_READWRITE;
+  tlb_invalidate_page((vaddr)zeroing_window);
+  ((uint32_t *)zeroing_window)[dir] = kernel_paging_directory[dir];
+  mb();
+  flat_pagetables_ptr[window_idx] = zeroing_window_idle_pte;
+  tlb_invalidate_page((vaddr)zeroing_window);
+  release_spinlock(&zerolock);
+}
+
+/**
+ * internal function to copy the kernel's directory entry `dir` into every app's root directory. Apps get a copy of the
+ * kernel's directory when they start (see initialise_app_pagingdir), so a 4Mb kernel page that is mapped or unmapped
+ * after that must be put into, or taken out of, theirs too. Otherwise an app would fault a blank page table in over it,
+ * or keep reaching RAM that has been given back. Must be called with memlock held, before any RAM being unmapped is freed.
+*/
+static void _propagate_kernel_pde(size_t dir)
+{
+  if(dir >= ADDR_TO_PAGEDIR_IDX(KERNEL_VA_END)) return;  //above here the apps have their own entries
+  process_pagingdirs_foreach((void *)dir, &_copy_kernel_pde);
 }
 
 void idmap_multiboot_data(void *multiboot_ptr, size_t length_bytes)
@@ -97,7 +209,7 @@ void idmap_multiboot_data(void *multiboot_ptr, size_t length_bytes)
   kputs("INFO Identity-mapping multiboot data...\r\n");
   for(size_t i=0;i<pages;i++) {
     vaddr phys_page = start_page + i*PAGE_SIZE;
-    reserve_physical_page(phys_page);
+    reserve_physical_page((void *)phys_page);
     kprintf("  DEBUG Mapping 0x%x to 0x%x...\r\n", phys_page, phys_page);
     k_map_page_bytes(kernel_paging_directory, phys_page, phys_page, MP_PRESENT|MP_READWRITE);
   }
@@ -191,6 +303,10 @@ void setup_paging() {
 size_t map_physical_memory_map_area(size_t map_start, size_t map_length_pages)
 {
   size_t virt_map_start = PHYSICAL_MAP_VMM_LIMIT - (map_length_pages*0x1000);
+  if(pse_enabled && map_length_pages>=LARGE_PAGE_PAGES) {
+    //a big map can use 4Mb pages for the middle of it, but only if virtual and physical addresses line up within a 4Mb page.
+    virt_map_start = ((virt_map_start - LARGE_PAGE_SIZE) & LARGE_PAGE_ADDRESS_MASK) | (map_start & ~LARGE_PAGE_ADDRESS_MASK);
+  }
   kprintf("DEBUG physical map runs from 0x%x to 0x%x\r\n", virt_map_start, PHYSICAL_MAP_VMM_LIMIT);
   //Unfortunately our clever on-demand mapping won't work yet, because it relies on having the physical map available in vm
   //So we have to set up enough _directories_ for the pages.
@@ -198,7 +314,7 @@ size_t map_physical_memory_map_area(size_t map_start, size_t map_length_pages)
   kprintf("DEBUG Need %d directories for %d pages\r\n", directories_needed, map_length_pages);
   vaddr directory_phys_base = map_start - (directories_needed << 12);
 
-  for(size_t i=0;i<directories_needed;i++) {
+  for(size_t i=0;i<directories_needed && !pse_enabled;i++) {
     vaddr phys_page = directory_phys_base + i*0x1000;
     //we need to map the directory for the first 4Mb after virt_map_start
     vaddr virt_dir = (virt_map_start >> 22) + i;
@@ -208,12 +324,28 @@ size_t map_physical_memory_map_area(size_t map_start, size_t map_length_pages)
   }
 
   kputs("INFO Bringing physical map into kernel-space...\r\n");
+  size_t directories_used = 0;
   for(size_t i=0; i<map_length_pages; i++) {
     void *phys_page = (void *)(map_start + i*0x1000);
     void *virt_page = (void *)(virt_map_start + i*0x1000);
+    vaddr virt_dir = (vaddr)virt_page >> 22;
+    if(pse_enabled) {
+      if(((vaddr)virt_page & ~LARGE_PAGE_ADDRESS_MASK)==0 && i+LARGE_PAGE_PAGES<=map_length_pages) {
+        kprintf("  DEBUG Mapping 0x%x to 0x%x as a 4Mb page...\r\n", phys_page, virt_page);
+        kernel_paging_directory[virt_dir] = (vaddr)phys_page | MP_PRESENT | MP_READWRITE | MP_PCD | MP_PAGESIZE;
+        i += LARGE_PAGE_PAGES - 1;
+        continue;
+      }
+      //the ends of the map that are not covered by a 4Mb page use the page tables we set aside for them
+      if(!(kernel_paging_directory[virt_dir] & MP_PRESENT)) {
+        if(directories_used>=directories_needed) k_panic("ERROR ran out of page tables for the physical map\r\n");
+        kernel_paging_directory[virt_dir] = (directory_phys_base + directories_used*0x1000) | MP_PRESENT | MP_READWRITE | MPC_PAGINGDIR | MP_PCD;
+        ++directories_used;
+      }
+    }
     kprintf("  DEBUG Mapping 0x%x to 0x%x...\r\n", phys_page, virt_page);
     
-    k_map_page_bytes(kernel_paging_directory, phys_page, virt_page, MP_PRESENT|MP_READWRITE|MP_PCD);
+    k_map_page_bytes(kernel_paging_directory, phys_page, virt_page, MP_PRESENT|MP_READWRITE|MP_PCD|tlb_global_flag());
   }
   physical_memory_map = (struct PhysMapEntry *)virt_map_start;
   kputs("Done.\r\n");
@@ -223,6 +355,11 @@ size_t map_physical_memory_map_area(size_t map_start, size_t map_length_pages)
   for(size_t i=0;i<physical_page_count;i++) {
     physical_memory_map[i].present=1;
     physical_memory_map[i].in_use=0;
+    physical_memory_map[i].usable=0;
+    physical_memory_map[i].free_head=0;
+    physical_memory_map[i].order=0;
+    physical_memory_map[i].next_free=PHYS_NO_PAGE;
+    physical_memory_map[i].prev_free=PHYS_NO_PAGE;
   }
 
   /**
@@ -289,7 +426,153 @@ uint32_t *get_pagetable(vaddr virt_address) {
 }
 
 /**
-Searches the physical memory map to find the requested number of free pages.
+Internal functions for the buddy allocator. A free block of 2^order pages is represented by its first
+page having free_head set in the physical memory map and being linked into phys_free_lists[order].
+All of these must be called with physlock held.
+*/
+static void _phys_list_push(uint32_t page_idx, uint8_t order)
+{
+  struct PhysMapEntry *e = &physical_memory_map[page_idx];
+  e->free_head = 1;
+  e->order = order;
+  e->prev_free = PHYS_NO_PAGE;
+  e->next_free = phys_free_lists[order];
+  if(phys_free_lists[order]!=PHYS_NO_PAGE) physical_memory_map[phys_free_lists[order]].prev_free = page_idx;
+  phys_free_lists[order] = page_idx;
+}
+
+static void _phys_list_remove(uint32_t page_idx, uint8_t order)
+{
+  struct PhysMapEntry *e = &physical_memory_map[page_idx];
+  if(e->prev_free==PHYS_NO_PAGE) {
+    phys_free_lists[order] = e->next_free;
+  } else {
+    physical_memory_map[e->prev_free].next_free = e->next_free;
+  }
+  if(e->next_free!=PHYS_NO_PAGE) physical_memory_map[e->next_free].prev_free = e->prev_free;
+  e->free_head = 0;
+  e->next_free = PHYS_NO_PAGE;
+  e->prev_free = PHYS_NO_PAGE;
+}
+
+/**
+Puts the given block back onto the free lists, merging it with its buddy for as long as the buddy is also free.
+The pages of the block must already be marked as not in use.
+*/
+static void _phys_free_block(uint32_t page_idx, uint8_t order)
+{
+  phys_free_page_count += (1 << order);
+  while(order<PHYS_MAX_ORDER) {
+    uint32_t buddy = page_idx ^ (1 << order);
+    if(buddy>=physical_page_count) break;
+    if(!physical_memory_map[buddy].free_head || physical_memory_map[buddy].order!=order) break;
+    _phys_list_remove(buddy, order);
+    if(buddy<page_idx) page_idx = buddy;
+    ++order;
+  }
+  _phys_list_push(page_idx, order);
+}
+
+/**
+Takes a block of 2^order pages off the free lists, splitting a larger one if needed, and marks it as in use.
+Returns the page index of the block or PHYS_NO_PAGE if there is nothing big enough.
+*/
+static uint32_t _phys_alloc_block(uint8_t order)
+{
+  uint8_t o = order;
+  while(o<=PHYS_MAX_ORDER && phys_free_lists[o]==PHYS_NO_PAGE) ++o;
+  if(o>PHYS_MAX_ORDER) return PHYS_NO_PAGE;
+
+  uint32_t page_idx = phys_free_lists[o];
+  _phys_list_remove(page_idx, o);
+  //return the upper half of the block to the free lists until it is the size we want
+  while(o>order) {
+    --o;
+    _phys_list_push(page_idx + (1 << o), o);
+  }
+  for(register size_t i=0;i<(1 << order);i++) physical_memory_map[page_idx+i].in_use = 1;
+  phys_free_page_count -= (1 << order);
+  return page_idx;
+}
+
+/**
+Frees an arbitrary run of pages by breaking it into the largest naturally-aligned blocks that fit
+*/
+static void _phys_free_range(uint32_t page_idx, size_t page_count)
+{
+  while(page_count>0) {
+    uint8_t order = 0;
+    while(order<PHYS_MAX_ORDER && (page_idx & ((2 << order)-1))==0 && (2 << order)<=page_count) ++order;
+    for(register size_t i=0;i<(1 << order);i++) physical_memory_map[page_idx+i].in_use = 0;
+    _phys_free_block(page_idx, order);
+    page_idx += (1 << order);
+    page_count -= (1 << order);
+  }
+}
+
+/**
+Marks a single page as in use. If it is currently part of a free block, that block is taken off the
+free lists and split so that the rest of it stays available.
+*/
+static void _phys_reserve_page(uint32_t page_idx)
+{
+  struct PhysMapEntry *e = &physical_memory_map[page_idx];
+  if(e->in_use) return;
+
+  for(uint8_t order=0;order<=PHYS_MAX_ORDER;order++) {
+    uint32_t head = page_idx & ~((1 << order)-1);
+    if(physical_memory_map[head].free_head && physical_memory_map[head].order==order) {
+      _phys_list_remove(head, order);
+      phys_free_page_count -= (1 << order);
+      while(order>0) {
+        --order;
+        uint32_t half = head + (1 << order);
+        if(page_idx>=half) {
+          _phys_free_block(head, order);
+          head = half;
+        } else {
+          _phys_free_block(half, order);
+        }
+      }
+      break;
+    }
+  }
+  e->in_use = 1;
+}
+
+/**
+Sets up the buddy allocator's free lists from the E820 memory map. Every page that lies within a "usable"
+range and has not already been reserved by map_physical_memory_map_area is made available; everything else
+(holes in the map, BIOS areas etc.) is marked as permanently in use.
+*/
+void initialise_physical_allocator(struct MemoryMapEntry memmap[], uint32_t entries)
+{
+  acquire_spinlock(&physlock);
+  for(register size_t o=0;o<=PHYS_MAX_ORDER;o++) phys_free_lists[o] = PHYS_NO_PAGE;
+  phys_free_page_count = 0;
+
+  for(register int i=0;i<entries;i++) {
+    struct MemoryMapEntry *e = (struct MemoryMapEntry *)&memmap[i];
+    if(e->type!=MMAP_TYPE_USABLE || e->base_addr>=0x100000000ULL) continue;
+    uint64_t start_page = (e->base_addr + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t end_page = (e->base_addr + e->length) / PAGE_SIZE;
+    if(end_page>physical_page_count) end_page = physical_page_count;
+    for(register size_t p=(size_t)start_page;p<(size_t)end_page;p++) physical_memory_map[p].usable = 1;
+  }
+
+  for(register size_t i=0;i<physical_page_count;i++) {
+    if(i<PHYS_ALLOC_FIRST_PAGE || !physical_memory_map[i].usable) {
+      physical_memory_map[i].in_use = 1;
+    } else if(!physical_memory_map[i].in_use) {
+      _phys_free_block(i, 0);
+    }
+  }
+  release_spinlock(&physlock);
+  kprintf("INFO %d of %d pages of physical RAM are available\r\n", phys_free_page_count, physical_page_count);
+}
+
+/**
+Obtains the requested number of free pages from the buddy allocator. The pages are not necessarily contiguous.
 Found pages are marked as "allocated" before returning.
 Returns (physical) memory pointers to each in the array pointed to by the "blocks" argument.
 This must be large enough to accomodate `page_count` pointers.
@@ -298,8 +581,6 @@ out-of-memory condition.
 */
 uint32_t allocate_free_physical_pages(uint32_t page_count, void **blocks)
 {
-  uint32_t current_entry;
-  uint32_t * current_page;
   uint32_t found_pages = 0;
   #ifdef MMGR_VERBOSE
   kputs("DEBUG allocate_free_physical_pages acquiring lock...\r\n");
@@ -307,20 +588,62 @@ uint32_t allocate_free_physical_pages(uint32_t page_count, void **blocks)
   #endif
   acquire_spinlock(&physlock);
 
-  for(register size_t i=0x30;i<physical_page_count;i++) {
-    //kprintf("DEBUG allocate_free_physical_pages checking %d 0x%x\r\n", i, &physical_memory_map[i]);
-    if(physical_memory_map[i].in_use==0) {
-      physical_memory_map[i].in_use=1;
-      blocks[found_pages] = (void *)(i*PAGE_SIZE);
-      found_pages+=1;
-      if(found_pages==page_count) {
-        release_spinlock(&physlock);
-        return page_count;  //we found enough pages
-      }
+  while(found_pages<page_count) {
+    uint32_t page_idx = _phys_alloc_block(0);
+    if(page_idx==PHYS_NO_PAGE) break;
+    blocks[found_pages] = (void *)(page_idx*PAGE_SIZE);
+    found_pages+=1;
+  }
+  release_spinlock(&physlock);
+  return found_pages; //if this is less than page_count then we ran out of memory.
+}
+
+void *allocate_contiguous_physical_pages(size_t page_count, size_t align_pages)
+{
+  uint8_t order = 0;
+  if(page_count==0) return NULL;
+  while((1 << order) < page_count || (1 << order) < align_pages) {
+    ++order;
+    if(order>PHYS_MAX_ORDER) {
+      kprintf("WARNING allocate_contiguous_physical_pages can't provide %d pages aligned to %d\r\n", page_count, align_pages);
+      return NULL;
+    }
+  }
+
+  acquire_spinlock(&physlock);
+  uint32_t page_idx = _phys_alloc_block(order);
+  if(page_idx==PHYS_NO_PAGE) {
+    release_spinlock(&physlock);
+    return NULL;
+  }
+  //give back whatever we don't need from the end of the block
+  if(page_count < (1 << order)) _phys_free_range(page_idx + page_count, (1 << order) - page_count);
+  release_spinlock(&physlock);
+  return (void *)(page_idx*PAGE_SIZE);
+}
+
+void deallocate_contiguous_physical_pages(void *phys_base, size_t page_count)
+{
+  size_t page_idx = (size_t)phys_base / PAGE_SIZE;
+  if(page_idx<PHYS_ALLOC_FIRST_PAGE || page_idx+page_count>physical_page_count) {
+    kprintf("WARNING attempt to free contiguous run 0x%x (%d pages) outside allocatable RAM\r\n", phys_base, page_count);
+    return;
+  }
+  acquire_spinlock(&physlock);
+  for(register size_t i=0;i<page_count;i++) {
+    if(!physical_memory_map[page_idx+i].in_use || !physical_memory_map[page_idx+i].usable) {
+      release_spinlock(&physlock);
+      kprintf("WARNING contiguous run 0x%x (%d pages) is not fully allocated, not freeing\r\n", phys_base, page_count);
+      return;
     }
   }
+  _phys_free_range(page_idx, page_count);
   release_spinlock(&physlock);
-  return found_pages; //we ran out of memory. Return the number of pages that we managed to get.
+}
+
+size_t physical_pages_free()
+{
+  return phys_free_page_count;
 }
 
 void reserve_physical_page(void *phys_addr)
@@ -337,7 +660,7 @@ void reserve_physical_page(void *phys_addr)
     return;
   }
   acquire_spinlock(&physlock);
-  physical_memory_map[page_idx].in_use=1;
+  _phys_reserve_page(page_idx);
   release_spinlock(&physlock);
 }
 
@@ -346,11 +669,12 @@ Marks the provided list of pages as "free".
 First argument is the number of pages in the list to free.
 Second argument is a pointer to a list of blocks to free. This must have the same
 number of entries as page_count.
-Third argument is 1 if we should set the page to zero before freeing.
+Pages that lie outside usable RAM (e.g. memory-mapped hardware) are never returned to the allocator.
 */
 uint32_t deallocate_physical_pages(uint32_t page_count, void **blocks)
 {
   vaddr phys_addr;
+  uint32_t freed = 0;
 
   acquire_spinlock(&physlock);
   for(register size_t i=0;i<page_count;i++) {
@@ -366,9 +690,17 @@ uint32_t deallocate_physical_pages(uint32_t page_count, void **blocks)
       kprintf("WARNING attempt to free page 0x%x which is beyond physical RAM limit of 0x%x pages\r\n", page_idx, physical_page_count);
       continue;
     }
+    if(!physical_memory_map[page_idx].usable || page_idx<PHYS_ALLOC_FIRST_PAGE) continue;
+    if(!physical_memory_map[page_idx].in_use) {
+      kprintf("WARNING attempt to free page 0x%x which is already free\r\n", page_idx);
+      continue;
+    }
     physical_memory_map[page_idx].in_use=0;
+    _phys_free_block(page_idx, 0);
+    ++freed;
   }
   release_spinlock(&physlock);
+  return freed;
 }
 
 /**
@@ -383,6 +715,31 @@ void *k_map_page_bytes(uint32_t *root_page_dir, void *phys_addr, void *target_vi
   return k_map_page(root_page_dir, phys_addr, pagedir_idx, pageent_idx, flags);
 }
 
+/**
+ * internal function to make sure that the given address space has spare range slots, by moving its ranges to a bigger
+ * array if it is running short. This allocates from the heap, so it must not be called with memlock held.
+*/
+static void _va_space_make_room(struct VaSpace *space)
+{
+  if(space==NULL || !va_space_wants_room(space)) return;
+  if(!kernel_heap_ready) return;  //too early in boot, the built-in ranges will have to do
+
+  //allocating the new array can come back through here for the kernel's space, which still has the spare slots to cope
+  space->growing = 1;
+  size_t new_capacity = space->range_capacity * 2;
+  struct VaRange *ranges = (struct VaRange *)malloc(new_capacity * sizeof(struct VaRange));
+  if(ranges==NULL) {
+    kprintf("WARNING could not grow address space tracking 0x%x beyond %l ranges\r\n", space, space->range_capacity);
+    space->growing = 0;
+    return;
+  }
+  acquire_spinlock(&memlock);
+  ranges = va_space_swap_ranges(space, ranges, new_capacity);
+  release_spinlock(&memlock);
+  space->growing = 0;
+  if(ranges) free(ranges);
+}
+
 /**
 map a page of physical memory into the given memory space
 this is a basic low-level function and no checks are performed, careful!
@@ -419,14 +776,18 @@ void * k_map_page(uint32_t *app_paging_dir, void * phys_addr, uint16_t pagedir_i
 
   if(pagedir_idx>1023 || pageent_idx>1023) return NULL; //out of bounds
 
+  if(pagetables==flat_pagetables_ptr) _va_space_make_room(&kernel_va_space);
   acquire_spinlock(&memlock);
 
   vaddr page_ptr = (vaddr)pagetables + ((vaddr)pagedir_idx << 12) + ((vaddr)pageent_idx * sizeof(uint32_t));
   #ifdef MMGR_VERBOSE
   kprintf("DEBUG k_map_page page ptr for %d - %d is 0x%x\r\n", pagedir_idx, pageent_idx, page_ptr);
   #endif
+  vaddr vptr = (vaddr)pagedir_idx << 22 | (vaddr)pageent_idx << 12;
+  flags |= _global_flag_for(pagetables, vptr, flags);
   //If the page_ptr is not valid, then this line triggers a page fault. The fault handler detects that the access was
   //from the kernel in the flat_pagetables area and maps a page of RAM into place for us then jumps back to retry to operation.
+  uint32_t old_value = *(uint32_t *)page_ptr;
   *(uint32_t *)page_ptr = (vaddr)phys_addr | MP_PRESENT | flags;
   mb();
 
@@ -447,7 +808,12 @@ void * k_map_page(uint32_t *app_paging_dir, void * phys_addr, uint16_t pagedir_i
     root_dir[pagedir_idx] |= MP_USER;
   }
 
-  vaddr vptr = (vaddr)pagedir_idx << 22 | (vaddr)pageent_idx << 12;
+  //re-mapping a page that was already present leaves the old translation in the TLB
+  if((old_value & MP_PRESENT) && pagetables==flat_pagetables_ptr) tlb_invalidate_page(vptr);
+
+  //make sure that the range allocator does not hand this address out again. If it has no room then _find_free_vpages
+  //will still see that the page is in use, so nothing is lost.
+  if(pagetables==flat_pagetables_ptr) va_space_reserve(&kernel_va_space, vptr, 1);
 
   //kprintf("DEBUG k_map_page successfully mapped physical pointer 0x%x to vptr 0x%x\r\n", phys_addr, vptr);
   release_spinlock(&memlock);
@@ -476,7 +842,11 @@ uint8_t vm_is_address_present(uint32_t *mapped_pagedirs, void *ptr)
   size_t dir_off = ADDR_TO_PAGEDIR_IDX(ptr);
   size_t pg_off  = ADDR_TO_PAGEDIR_OFFSET(ptr);
 
-  vaddr pageinfo = (vaddr)mapped_pagedirs + ((vaddr)dir_off << 12) + ((vaddr)pg_off * sizeof(uint32_t));
+  //check the directory entry first; if there is no page table then reading it would fault one in, and a 4Mb page has none
+  uint32_t pageinfo = _root_dir_for(mapped_pagedirs)[dir_off];
+  if((pageinfo & MP_PRESENT) && !(pageinfo & MP_PAGESIZE)) {
+    pageinfo = mapped_pagedirs[(dir_off << 10) + pg_off];
+  }
 
   release_spinlock(&memlock);
 
@@ -487,11 +857,110 @@ uint8_t vm_is_address_present(uint32_t *mapped_pagedirs, void *ptr)
   }
 }
 
+/**
+ * internal function to replace the 4Mb page at the given directory index with a page table that maps the same memory as
+ * 4k pages, so that part of it can be unmapped or have its flags changed. Must be called with memlock held.
+ * Returns 0 on success or 1 if no RAM was available for the page table.
+*/
+static uint8_t _split_large_page(uint32_t *pagetables, size_t dir)
+{
+  uint32_t *root_dir = _root_dir_for(pagetables);
+  uint32_t pde = root_dir[dir];
+  void *table_phys;
+
+  #ifdef MMGR_VERBOSE
+  kprintf("DEBUG _split_large_page splitting 4Mb page at 0x%x\r\n", dir << 22);
+  #endif
+  //the table must start out blank, so that nothing stale is mapped between switching the directory entry over and filling it in
+  if(allocate_zeroed_physical_pages(1, &table_phys)!=1) return 1;
+
+  vaddr base = pde & LARGE_PAGE_ADDRESS_MASK;
+  uint32_t pte_flags = pde & ~MP_ADDRESS_MASK & ~(MP_PAGESIZE);
+  uint32_t *table = &pagetables[dir << 10];
+
+  root_dir[dir] = (vaddr)table_phys | MP_PRESENT | MP_READWRITE | (pde & MP_USER);
+  tlb_invalidate_page((vaddr)table);
+  for(register size_t i=0; i<LARGE_PAGE_PAGES; i++) table[i] = (base + i*PAGE_SIZE) | pte_flags;
+  mb();
+  //a single invlpg anywhere in a 4Mb page drops the whole translation
+  tlb_invalidate_page(dir << 22);
+  return 0;
+}
+
+/**
+ * internal function to find the page tables area and the free address space tracking for the given root page directory.
+ * NULL (or the kernel's own directory) means kernel-space; anything else must be an app directory that has been mapped
+ * into kernel-space with map_app_pagingdir, or the one that is currently loaded.
+ * The tracking is given room to grow, so this must not be called with memlock held.
+ * Returns NULL if the directory does not belong to any process.
+*/
+static struct VaSpace *_va_space_for(uint32_t *root_page_dir, uint32_t **pagetables)
+{
+  struct VaSpace *space = NULL;
+
+  if(root_page_dir==NULL || root_page_dir==kernel_paging_directory) {
+    *pagetables = flat_pagetables_ptr;
+    space = &kernel_va_space;
+  } else if((vaddr)root_page_dir==_mmgr_get_pd()) {
+    //an app's directory that is already loaded, e.g. during a native API call. Its own self-mapping is the way in.
+    //That is nearly always the process that this processor is running, so try that before searching the process table.
+    *pagetables = flat_pagetables_ptr;
+    struct ProcessTableEntry *process = get_current_process();
+    if(process==NULL || process->root_paging_directory_phys!=(void *)root_page_dir) process = find_process_by_pagingdir(root_page_dir);
+    if(process) space = process->va_space;
+  } else {
+    *pagetables = root_page_dir;
+    space = mapped_app_va_spaces[ADDR_TO_PAGEDIR_IDX(root_page_dir)];
+  }
+  _va_space_make_room(space);
+  return space;
+}
+
+/**
+ * internal function to take `pages` continuous pages from the given address space. Must be called with memlock held.
+ * The range allocator does not know about anything that was mapped to a fixed address before it was set up, so
+ * check that the pages really are free. Any that are not stay reserved, so this only happens once per page.
+ * Returns the first page number, or 0 if there is no space.
+*/
+static size_t _find_free_vpages(struct VaSpace *space, uint32_t *pagetables, size_t pages)
+{
+  register size_t i;
+  size_t base_vpage;
+
+  while(1) {
+    base_vpage = va_space_alloc(space, pages) >> 12;
+    if(base_vpage==0) return 0;
+    for(i=0;i<pages;i++) {
+      if(pagetables[base_vpage+i] & (MP_PRESENT|MPC_DEMANDZERO)) break;
+    }
+    if(i==pages) return base_vpage;
+    #ifdef MMGR_VERBOSE
+    kprintf("DEBUG _find_free_vpages page 0x%x is already mapped, retrying\r\n", (base_vpage+i) << 12);
+    #endif
+    va_space_free(space, base_vpage << 12, i);
+    va_space_free(space, (base_vpage+i+1) << 12, pages-i-1);
+  }
+}
+
+/**
+ * internal function to set MP_USER on the directory entries covering the given pages. As in k_map_page, user mappings in an app's space
+ * need it on the parent directory entries too. Must be called with memlock held.
+*/
+static void _mark_user_dirs(uint32_t *pagetables, size_t base_vpage, size_t pages)
+{
+  if(pagetables==flat_pagetables_ptr) return;
+  uint32_t *root_dir = _root_dir_for(pagetables);
+  size_t first_dir = base_vpage >> 10;
+  size_t last_dir = (base_vpage + pages - 1) >> 10;
+  for(register size_t d=first_dir; d<=last_dir; d++) root_dir[d] |= MP_USER;
+}
+
 /**
 Maps the given physical address(es) into the next (contigous block of) free page of the given root page directory.
 You should ensure that interrupts are disabled when calling this function.
 Arguments:
-- root_page_dir - pointer to the root page directory to use.  NULL means use the kernel paging directory.
+- root_page_dir - NULL means use the kernel paging directory. Otherwise, this is the pointer to the flat pagetables map area
+                  for an app as returned by map_app_pagingdir; the pages are then found in that app's address space.
 - flags - MP_* flags to apply to the allocated Memory
 - phys_addr - a pointer to an array of physical RAM pointers. These must be 4k aligned, and available.
 - pages - the length of the phys_addr array.
@@ -503,64 +972,53 @@ void * vm_map_next_unallocated_pages(uint32_t *root_page_dir, uint32_t flags, vo
 {
   register size_t i;
   register size_t p = 0;
-  //uint32_t *pagedir_entries = (uint32_t *)PAGEDIR_ENTRIES_LOCATION;
-  size_t continuous_page_count = 0;
-  uint32_t *pagedir_entry_phys, *pagedir_entry_vptr = NULL;
+  uint32_t *pagetables;
   size_t base_vpage;
 
   if(pages==0) return NULL; //don't try and map no Memory
 
-  if(root_page_dir==NULL) root_page_dir = kernel_paging_directory;
+  struct VaSpace *space = _va_space_for(root_page_dir, &pagetables);
+  if(space==NULL) {
+    kprintf("ERROR vm_map_next_unallocated_pages paging directory 0x%x does not belong to any process\r\n", root_page_dir);
+    return NULL;
+  }
 
   acquire_spinlock(&memlock);
   //we need to find `pages` contigous free pages of virtual memory space then map the potentially
   //discontinues phys_addr pointers onto them with the given flags.
-  //then, return the vmem ptr to the first one.
-  //Don't map anything into the first Mb to avoid confusion.
-  for(i=0x100;i<(1024*1024);i++) {
-    //i counts the page where we are
-    if(! (flat_pagetables_ptr[i] & MP_PRESENT) ){ //|| ((*pageptr) & MPC_PAGINGDIR)) {  //if this vpage is in use, then there is either a page mapped to it (MP_PRESENT) or it's labelled MPC_PAGINGDIR (map a physical page in on first access)
-      continuous_page_count++;
-      //kprintf("DEBUG found page %d of %d at %d-%d (0x%x @ 0x%x)\r\n", continuous_page_count, pages, starting_page_dir, starting_page_off, *pageptr, pageptr);
-      if(continuous_page_count>=pages) break;
-    }
-  }
-  base_vpage = i;
-
-  if(continuous_page_count<pages) {
-    kprintf("    ERROR Found %l pages but need %l\r\n", continuous_page_count, pages);
+  base_vpage = _find_free_vpages(space, pagetables, pages);
+  if(base_vpage==0) {
+    kprintf("    ERROR Could not find %l continuous free pages\r\n", pages);
     release_spinlock(&memlock);
     return NULL;
   }
 
   //mark the pages as "in-use" (if we enter through directly mapping memory-mapped hardware we need this here)
+  acquire_spinlock(&physlock);
   for(i=0;i<pages;i++) {
     size_t page_index = ((vaddr)(phys_addr[i]) >> 12);
     //kprintf("DEBUG vm_map_next_unallocated_pages index for 0x%x is 0x%x\r\n", (vaddr)phys_addr[i], page_index);
-    //kprintf("DEBUG physical_memory_map ptr 0x%x\r\n", &physical_memory_map[page_index]);
     if(page_index<physical_page_count) {
-      physical_memory_map[page_index].in_use = 1;
+      _phys_reserve_page(page_index);
     } else {
       kprintf("WARN mapping page beyond physical RAM limit of 0x%x pages\r\n", physical_page_count);
     }
   }
+  release_spinlock(&physlock);
   
   //now map the pages
-  uint32_t *pagedir_ptr =&flat_pagetables_ptr[base_vpage];
+  uint32_t *pagedir_ptr =&pagetables[base_vpage];
   #ifdef MMGR_VERBOSE
   kprintf("DEBUG vm_map_next_unallocated_pages starting allocation from 0x%x\r\n", pagedir_ptr);
   #endif
 
+  flags |= _global_flag_for(pagetables, base_vpage << 12, flags);
   for(p=0;p<pages;p++) {
-    // #ifdef MMGR_VERBOSE
-    // kprintf("DEBUG mapping page 0x%x\r\n", p);
-    // #endif
     pagedir_ptr[p] = ((vaddr)phys_addr[p] & MP_ADDRESS_MASK) | MP_PRESENT | flags;
-    // #ifdef MMGR_VERBOSE
-    // kprintf("DEBUG raw page value for 0x%x is 0x%x\r\n", p, pagedir_ptr[p]);
-    // #endif
   }
 
+  if(flags & MP_USER) _mark_user_dirs(pagetables, base_vpage, pages);
+
   mb();
   //now calculate the virtual pointer
   void *ptr = (void *)(base_vpage << 12);
@@ -570,6 +1028,51 @@ void * vm_map_next_unallocated_pages(uint32_t *root_page_dir, uint32_t flags, vo
   return ptr;
 }
 
+void *vm_map_demand_zero_pages(uint32_t *root_page_dir, void *vmem_ptr, size_t page_count, uint32_t flags)
+{
+  uint32_t *pagetables;
+  size_t base_vpage;
+
+  if(page_count==0) return NULL;
+
+  struct VaSpace *space = _va_space_for(root_page_dir, &pagetables);
+  if(space==NULL) {
+    kprintf("ERROR vm_map_demand_zero_pages paging directory 0x%x does not belong to any process\r\n", root_page_dir);
+    return NULL;
+  }
+  //the entry is not present, so the CPU ignores everything else in it. The fault handler uses these flags for the real page.
+  uint32_t entry = MPC_DEMANDZERO | (flags & (MP_READWRITE|MP_USER|MP_PWT|MP_PCD|MPC_FILEBACKED));
+
+  acquire_spinlock(&memlock);
+  if(vmem_ptr) {
+    base_vpage = (vaddr)vmem_ptr >> 12;
+    if(!va_space_reserve(space, base_vpage << 12, page_count)) {
+      kprintf("    ERROR No room to reserve 0x%x pages at 0x%x\r\n", page_count, vmem_ptr);
+      release_spinlock(&memlock);
+      return NULL;
+    }
+  } else {
+    base_vpage = _find_free_vpages(space, pagetables, page_count);
+    if(base_vpage==0) {
+      kprintf("    ERROR Could not find %l continuous free pages\r\n", page_count);
+      release_spinlock(&memlock);
+      return NULL;
+    }
+  }
+
+  for(register size_t i=0; i<page_count; i++) {
+    if(!(pagetables[base_vpage+i] & MP_PRESENT)) pagetables[base_vpage+i] = entry;
+  }
+  if(flags & MP_USER) _mark_user_dirs(pagetables, base_vpage, page_count);
+  mb();
+  release_spinlock(&memlock);
+
+  #ifdef MMGR_VERBOSE
+  kprintf("DEBUG vm_map_demand_zero_pages set up 0x%x pages at 0x%x\r\n", page_count, base_vpage << 12);
+  #endif
+  return (void *)(base_vpage << 12);
+}
+
 /**
  * Maps the contents of the given paging dir into memory, on a 4mb boundary
 */
@@ -587,6 +1090,9 @@ uint32_t *map_app_pagingdir(vaddr paging_dir_phys, vaddr starting_from) {
   #endif
   uint32_t *result = NULL;
 
+  //look up the owner once here, so that mapping pages into the directory doesn't have to search the process table each time
+  struct ProcessTableEntry *process = find_process_by_pagingdir((void *)paging_dir_phys);
+
   //we are going to map the _entire_ app root paging dir onto a level 1 entry of the kernel's directory
   //that way we have every page exposed as "real" memory
   acquire_spinlock(&memlock);
@@ -602,6 +1108,7 @@ uint32_t *map_app_pagingdir(vaddr paging_dir_phys, vaddr starting_from) {
       #endif
       //now map it in
       kernel_paging_directory[i] = (uint32_t *)(paging_dir_phys | MP_PRESENT | MP_READWRITE);
+      mapped_app_va_spaces[i] = process ? process->va_space : NULL;
       result = (uint32_t *)(i << 22);
       break;
     }
@@ -627,11 +1134,14 @@ void unmap_app_pagingdir(uint32_t *mapped_pd) {
   kprintf("DEBUG unmap_app_pagingdir pd location 0x%x is page 0x%x\r\n", mapped_pd, page_num);
   #endif
   kernel_paging_directory[page_num] = NULL;
-  
-  for(register size_t i=0; i<0x400; i++) {
-    vaddr target = (vaddr)mapped_pd | i<<12;
-    __invalidate_vptr(target);
-  }
+  mapped_app_va_spaces[page_num] = NULL;
+  mb();
+
+  //the app's directory entries are never global, so reloading CR3 is enough to get rid of the whole 4Mb worth
+  struct TlbBatch batch;
+  tlb_batch_init(&batch);
+  tlb_batch_add(&batch, (vaddr)mapped_pd, 0x400, 0);
+  tlb_batch_flush(&batch);
 
   release_spinlock(&memlock);
 }
@@ -651,10 +1161,22 @@ void free_app_memory(uint32_t *mapped_pd, void *root_pd_phys) {
   uint32_t *paging_dir_root = (uint32_t *)((vaddr)mapped_pd + PAGEDIR_ROOT_OFFSET); //the root directory is mapped at the end of the 
 
   for(size_t i=0; i<1024;i++) {
+    if( (paging_dir_root[i] & MP_PRESENT) && (paging_dir_root[i] & MP_PAGESIZE) && ! (paging_dir_root[i] & MP_GLOBAL) && (paging_dir_root[i] & MP_USER)) {
+      //a 4Mb page, there is no table to walk
+      deallocate_contiguous_physical_pages((void *)(paging_dir_root[i] & LARGE_PAGE_ADDRESS_MASK), LARGE_PAGE_PAGES);
+      paging_dir_root[i] = 0;
+      unmap_counter += LARGE_PAGE_PAGES;
+      continue;
+    }
     if( (paging_dir_root[i] & MP_PRESENT) && ! (paging_dir_root[i] & MP_GLOBAL) && (paging_dir_root[i] & MP_USER)) {
       //first, unmap every page that is in the directory
       uint32_t *paging_dir_ent = (uint32_t *)((vaddr)mapped_pd + i*PAGE_SIZE);
       for(size_t j=0; j<1024; j++) {
+        if((paging_dir_ent[j] & MP_PRESENT) && (paging_dir_ent[j] & MPC_SHARED)) {
+          //belongs to a SharedImage, which frees it once no process is using it
+          paging_dir_ent[j] = 0;
+          continue;
+        }
         if(paging_dir_ent[j] & MP_PRESENT && ! (paging_dir_ent[j] & MP_GLOBAL) && (paging_dir_ent[j] & MP_USER)) {
           ++unmap_counter;
           #ifdef MMGR_VERBOSE
@@ -708,7 +1230,7 @@ uint8_t _resolve_vptr(void *vmem_ptr, uint16_t *dir, uint16_t *off)
 }
 
 /**
-unmaps the given pages, and marks them as free.
+unmaps the given pages and returns the physical RAM behind them to the physical allocator.
 FIXME: should also wipe the contents for security.
 Arguments:
 - root_page_dir - paging directory to use. Pass NULL to use the kernel's one.
@@ -718,19 +1240,60 @@ begin on a page boundary.
 */
 void vm_deallocate_physical_pages(uint32_t *root_page_dir, void *vmem_ptr, size_t page_count)
 {
-  int16_t dir,off;
   vaddr phys_ptr;
-  size_t phys_page_idx;
+  uint32_t *pagetables;
 
-  if(root_page_dir==NULL) root_page_dir = (uint32_t *)kernel_paging_directory;
+  struct VaSpace *space = _va_space_for(root_page_dir, &pagetables);
 
   vaddr pageptr_offset = (vaddr)vmem_ptr >> 12;
 
-  for(uint32_t p=pageptr_offset; p<pageptr_offset+page_count; p++) {
-    flat_pagetables_ptr[p] = 0;
-    __invalidate_vptr((vaddr)vmem_ptr + (p-pageptr_offset)*PAGE_SIZE);
+  uint32_t *root_dir = _root_dir_for(pagetables);
+  uint32_t p;
+  struct TlbBatch batch;
+  tlb_batch_init(&batch);
+
+  acquire_spinlock(&memlock);
+  //First pass: take the pages out of the page tables, leaving just the physical address in each entry so that we know what to free.
+  //The physical pages can't be given back until the TLB has been flushed, otherwise a stale translation could still reach them.
+  for(p=pageptr_offset; p<pageptr_offset+page_count; p++) {
+    uint32_t pde = root_dir[p >> 10];
+    if((pde & MP_PRESENT) && (pde & MP_PAGESIZE)) {
+      if((p & (LARGE_PAGE_PAGES-1))==0 && p+LARGE_PAGE_PAGES <= pageptr_offset+page_count) {
+        //the whole 4Mb page is going, so drop the directory entry and give back the block in one go
+        root_dir[p >> 10] = MPC_PAGINGDIR | MP_READWRITE;
+        mb();
+        if(space==&kernel_va_space) _propagate_kernel_pde(p >> 10);
+        tlb_invalidate_page((vaddr)&pagetables[p]);
+        tlb_invalidate_page((vaddr)p << 12);
+        deallocate_contiguous_physical_pages((void *)(pde & LARGE_PAGE_ADDRESS_MASK), LARGE_PAGE_PAGES);
+        p += LARGE_PAGE_PAGES - 1;
+        continue;
+      }
+      if(_split_large_page(pagetables, p >> 10)!=0) k_panic("Unable to split 4Mb page to unmap part of it\r\n");
+    }
+    phys_ptr = pagetables[p];
+    //only give back RAM that was actually mapped here. Page 0 is never handed out, so 0 can mean "nothing to free".
+    pagetables[p] = (phys_ptr & MP_PRESENT) ? (phys_ptr & MP_ADDRESS_MASK) : 0;
+    if(phys_ptr & MP_PRESENT) tlb_batch_add(&batch, (vaddr)p << 12, 1, (phys_ptr & MP_GLOBAL) ? 1 : 0);
+  }
+  mb();
+  tlb_batch_flush(&batch);
+
+  //Second pass: now nothing can reach them, free the pages
+  for(p=pageptr_offset; p<pageptr_offset+page_count; p++) {
+    if(!(root_dir[p >> 10] & MP_PRESENT)) {
+      p |= (LARGE_PAGE_PAGES-1);  //no page table (or a 4Mb page we already dealt with), skip to the next directory entry
+      continue;
+    }
+    phys_ptr = pagetables[p];
+    if(phys_ptr) {
+      pagetables[p] = 0;
+      deallocate_physical_pages(1, (void **)&phys_ptr);
+    }
   }
   mb();
+  if(space) va_space_free(space, (vaddr)vmem_ptr, page_count);
+  release_spinlock(&memlock);
 }
 
 void k_unmap_page_ptr(uint32_t *root_page_dir, void *vptr)
@@ -754,27 +1317,117 @@ void k_unmap_page(uint32_t *root_page_dir, uint16_t pagedir_idx, uint16_t pageen
 
   if(root_page_dir==NULL) root_page_dir = kernel_paging_directory;
 
+  _va_space_make_room(&kernel_va_space);
+  acquire_spinlock(&memlock);
+  if((kernel_paging_directory[pagedir_idx] & MP_PRESENT) && (kernel_paging_directory[pagedir_idx] & MP_PAGESIZE)) {
+    if(_split_large_page(flat_pagetables_ptr, pagedir_idx)!=0) k_panic("Unable to split 4Mb page to unmap part of it\r\n");
+  }
   mb();
   uint32_t* page_ptr = (uint32_t *)((vaddr)flat_pagetables_ptr + ((vaddr)pagedir_idx << 12));
   #ifdef MMGR_VERBOSE
   kprintf("DEBUG k_unmap_page page for %d - %d is at 0x%x\r\n", pagedir_idx, pageent_idx, &page_ptr[pageent_idx]);
   #endif
   page_ptr[pageent_idx] = 0;
-  __invalidate_vptr((vaddr)pagedir_idx << 22 | (vaddr)pageent_idx << 12);
+  tlb_invalidate_page((vaddr)pagedir_idx << 22 | (vaddr)pageent_idx << 12);
   mb();
+  va_space_free(&kernel_va_space, (vaddr)pagedir_idx << 22 | (vaddr)pageent_idx << 12, 1);
+  release_spinlock(&memlock);
+}
+
+void *vm_alloc_large_pages(uint32_t *root_page_dir, size_t large_page_count, uint32_t flags)
+{
+  uint32_t *pagetables;
+  register size_t i, j;
+
+  if(!pse_enabled || large_page_count==0) return NULL;
+  struct VaSpace *space = _va_space_for(root_page_dir, &pagetables);
+  if(space==NULL) return NULL;
+  uint32_t *root_dir = _root_dir_for(pagetables);
+
+  uint8_t zero = (flags & MPC_ZEROED) ? 1 : 0;
+  flags &= ~MPC_ZEROED;
+
+  acquire_spinlock(&memlock);
+  vaddr base = va_space_alloc_aligned(space, large_page_count*LARGE_PAGE_PAGES, LARGE_PAGE_PAGES);
+  if(base==0) {
+    release_spinlock(&memlock);
+    return NULL;
+  }
+  flags |= _global_flag_for(pagetables, base, flags);
+  size_t first_dir = base >> 22;
+  //the range allocator says nothing is mapped here, but there could be mappings from before it was set up,
+  //or an empty page table left behind by earlier 4k mappings. Only the latter is OK.
+  for(i=first_dir; i<first_dir+large_page_count; i++) {
+    if(!(root_dir[i] & MP_PRESENT)) continue;
+    uint8_t in_use = (root_dir[i] & MP_PAGESIZE) ? 1 : 0;
+    for(j=0; j<LARGE_PAGE_PAGES && !in_use; j++) {
+      if(pagetables[(i << 10) + j] & MP_PRESENT) in_use = 1;
+    }
+    if(in_use) {
+      kprintf("WARNING vm_alloc_large_pages found existing mappings at 0x%x, falling back\r\n", i << 22);
+      va_space_free(space, base, large_page_count*LARGE_PAGE_PAGES);
+      release_spinlock(&memlock);
+      return NULL;
+    }
+  }
+  release_spinlock(&memlock);
+
+  for(i=0; i<large_page_count; i++) {
+    void *phys = allocate_contiguous_physical_pages(LARGE_PAGE_PAGES, LARGE_PAGE_PAGES);
+    if(phys==NULL) {
+      kprintf("WARNING vm_alloc_large_pages could only get %l of %l 4Mb pages\r\n", i, large_page_count);
+      if(i>0) vm_deallocate_physical_pages(root_page_dir, (void *)base, i*LARGE_PAGE_PAGES);
+      acquire_spinlock(&memlock);
+      va_space_free(space, base + i*LARGE_PAGE_SIZE, (large_page_count - i)*LARGE_PAGE_PAGES);
+      release_spinlock(&memlock);
+      return NULL;
+    }
+    if(zero) {
+      for(j=0; j<LARGE_PAGE_PAGES; j++) zero_physical_page((void *)((vaddr)phys + j*PAGE_SIZE));
+    }
+
+    acquire_spinlock(&memlock);
+    size_t dir = first_dir + i;
+    vaddr old_table = (root_dir[dir] & MP_PRESENT) ? (root_dir[dir] & MP_ADDRESS_MASK) : 0;
+    root_dir[dir] = (vaddr)phys | MP_PRESENT | MP_PAGESIZE | flags;
+    mb();
+    if(space==&kernel_va_space) _propagate_kernel_pde(dir);
+    //the flat pagetables view of this directory entry now points at the new page rather than a page table
+    tlb_invalidate_page((vaddr)&pagetables[dir << 10]);
+    tlb_invalidate_page(dir << 22);
+    release_spinlock(&memlock);
+    if(old_table) deallocate_physical_pages(1, (void **)&old_table);
+  }
+  #ifdef MMGR_VERBOSE
+  kprintf("DEBUG vm_alloc_large_pages mapped %l 4Mb pages at 0x%x\r\n", large_page_count, base);
+  #endif
+  return (void *)base;
 }
 
 /**
 allocates the given number of pages and maps them into the memory space of the given page directory.
+If the CPU supports it and the request is a whole number of 4Mb pages, then 4Mb pages are used.
 */
 void *vm_alloc_pages(uint32_t *root_page_dir, size_t page_count, uint32_t flags)
 {
+  //demand-zero pages are always blank, and MPC_ZEROED would be taken for MPC_FILEBACKED
+  if(flags & MPC_DEMANDZERO) return vm_map_demand_zero_pages(root_page_dir, NULL, page_count, flags & ~(MPC_DEMANDZERO|MPC_ZEROED));
+  if(pse_enabled && page_count>=LARGE_PAGE_PAGES && (page_count % LARGE_PAGE_PAGES)==0) {
+    void *large_ptr = vm_alloc_large_pages(root_page_dir, page_count / LARGE_PAGE_PAGES, flags);
+    if(large_ptr) return large_ptr;
+  }
   if(page_count>512) return NULL; //for the time being only allow block allocation up to 512 pages.
 
   if(root_page_dir==NULL) root_page_dir = kernel_paging_directory;
   void *phys_ptrs[512];
 
-  uint32_t allocd = allocate_free_physical_pages(page_count, (void **)&phys_ptrs);
+  uint32_t allocd;
+  if(flags & MPC_ZEROED) {
+    allocd = allocate_zeroed_physical_pages(page_count, (void **)&phys_ptrs);
+    flags &= ~MPC_ZEROED; //this is a request flag, not something that belongs in the page table
+  } else {
+    allocd = allocate_free_physical_pages(page_count, (void **)&phys_ptrs);
+  }
   #ifdef MMGR_VERBOSE
   kprintf("  DEBUG allocated %d free physical pages\r\n", allocd);
   #endif
@@ -822,21 +1475,32 @@ void *vm_alloc_specific_page(uint32_t root_page_dir, void *dest_vaddr, uint32_t
 
 void vm_update_page_flags(uint32_t *root_page_dir, void *vmem_ptr, uint32_t new_flags)
 {
-  int16_t dir,off;
-  vaddr phys_ptr;
-  size_t phys_page_idx;
+  uint16_t dir,off;
+  uint32_t *pagetables = flat_pagetables_ptr;
 
-  if(root_page_dir==NULL) root_page_dir = (uint32_t *)kernel_paging_directory;
+  //as elsewhere, an app directory is passed as its mapped flat pagetables area
+  if(root_page_dir!=NULL && root_page_dir!=kernel_paging_directory) pagetables = root_page_dir;
 
   _resolve_vptr(vmem_ptr, &dir, &off);
 
-  vaddr pageptr = (vaddr)root_page_dir + ((vaddr)dir << 12) + ((vaddr)off * sizeof(uint32_t));
+  uint32_t *root_dir = _root_dir_for(pagetables);
+  if((root_dir[dir] & MP_PRESENT) && (root_dir[dir] & MP_PAGESIZE)) {
+    acquire_spinlock(&memlock);
+    uint8_t failed = _split_large_page(pagetables, dir);
+    release_spinlock(&memlock);
+    if(failed) {
+      kprintf("ERROR vm_update_page_flags could not split the 4Mb page containing 0x%x\r\n", vmem_ptr);
+      return;
+    }
+  }
+
+  vaddr pageptr = (vaddr)pagetables + ((vaddr)dir << 12) + ((vaddr)off * sizeof(uint32_t));
   uint32_t entry = *(uint32_t *)pageptr;
   if(entry & MP_PRESENT) {
-    entry = (entry & MP_ADDRESS_MASK) | MP_PRESENT | new_flags;
+    entry = (entry & MP_ADDRESS_MASK) | MP_PRESENT | new_flags | _global_flag_for(pagetables, (vaddr)vmem_ptr, new_flags);
     *(uint32_t *)pageptr = entry;
     mb();
-    __invalidate_vptr((vaddr)vmem_ptr);
+    tlb_invalidate_page((vaddr)vmem_ptr);
   }
 }
 /**
@@ -902,13 +1566,15 @@ internal function called from apply_memory_map_protections to protect a given
 memory block
 */
 void _reserve_memory_block(size_t base_addr, uint32_t page_count) {
-  size_t base_phys_page = ADDR_TO_PAGEDIR_IDX(base_addr);
+  size_t base_phys_page = base_addr >> 12;
 
   kprintf("     Protecting %d pages from %x, memory map starts at 0x%x\r\n", page_count, base_phys_page, physical_memory_map);
 
-  for(register size_t i=0;i<page_count;i++) {
-    physical_memory_map[i+base_phys_page].in_use=1;
+  acquire_spinlock(&physlock);
+  for(register size_t i=0;i<page_count && i+base_phys_page<physical_page_count;i++) {
+    _phys_reserve_page(i+base_phys_page);
   }
+  release_spinlock(&physlock);
 }
 
 /**
@@ -921,6 +1587,7 @@ void apply_memory_map_protections(struct MemoryMapEntry memmap[], uint32_t entry
   for(register int i=0;i<entry_count;i++){
     struct MemoryMapEntry *e = (struct MemoryMapEntry *)&memmap[i];
     uint32_t page_count = e->length / 4096;
+    if(e->base_addr>=0x100000000ULL) continue;  //we can't address anything above 4Gb anyway
 
     switch(e->type) {
       case MMAP_TYPE_RESERVED:
@@ -976,7 +1643,7 @@ void allocate_physical_map(struct MemoryMapEntry memmap[], uint32_t entry_count,
 
 /*
 * This function sets up a paging directory and memory map for a new process
-* @param phys_ptr_list  - pointer to an array of at least 6 allocated physical memory page pointers
+* @param phys_ptr_list  - pointer to an array of at least 6 allocated physical memory page pointers. These must already be zeroed.
 * @param phys_ptr_count - size of the list in phys_ptr_list, for checks.
 * @return pointer to the app root paging directory, in kernel vmem.
 *
@@ -1012,17 +1679,17 @@ uint32_t *initialise_app_pagingdir(void **phys_ptr_list, size_t phys_ptr_count)
   uint32_t *stack_paging_table_virt = (uint32_t *) (temp_ptr + (2*PAGE_SIZE));  
   uint32_t *stack_initial_page_virt = (uint32_t *) (temp_ptr + (3*PAGE_SIZE)); 
 
-  memset_dw(root_dir_virt, 0, PAGE_SIZE_DWORDS);
   //POTENTIAL BUG - by copying the kernel paging directory here, the page table entries get freed when the process exits
   //and then the kernel crashes when it tries to access them.  This is now prevented by ensuring that the kernel page tables are
   //marked as MP_GLOBAL so the freeing process will skip them.
   memcpy_dw(root_dir_virt, kernel_paging_directory, PAGE_SIZE_DWORDS);
 
   //That's the system area taken care of. Now we need the app stack.  This will get extended by a fault handler.
-  memset_dw(stack_paging_table_virt, 0, PAGE_SIZE_DWORDS);
-  memset_dw(stack_initial_page_virt, 0, PAGE_SIZE_DWORDS);
+  //The stack pages were zeroed when they were allocated.
   stack_paging_table_virt[0x3FF] = (vaddr)stack_initial_page | MP_PRESENT | MP_READWRITE | MP_USER;
   root_dir_virt[0x3FF] = (vaddr)stack_paging_table | MP_PRESENT | MP_READWRITE | MP_USER;
+  //the time page shares the stack's page table, a long way below where the stack can grow to
+  stack_paging_table_virt[ADDR_TO_PAGEDIR_OFFSET(TIME_PAGE_ADDRESS)] = time_page_entry();
 
   //Finally we need the (sparsely-mapped) paging directory area. This will enable JIT allocation of memory pages
   root_dir_virt[0x3C0] = (vaddr) root_dir_phys | MP_PRESENT | MP_READWRITE;
@@ -1033,10 +1700,9 @@ uint32_t *initialise_app_pagingdir(void **phys_ptr_list, size_t phys_ptr_count)
 
 
   mb();
-  __invalidate_vptr(stack_initial_page_virt);
-  __invalidate_vptr(stack_paging_table_virt);
-  //__invalidate_vptr(page_one_virt);
-  __invalidate_vptr(root_dir_virt);
+  tlb_invalidate_page((vaddr)stack_initial_page_virt);
+  tlb_invalidate_page((vaddr)stack_paging_table_virt);
+  tlb_invalidate_page((vaddr)root_dir_virt);
   __asm__ volatile ("wbinvd" : : : ); //write back everything in the CPU cache and invalidate
 
   return root_dir_virt;
@@ -1044,10 +1710,19 @@ uint32_t *initialise_app_pagingdir(void **phys_ptr_list, size_t phys_ptr_count)
 
 vaddr _mmgr_get_pd();
 
+/**
+ * internal function to get the root directory of whichever address space is currently loaded, through its own self-mapping.
+ * In kernel context this is the same as kernel_paging_directory; when a fault happens while an app's directory is loaded it is the app's.
+*/
+static inline uint32_t *_current_root_dir()
+{
+  return (uint32_t *)((vaddr)flat_pagetables_ptr + PAGEDIR_ROOT_OFFSET);
+}
+
 uint32_t page_value_for_vaddr(vaddr pf_load_addr) {
   size_t pf_load_dir = ADDR_TO_PAGEDIR_IDX(pf_load_addr);
   size_t pf_load_pg  = ADDR_TO_PAGEDIR_OFFSET(pf_load_addr);
-  uint32_t pd_value = kernel_paging_directory[pf_load_dir];
+  uint32_t pd_value = _current_root_dir()[pf_load_dir];
   #ifdef MMGR_VERBOSE
   kprintf("DEBUG page_value_for_vaddr looking up 0x%x-0x%x for 0x%x\r\n", pf_load_dir, pf_load_pg, pf_load_addr);
   #endif
@@ -1057,26 +1732,124 @@ uint32_t page_value_for_vaddr(vaddr pf_load_addr) {
   if(!(pd_value & MP_PRESENT)) {
     return pd_value;
   }
+  //a 4Mb page has no page table, the directory entry is the mapping
+  if(pd_value & MP_PAGESIZE) {
+    return pd_value;
+  }
 
   vaddr ptr = (vaddr)flat_pagetables_ptr + ((vaddr)pf_load_dir << 12) + ((vaddr)pf_load_pg * sizeof(uint32_t));
   return *(uint32_t *)ptr;
 }
 
+uint8_t vm_user_range_writable(vaddr start, size_t length)
+{
+  if(length==0) return 1;
+  vaddr last = start + length - 1;
+  if(start < APP_VA_START || last < start) return 0;
+
+  for(vaddr page = start & MP_ADDRESS_MASK; ; page += PAGE_SIZE) {
+    //the time page is mapped into every app read-only, the kernel must never write through it on an app's behalf
+    if(page == (TIME_PAGE_ADDRESS & MP_ADDRESS_MASK)) return 0;
+
+    uint32_t page_flags = page_value_for_vaddr(page) & (~MP_ADDRESS_MASK);
+    if(page_flags & MP_PRESENT) {
+      if((page_flags & (MP_USER|MP_READWRITE)) != (MP_USER|MP_READWRITE)) return 0;
+    } else if(page_flags & MPC_DEMANDZERO) {
+      //a file-backed page would have to block for its read, which can't happen from a kernel-mode write
+      if(page_flags & MPC_FILEBACKED) return 0;
+      if((page_flags & (MP_USER|MP_READWRITE)) != (MP_USER|MP_READWRITE)) return 0;
+    } else if(page < APP_STACK_LIMIT || (page_flags & MPC_PAGINGDIR)) {
+      return 0;   //not mapped, and not stack that _handle_stack_fault would grow
+    }
+
+    if(last - page < PAGE_SIZE) break;  //checked the page holding the final byte; also stops before page wraps past 0xFFFFFFFF
+  }
+  return 1;
+}
+
+
+/**
+ * internal function to map a zeroed page over a demand-zero entry in the current address space, when it is first touched.
+ * Like the rest of the fault handling this doesn't take memlock, as the fault could have come from code that is already holding it.
+ * Returns 0 if the page was mapped or 1 if there was no RAM for it.
+*/
+static uint8_t _handle_demand_zero_fault(vaddr pf_load_addr, uint32_t page_flags)
+{
+  void *phys_ptr;
+  if(allocate_zeroed_physical_pages(1, &phys_ptr)!=1) {
+    kprintf("ERROR Could not allocate RAM for demand-zero page at 0x%x\r\n", pf_load_addr);
+    return 1;
+  }
+  flat_pagetables_ptr[pf_load_addr >> 12] = ((vaddr)phys_ptr & MP_ADDRESS_MASK) | MP_PRESENT | (page_flags & (MP_READWRITE|MP_USER|MP_PWT|MP_PCD));
+  mb();
+  return 0;
+}
+
+uint8_t vm_fill_faulted_page(vaddr page, void *data, size_t offset, size_t length, uint32_t flags)
+{
+  void *phys_ptr;
+  if(allocate_zeroed_physical_pages(1, &phys_ptr)!=1) {
+    kprintf("ERROR Could not allocate RAM for page at 0x%x\r\n", page);
+    return 1;
+  }
+  //the data goes in while the page is still supervisor-only, then it is handed over with its real flags
+  flat_pagetables_ptr[page >> 12] = ((vaddr)phys_ptr & MP_ADDRESS_MASK) | MP_PRESENT | MP_READWRITE;
+  mb();
+  if(length>0) memcpy((void *)(page + offset), data, length);
+  flat_pagetables_ptr[page >> 12] = ((vaddr)phys_ptr & MP_ADDRESS_MASK) | MP_PRESENT | (flags & (MP_READWRITE|MP_USER|MP_PWT|MP_PCD));
+  mb();
+  tlb_invalidate_page(page);
+  return 0;
+}
+
+/**
+ * internal function to extend the current app's stack downwards when it touches a page just below it.
+ * Returns 0 if the page was mapped or 1 if this is not a stack access that we can satisfy.
+*/
+static uint8_t _handle_stack_fault(vaddr pf_load_addr)
+{
+  void *phys_ptr;
+  size_t pf_load_dir = ADDR_TO_PAGEDIR_IDX(pf_load_addr);
+
+  //the stack's page table is set up by initialise_app_pagingdir, so if it is missing then this is not an app
+  if(!(_current_root_dir()[pf_load_dir] & MP_USER)) return 1;
+
+  struct ProcessTableEntry *process = get_current_process();
+  if(!process || (vaddr)process->root_paging_directory_phys != _mmgr_get_pd()) return 1;
+
+  if(allocate_zeroed_physical_pages(1, &phys_ptr)!=1) {
+    kprintf("ERROR Could not allocate RAM to extend stack of process %d to 0x%x\r\n", process->pid, pf_load_addr);
+    return 1;
+  }
+  flat_pagetables_ptr[pf_load_addr >> 12] = ((vaddr)phys_ptr & MP_ADDRESS_MASK) | MP_PRESENT | MP_READWRITE | MP_USER;
+  mb();
+  ++process->stack_page_count;
+  #ifdef MMGR_VERBOSE
+  kprintf("DEBUG _handle_stack_fault process %d stack now %l pages\r\n", process->pid, process->stack_page_count);
+  #endif
+  return 0;
+}
 
 /**
  * This is called from the pagefault handler and it will allocate extra paging directories as required, provided that the fault occurred from
  * kernel code when accessing the page mapped area.
+ * It also maps in pages that were set up by vm_map_demand_zero_pages, and extends app stacks down to APP_STACK_LIMIT.
  * 
- * Returns 0 if the exception was handled and 1 otherwise.
+ * Returns 0 if the exception was handled and 1 otherwise. For a file-backed page it can also return PAGEFAULT_BLOCKED, see file_mapping_fault.
 */
 uint8_t handle_allocation_fault(uint32_t pf_load_addr, uint32_t error_code, uint32_t faulting_addr, uint32_t faulting_codeseg, uint32_t eflags)
 {
-    kprintf("INFO handle_allocation_fault access 0x%x from 0x%x:0x%x err 0x%x, recursion depth %l\r\n",
-      pf_load_addr, faulting_codeseg, faulting_addr, error_code, pagefault_depth_ctr);
+  //demand-zero and stack faults are routine, so only log when asked to
+  #ifdef MMGR_VERBOSE
+  kprintf("INFO handle_allocation_fault access 0x%x from 0x%x:0x%x err 0x%x, recursion depth %l\r\n",
+    pf_load_addr, faulting_codeseg, faulting_addr, error_code, pagefault_depth_ctr);
+  #endif
 
   void *phys_ptr;
   if(error_code&PAGEFAULT_ERR_PRESENT) {  //if this is set, then the page _was_ present => protection violation => not an allocation fault => can't handle it here.
+    #ifdef MMGR_VERBOSE
     kputs("DEBUG error was a protection violation, not handling\r\n");
+    #endif
     return 1;
   }
 
@@ -1088,7 +1861,13 @@ uint8_t handle_allocation_fault(uint32_t pf_load_addr, uint32_t error_code, uint
   //did the fault happen on a sparse page? To find out, we need to obtain the page directory for the given pf_load_addr
   uint32_t page_flags = page_value_for_vaddr(pf_load_addr) & (~MP_ADDRESS_MASK);
 
+  #ifdef MMGR_VERBOSE
   kprintf("DEBUG handle_allocation_fault Address 0x%x has page flags 0x%x\r\n", pf_load_addr, page_flags);
+  #endif
+
+  if((page_flags & MPC_DEMANDZERO) && (page_flags & MPC_FILEBACKED)) return file_mapping_fault(pf_load_addr, error_code);
+  if(page_flags & MPC_DEMANDZERO) return _handle_demand_zero_fault(pf_load_addr, page_flags);
+  if(pf_load_addr >= APP_STACK_LIMIT && !(page_flags & MPC_PAGINGDIR)) return _handle_stack_fault(pf_load_addr);
 
   if(page_flags&MPC_PAGINGDIR) { //the fault occurred on a sparse page
     if(faulting_codeseg!=0x08 || error_code&PAGEFAULT_ERR_USER) {
@@ -1097,9 +1876,11 @@ uint8_t handle_allocation_fault(uint32_t pf_load_addr, uint32_t error_code, uint
     }
 
     ++pagefault_depth_ctr;
+    #ifdef MMGR_VERBOSE
     kputs("DEBUG handle_allocation_fault detected on sparse page\r\n");
-    uint32_t *current_pd = (uint32_t *)_mmgr_get_pd();
-    kprintf("DEBUG current PD is 0x%x\r\n", current_pd);
+    kprintf("DEBUG current PD is 0x%x\r\n", _mmgr_get_pd());
+    #endif
+    uint32_t *current_pd = _current_root_dir();
 
     size_t pf_load_dir = ADDR_TO_PAGEDIR_IDX(pf_load_addr);
     size_t pf_load_pg  = ADDR_TO_PAGEDIR_OFFSET(pf_load_addr);
@@ -1107,7 +1888,7 @@ uint8_t handle_allocation_fault(uint32_t pf_load_addr, uint32_t error_code, uint
 
     // Ensure a backing page-table exists for this directory before touching flat page-table view.
     if(!(current_pd[pf_load_dir] & MP_PRESENT)) {
-      uint32_t allocd_pt = allocate_free_physical_pages(1, &phys_ptr);
+      uint32_t allocd_pt = allocate_zeroed_physical_pages(1, &phys_ptr);
       if(allocd_pt!=1) {
         kputs("ERROR Could not allocate physical page table\r\n");
         --pagefault_depth_ctr;
@@ -1116,16 +1897,13 @@ uint8_t handle_allocation_fault(uint32_t pf_load_addr, uint32_t error_code, uint
 
       uint32_t pd_flags = MP_PRESENT | MP_READWRITE | MP_PCD | MPC_PAGINGDIR;
       if(page_flags & MP_USER) pd_flags |= MP_USER;
-      if(page_flags & MP_GLOBAL) pd_flags |= MP_GLOBAL;
+      //MP_GLOBAL is deliberately not copied onto the directory entry, see tlb_global_flag
+      //the page came from the zeroed pool, so the new page-table has no stale mappings.
       current_pd[pf_load_dir] = ((vaddr)phys_ptr & MP_ADDRESS_MASK) | pd_flags;
       mb();
-
-      // New page-table must be cleared to avoid stale mappings.
-      memset_dw(pagetables_entry, 0, PAGE_SIZE_DWORDS);
-      mb();
     }
 
-    uint32_t allocd_page = allocate_free_physical_pages(1, &phys_ptr);
+    uint32_t allocd_page = allocate_zeroed_physical_pages(1, &phys_ptr);
     if(allocd_page!=1) {
       kputs("ERROR Could not allocate more physical RAM\r\n");
       --pagefault_depth_ctr;
@@ -1138,13 +1916,11 @@ uint8_t handle_allocation_fault(uint32_t pf_load_addr, uint32_t error_code, uint
     pagetables_entry[pf_load_pg] = ((vaddr)phys_ptr & MP_ADDRESS_MASK) | pte_flags;
     mb();
 
-    vaddr pageaddr_nowmapped = pf_load_addr & 0xFFFFF000; //base of the page we just mapped
-    memset_dw((void *)pageaddr_nowmapped, 0, PAGE_SIZE_DWORDS);
-    mb();
-
     //the faulting operation can now be retried by returning 0
     --pagefault_depth_ctr;
+    #ifdef MMGR_VERBOSE
     kputs("INFO handle_allocation_fault completed\r\n");
+    #endif
     return 0;
   } else {  //not relevant to us.
     return 1;
@@ -1167,7 +1943,7 @@ vaddr _mmgr_get_pd()
 */
 void _mmgr_set_pd(vaddr pd)
 {
-  asm("mov %0, %%cr3" : : "r"(pd) : );
+  tlb_switch_pd(pd);
 }
 
 /**
@@ -1180,6 +1956,7 @@ void validate_kernel_memory_allocations(uint8_t should_panic)
   acquire_spinlock(&memlock);
   for(register size_t i=0; i<1024; i++) {
     vaddr dir = kernel_paging_directory[i];
+    if((dir & MP_PRESENT) && (dir & MP_PAGESIZE)) continue;  //4Mb pages are allocated and freed as a block, and have no table to check
     if(dir & MP_PRESENT) { //if we were to hit the page content directly, it could trigger a page-fault which would result in allocation. We don't want that.
       for(register size_t j=0; j<1024; j++) {
         size_t index = (i<<10) + j; //<<10 because the index is in dwords not bytes
@@ -5,12 +5,18 @@
 #include <spinlock.h>
 #include <memops.h>
 #include <sys/ioports.h>
+#include <sys/vaspace.h>
+#include <sys/shared_image.h>
+#include <sys/smp.h>
+#include <sys/filemap.h>
+#include <fs/fat_fileops.h>
+#include <scheduler/runqueue.h>
+#include <scheduler/fpu.h>
 #include "heap.h"
 #include "process.h"
 
 //store a static pointer to the kernel process table
 static struct ProcessTableEntry* process_table;
-static uint16_t current_running_processid;
 static uint16_t last_assigned_processid;
 static spinlock_t process_table_lock = 0;
 
@@ -42,7 +48,7 @@ void initialise_process_table(uint32_t* kernel_paging_directory)
   }
 
   //process 0 is kernel
-  current_running_processid = 0;
+  this_cpu()->current_pid = 0;
   //kernel paging directory is identity-mapped
   process_table->root_paging_directory_phys = kernel_paging_directory;
   process_table->root_paging_directory_kmem = kernel_paging_directory;
@@ -77,9 +83,36 @@ struct ProcessTableEntry* get_process(uint16_t pid)
   return e;
 }
 
+struct ProcessTableEntry* find_process_by_pagingdir(void *root_paging_directory_phys)
+{
+  struct ProcessTableEntry *result = NULL;
+
+  acquire_spinlock(&process_table_lock);
+  for(uint16_t i=1; i<PID_MAX; i++) {
+    if(process_table[i].status!=PROCESS_NONE && process_table[i].root_paging_directory_phys==root_paging_directory_phys) {
+      result = &process_table[i];
+      break;
+    }
+  }
+  release_spinlock(&process_table_lock);
+  return result;
+}
+
+void process_pagingdirs_foreach(void *extradata, void (*callback)(void *root_paging_directory_phys, void *extradata))
+{
+  acquire_spinlock(&process_table_lock);
+  for(uint16_t i=1; i<PID_MAX; i++) {
+    if(process_table[i].status!=PROCESS_NONE && process_table[i].root_paging_directory_phys!=NULL) {
+      callback(process_table[i].root_paging_directory_phys, extradata);
+    }
+  }
+  release_spinlock(&process_table_lock);
+}
+
 uint16_t get_current_processid()
 {
-  return current_running_processid;
+  //each processor has its own, see sys/smp.h
+  return this_cpu()->current_pid;
 }
 
 struct ProcessTableEntry* get_current_process()
@@ -121,13 +154,14 @@ void dump_process_struct(struct ProcessTableEntry *p)
   kprintf("  GS: 0x%x\r\n", p->saved_regs.gs);
   kprintf("  ESP: 0x%x\r\n", p->saved_regs.esp);
   kprintf("  EIP: 0x%x\r\n", p->saved_regs.eip);
+  kprintf(" Runtime: %l ticks, preempted %d times, priority %d\r\n", (uint32_t)p->runtime_ticks, p->preempt_count, (uint16_t)p->priority);
   
 }
 
 //INTERNAL USE ONLY! Called when entering kernel context.
 uint16_t set_current_process_id(uint16_t pid)
 {
-  current_running_processid = pid;
+  this_cpu()->current_pid = pid;
 }
 
 /**
@@ -165,7 +199,7 @@ struct ProcessTableEntry* new_process()
   kprintf("INFO Initialising new process entry\r\n");
   void *phys_ptrs[5];
 
-  cli();
+  //no need to turn interrupts off for this, nothing else touches a process while it is PROCESS_LOADING
   struct ProcessTableEntry *e = get_next_available_process();
   if(e==NULL) {
     return NULL;  //failed so bail out.
@@ -174,15 +208,24 @@ struct ProcessTableEntry* new_process()
   pid_t pid = e->pid;
   memset(e, 0, sizeof(struct ProcessTableEntry));
   e->magic  = PROCESS_TABLE_ENTRY_SIG;
-  e->status = PROCESS_LOADING;
+  process_set_status(e, PROCESS_LOADING);
   e->pid = pid;
+  e->priority = SCHED_PRIORITY_DEFAULT;
+
+  e->va_space = (struct VaSpace *)malloc(sizeof(struct VaSpace));
+  if(e->va_space==NULL) {
+    kprintf("ERROR Cannot allocate address space tracking for new process\r\n");
+    remove_process(e);
+    return NULL;
+  }
+  va_space_init(e->va_space, APP_VA_START, APP_VA_END);
 
   //set up a paging directory
   #ifdef PROCESS_VERBOSE
   kputs("DEBUG new_process Setting up paging directory\r\n");
   #endif
 
-  size_t c = allocate_free_physical_pages(4, phys_ptrs);
+  size_t c = allocate_zeroed_physical_pages(4, phys_ptrs);
   if(c<4) {
     kprintf("ERROR Cannot allocate memory for new process\r\n");
     remove_process(e);
@@ -219,6 +262,37 @@ struct ProcessTableEntry* new_process()
   return e;
 }
 
+/**
+Maps a segment that the ELF loader did not read, so that each page is read from the file the first time the process touches it.
+Returns 0 on success or 1 on failure.
+*/
+static uint8_t _map_lazy_segment(struct ProcessTableEntry *e, uint32_t *mapped_pagedirs, struct elf_parsed_data *elf, struct elf_program_header_i386 *ph, size_t pages_required, uint32_t segment_flags)
+{
+  VFatOpenFile *fp = vfat_open_by_location(elf->image_key.fs, elf->image_key.first_cluster, elf->image_key.file_size, vfat_get_sector_offset(elf->image_key.fs));
+  if(!fp) return 1;
+
+  struct FileMapping *m = file_mapping_new(fp, ph->p_offset, ph->p_vaddr & 0xFFF, ph->p_filesz, segment_flags);
+  if(!m) {
+    vfat_close(fp);
+    return 1;
+  }
+  if(!file_mapping_attach(e, mapped_pagedirs, m, ph->p_vaddr & ~0xFFF, pages_required)) {
+    file_mapping_free(m);
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * internal function to back out of internal_create_process once the process entry exists. remove_process drops the
+ * shared image (freeing it if we were still building it), the address space and any file mappings.
+*/
+static void _abandon_new_process(struct ProcessTableEntry *new_entry, uint32_t *mapped_pagedirs)
+{
+  if(mapped_pagedirs) unmap_app_pagingdir(mapped_pagedirs);
+  remove_process(new_entry);
+}
+
 pid_t internal_create_process(struct elf_parsed_data *elf)
 {
   struct ProcessTableEntry *new_entry = new_process();
@@ -231,32 +305,94 @@ pid_t internal_create_process(struct elf_parsed_data *elf)
   uint32_t *mapped_pagedirs = map_app_pagingdir((vaddr)new_entry->root_paging_directory_phys, APP_PAGEDIRS_BASE);
   if(!mapped_pagedirs) {
     kputs("ERROR Unable to map app paging dir\r\n");
-    new_entry->status = PROCESS_NONE;
+    _abandon_new_process(new_entry, NULL);
     return 0;
   }
 
+  //Read-only segments are shared between every process running the same file. If the loader found them already in memory then
+  //we map those pages; otherwise we start a new image with the pages we load here, for the next process to use.
+  struct SharedImage *image = elf->shared_image;
+  uint8_t building_image = 0;
+  if(image) {
+    shared_image_ref(image);
+  } else {
+    image = shared_image_new(&elf->image_key);
+    building_image = 1;
+  }
+  new_entry->shared_image = image;
+
   for(size_t i=0; i<elf->program_headers_count; ++i) {
     if(elf->program_headers[i].p_type != PT_LOAD) continue;
 
     struct elf_program_header_i386 *ph = &elf->program_headers[i];
-    size_t pages_required = ph->p_memsz / PAGE_SIZE;
-    if((ph->p_memsz % PAGE_SIZE) != 0) pages_required++;  //if there is any remainder, we must allocate an extra page.
-    if(pages_required==0) continue; //nothing to do!
+    //the segment need not start on a page boundary, so count pages from the start of the first one
+    size_t page_offset = ph->p_vaddr & 0xFFF;
+    size_t segment_pages = (page_offset + ph->p_memsz + PAGE_SIZE - 1) / PAGE_SIZE;
+    //only the pages with file content in them are loaded now. Anything after that (e.g. .bss) is demand-zero, so it
+    //only takes up RAM once the app touches it.
+    size_t pages_required = ph->p_filesz==0 ? 0 : (page_offset + ph->p_filesz + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t segment_flags = MP_USER;
+    if(ph->p_flags & PF_W) segment_flags |= MP_READWRITE;
+
+    if(segment_pages > pages_required) {
+      void *bss_start = (void *)((ph->p_vaddr & ~0xFFF) + pages_required*PAGE_SIZE);
+      #ifdef PROCESS_VERBOSE
+      kprintf("DEBUG internal_create_process segment %d has 0x%x demand-zero pages at 0x%x\r\n", i, segment_pages - pages_required, bss_start);
+      #endif
+      if(!vm_map_demand_zero_pages(mapped_pagedirs, bss_start, segment_pages - pages_required, segment_flags)) {
+        kputs("ERROR Unable to set up demand-zero pages for process segment\r\n");
+        _abandon_new_process(new_entry, mapped_pagedirs);
+        return 0;
+      }
+    }
+    if(pages_required==0) continue; //nothing to load from the file
+
+    if(i<32 && (elf->lazy_segments & (1 << i))) {
+      #ifdef PROCESS_VERBOSE
+      kprintf("DEBUG internal_create_process segment %d has 0x%x pages loaded on demand\r\n", i, pages_required);
+      #endif
+      if(_map_lazy_segment(new_entry, mapped_pagedirs, elf, ph, pages_required, segment_flags)!=0) {
+        kputs("ERROR Unable to map process segment from its file\r\n");
+        _abandon_new_process(new_entry, mapped_pagedirs);
+        return 0;
+      }
+      continue;
+    }
+
+    uint8_t shareable = image!=NULL && !(ph->p_flags & PF_W);
+    if(shareable && !building_image) {
+      struct SharedSegment *shared = shared_image_find_segment(image, ph->p_vaddr & ~0xFFF);
+      if(shared && shared->page_count==pages_required) {
+        #ifdef PROCESS_VERBOSE
+        kprintf("DEBUG internal_create_process mapping 0x%x shared pages for segment %d\r\n", pages_required, i);
+        #endif
+        for(size_t pagenum=0;pagenum < pages_required; ++pagenum) {
+          void *page_addr = (void *) ( (ph->p_vaddr & ~0xFFF) + pagenum*PAGE_SIZE);
+          k_map_page_bytes(mapped_pagedirs, shared->phys_pages[pagenum], page_addr, MP_PRESENT | MPC_SHARED | segment_flags);
+        }
+        continue;
+      }
+    }
+    //if we are starting a new image then these pages go into it, as long as there is room
+    if(shareable && building_image && image->segment_count<SHARED_IMAGE_MAX_SEGMENTS) {
+      segment_flags |= MPC_SHARED;
+    } else {
+      shareable = 0;
+    }
 
     phys_ptrs = (void **)malloc(sizeof(void *) * pages_required);
     if(!phys_ptrs) {
       kputs("ERROR Unable to allocate memory for process segment\r\n");
-      unmap_app_pagingdir(mapped_pagedirs);
-      new_entry->status = PROCESS_NONE;
+      _abandon_new_process(new_entry, mapped_pagedirs);
       return 0;
     }
 
-    size_t c = allocate_free_physical_pages(pages_required, phys_ptrs);
+    //the pages come pre-zeroed, so the part of the last page beyond p_filesz is already blank
+    size_t c = allocate_zeroed_physical_pages(pages_required, phys_ptrs);
     if(c<pages_required) {
       kputs("ERROR Unable to allocate memory for process segment\r\n");
       free(phys_ptrs);
-      unmap_app_pagingdir(mapped_pagedirs);
-      new_entry->status = PROCESS_NONE;
+      _abandon_new_process(new_entry, mapped_pagedirs);
       return 0;
     }
     void *base_kernel_ptr = vm_map_next_unallocated_pages(NULL, MP_PRESENT|MP_USER|MP_READWRITE, phys_ptrs, pages_required);
@@ -264,11 +400,9 @@ pid_t internal_create_process(struct elf_parsed_data *elf)
       kputs("ERROR Unable to map process segment into kernel memory\r\n");
       deallocate_physical_pages(c, &phys_ptrs);
       free(phys_ptrs);
-      unmap_app_pagingdir(mapped_pagedirs);
-      new_entry->status = PROCESS_NONE;
+      _abandon_new_process(new_entry, mapped_pagedirs);
       return 0;
     }
-    memset_dw(base_kernel_ptr, 0, PAGE_SIZE_DWORDS * pages_required); //ensure that the memory is zeroed before we use it.
     //The entire segment should be in a single load list entry. We just need to find it.
     struct LoadList *seg = load_list_find_by_offset(elf->loaded_segments, ph->p_offset);
     if(!seg) {
@@ -276,8 +410,7 @@ pid_t internal_create_process(struct elf_parsed_data *elf)
       k_unmap_page_ptr(NULL, base_kernel_ptr);
       deallocate_physical_pages(c, &phys_ptrs);
       free(phys_ptrs);
-      unmap_app_pagingdir(mapped_pagedirs);
-      new_entry->status = PROCESS_NONE;
+      _abandon_new_process(new_entry, mapped_pagedirs);
       return 0;
     }
     if(seg->length < ph->p_filesz) {
@@ -285,8 +418,7 @@ pid_t internal_create_process(struct elf_parsed_data *elf)
       k_unmap_page_ptr(NULL, base_kernel_ptr);
       deallocate_physical_pages(c, &phys_ptrs);
       free(phys_ptrs);
-      unmap_app_pagingdir(mapped_pagedirs);
-      new_entry->status = PROCESS_NONE;
+      _abandon_new_process(new_entry, mapped_pagedirs);
       return 0;
     }
 
@@ -295,24 +427,29 @@ pid_t internal_create_process(struct elf_parsed_data *elf)
     #endif
     //There might be an offset from the start of the segment to the start of the load list entry.
     size_t offset_into_seg = ph->p_offset - seg->file_offset;
-    memcpy(base_kernel_ptr, (void *)((vaddr)seg->vptr + offset_into_seg), ph->p_filesz);
+    memcpy(base_kernel_ptr + page_offset, (void *)((vaddr)seg->vptr + offset_into_seg), ph->p_filesz);
 
     //now map the pages into the process's paging directory and remove them from kernel space
     for(size_t pagenum=0;pagenum < pages_required; ++pagenum) {
       void *page_addr = (void *) ( (ph->p_vaddr & ~0xFFF) + pagenum*PAGE_SIZE);
-      size_t flags = MP_PRESENT | MP_USER;
-      if(ph->p_flags & PF_W) flags |= MP_READWRITE;
-      k_map_page_bytes(mapped_pagedirs, phys_ptrs[pagenum], page_addr, flags);
+      k_map_page_bytes(mapped_pagedirs, phys_ptrs[pagenum], page_addr, MP_PRESENT | segment_flags);
       k_unmap_page_ptr(NULL, (vaddr)(base_kernel_ptr + pagenum*PAGE_SIZE));
     }
+    if(shareable) {
+      //the image owns the pages, and the list of them, from now on
+      shared_image_add_segment(image, ph->p_vaddr & ~0xFFF, pages_required, phys_ptrs);
+    } else {
+      free(phys_ptrs);
+    }
   }
+  if(building_image && image) shared_image_publish(image);
 
   //now set up a heap
   #ifdef PROCESS_VERBOSE
   kputs("DEBUG new_process setting up process heap\r\n");
   #endif
-  //the app prolog itself should configure the app heap, we just allocate it here.
-  new_entry->heap_start = vm_alloc_pages(mapped_pagedirs, MIN_ZONE_SIZE_PAGES, MP_USER|MP_READWRITE);
+  //the app prolog itself should configure the app heap, we just allocate it here. Pages only get RAM when they are touched.
+  new_entry->heap_start = vm_alloc_pages(mapped_pagedirs, MIN_ZONE_SIZE_PAGES, MP_USER|MP_READWRITE|MPC_DEMANDZERO);
   new_entry->heap_allocated = MIN_ZONE_SIZE_PAGES;
   new_entry->heap_used = 0;
 
@@ -342,10 +479,8 @@ pid_t internal_create_process(struct elf_parsed_data *elf)
   k_unmap_page_ptr(NULL, new_entry->stack_kmem_ptr);
   new_entry->stack_kmem_ptr = NULL;
 
-  new_entry->status = PROCESS_READY;
+  process_set_status(new_entry, PROCESS_READY);
 
-  
-  sti();
   #ifdef PROCESS_VERBOSE
   kprintf("DEBUG new_process process initialised at 0x%x\r\n", new_entry);
   #endif
@@ -388,5 +523,16 @@ void process_initial_stack(struct ProcessTableEntry *new_entry, ElfFileHeader* f
 void remove_process(struct ProcessTableEntry* e)
 {
   //FIXME: need to de-alloc pages etc.
-  e->status = PROCESS_NONE;
+  if(e->va_space) {
+    va_space_destroy(e->va_space);
+    free(e->va_space);
+    e->va_space = NULL;
+  }
+  if(e->shared_image) {
+    shared_image_unref(e->shared_image);
+    e->shared_image = NULL;
+  }
+  file_mapping_release_all(e);
+  fpu_release(e);
+  process_set_status(e, PROCESS_NONE);
 }
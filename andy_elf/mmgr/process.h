@@ -14,5 +14,11 @@ void remove_process(struct ProcessTableEntry* e);
 uint16_t set_current_process_id(uint16_t pid);
 //Get the process table entry for a given pid
 struct ProcessTableEntry* get_process(pid_t pid);
+//Get the process table entry for the process that is currently running
+struct ProcessTableEntry* get_current_process();
+//Get the process table entry that owns the given root paging directory, or NULL if there is none. Does not return the kernel.
+struct ProcessTableEntry* find_process_by_pagingdir(void *root_paging_directory_phys);
+//Calls `callback` with the root paging directory of every process that has one. The process table lock is held throughout.
+void process_pagingdirs_foreach(void *extradata, void (*callback)(void *root_paging_directory_phys, void *extradata));
 
 #endif
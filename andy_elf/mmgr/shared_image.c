@@ -0,0 +1,109 @@
+#include <types.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <panic.h>
+#include <memops.h>
+#include <spinlock.h>
+#include <sys/mmgr.h>
+#include <sys/shared_image.h>
+
+static struct SharedImage *shared_images = NULL;
+static spinlock_t imagelock = 0;
+
+static uint8_t _key_matches(struct SharedImageKey *a, struct SharedImageKey *b)
+{
+  return a->fs==b->fs && a->first_cluster==b->first_cluster && a->file_size==b->file_size &&
+    a->last_mod_time==b->last_mod_time && a->last_mod_date==b->last_mod_date;
+}
+
+struct SharedImage *shared_image_find(struct SharedImageKey *key)
+{
+  acquire_spinlock(&imagelock);
+  for(struct SharedImage *image=shared_images; image!=NULL; image=image->next) {
+    if(image->magic!=SHARED_IMAGE_SIG) k_panic("Shared image list is corrupted\r\n");
+    if(image->published && _key_matches(&image->key, key)) {
+      ++image->refcount;
+      release_spinlock(&imagelock);
+      return image;
+    }
+  }
+  release_spinlock(&imagelock);
+  return NULL;
+}
+
+struct SharedImage *shared_image_new(struct SharedImageKey *key)
+{
+  struct SharedImage *image = (struct SharedImage *)malloc(sizeof(struct SharedImage));
+  if(!image) return NULL;
+  memset(image, 0, sizeof(struct SharedImage));
+  image->magic = SHARED_IMAGE_SIG;
+  image->key = *key;
+  image->refcount = 1;
+
+  acquire_spinlock(&imagelock);
+  image->next = shared_images;
+  shared_images = image;
+  release_spinlock(&imagelock);
+  return image;
+}
+
+uint8_t shared_image_add_segment(struct SharedImage *image, vaddr base, size_t page_count, void **phys_pages)
+{
+  if(image->published) k_panic("Attempt to add a segment to a shared image that is already in use\r\n");
+  if(image->segment_count>=SHARED_IMAGE_MAX_SEGMENTS) return 1;
+
+  struct SharedSegment *seg = &image->segments[image->segment_count];
+  seg->base = base;
+  seg->page_count = page_count;
+  seg->phys_pages = phys_pages;
+  ++image->segment_count;
+  return 0;
+}
+
+struct SharedSegment *shared_image_find_segment(struct SharedImage *image, vaddr base)
+{
+  for(register size_t i=0; i<image->segment_count; i++) {
+    if(image->segments[i].base==base) return &image->segments[i];
+  }
+  return NULL;
+}
+
+void shared_image_publish(struct SharedImage *image)
+{
+  acquire_spinlock(&imagelock);
+  image->published = 1;
+  release_spinlock(&imagelock);
+}
+
+void shared_image_ref(struct SharedImage *image)
+{
+  acquire_spinlock(&imagelock);
+  ++image->refcount;
+  release_spinlock(&imagelock);
+}
+
+void shared_image_unref(struct SharedImage *image)
+{
+  if(image->magic!=SHARED_IMAGE_SIG) k_panic("Shared image is corrupted\r\n");
+
+  acquire_spinlock(&imagelock);
+  if(--image->refcount > 0) {
+    release_spinlock(&imagelock);
+    return;
+  }
+  //that was the last user, take it out of the list so nobody else can find it
+  struct SharedImage **p = &shared_images;
+  while(*p && *p!=image) p = &(*p)->next;
+  if(*p) *p = image->next;
+  release_spinlock(&imagelock);
+
+  #ifdef MMGR_VERBOSE
+  kprintf("DEBUG shared_image_unref freeing image 0x%x with %l segments\r\n", image, image->segment_count);
+  #endif
+  for(register size_t i=0; i<image->segment_count; i++) {
+    deallocate_physical_pages(image->segments[i].page_count, image->segments[i].phys_pages);
+    free(image->segments[i].phys_pages);
+  }
+  image->magic = 0;
+  free(image);
+}
@@ -0,0 +1,209 @@
+#include <types.h>
+#include <slab.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <panic.h>
+#include <sys/mmgr.h>
+#include <memops.h>
+
+/**
+Simple slab allocator for fixed-size kernel objects, which are allocated and freed far too often to want to
+walk the heap every time.
+Each cache owns a number of single-page slabs, kept on one of three lists (partial, full, empty). Allocation takes
+the first free object of the first partial (or empty) slab and freeing finds the slab header by rounding the pointer
+down to its page, so both are O(1).
+Compile with SLAB_VERBOSE for extra debugging output.
+*/
+
+static void _slab_list_remove(SlabHeader **list, SlabHeader *slab)
+{
+  if(slab->prev_slab) {
+    slab->prev_slab->next_slab = slab->next_slab;
+  } else {
+    *list = slab->next_slab;
+  }
+  if(slab->next_slab) slab->next_slab->prev_slab = slab->prev_slab;
+  slab->next_slab = NULL;
+  slab->prev_slab = NULL;
+}
+
+static void _slab_list_push(SlabHeader **list, SlabHeader *slab)
+{
+  slab->prev_slab = NULL;
+  slab->next_slab = *list;
+  if(*list) (*list)->prev_slab = slab;
+  *list = slab;
+}
+
+/**
+Allocates a new page for the cache and threads all of its objects onto the slab's free list.
+Must be called with the cache lock held.
+*/
+static SlabHeader *_slab_new(SlabCache *cache)
+{
+  SlabHeader *slab = (SlabHeader *)vm_alloc_pages(NULL, 1, MP_READWRITE);
+  if(!slab) return NULL;
+
+  slab->magic = SLAB_SIG;
+  slab->cache = cache;
+  slab->next_slab = NULL;
+  slab->prev_slab = NULL;
+  slab->in_use = 0;
+  slab->free_list = NULL;
+
+  //build the free list backwards so that objects are handed out in address order
+  for(size_t i=cache->stats.objects_per_slab;i>0;i--) {
+    void **obj = (void **)((vaddr)slab + cache->first_object_offset + (i-1)*cache->stats.object_size);
+    *obj = slab->free_list;
+    slab->free_list = (void *)obj;
+  }
+  ++cache->stats.slab_count;
+  #ifdef SLAB_VERBOSE
+  kprintf("DEBUG slab cache %s new slab at 0x%x\r\n", cache->name, slab);
+  #endif
+  return slab;
+}
+
+static void _slab_release(SlabCache *cache, SlabHeader *slab)
+{
+  slab->magic = 0;
+  vm_deallocate_physical_pages(NULL, (void *)slab, 1);
+  --cache->stats.slab_count;
+}
+
+SlabCache *slab_cache_create(const char *name, size_t object_size)
+{
+  if(object_size==0 || object_size>SLAB_MAX_OBJECT) {
+    kprintf("ERROR slab_cache_create can't cache %s objects of %d bytes\r\n", name, object_size);
+    return NULL;
+  }
+
+  //small objects are packed at a power-of-two size so they never straddle a cache line; anything bigger
+  //is rounded up to a whole number of cache lines.
+  size_t aligned_size = sizeof(void *);
+  if(object_size > SLAB_CACHE_LINE/2) {
+    aligned_size = (object_size + SLAB_CACHE_LINE - 1) & ~(SLAB_CACHE_LINE - 1);
+  } else {
+    while(aligned_size < object_size) aligned_size <<= 1;
+  }
+
+  SlabCache *cache = (SlabCache *)malloc(sizeof(SlabCache));
+  if(!cache) return NULL;
+
+  memset(cache, 0, sizeof(SlabCache));
+  cache->magic = SLAB_CACHE_SIG;
+  cache->name = name;
+  cache->first_object_offset = (sizeof(SlabHeader) + SLAB_CACHE_LINE - 1) & ~(SLAB_CACHE_LINE - 1);
+  cache->stats.object_size = aligned_size;
+  cache->stats.objects_per_slab = (PAGE_SIZE - cache->first_object_offset) / aligned_size;
+  cache->lock = 0;
+
+  #ifdef SLAB_VERBOSE
+  kprintf("DEBUG slab_cache_create %s object size %d, %d per slab\r\n", name, aligned_size, cache->stats.objects_per_slab);
+  #endif
+  return cache;
+}
+
+uint8_t slab_cache_destroy(SlabCache *cache)
+{
+  if(cache->magic!=SLAB_CACHE_SIG) k_panic("Slab cache corruption detected\r\n");
+
+  acquire_spinlock(&cache->lock);
+  if(cache->stats.objects_in_use>0) {
+    release_spinlock(&cache->lock);
+    kprintf("ERROR slab_cache_destroy %s still has %d objects in use\r\n", cache->name, cache->stats.objects_in_use);
+    return 1;
+  }
+
+  while(cache->empty_slabs) {
+    SlabHeader *slab = cache->empty_slabs;
+    _slab_list_remove(&cache->empty_slabs, slab);
+    _slab_release(cache, slab);
+  }
+  cache->magic = 0;
+  release_spinlock(&cache->lock);
+  free(cache);
+  return 0;
+}
+
+void *slab_alloc(SlabCache *cache)
+{
+  if(cache->magic!=SLAB_CACHE_SIG) k_panic("Slab cache corruption detected\r\n");
+
+  acquire_spinlock(&cache->lock);
+  SlabHeader *slab = cache->partial_slabs;
+  if(!slab) {
+    slab = cache->empty_slabs;
+    if(slab) {
+      _slab_list_remove(&cache->empty_slabs, slab);
+      --cache->empty_count;
+    } else {
+      slab = _slab_new(cache);
+      if(!slab) {
+        release_spinlock(&cache->lock);
+        kprintf("ERROR slab_alloc could not get a new slab for %s\r\n", cache->name);
+        return NULL;
+      }
+    }
+    _slab_list_push(&cache->partial_slabs, slab);
+  }
+
+  void **obj = (void **)slab->free_list;
+  slab->free_list = *obj;
+  ++slab->in_use;
+  if(slab->free_list==NULL) {
+    _slab_list_remove(&cache->partial_slabs, slab);
+    _slab_list_push(&cache->full_slabs, slab);
+  }
+
+  ++cache->stats.alloc_count;
+  ++cache->stats.objects_in_use;
+  if(cache->stats.objects_in_use > cache->stats.high_water_mark) cache->stats.high_water_mark = cache->stats.objects_in_use;
+  release_spinlock(&cache->lock);
+  return (void *)obj;
+}
+
+void slab_free(SlabCache *cache, void *ptr)
+{
+  if(!ptr) return;
+  SlabHeader *slab = (SlabHeader *)((vaddr)ptr & MP_ADDRESS_MASK);
+  if(slab->magic!=SLAB_SIG || slab->cache!=cache) {
+    kprintf("ERROR slab_free pointer 0x%x does not belong to cache %s\r\n", ptr, cache->name);
+    k_panic("Slab corruption detected\r\n");
+  }
+  if((vaddr)ptr - (vaddr)slab < cache->first_object_offset || ((vaddr)ptr - (vaddr)slab - cache->first_object_offset) % cache->stats.object_size != 0) {
+    kprintf("ERROR slab_free pointer 0x%x is not the start of a %s object\r\n", ptr, cache->name);
+    k_panic("Slab corruption detected\r\n");
+  }
+
+  acquire_spinlock(&cache->lock);
+  if(slab->free_list==NULL) {
+    //slab was full, now it's not
+    _slab_list_remove(&cache->full_slabs, slab);
+    _slab_list_push(&cache->partial_slabs, slab);
+  }
+  *(void **)ptr = slab->free_list;
+  slab->free_list = ptr;
+  --slab->in_use;
+
+  if(slab->in_use==0) {
+    _slab_list_remove(&cache->partial_slabs, slab);
+    if(cache->empty_count < SLAB_MAX_EMPTY) {
+      _slab_list_push(&cache->empty_slabs, slab);
+      ++cache->empty_count;
+    } else {
+      _slab_release(cache, slab);
+    }
+  }
+
+  ++cache->stats.free_count;
+  --cache->stats.objects_in_use;
+  release_spinlock(&cache->lock);
+}
+
+void slab_cache_stats(SlabCache *cache, SlabCacheStats *stats)
+{
+  acquire_spinlock(&cache->lock);
+  memcpy(stats, &cache->stats, sizeof(SlabCacheStats));
+  release_spinlock(&cache->lock);
+}
@@ -0,0 +1,160 @@
+#include <types.h>
+#include <stdio.h>
+#include <cpuid.h>
+#include <sys/mmgr.h>
+#include <sys/tlb.h>
+#include <sys/smp.h>
+#include <sys/vaspace.h>
+#include <sys/x86_control_registers.h>
+
+//not static, because the context-switch code in scheduler/lowlevel.asm updates the CR3 counters directly
+struct TlbStats tlb_counters = {0};
+
+static uint8_t pge_enabled = 0;
+
+#define __invlpg(vptr) __asm__ __volatile__("invlpg (%0)" : : "r" (vptr) : "memory")
+
+static inline uint32_t _read_cr4()
+{
+  uint32_t cr4;
+  asm volatile("mov %%cr4, %0" : "=r"(cr4));
+  return cr4;
+}
+
+static inline void _write_cr4(uint32_t cr4)
+{
+  asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static inline uint32_t _read_cr3()
+{
+  uint32_t cr3;
+  asm volatile("mov %%cr3, %0" : "=r"(cr3));
+  return cr3;
+}
+
+static inline void _write_cr3(uint32_t cr3)
+{
+  asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+void initialise_tlb(uint32_t cpuid_edx)
+{
+  if(cpuid_edx & CPUID_FEAT_EDX_PGE) {
+    kputs("CPU supports global pages, enabling PGE.\r\n");
+    _write_cr4(_read_cr4() | CR4_PGE);
+    pge_enabled = 1;
+  } else {
+    kputs("WARNING CPU does not support global pages, kernel translations will be flushed on every context switch\r\n");
+  }
+}
+
+uint32_t tlb_global_flag()
+{
+  return pge_enabled ? MP_GLOBAL : 0;
+}
+
+/**
+Returns 1 if no other processor can have a translation for the page cached, so there is no need to tell them about it.
+That is the case for a page of the running process: processes only run on one processor at a time, and switch_out_process
+goes back to the kernel directory when it leaves one, which drops its non-global translations.
+*/
+static uint8_t _is_private(vaddr vptr)
+{
+  if(_read_cr3()==ROOT_PAGE_DIR_LOCATION) return 0;
+  if(vptr >= APP_VA_START && vptr < APP_VA_END) return 1;
+  //the stack and the paging directory's view of itself, see initialise_app_pagingdir
+  size_t dir_idx = ADDR_TO_PAGEDIR_IDX(vptr);
+  return dir_idx==0x3FF || dir_idx==0x3C0;
+}
+
+static void _flush_all_local(uint8_t include_global)
+{
+  if(include_global && pge_enabled) {
+    //turning PGE off drops every translation, global or not. Turning it back on again doesn't bring them back.
+    uint32_t cr4 = _read_cr4();
+    _write_cr4(cr4 & ~CR4_PGE);
+    _write_cr4(cr4);
+    ++tlb_counters.global_flushes;
+  } else {
+    _write_cr3(_read_cr3());
+    ++tlb_counters.full_flushes;
+  }
+}
+
+void tlb_invalidate_page(vaddr vptr)
+{
+  __invlpg(vptr);
+  ++tlb_counters.pages_invalidated;
+  if(!_is_private(vptr)) smp_tlb_shootdown(&vptr, 1, 1);
+}
+
+void tlb_flush_all(uint8_t include_global)
+{
+  _flush_all_local(include_global);
+  smp_tlb_shootdown(NULL, 0, include_global);
+}
+
+void tlb_apply_shootdown(const vaddr *pages, size_t page_count, uint8_t include_global)
+{
+  if(page_count==0) {
+    _flush_all_local(include_global);
+    return;
+  }
+  for(register size_t i=0; i<page_count; i++) __invlpg(pages[i]);
+  tlb_counters.pages_invalidated += page_count;
+}
+
+void tlb_batch_init(struct TlbBatch *batch)
+{
+  batch->page_count = 0;
+  batch->flush_all = 0;
+  batch->flush_global = 0;
+}
+
+void tlb_batch_add(struct TlbBatch *batch, vaddr vptr, size_t page_count, uint8_t global)
+{
+  if(global) batch->flush_global = 1;
+  if(batch->flush_all) return;
+  if(batch->page_count + page_count > TLB_BATCH_MAX) {
+    batch->flush_all = 1;
+    return;
+  }
+  for(register size_t i=0; i<page_count; i++) {
+    batch->pages[batch->page_count++] = (vptr & MP_ADDRESS_MASK) + i*PAGE_SIZE;
+  }
+}
+
+void tlb_batch_flush(struct TlbBatch *batch)
+{
+  if(batch->flush_all) {
+    tlb_flush_all(batch->flush_global);
+    ++tlb_counters.batches_flushed;
+  } else if(batch->page_count>0) {
+    //invlpg drops global translations too, so a short list is fine either way
+    uint8_t shared = 0;
+    for(register size_t i=0; i<batch->page_count; i++) {
+      __invlpg(batch->pages[i]);
+      if(!shared && !_is_private(batch->pages[i])) shared = 1;
+    }
+    tlb_counters.pages_invalidated += batch->page_count;
+    ++tlb_counters.batches_flushed;
+    if(shared) smp_tlb_shootdown(batch->pages, batch->page_count, batch->flush_global);
+  }
+  tlb_batch_init(batch);
+}
+
+void tlb_switch_pd(vaddr pd_phys)
+{
+  if(_read_cr3()==pd_phys) {
+    ++tlb_counters.cr3_loads_skipped;
+    return;
+  }
+  _write_cr3(pd_phys);
+  ++tlb_counters.cr3_loads;
+}
+
+void tlb_get_stats(struct TlbStats *stats)
+{
+  *stats = tlb_counters;
+}
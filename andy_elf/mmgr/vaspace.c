@@ -0,0 +1,201 @@
+#include <types.h>
+#include <stdio.h>
+#include <panic.h>
+#include <malloc.h>
+#include <memops.h>
+#include <sys/mmgr.h>
+#include <sys/vaspace.h>
+
+/**
+Returns the index of the first range that starts beyond the given page, by binary search.
+This is range_count if there is none.
+*/
+static size_t _first_range_after(struct VaSpace *space, size_t page)
+{
+  size_t lo = 0, hi = space->range_count;
+  while(lo<hi) {
+    size_t mid = (lo+hi) >> 1;
+    if(space->ranges[mid].base_page > page) {
+      hi = mid;
+    } else {
+      lo = mid+1;
+    }
+  }
+  return lo;
+}
+
+static uint8_t _insert_range(struct VaSpace *space, size_t idx, size_t base_page, size_t page_count)
+{
+  if(space->range_count>=space->range_capacity) return 0;
+  for(register size_t i=space->range_count; i>idx; i--) space->ranges[i] = space->ranges[i-1];
+  space->ranges[idx].base_page = base_page;
+  space->ranges[idx].page_count = page_count;
+  ++space->range_count;
+  return 1;
+}
+
+static void _remove_range(struct VaSpace *space, size_t idx)
+{
+  for(register size_t i=idx; i+1<space->range_count; i++) space->ranges[i] = space->ranges[i+1];
+  --space->range_count;
+}
+
+void va_space_init(struct VaSpace *space, vaddr start, vaddr end)
+{
+  space->magic = VA_SPACE_SIG;
+  space->start_page = start >> 12;
+  space->end_page = end >> 12;
+  space->cursor_page = space->start_page;
+  space->free_pages = space->end_page - space->start_page;
+  space->range_count = 1;
+  space->range_capacity = VA_SPACE_INITIAL_RANGES;
+  space->growing = 0;
+  space->ranges = space->initial_ranges;
+  space->ranges[0].base_page = space->start_page;
+  space->ranges[0].page_count = space->free_pages;
+}
+
+void va_space_destroy(struct VaSpace *space)
+{
+  if(space->ranges!=space->initial_ranges) free(space->ranges);
+  space->ranges = space->initial_ranges;
+  space->range_count = 0;
+  space->magic = 0;
+}
+
+uint8_t va_space_wants_room(struct VaSpace *space)
+{
+  if(space->growing) return 0;
+  return space->range_capacity - space->range_count < VA_SPACE_SPARE_RANGES ? 1 : 0;
+}
+
+struct VaRange *va_space_swap_ranges(struct VaSpace *space, struct VaRange *new_ranges, size_t new_capacity)
+{
+  if(new_capacity<=space->range_capacity) return new_ranges;  //somebody else got there first
+
+  struct VaRange *old_ranges = space->ranges;
+  memcpy(new_ranges, old_ranges, space->range_count*sizeof(struct VaRange));
+  space->ranges = new_ranges;
+  space->range_capacity = new_capacity;
+  return old_ranges==space->initial_ranges ? NULL : old_ranges;
+}
+
+vaddr va_space_alloc(struct VaSpace *space, size_t page_count)
+{
+  return va_space_alloc_aligned(space, page_count, 1);
+}
+
+vaddr va_space_alloc_aligned(struct VaSpace *space, size_t page_count, size_t align_pages)
+{
+  if(space->magic!=VA_SPACE_SIG) k_panic("Virtual address space tracking is corrupted\r\n");
+  if(page_count==0 || page_count>space->free_pages || space->range_count==0) return 0;
+
+  //start from the range containing the cursor, or the one after it if the cursor is in a gap
+  size_t start_idx = _first_range_after(space, space->cursor_page);
+  if(start_idx>0 && space->ranges[start_idx-1].base_page + space->ranges[start_idx-1].page_count > space->cursor_page) --start_idx;
+
+  for(register size_t n=0; n<space->range_count; n++) {
+    size_t i = (start_idx + n) % space->range_count;
+    struct VaRange *r = &space->ranges[i];
+    size_t base_page = (r->base_page + align_pages - 1) & ~(align_pages - 1);
+    if(base_page + page_count > r->base_page + r->page_count) continue;
+
+    if(base_page==r->base_page) {
+      r->base_page += page_count;
+      r->page_count -= page_count;
+      if(r->page_count==0) _remove_range(space, i);
+      space->free_pages -= page_count;
+    } else if(!va_space_reserve(space, (vaddr)base_page << 12, page_count)) {
+      kprintf("WARNING va_space 0x%x has no room to split a range, failing allocation of 0x%x pages\r\n", space, page_count);
+      return 0;
+    }
+    space->cursor_page = base_page + page_count;
+    return (vaddr)base_page << 12;
+  }
+  return 0;
+}
+
+uint8_t va_space_free(struct VaSpace *space, vaddr base, size_t page_count)
+{
+  if(space->magic!=VA_SPACE_SIG) k_panic("Virtual address space tracking is corrupted\r\n");
+  size_t p = base >> 12;
+  size_t end = p + page_count;
+  if(p < space->start_page) p = space->start_page;
+  if(end > space->end_page) end = space->end_page;
+
+  while(p<end) {
+    size_t idx = _first_range_after(space, p);
+    struct VaRange *prev = idx>0 ? &space->ranges[idx-1] : NULL;
+    struct VaRange *next = idx<space->range_count ? &space->ranges[idx] : NULL;
+
+    if(prev && prev->base_page + prev->page_count > p) {
+      //this part is already free, skip over it
+      p = prev->base_page + prev->page_count;
+      continue;
+    }
+
+    size_t chunk_end = end;
+    if(next && next->base_page < chunk_end) chunk_end = next->base_page;
+    size_t n = chunk_end - p;
+
+    uint8_t joins_prev = prev && prev->base_page + prev->page_count == p;
+    uint8_t joins_next = next && next->base_page == chunk_end;
+    if(joins_prev && joins_next) {
+      prev->page_count += n + next->page_count;
+      _remove_range(space, idx);
+    } else if(joins_prev) {
+      prev->page_count += n;
+    } else if(joins_next) {
+      next->base_page = p;
+      next->page_count += n;
+    } else if(!_insert_range(space, idx, p, n)) {
+      //only the first piece can need a new range, as every later one starts where a free range ends, so nothing has changed yet
+      kprintf("ERROR va_space 0x%x has no room to record 0x%x free pages at 0x%x\r\n", space, n, p << 12);
+      return 0;
+    }
+    space->free_pages += n;
+    p = chunk_end;
+  }
+  return 1;
+}
+
+uint8_t va_space_reserve(struct VaSpace *space, vaddr base, size_t page_count)
+{
+  if(space->magic!=VA_SPACE_SIG) k_panic("Virtual address space tracking is corrupted\r\n");
+  size_t p = base >> 12;
+  size_t end = p + page_count;
+
+  size_t idx = _first_range_after(space, p);
+  if(idx>0 && space->ranges[idx-1].base_page + space->ranges[idx-1].page_count > p) --idx;
+
+  //a split can only happen when the reservation is inside a single range, so check for room before changing anything
+  if(idx<space->range_count && space->range_count>=space->range_capacity) {
+    struct VaRange *r = &space->ranges[idx];
+    if(r->base_page < p && r->base_page + r->page_count > end) return 0;
+  }
+
+  while(idx<space->range_count && space->ranges[idx].base_page < end) {
+    struct VaRange *r = &space->ranges[idx];
+    size_t r_end = r->base_page + r->page_count;
+    size_t cut_lo = r->base_page > p ? r->base_page : p;
+    size_t cut_hi = r_end < end ? r_end : end;
+    space->free_pages -= cut_hi - cut_lo;
+
+    if(cut_lo==r->base_page && cut_hi==r_end) {
+      _remove_range(space, idx);
+    } else if(cut_lo==r->base_page) {
+      r->base_page = cut_hi;
+      r->page_count = r_end - cut_hi;
+      ++idx;
+    } else if(cut_hi==r_end) {
+      r->page_count = cut_lo - r->base_page;
+      ++idx;
+    } else {
+      //the reservation is in the middle of this range, so it splits in two
+      r->page_count = cut_lo - r->base_page;
+      _insert_range(space, idx+1, cut_hi, r_end - cut_hi);
+      idx += 2;
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,74 @@
+#include <types.h>
+#include <sys/mmgr.h>
+#include <spinlock.h>
+#include <stdio.h>
+
+static void *zeroed_pool[ZEROED_POOL_CAPACITY];
+static size_t zeroed_pool_depth = 0;
+static uint32_t zeroed_pool_hits = 0;
+static uint32_t zeroed_pool_misses = 0;
+static spinlock_t poollock = 0;
+
+/**
+ * Obtains the given number of zeroed physical pages. Pages are taken from the pool first and anything
+ * that the pool can't satisfy is allocated and zeroed on the spot.
+ * Returns the number of pages obtained; if this is < page_count it indicates an out-of-memory condition.
+*/
+uint32_t allocate_zeroed_physical_pages(uint32_t page_count, void **blocks)
+{
+  uint32_t found_pages = 0;
+
+  acquire_spinlock(&poollock);
+  while(found_pages<page_count && zeroed_pool_depth>0) {
+    --zeroed_pool_depth;
+    blocks[found_pages] = zeroed_pool[zeroed_pool_depth];
+    ++found_pages;
+  }
+  zeroed_pool_hits += found_pages;
+  release_spinlock(&poollock);
+
+  if(found_pages==page_count) return found_pages;
+
+  uint32_t allocd = allocate_free_physical_pages(page_count - found_pages, &blocks[found_pages]);
+  for(register uint32_t i=0;i<allocd;i++) {
+    zero_physical_page(blocks[found_pages+i]);
+  }
+
+  acquire_spinlock(&poollock);
+  zeroed_pool_misses += allocd;
+  release_spinlock(&poollock);
+  return found_pages + allocd;
+}
+
+void refill_zeroed_page_pool()
+{
+  void *phys_ptr;
+
+  for(register size_t i=0;i<ZEROED_POOL_REFILL_BATCH;i++) {
+    if(zeroed_pool_depth>=ZEROED_POOL_CAPACITY) return;
+    //don't hoard pages in the pool if RAM is getting tight
+    if(physical_pages_free() < ZEROED_POOL_CAPACITY*2) return;
+
+    if(allocate_free_physical_pages(1, &phys_ptr)!=1) return;
+    zero_physical_page(phys_ptr);
+
+    acquire_spinlock(&poollock);
+    if(zeroed_pool_depth<ZEROED_POOL_CAPACITY) {
+      zeroed_pool[zeroed_pool_depth] = phys_ptr;
+      ++zeroed_pool_depth;
+      phys_ptr = NULL;
+    }
+    release_spinlock(&poollock);
+    if(phys_ptr) deallocate_physical_pages(1, &phys_ptr); //somebody else filled the pool while we were busy
+  }
+}
+
+void zeroed_page_pool_stats(struct ZeroedPoolStats *stats)
+{
+  acquire_spinlock(&poollock);
+  stats->depth = zeroed_pool_depth;
+  stats->capacity = ZEROED_POOL_CAPACITY;
+  stats->hits = zeroed_pool_hits;
+  stats->misses = zeroed_pool_misses;
+  release_spinlock(&poollock);
+}
@@ -1,9 +1,9 @@
-;This file defines the constants used for native API functions
+;This file defines the constants used for native API functions. Keep it in-sync with include/native_api/apicodes.h
 %define API_NONE            0x0
 
 %define API_EXIT            0x00000001
 %define API_CREATE_PROCESS  0x00000002
-%define API_SLEEP           0x00000003
+%define API_SLEEP           0x00000003    ;Sleep for the number of microseconds in EBX
 
 %define API_CLOSE           0x00000008
 %define API_OPEN            0x00000009
@@ -13,8 +13,9 @@
 %define API_IOCTL           0x0000000D
 
 %define API_GET_TIME        0x00000010    ;Return time as number of seconds since Jan 1, 2000
+%define API_MMAP            0x00000011    ;Map part of an open file into memory, it is read in as it is touched
+%define API_MUNMAP          0x00000012    ;Remove a mapping made by API_MMAP
+%define API_NICE            0x00000013    ;Change the calling process's scheduling priority
+%define API_CALL_INFO       0x00000014    ;Get the counters for the API code in EBX, see include/native_api/dispatch.h
 %define API_ERR_NOTFOUND    0x80000001    ;No such api code found
 
-extern api_terminate_current_process
-extern api_sleep_current_process
-extern api_create_process
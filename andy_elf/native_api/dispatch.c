@@ -0,0 +1,186 @@
+#include <types.h>
+#include <stdio.h>
+#include <memops.h>
+#include <sys/mmgr.h>
+#include <native_api/errors.h>
+#include <native_api/apicodes.h>
+#include <native_api/dispatch.h>
+#include <scheduler/clocksource.h>
+#include "process_ops.h"
+#include "stream_ops.h"
+#include "memory_ops.h"
+
+static struct NativeApiCall calls[NATIVE_API_MAX_CALLS];
+
+static uint8_t _histogram_bucket(uint64_t cycles)
+{
+  if(cycles >> 32) return NATIVE_API_HISTOGRAM_BUCKETS - 1;
+
+  uint32_t scaled = (uint32_t)cycles >> NATIVE_API_HISTOGRAM_SHIFT;
+  uint8_t bucket = 0;
+  while(scaled && bucket < NATIVE_API_HISTOGRAM_BUCKETS - 1) {
+    scaled >>= 1;
+    ++bucket;
+  }
+  return bucket;
+}
+
+uint8_t native_api_register(uint32_t code, const char *name, native_api_handler handler, uint8_t return_mode)
+{
+  if(code>=NATIVE_API_MAX_CALLS) {
+    kprintf("ERROR Can't register native API call %s, code 0x%x is out of range\r\n", name, code);
+    return 1;
+  }
+  if(calls[code].handler) {
+    kprintf("ERROR Can't register native API call %s, code 0x%x is already used by %s\r\n", name, code, calls[code].name);
+    return 1;
+  }
+
+  memset(&calls[code], 0, sizeof(struct NativeApiCall));
+  for(uint8_t i=0; i<NATIVE_API_NAME_LENGTH-1 && name[i]; i++) calls[code].name[i] = name[i];
+  calls[code].return_mode = return_mode;
+  calls[code].handler = handler;
+  return 0;
+}
+
+void native_api_unregister(uint32_t code)
+{
+  if(code>=NATIVE_API_MAX_CALLS) return;
+  memset(&calls[code], 0, sizeof(struct NativeApiCall));
+}
+
+uint8_t native_api_dispatch(struct NativeApiRegs *regs)
+{
+  uint32_t code = regs->eax;
+  if(code>=NATIVE_API_MAX_CALLS || !calls[code].handler) {
+    regs->eax = API_ERR_NOTFOUND;
+    return 1;
+  }
+
+  struct NativeApiCall *call = &calls[code];
+  ++call->count;
+
+  uint8_t timed = clocksource_tsc_present();
+  uint64_t started = timed ? clocksource_read_tsc() : 0;
+  uint32_t rtn = call->handler(regs);
+  if(timed) {
+    uint64_t cycles = clocksource_read_tsc() - started;
+    call->total_cycles += cycles;
+    if(cycles > call->max_cycles) call->max_cycles = cycles;
+    ++call->histogram[_histogram_bucket(cycles)];
+  }
+
+  regs->eax = rtn;
+  switch(call->return_mode) {
+    case NAPI_SWITCH_OUT:
+      return 0;
+    case NAPI_SWITCH_IF_ZERO:
+      return rtn==0 ? 0 : 1;
+    default:
+      return 1;
+  }
+}
+
+/*
+The kernel's own calls. These just take the arguments out of the registers for the api_ functions.
+*/
+static uint32_t _napi_exit(struct NativeApiRegs *regs)
+{
+  api_terminate_current_process();  //puts the process record into a TERMINATING state. The scheduler will trigger cleanup
+  return 0;
+}
+
+static uint32_t _napi_create_process(struct NativeApiRegs *regs)
+{
+  return (uint32_t)api_create_process();
+}
+
+static uint32_t _napi_sleep(struct NativeApiRegs *regs)
+{
+  api_sleep_current_process(regs->ebx);  //microseconds
+  return 0;
+}
+
+static uint32_t _napi_close(struct NativeApiRegs *regs)
+{
+  api_close(regs->ebx & 0xFFFF);
+  return 0;
+}
+
+static uint32_t _napi_open(struct NativeApiRegs *regs)
+{
+  return api_open((char *)regs->esi, (char *)regs->edi, (uint16_t)regs->ecx);
+}
+
+static uint32_t _napi_read(struct NativeApiRegs *regs)
+{
+  //returns 0 if the process now has to wait for the data
+  return (uint32_t)api_read(regs->ebx & 0xFFFF, (char *)regs->esi, regs->ecx);
+}
+
+static uint32_t _napi_write(struct NativeApiRegs *regs)
+{
+  return (uint32_t)api_write(regs->ebx & 0xFFFF, (char *)regs->esi, regs->ecx);
+}
+
+static uint32_t _napi_get_time(struct NativeApiRegs *regs)
+{
+  uint32_t seconds;
+  clock_wall_time(&seconds, NULL);
+  return seconds;
+}
+
+static uint32_t _napi_mmap(struct NativeApiRegs *regs)
+{
+  //returns the address of the mapping or an error code
+  return api_mmap(regs->ebx & 0xFFFF, regs->ecx, regs->edx, regs->esi);
+}
+
+static uint32_t _napi_munmap(struct NativeApiRegs *regs)
+{
+  return api_munmap((void *)regs->ebx, regs->ecx);
+}
+
+static uint32_t _napi_nice(struct NativeApiRegs *regs)
+{
+  //returns the new nice value or an error code
+  return (uint32_t)api_nice((int32_t)regs->ebx);
+}
+
+static uint32_t _napi_call_info(struct NativeApiRegs *regs)
+{
+  uint32_t code = regs->ebx;
+  struct NativeApiCallInfo *info = (struct NativeApiCallInfo *)regs->esi;
+
+  if(code>=NATIVE_API_MAX_CALLS || !calls[code].handler) return API_ERR_NOTFOUND;
+  if(!info || regs->ecx < sizeof(struct NativeApiCallInfo)) return API_ERR_NOTSUPP;
+  //the buffer comes straight from the caller, so all of it has to be writable memory of the caller's own
+  if(!vm_user_range_writable((vaddr)info, sizeof(struct NativeApiCallInfo))) return API_ERR_NOTSUPP;
+
+  struct NativeApiCall *call = &calls[code];
+  info->code = code;
+  memcpy(info->name, call->name, NATIVE_API_NAME_LENGTH);
+  info->count = call->count;
+  info->total_cycles = call->total_cycles;
+  info->max_cycles = call->max_cycles;
+  memcpy(info->histogram, call->histogram, sizeof(info->histogram));
+  return 0;
+}
+
+void native_api_register_builtins()
+{
+  if(!clocksource_tsc_present()) kputs("WARNING CPU has no TSC, native API calls will be counted but not timed\r\n");
+
+  native_api_register(API_EXIT, "exit", &_napi_exit, NAPI_SWITCH_OUT);
+  native_api_register(API_CREATE_PROCESS, "create_process", &_napi_create_process, NAPI_SWITCH_OUT);
+  native_api_register(API_SLEEP, "sleep", &_napi_sleep, NAPI_SWITCH_OUT);
+  native_api_register(API_CLOSE, "close", &_napi_close, NAPI_RETURN);
+  native_api_register(API_OPEN, "open", &_napi_open, NAPI_RETURN);
+  native_api_register(API_READ, "read", &_napi_read, NAPI_SWITCH_IF_ZERO);
+  native_api_register(API_WRITE, "write", &_napi_write, NAPI_RETURN);
+  native_api_register(API_GET_TIME, "get_time", &_napi_get_time, NAPI_RETURN);
+  native_api_register(API_MMAP, "mmap", &_napi_mmap, NAPI_RETURN);
+  native_api_register(API_MUNMAP, "munmap", &_napi_munmap, NAPI_RETURN);
+  native_api_register(API_NICE, "nice", &_napi_nice, NAPI_RETURN);
+  native_api_register(API_CALL_INFO, "call_info", &_napi_call_info, NAPI_RETURN);
+}
@@ -0,0 +1,82 @@
+#include <types.h>
+#include <process.h>
+#include <scheduler/scheduler.h>
+#include <stdio.h>
+#include <native_api/errors.h>
+#include <fs/fat_fileops.h>
+#include <sys/mmgr.h>
+#include <sys/filemap.h>
+#include "memory_ops.h"
+
+static struct ProcessTableEntry *_api_current_process(const char *caller)
+{
+  pid_t current_pid = get_active_pid();
+  if(current_pid==0) return NULL;
+
+  struct ProcessTableEntry *process = get_process(current_pid);
+  if(!process || process->status==PROCESS_NONE) return NULL;
+  if(process->magic!=PROCESS_TABLE_ENTRY_SIG) {
+    kprintf("ERROR %s process entry for %d is not valid, process table may be corrupted!\r\n", caller, current_pid);
+    return NULL;
+  }
+  return process;
+}
+
+/**
+Maps `length` bytes of the open file `fd`, starting at `offset`, into the calling process. No data is read now; each page is read
+from the file the first time it is touched, and the process sleeps until it arrives. Anything in the last page beyond the end
+of the file reads as zero. The mapping is private, so with MMAP_FLAG_WRITE the process can change its copy but the file is not updated.
+`offset` must be a multiple of the page size.
+Returns the address of the mapping, or an API_ERR_ code. Those are never page-aligned, so they can't be mistaken for an address.
+*/
+uint32_t api_mmap(uint32_t fd, size_t length, size_t offset, uint32_t flags)
+{
+  if(fd >= FILE_MAX || length==0 || (offset & (PAGE_SIZE-1))!=0) return API_ERR_NOTSUPP;
+
+  struct ProcessTableEntry *process = _api_current_process("api_mmap");
+  if(!process) return API_ERR_NOTSUPP;
+
+  struct FilePointer *fp = &process->files[fd];
+  if(fp->type!=FP_TYPE_VFAT || !fp->content) return API_ERR_NOTSUPP; //only files on disk can be mapped
+
+  VFatOpenFile *file = (VFatOpenFile *)fp->content;
+  if(offset >= file->file_length) return API_ERR_NOTSUPP;
+  size_t data_length = file->file_length - offset;
+  if(data_length > length) data_length = length;
+
+  //the mapping gets its own handle on the file, so that reading pages in doesn't move the process's file position
+  VFatOpenFile *mapping_file = vfat_open_by_location(file->parent_fs, file->first_cluster, file->file_length, file->fs_sector_offset);
+  if(!mapping_file) return API_ERR_NOTSUPP;
+
+  uint32_t page_flags = MP_USER;
+  if(flags & MMAP_FLAG_WRITE) page_flags |= MP_READWRITE;
+
+  struct FileMapping *m = file_mapping_new(mapping_file, offset, 0, data_length, page_flags);
+  if(!m) {
+    vfat_close(mapping_file);
+    return API_ERR_NOTSUPP;
+  }
+
+  //we are running on the process's own paging directory, so it is given by its physical address
+  size_t page_count = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+  vaddr base = file_mapping_attach(process, (uint32_t *)process->root_paging_directory_phys, m, 0, page_count);
+  if(!base) {
+    kprintf("ERROR api_mmap no room for 0x%x pages in process %d\r\n", page_count, process->pid);
+    file_mapping_free(m);
+    return API_ERR_NOTSUPP;
+  }
+  return (uint32_t)base;
+}
+
+/**
+Removes a mapping made by api_mmap. `addr` must be the address that api_mmap returned; the whole mapping goes, whatever `length` is.
+Returns 0 or an API_ERR_ code.
+*/
+uint32_t api_munmap(void *addr, size_t length)
+{
+  struct ProcessTableEntry *process = _api_current_process("api_munmap");
+  if(!process) return API_ERR_NOTSUPP;
+
+  if(file_mapping_remove(process, (vaddr)addr)!=0) return API_ERR_NOTSUPP;
+  return 0;
+}
@@ -0,0 +1,9 @@
+#include <types.h>
+
+#ifndef __API_MEMORY_OPS_H
+#define __API_MEMORY_OPS_H
+
+uint32_t api_mmap(uint32_t fd, size_t length, size_t offset, uint32_t flags);
+uint32_t api_munmap(void *addr, size_t length);
+
+#endif
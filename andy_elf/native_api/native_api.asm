@@ -3,6 +3,7 @@
 section .text
 global init_native_api
 global native_api_landing_pad
+global sysenter_landing_pad
 
 %include "apicodes.asm"
 %include "memlayout.asm"
@@ -11,25 +12,19 @@ extern CreateIA32IDTEntry
 ;kickoff.asm
 extern idle_loop
 
-;process_ops.c
-extern api_terminate_current_process
-extern api_sleep_current_process
-extern api_create_process
-
-;stream_ops.c
-extern api_close
-extern api_open
-extern api_read
-extern api_write
+;dispatch.c
+extern native_api_register_builtins
+extern native_api_dispatch
 
 ;scheduler/lowlevel.asm
 extern switch_out_process
 
-;drivers/cmos/rtc.c
-extern rtc_get_epoch_time
+;smp/smp.c
+extern kernel_lock
+extern kernel_unlock
 
 ;Purpose - initialise the native API by attaching the landing pad function to
-; the int 0x60 interrupt
+; the int 0x60 interrupt, and filling in the dispatch table
 init_native_api:
   push ebp
   mov ebp, esp
@@ -46,104 +41,75 @@ init_native_api:
   call CreateIA32IDTEntry
 
   pop es
+  call native_api_register_builtins
   pop ebp
   ret
 
-; native_api_landing_pad_v2:
-;   call enter_kernel_context
-;   mov esi, .napi_jump_table
-;   add esi, eax
-;   cmp esi, .napi_jump_table_end
-;   jg .napi_nf
-;   call esi
-;   jmp .napi_rtn_to_kern
-
-; .napi_jump_table:
-;   dd api_terminate_current_process
-;   dd api_sleep_current_process
-;   dd api_create_process
-;   dd api_close
-;   dd api_open
-;   dd api_read
-;   dd api_write
-;   dd api_get_time
-; .napi_jump_table_end:
-;   nop
+;SYSENTER comes here, see native_api/sysenter.c. It gives us the kernel stack but nothing else, so we make it look like
+;int 0x60 had been used and then carry on with the same code. The caller has pushed its return address and put its stack
+;pointer into EBP. CS in the frame is GDT_SYSEXIT_CS rather than the usual user CS, which tells .napi_rtn_direct that it
+;can go back with SYSEXIT; if the process gets switched out instead then exit_to_process goes back with iret as usual.
+;EBP is whatever the process says it is, so it has to point into the process's own address space before we read through it.
+sysenter_landing_pad:
+  jmp 0x08:.reload_cs   ;SYSENTER loads CS and SS from GDT_SYSENTER_CS, the rest of the kernel expects its usual ones
+.reload_cs:
+  push eax
+  mov ax, 0x10
+  mov ss, ax
+  pop eax
+  cmp ebp, AppVaStart
+  jb .bad_user_stack
+  cmp ebp, 0xFFFFFFFC   ;the return address has to fit below the top of memory
+  ja .bad_user_stack
+  push dword 0x53       ;user SS, GDT_SYSEXIT_SS | 3
+  add ebp, 4
+  push ebp              ;user ESP, once the return address has been popped
+  pushfd
+  or dword [esp], 0x200 ;SYSENTER turned interrupts off, the process had them on
+  push dword 0x4B       ;user CS, GDT_SYSEXIT_CS | 3
+  push dword [ebp-4]    ;user EIP, the return address
+  jmp native_api_landing_pad
+
+.bad_user_stack:
+  ;there is no trustworthy return address, so the call becomes an exit. That switches the process out, so the
+  ;EIP and ESP in this frame are never used.
+  mov eax, API_EXIT
+  push dword 0x53
+  push dword 0
+  pushfd
+  or dword [esp], 0x200
+  push dword 0x4B
+  push dword 0
+  ;fall through
 
 ;this interrupt handler is called for every native API call. Its job is to dispatch
-;the call into the necessary handler (usually a C function)
+;the call into the necessary handler, which native_api_dispatch looks up in its table
 native_api_landing_pad:
-  cmp eax, API_EXIT
-  jnz .napi_2
-  call api_terminate_current_process ;puts the process record into a TERMINATING state. The scheduler will trigger cleanup
-  jmp .napi_rtn_to_kern
-.napi_2:
-  cmp eax, API_SLEEP
-  jnz .napi_3
-  call api_sleep_current_process
-  jmp .napi_rtn_to_kern
-.napi_3:
-  cmp eax, API_CREATE_PROCESS
-  jnz .napi_4
-  call api_create_process
-  jmp .napi_rtn_to_kern
-.napi_4:
-  cmp eax, API_CLOSE
-  jnz .napi_5
-  call api_close
-  jmp .napi_rtn_direct
-.napi_5:
-  cmp eax, API_OPEN
-  jnz .napi_6
-  call api_open
-  jmp .napi_rtn_direct
-.napi_6:
-  cmp eax, API_READ
-  jnz .napi_7
-  push ecx        ;length
-  push esi        ;pointer
-  and ebx, 0xFFFF
-  push ebx        ;file descriptor
-  call api_read
-  add esp, 12
-  test ax,ax
-  jnz .napi_rtn_direct
-  jmp .napi_rtn_to_kern
-.napi_7:
-  cmp eax, API_WRITE
-  jnz .napi_8
-  push ecx          ;length
-  push esi          ;pointer
-  and ebx, 0xFFFF
-  push ebx          ;file descriptor
-  call api_write
-  add esp, 12
-
-  jmp .napi_rtn_direct
-.napi_8:
-  cmp eax, API_GET_TIME
-  jnz .napi_nf
-  push ebx
-  push ecx
-  push edx
-  push edi
-  push esi
-  call rtc_get_epoch_time
-  pop esi
-  pop edi
-  pop edx
-  pop ecx
-  pop ebx
-  jmp .napi_rtn_direct
-
-.napi_nf:
-  ;we did not recognise the API code. Fallthrough to return to process.
-  mov eax, API_ERR_NOTFOUND
+  pushad            ;struct NativeApiRegs in include/native_api/dispatch.h
+  call kernel_lock  ;kept hold of on the way back to the kernel, idle_loop expects to have it
+  push esp
+  call native_api_dispatch  ;puts the return value into the saved EAX
+  add esp, 4
+  test al, al
+  jz .napi_rtn_to_kern
 
 .napi_rtn_direct:
+  call kernel_unlock
+  popad
+  cmp dword [esp+4], 0x4B
+  je .napi_sysexit
   iret
 
+.napi_sysexit:
+  ;SYSEXIT goes back to EIP = edx and ESP = ecx, which is why the caller can't have those back. Nothing needs popping,
+  ;the next SYSENTER or interrupt starts again from the top of the kernel stack.
+  mov edx, [esp]
+  mov ecx, [esp+12]
+  sti               ;doesn't take effect until after the next instruction, so nothing can interrupt us in between
+  sysexit
+
 .napi_rtn_to_kern:
+  popad
   call switch_out_process
   ;set up a stack frame that gets us back to the kernel idle loop
   pushf
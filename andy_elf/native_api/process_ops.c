@@ -1,6 +1,10 @@
 #include <types.h>
 #include <stdio.h>
 #include <process.h>
+#include <scheduler/scheduler.h>
+#include <scheduler/runqueue.h>
+#include <scheduler/waitqueue.h>
+#include <native_api/errors.h>
 
 void api_terminate_current_process()
 {
@@ -12,13 +16,43 @@ void api_terminate_current_process()
     }
 
     kprintf("\r\nDEBUG api_terminate PID %d is at 0x%x\r\n", current_pid, entry);
-    entry->status = PROCESS_TERMINATING;
+    process_set_status(entry, PROCESS_TERMINATING);
     schedule_cleanup_task(current_pid);
 }
 
-void api_sleep_current_process()
+/**
+Puts the calling process to sleep for `microseconds`. It is on no run queue in the meantime, so it uses no CPU.
+Sleeping for 0 just gives up the rest of the quantum.
+*/
+void api_sleep_current_process(uint32_t microseconds)
 {
+    pid_t current_pid = get_active_pid();
+    struct ProcessTableEntry *entry = get_process(current_pid);
+    if(current_pid==0 || entry==NULL) return;
+
+    if(microseconds==0) {
+        process_set_status(entry, PROCESS_READY);
+        return;
+    }
+    wait_queue_wait(NULL, entry, (uint64_t)microseconds * NS_PER_US, 0, NULL);
+}
+
+/**
+Adds `increment` to the calling process's nice value, which runs from -16 (most favoured) to 15. Returns the new nice value,
+or API_ERR_NOTSUPP if there is no calling process.
+Callers of the native API are all unprivileged user processes, so a negative increment can only take back an earlier
+positive one; the result is clamped so that a process never gets ahead of the default (nice 0).
+*/
+int32_t api_nice(int32_t increment)
+{
+    pid_t current_pid = get_active_pid();
+    struct ProcessTableEntry *entry = get_process(current_pid);
+    if(current_pid==0 || entry==NULL) return API_ERR_NOTSUPP;
 
+    int32_t priority = (int32_t)entry->priority + increment;
+    if(increment < 0 && priority < SCHED_PRIORITY_DEFAULT) priority = SCHED_PRIORITY_DEFAULT;
+    process_set_priority(entry, priority);
+    return (int32_t)entry->priority - SCHED_PRIORITY_DEFAULT;
 }
 
 pid_t api_create_process()
@@ -4,7 +4,8 @@
 #define __API_PROCESS_OPS_H
 
 void api_terminate_current_process();
-void api_sleep_current_process();
+void api_sleep_current_process(uint32_t microseconds);
+int32_t api_nice(int32_t increment);
 pid_t api_create_process();
 
 #endif
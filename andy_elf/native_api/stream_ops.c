@@ -1,13 +1,36 @@
 #include <types.h>
 #include <process.h>
 #include <scheduler/scheduler.h>
+#include <scheduler/runqueue.h>
+#include <scheduler/waitqueue.h>
 #include <stdio.h>
+#include <malloc.h>
+#include <memops.h>
+#include <sys/mmgr.h>
+#include <errors.h>
 #include <native_api/errors.h>
 #include <fs/fat_fileops.h>
 #include <drivers/kb_buffer.h>
 #include "stream_ops.h"
 #include "console.h"
 
+//the largest VFAT read that is done in one go. The data is bounced through the kernel heap, so a bigger request gets a short count
+//and the app reads again for the rest.
+#define API_READ_MAX_CHUNK  (4*PAGE_SIZE)
+
+//processes that are blocked in api_read on a VFAT file. Each one waits with its open file as the data.
+static WaitQueue vfat_readers = { NULL, NULL };
+
+/**
+A VFAT read in flight. The completion runs in whatever address space happens to be loaded, so the file system reads into
+`data` here in kernel memory and it is copied into the process's own buffer just before the process is woken.
+*/
+struct VfatReadRequest {
+  struct ProcessTableEntry *process;
+  char *user_buf;
+  char data[];
+};
+
 uint32_t api_open(char *filename, char *xtn, uint16_t mode_flags)
 {
 
@@ -20,7 +43,20 @@ void api_close(uint32_t fd)
 
 void _api_process_read_completed(VFatOpenFile *fp, uint8_t status, size_t bytes_read, void *buf, void *extradata)
 {
-  kprintf("INFO _api_process_read_completed FIXME not implemented yet!\r\n");
+  struct VfatReadRequest *req = (struct VfatReadRequest *)extradata;
+  //if the reader has been terminated in the meantime then its paging directory may already be gone
+  WaitQueueEntry *e = wait_queue_entry(req->process);
+  if(status==E_OK && bytes_read>0 && e->waiting && e->data==(void *)fp) {
+    vaddr old_pd = switch_paging_directory_if_required((vaddr)req->process->root_paging_directory_phys);
+    memcpy(req->user_buf, req->data, bytes_read);
+    if(old_pd!=0) switch_paging_directory_if_required(old_pd);
+  }
+  free(req);
+
+  //the reader goes straight back on the run queue, and gets the byte count (or error) as the return value of its read
+  if(!wait_queue_wake_data(&vfat_readers, (void *)fp, status==E_OK ? (uint32_t)bytes_read : API_ERR_IO)) {
+    kprintf("WARNING VFAT read completed for 0x%x but nobody is waiting for it\r\n", fp);
+  }
 }
 
 size_t api_read(uint32_t fd, char *buf, size_t len)
@@ -52,11 +88,17 @@ size_t api_read(uint32_t fd, char *buf, size_t len)
     case FP_TYPE_CONSOLE:
       return kb_read_to_file(process, fp);
     case FP_TYPE_VFAT:
-      //FIXME: callbacks will be run in kernel context, so we need to translate the buffer into kernel space first.
-      vfat_read_async((VFatOpenFile *)fp->content, buf, len, (void *)process, &_api_process_read_completed);
-      process->status = PROCESS_IOWAIT;
-      //FIXME: we are going into IOWAIT so need to switch context
-      return 0;
+    {
+      if(len > API_READ_MAX_CHUNK) len = API_READ_MAX_CHUNK;
+      struct VfatReadRequest *req = (struct VfatReadRequest *)malloc(sizeof(struct VfatReadRequest) + len);
+      if(!req) return API_ERR_NOMEM;
+      req->process = process;
+      req->user_buf = buf;
+      //Start waiting first, because if the read fails straight away then the completion runs before vfat_read_async returns.
+      wait_queue_wait(&vfat_readers, process, WAIT_FOREVER, 0, fp->content);
+      vfat_read_async((VFatOpenFile *)fp->content, req->data, len, (void *)req, &_api_process_read_completed);
+      return 0; //we are in IOWAIT now, so the landing pad switches us out
+    }
     default:
       kprintf("ERROR api_read fd %l for process %d is not valid, unknown type\r\n", fd, current_pid);
       return API_ERR_CONSISTENCY;
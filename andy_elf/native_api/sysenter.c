@@ -0,0 +1,36 @@
+#include <types.h>
+#include <stdio.h>
+#include <cpuid.h>
+#include <sys/gdt.h>
+#include <sys/smp.h>
+#include <native_api/sysenter.h>
+
+extern void sysenter_landing_pad();   //native_api.asm
+
+static uint8_t sysenter_supported = 0;
+
+static inline void _wrmsr(uint32_t msr, uint32_t value)
+{
+  asm volatile("wrmsr" : : "c"(msr), "a"(value), "d"(0));
+}
+
+void init_sysenter()
+{
+  if(!(cpuid_edx_features() & CPUID_FEAT_EDX_SEP)) {
+    kputs("CPU does not support SYSENTER, the native API is only available through int 0x60\r\n");
+    return;
+  }
+  kputs("CPU supports SYSENTER, enabling the fast native API entry point\r\n");
+  sysenter_supported = 1;
+  sysenter_initialise_cpu();
+}
+
+void sysenter_initialise_cpu()
+{
+  if(!sysenter_supported) return;
+
+  _wrmsr(MSR_IA32_SYSENTER_CS, GDT_SYSENTER_CS);
+  //the same place as an interrupt from ring 3 would start, i.e. the TSS's esp0
+  _wrmsr(MSR_IA32_SYSENTER_ESP, smp_kernel_stack() - 0x08);
+  _wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t)&sysenter_landing_pad);
+}
@@ -5,12 +5,17 @@
 #include <memops.h>
 #include <panic.h>
 #include <sys/mmgr.h>
-#include <drivers/kb_buffer.h>
+#include <sys/vaspace.h>
+#include <sys/shared_image.h>
+#include <sys/filemap.h>
+#include <scheduler/runqueue.h>
+#include <scheduler/waitqueue.h>
+#include <sys/smp.h>
 
 /**
- * Routine to actually cleanup the process.  This is called from the scheduler by schedule_cleanup_task
+ * Routine to actually cleanup the process.  Needs the kernel lock, see cleanup_process
 */
-void cleanup_process(SchedulerTask *t)
+static void _cleanup_process(SchedulerTask *t)
 {
     kputs("DEBUG entered cleanup_process\r\n");
     pid_t pid = (pid_t)t->data;
@@ -27,9 +32,10 @@ void cleanup_process(SchedulerTask *t)
         return;
     }
 
-    // Clean up any pending keyboard operations for this process
-    kputs("DEBUG cleanup_process: cleaning keyboard operations\r\n");
-    kb_cleanup_process_operations(process);
+    // Take it off anything it was waiting for, e.g. keyboard input
+    wait_queue_cancel(process);
+    //and any files it had mapped. The pages that were read in go with the rest of its memory, below.
+    file_mapping_release_all(process);
 
     //get hold of the process's memory table
     uint32_t *pagingdir = map_app_pagingdir(process->root_paging_directory_phys, APP_PAGEDIRS_BASE);
@@ -46,7 +52,7 @@ void cleanup_process(SchedulerTask *t)
     
     // Reset the process table entry to PROCESS_NONE to indicate it's available
     // Clear any stale data that might cause issues
-    process->status = PROCESS_NONE;
+    process_set_status(process, PROCESS_NONE);
     process->root_paging_directory_phys = NULL;
     process->root_paging_directory_kmem = NULL;
     process->heap_start = NULL;
@@ -54,10 +60,29 @@ void cleanup_process(SchedulerTask *t)
     process->heap_used = 0;
     process->stack_phys_ptr = NULL;
     process->stack_kmem_ptr = NULL;
+    if(process->va_space) {
+      va_space_destroy(process->va_space);
+      free(process->va_space);
+    }
+    process->va_space = NULL;
+    //the shared read-only pages were skipped by free_app_memory; they go once nothing else is running this file
+    if(process->shared_image) shared_image_unref(process->shared_image);
+    process->shared_image = NULL;
     
     kprintf("INFO cleanup_process done\r\n");
 }
 
+/**
+ * This is called from the scheduler by schedule_cleanup_task. Task workers run without the kernel lock, and just about
+ * everything that the cleanup touches needs it.
+*/
+void cleanup_process(SchedulerTask *t)
+{
+    kernel_lock();
+    _cleanup_process(t);
+    kernel_unlock();
+}
+
 /**
  * We need to clean up a terminated process, but do this off the critical path.
  * Schedule a callback task for the scheduler to call when idle.
@@ -7,9 +7,28 @@
 #include <memops.h>
 #include <sys/mmgr.h>
 #include <malloc.h>
+#include <slab.h>
+#include <panic.h>
 #include <exeformats/elf.h>
+#include <sys/shared_image.h>
 #include "elfloader.h"
 
+//load list entries are small and get created and thrown away for every program load
+static SlabCache *load_list_cache = NULL;
+
+void elf_loader_init() {
+  load_list_cache = slab_cache_create("LoadList", sizeof(struct LoadList));
+  if(!load_list_cache) {
+    k_panic("Unable to create ELF load list cache\r\n");
+  }
+}
+
+struct LoadList *new_load_list_entry() {
+  struct LoadList *entry = (struct LoadList *)slab_alloc(load_list_cache);
+  if(entry) memset(entry, 0, sizeof(struct LoadList));
+  return entry;
+}
+
 struct LoadList *load_list_push(struct LoadList *list, struct LoadList *new) {
   if(!new) return list;
   if (!list) return new;
@@ -35,7 +54,7 @@ void delete_load_list(struct LoadList *list, uint8_t free_vptr) {
   while (cur) {
     struct LoadList *next = cur->next;
     if (cur->vptr && free_vptr) free(cur->vptr);
-    free(cur);
+    slab_free(load_list_cache, cur);
     cur = next;
   }
 }
@@ -44,6 +63,7 @@ void delete_elf_parsed_data(struct elf_parsed_data *t) {
   if(!t) return;
   if(t->file_header) free(t->file_header);
   if(t->program_headers) free(t->program_headers);
+  if(t->shared_image) shared_image_unref(t->shared_image);
   free(t);
 }
 
@@ -148,16 +168,38 @@ void _elf_loaded_program_headers(VFatOpenFile *fp, uint8_t status, size_t bytes_
   t->parsed_data->program_headers_count = t->parsed_data->file_header->i386_subheader.program_header_table_entry_count;
   kprintf("INFO Loaded %d ELF program headers\r\n", t->parsed_data->program_headers_count);
 
+  //If another process is already running this file then its read-only segments are in memory, and we don't need to read them again
+  t->parsed_data->shared_image = shared_image_find(&t->image_key);
+
   //Now we must build a load-list
   for(size_t i = 0; i < t->parsed_data->program_headers_count; i++) {
-    struct LoadList *entry = (struct LoadList *) malloc(sizeof(struct LoadList));
+    ElfProgramHeader32 *ph = &t->parsed_data->program_headers[i];
+    if(t->parsed_data->shared_image && ph->p_type==PT_LOAD && !(ph->p_flags & PF_W) &&
+      shared_image_find_segment(t->parsed_data->shared_image, ph->p_vaddr & ~0xFFF)) {
+      #ifdef ELFLOADER_VERBOSE
+      kprintf("DEBUG Segment %d is already loaded in a shared image\r\n", i);
+      #endif
+      continue;
+    }
+    //A read-only segment that isn't in the shared image yet is read in now if there is no image, because this process is
+    //going to start one and the next process can then map it rather than reading it again. Only if there is an image that
+    //doesn't have it (i.e. it couldn't be shared) is it worth loading on demand.
+    uint8_t lazy_ok = (ph->p_flags & PF_W) || t->parsed_data->shared_image!=NULL;
+    if(ph->p_type==PT_LOAD && ph->p_filesz>=ELF_LAZY_SEGMENT_MIN && lazy_ok && i<32) {
+      //big segments are not read now, so that the program can start sooner. The process maps them from the file instead.
+      #ifdef ELFLOADER_VERBOSE
+      kprintf("DEBUG Segment %d will be loaded on demand\r\n", i);
+      #endif
+      t->parsed_data->lazy_segments |= (1 << i);
+      continue;
+    }
+    struct LoadList *entry = new_load_list_entry();
     if(!entry) {
       kprintf("ERROR: Out of memory\r\n");
       t->callback(E_NOMEM, t->parsed_data, t->extradata);
       delete_elf_loader_state(t);
       return;
     }
-    memset(entry, 0, sizeof(struct LoadList));
     entry->file_offset = t->parsed_data->program_headers[i].p_offset;
     entry->length = t->parsed_data->program_headers[i].p_filesz;
     t->load_list = load_list_push(t->load_list, entry);
@@ -175,7 +217,7 @@ void _elf_loaded_program_headers(VFatOpenFile *fp, uint8_t status, size_t bytes_
       struct LoadList *to_delete = cur->next;
       cur->length += to_delete->length;
       cur->next = to_delete->next;
-      free(to_delete);
+      slab_free(load_list_cache, to_delete);
     }
   }
 
@@ -188,6 +230,13 @@ void _elf_loaded_program_headers(VFatOpenFile *fp, uint8_t status, size_t bytes_
   #endif
 
   //now we can start loading the segments
+  if(t->load_list_count==0 && (t->parsed_data->shared_image || t->parsed_data->lazy_segments)) {
+    //everything was already in memory, or will be read when it is needed
+    t->callback(E_OK, t->parsed_data, t->extradata);
+    delete_elf_loader_state(t);
+    vfat_close(fp);
+    return;
+  }
   if(t->load_list_count==0) {
     kprintf("ERROR: ELF file has no loadable segments\r\n");
     t->callback(E_MALFORMED_ELF, t->parsed_data, t->extradata);
@@ -297,6 +346,7 @@ void _elf_loaded_file_header(VFatOpenFile *fp, uint8_t status, size_t bytes_read
   }
   memset(t->parsed_data, 0, sizeof(struct elf_parsed_data));
   t->parsed_data->file_header = header;
+  t->parsed_data->image_key = t->image_key;
   #ifdef ELFLOADER_VERBOSE
   kprintf("INFO ELF entry point is 0x%x\r\n", header->i386_subheader.entrypoint);
   kprintf("INFO ELF has %d program headers, at offset 0x%x\r\n", header->i386_subheader.program_header_table_entry_count, header->i386_subheader.program_header_offset);
@@ -360,6 +410,11 @@ void elf_load_and_parse(FATFS* fs_ptr, DirectoryEntry *file, void *extradata, vo
   t->extradata = extradata;
   t->callback = callback;
   t->file = fp;
+  t->image_key.fs = (void *)fs_ptr;
+  t->image_key.first_cluster = FAT32_CLUSTER_NUMBER(file);
+  t->image_key.file_size = file->file_size;
+  t->image_key.last_mod_time = file->last_mod_time;
+  t->image_key.last_mod_date = file->last_mod_date;
 
   /* Step one - load in the file header */
   ElfFileHeader *header_buf = (ElfFileHeader *)malloc(sizeof(ElfFileHeader));
@@ -4,6 +4,8 @@
 #ifndef __ELFLOADER_H
 #define __ELFLOADER_H
 
+#define ELF_LAZY_SEGMENT_MIN  0x10000 //PT_LOAD segments with at least this much file data are not read in by the loader, but loaded a page at a time as the program touches them. Read-only segments that can go into a shared image are always read in.
+
 struct ElfLoaderState {
     struct LoadList *load_list;
     size_t load_list_count;
@@ -13,10 +15,17 @@ struct ElfLoaderState {
     struct elf_parsed_data *parsed_data;
     VFatOpenFile *file;
 
+    struct SharedImageKey image_key;
+
     void *extradata;
     void (*callback)(uint8_t status, struct elf_parsed_data* parsed_data, void* extradata);
 };
 
+/**
+ * Sets up the ELF loader's object caches. Called once at boot, before any program is loaded.
+*/
+void elf_loader_init();
+
 /**
  * Removes an ELF parsed data container and all references within it
 */
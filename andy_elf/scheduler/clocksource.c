@@ -0,0 +1,195 @@
+#include <types.h>
+#include <stdio.h>
+#include <cpuid.h>
+#include <kernel_config.h>
+#include <sys/ioports.h>
+#include <scheduler/timer.h>
+#include <scheduler/clocksource.h>
+#include "../drivers/cmos/rtc.h"
+#include "../drivers/cmos/lowlevel.h"
+
+#define RTC_TICK_NS   1953125   //the RTC interrupt runs at 512Hz
+
+static uint8_t tsc_present = 0;
+static uint8_t source = CLOCKSOURCE_PIT;
+static uint32_t tsc_khz = 0;
+static uint32_t tsc_mult = 0;
+static uint64_t tsc_base = 0;       //the TSC when it took over from the PIT
+static uint64_t tsc_base_ns = 0;    //and timer_now_ns() at the same time, so that the clock carries straight on
+
+//the wall clock is worked out from the monotonic one
+static uint32_t wall_base_seconds = 0;
+static uint32_t wall_base_nsec = 0;
+static uint64_t wall_base_ns = 0;
+
+/**
+(cycles * tsc_mult) >> CLOCKSOURCE_SHIFT without losing the top of the product.
+*/
+static inline uint64_t _cycles_to_ns(uint64_t cycles)
+{
+  uint64_t low = (uint64_t)(uint32_t)cycles * tsc_mult;
+  uint64_t high = (uint64_t)(uint32_t)(cycles >> 32) * tsc_mult;
+  return (high << (32 - CLOCKSOURCE_SHIFT)) + (low >> CLOCKSOURCE_SHIFT);
+}
+
+static uint8_t _tsc_is_invariant()
+{
+  uint32_t eax = 0x80000000, ebx, ecx = 0, edx;
+  asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+  if(eax < 0x80000007) return 0;
+
+  eax = 0x80000007;
+  ecx = 0;
+  asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+  return (edx & (1 << 8)) ? 1 : 0;
+}
+
+/**
+Counts TSC cycles over CLOCKSOURCE_CALIBRATE_TICKS ticks of the RTC, starting on a tick so that none of them are partial.
+Returns 0 if the RTC doesn't tick when it should.
+*/
+static uint64_t _calibrate_against_rtc(uint32_t *elapsed_us)
+{
+  uint64_t give_up = timer_now_ns() + 10*NS_PER_MS;
+  uint32_t start = rtc_get_ticks();
+  while(rtc_get_ticks()==start) {
+    if(timer_now_ns() > give_up) return 0;
+    asm volatile("pause");
+  }
+
+  start = rtc_get_ticks();
+  uint64_t tsc_start = clocksource_read_tsc();
+  give_up = timer_now_ns() + 2 * (uint64_t)CLOCKSOURCE_CALIBRATE_TICKS * RTC_TICK_NS;
+  while(rtc_get_ticks() - start < CLOCKSOURCE_CALIBRATE_TICKS) {
+    if(timer_now_ns() > give_up) return 0;
+    asm volatile("pause");
+  }
+  uint64_t cycles = clocksource_read_tsc() - tsc_start;
+
+  *elapsed_us = CLOCKSOURCE_CALIBRATE_TICKS * (RTC_TICK_NS / 125) / 8;  //RTC_TICK_NS isn't a whole number of microseconds
+  return cycles;
+}
+
+/**
+Counts TSC cycles over CLOCKSOURCE_CALIBRATE_PIT_MS of the PIT-based timer.
+*/
+static uint64_t _calibrate_against_pit(uint32_t *elapsed_us)
+{
+  uint64_t start_ns = timer_now_ns();
+  uint64_t tsc_start = clocksource_read_tsc();
+  uint64_t now_ns;
+  do {
+    asm volatile("pause");
+    now_ns = timer_now_ns();
+  } while(now_ns - start_ns < (uint64_t)CLOCKSOURCE_CALIBRATE_PIT_MS * NS_PER_MS);
+  uint64_t cycles = clocksource_read_tsc() - tsc_start;
+
+  *elapsed_us = (uint32_t)(now_ns - start_ns) / NS_PER_US;
+  return cycles;
+}
+
+static void _set_wall_base()
+{
+  uint32_t flags = irq_save();
+  uint32_t rtc_ticks = rtc_get_ticks();
+  wall_base_ns = clock_monotonic_ns();
+  irq_restore(flags);
+
+  wall_base_seconds = rtc_get_boot_time() + (rtc_ticks >> 9);
+  wall_base_nsec = (rtc_ticks & 511) * RTC_TICK_NS;
+}
+
+void initialise_clocksource()
+{
+  tsc_present = (cpuid_edx_features() & CPUID_FEAT_EDX_TSC) ? 1 : 0;
+
+  if(!tsc_present) {
+    kputs("INFO CPU has no TSC, the clock will count PIT clocks\r\n");
+    _set_wall_base();
+    return;
+  }
+  if(config_commandline_uint((struct KernelConfig *)get_kernel_config(), "tsc", 1)==0) {
+    kputs("INFO TSC clocksource disabled by tsc=0, the clock will count PIT clocks\r\n");
+    _set_wall_base();
+    return;
+  }
+
+  uint32_t elapsed_us = 0;
+  const char *reference = "RTC";
+  uint64_t cycles = _calibrate_against_rtc(&elapsed_us);
+  if(cycles==0) {
+    kputs("WARNING RTC is not ticking, calibrating the TSC against the PIT instead\r\n");
+    reference = "PIT";
+    cycles = _calibrate_against_pit(&elapsed_us);
+  }
+
+  uint64_t khz = cycles * 1000;
+  timer_div64(&khz, elapsed_us ? elapsed_us : 1);
+  //CLOCKSOURCE_SHIFT leaves room in 32 bits for the multiplier of anything from 1MHz up
+  if(khz < 1000 || khz >> 32) {
+    kprintf("WARNING TSC calibration against the %s gave a nonsensical rate, the clock will count PIT clocks\r\n", reference);
+    _set_wall_base();
+    return;
+  }
+  tsc_khz = (uint32_t)khz;
+
+  uint64_t mult = (uint64_t)1000000 << CLOCKSOURCE_SHIFT;
+  timer_div64(&mult, tsc_khz);
+
+  uint32_t flags = irq_save();
+  tsc_mult = (uint32_t)mult;
+  tsc_base_ns = timer_now_ns();
+  tsc_base = clocksource_read_tsc();
+  source = CLOCKSOURCE_TSC;
+  irq_restore(flags);
+  _set_wall_base();
+
+  kprintf("INFO TSC runs at %d kHz, calibrated against the %s\r\n", tsc_khz, reference);
+  if(!_tsc_is_invariant()) kputs("WARNING TSC is not invariant, the clock may drift if the CPU changes speed\r\n");
+}
+
+uint8_t clocksource_type()
+{
+  return source;
+}
+
+uint8_t clocksource_tsc_present()
+{
+  return tsc_present;
+}
+
+uint32_t clocksource_tsc_khz()
+{
+  return source==CLOCKSOURCE_TSC ? tsc_khz : 0;
+}
+
+uint32_t clocksource_tsc_mult()
+{
+  return source==CLOCKSOURCE_TSC ? tsc_mult : 0;
+}
+
+uint64_t clocksource_tsc_to_ns(uint64_t tsc)
+{
+  //another processor's TSC can be a little behind the one that took the base reading
+  if(tsc < tsc_base) return tsc_base_ns;
+  return tsc_base_ns + _cycles_to_ns(tsc - tsc_base);
+}
+
+uint64_t clock_monotonic_ns()
+{
+  if(source==CLOCKSOURCE_TSC) return clocksource_tsc_to_ns(clocksource_read_tsc());
+  return timer_now_ns();
+}
+
+void clock_wall_from_monotonic(uint64_t monotonic_ns, uint32_t *seconds, uint32_t *nsec)
+{
+  uint64_t ns = wall_base_nsec + (monotonic_ns > wall_base_ns ? monotonic_ns - wall_base_ns : 0);
+  uint32_t rem = timer_div64(&ns, NS_PER_SECOND);
+  if(seconds) *seconds = wall_base_seconds + (uint32_t)ns;
+  if(nsec) *nsec = rem;
+}
+
+void clock_wall_time(uint32_t *seconds, uint32_t *nsec)
+{
+  clock_wall_from_monotonic(clock_monotonic_ns(), seconds, nsec);
+}
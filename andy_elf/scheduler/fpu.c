@@ -0,0 +1,179 @@
+#include <types.h>
+#include <stdio.h>
+#include <malloc.h>
+#include <memops.h>
+#include <cpuid.h>
+#include <process.h>
+#include <sys/smp.h>
+#include <sys/x86_control_registers.h>
+#include <scheduler/runqueue.h>
+#include <scheduler/fpu.h>
+#include "../mmgr/process.h"
+
+static uint8_t fpu_present = 0;
+static uint8_t fxsr_supported = 0;
+static uint8_t sse_supported = 0;
+
+//malloc doesn't promise 16-byte alignment, so the save areas are over-allocated and lined up by hand
+#define _save_area(p) ((void *)(((vaddr)(p)->fpu_state + 15) & ~(vaddr)15))
+
+static inline uint32_t _read_cr0()
+{
+  uint32_t cr0;
+  asm volatile("mov %%cr0, %0" : "=r"(cr0));
+  return cr0;
+}
+
+static inline void _write_cr0(uint32_t cr0)
+{
+  asm volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline uint32_t _read_cr4()
+{
+  uint32_t cr4;
+  asm volatile("mov %%cr4, %0" : "=r"(cr4));
+  return cr4;
+}
+
+static inline void _write_cr4(uint32_t cr4)
+{
+  asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static inline void _set_ts()
+{
+  uint32_t cr0 = _read_cr0();
+  if(!(cr0 & CR0_TS)) _write_cr0(cr0 | CR0_TS);
+}
+
+void initialise_fpu()
+{
+  uint32_t cpuid_edx = cpuid_edx_features();
+
+  fpu_present = (cpuid_edx & CPUID_FEAT_EDX_FPU) ? 1 : 0;
+  fxsr_supported = (cpuid_edx & CPUID_FEAT_EDX_FXSR) ? 1 : 0;
+  sse_supported = fxsr_supported && (cpuid_edx & CPUID_FEAT_EDX_SSE) ? 1 : 0;
+
+  if(!fpu_present) {
+    kputs("WARNING CPU has no FPU, processes that use floating-point will be terminated\r\n");
+  } else if(sse_supported) {
+    kputs("CPU supports SSE, enabling FXSAVE and SIMD exceptions.\r\n");
+  } else if(fxsr_supported) {
+    kputs("CPU supports FXSAVE but not SSE.\r\n");
+  } else {
+    kputs("CPU does not support FXSAVE, FPU registers will be switched with FNSAVE\r\n");
+  }
+  fpu_initialise_cpu();
+}
+
+void fpu_initialise_cpu()
+{
+  if(!fpu_present) {
+    _write_cr0(_read_cr0() | CR0_EM);
+    return;
+  }
+
+  uint32_t cr4 = _read_cr4();
+  if(sse_supported) cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+  _write_cr4(cr4);
+
+  //MP makes WAIT trap with TS set as well, so that it can't see another process's exceptions
+  uint32_t cr0 = (_read_cr0() & ~(CR0_EM)) | CR0_MP;
+  _write_cr0(cr0 & ~(CR0_TS));
+  asm volatile("fninit");
+  _write_cr0(cr0 | CR0_TS);
+
+  this_cpu()->fpu_owner = 0;
+}
+
+/**
+Gives a process that has never used the FPU a save area and a clean set of registers. Returns 1 if there is no memory for it.
+*/
+static uint8_t _first_use(struct ProcessTableEntry *p)
+{
+  p->fpu_state = malloc((fxsr_supported ? FPU_FXSAVE_SIZE : FPU_FNSAVE_SIZE) + 15);
+  if(!p->fpu_state) return 1;
+
+  asm volatile("fninit");
+  //fninit leaves MXCSR alone, so it would still have whatever the last process put there
+  if(sse_supported) {
+    uint32_t mxcsr = FPU_MXCSR_DEFAULT;
+    asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+  }
+  return 0;
+}
+
+uint8_t fpu_device_not_available()
+{
+  struct CpuState *cpu = this_cpu();
+  struct ProcessTableEntry *p = get_current_process();
+  if(!p || p->pid==0) {
+    kputs("ERROR FPU used with no process running\r\n");
+    return 1;
+  }
+
+  if(fpu_present) {
+    _write_cr0(_read_cr0() & ~(CR0_TS));
+    if(!p->fpu_state) {
+      if(_first_use(p)==0) {
+        cpu->fpu_owner = p->pid;
+        p->fpu_cpu = cpu->index;
+        return 0;
+      }
+      _set_ts();
+      kprintf("ERROR No memory for the FPU registers of process %d, terminating it\r\n", (uint32_t)p->pid);
+    } else {
+      //the registers might still be the ones that it left behind, if nothing else has used the FPU here since
+      if(cpu->fpu_owner!=p->pid || p->fpu_cpu!=cpu->index) {
+        if(fxsr_supported) {
+          asm volatile("fxrstor (%0)" : : "r"(_save_area(p)) : "memory");
+        } else {
+          asm volatile("frstor (%0)" : : "r"(_save_area(p)) : "memory");
+        }
+      }
+      cpu->fpu_owner = p->pid;
+      p->fpu_cpu = cpu->index;
+      return 0;
+    }
+  } else {
+    kprintf("ERROR Process %d used the FPU but there isn't one, terminating it\r\n", (uint32_t)p->pid);
+  }
+
+  process_set_status(p, PROCESS_TERMINATING);
+  schedule_cleanup_task(p->pid);
+  return 1;
+}
+
+void fpu_switch_out(struct ProcessTableEntry *p)
+{
+  //TS is still set if it hasn't touched the FPU since it was entered, so there is nothing new to save
+  uint32_t cr0 = _read_cr0();
+  if(cr0 & CR0_TS) return;
+
+  struct CpuState *cpu = this_cpu();
+  if(p->fpu_state && cpu->fpu_owner==p->pid) {
+    if(fxsr_supported) {
+      asm volatile("fxsave (%0)" : : "r"(_save_area(p)) : "memory");
+    } else {
+      //fnsave re-initialises the FPU afterwards, so the registers aren't the process's any more
+      asm volatile("fnsave (%0)" : : "r"(_save_area(p)) : "memory");
+      cpu->fpu_owner = 0;
+    }
+    p->fpu_cpu = cpu->index;
+  }
+  _write_cr0(cr0 | CR0_TS);
+}
+
+void fpu_release(struct ProcessTableEntry *p)
+{
+  if(p->fpu_state) {
+    free(p->fpu_state);
+    p->fpu_state = NULL;
+  }
+  //the pid will be given out again, and the new process mustn't think that these registers are its own
+  for(uint8_t i=0; i<smp_cpu_count(); i++) {
+    struct CpuState *cpu = smp_get_cpu(i);
+    if(cpu->fpu_owner==p->pid) cpu->fpu_owner = 0;
+  }
+}
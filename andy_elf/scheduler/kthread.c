@@ -0,0 +1,160 @@
+#include <types.h>
+#include <stdio.h>
+#include <panic.h>
+#include <malloc.h>
+#include <memops.h>
+#include <sys/mmgr.h>
+#include <sys/ioports.h>
+#include <sys/smp.h>
+#include <spinlock.h>
+#include <scheduler/timer.h>
+#include <scheduler/kthread.h>
+#include "lowlevel.h"
+
+static KernelThread *threads[KTHREAD_MAX];
+static uint8_t thread_count = 0;
+//state changes, since threads can be woken from processors that do not have the kernel lock
+static spinlock_t state_lock = 0;
+
+/**
+The first thing that a new thread runs, from the stack frame that kthread_create builds.
+*/
+static void _kthread_start()
+{
+  KernelThread *self = kthread_current();
+  self->entry(self);
+  kprintf("ERROR Kernel thread %s returned\r\n", self->name);
+  k_panic("Kernel threads must not return\r\n");
+}
+
+KernelThread *kthread_create(const char *name, void (*entry)(KernelThread *self), void *data)
+{
+  if(thread_count>=KTHREAD_MAX) {
+    kprintf("ERROR Can't create kernel thread %s, there are already %d\r\n", name, KTHREAD_MAX);
+    return NULL;
+  }
+
+  KernelThread *t = (KernelThread *)malloc(sizeof(KernelThread));
+  if(!t) return NULL;
+  memset(t, 0, sizeof(KernelThread));
+  t->name = name;
+  t->entry = entry;
+  t->data = data;
+  t->state = KTHREAD_SLEEPING;
+
+  t->stack_base = vm_alloc_pages(NULL, KTHREAD_STACK_PAGES, MP_READWRITE);
+  if(!t->stack_base) {
+    kprintf("ERROR Not enough memory for a stack for kernel thread %s\r\n", name);
+    free(t);
+    return NULL;
+  }
+
+  //what kthread_switch expects to find when it switches to the thread for the first time
+  uint32_t *sp = (uint32_t *)((vaddr)t->stack_base + KTHREAD_STACK_PAGES*PAGE_SIZE);
+  *(--sp) = 0;                      //return address for _kthread_start, which never returns
+  *(--sp) = (uint32_t)&_kthread_start;
+  *(--sp) = 0x02;                   //EFLAGS, interrupts off until the thread turns them on
+  *(--sp) = 0;                      //EBP
+  *(--sp) = 0;                      //EBX
+  *(--sp) = 0;                      //ESI
+  *(--sp) = 0;                      //EDI
+  t->saved_esp = (vaddr)sp;
+
+  threads[thread_count++] = t;
+  return t;
+}
+
+void kthread_wake(KernelThread *t)
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&state_lock);
+  if(t->state==KTHREAD_SLEEPING) {
+    t->state = KTHREAD_READY;
+    smp_kick_idle_cpu();
+  } else if(t->state==KTHREAD_RUNNING) {
+    //it may be just about to go to sleep, having found nothing to do before this was called
+    t->wake_pending = 1;
+  }
+  release_spinlock(&state_lock);
+  irq_restore(flags);
+}
+
+KernelThread *kthread_current()
+{
+  return this_cpu()->current_kthread;
+}
+
+void kthread_run_ready()
+{
+  struct CpuState *cpu = this_cpu();
+
+  for(uint8_t i=0; i<thread_count; i++) {
+    KernelThread *t = threads[i];
+    uint32_t flags = irq_save();
+    acquire_spinlock(&state_lock);
+    if(t->state!=KTHREAD_READY) {
+      release_spinlock(&state_lock);
+      irq_restore(flags);
+      continue;
+    }
+    t->state = KTHREAD_RUNNING;
+    t->wake_pending = 0;
+    release_spinlock(&state_lock);
+    t->cpu = cpu->index;
+    t->entered_ns = timer_now_ns();
+    ++t->switches;
+    cpu->current_kthread = t;
+
+    kthread_switch(&t->return_esp, t->saved_esp);
+
+    //the thread has given the processor back
+    cpu->current_kthread = NULL;
+    irq_restore(flags);
+  }
+}
+
+/**
+Switches from the running thread back to the idle loop that entered it.
+*/
+static void _kthread_leave(KernelThread *self, uint8_t state)
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&state_lock);
+  if(state==KTHREAD_SLEEPING && self->wake_pending) state = KTHREAD_READY;
+  self->state = state;
+  release_spinlock(&state_lock);
+  //nobody can enter it again before it has switched away, because that needs the kernel lock that we are holding
+  kthread_switch(&self->saved_esp, self->return_esp);
+  irq_restore(flags);
+}
+
+void kthread_yield()
+{
+  KernelThread *self = kthread_current();
+  if(!self) k_panic("kthread_yield called outside of a kernel thread\r\n");
+  ++self->yields;
+  _kthread_leave(self, KTHREAD_READY);
+}
+
+void kthread_sleep()
+{
+  KernelThread *self = kthread_current();
+  if(!self) k_panic("kthread_sleep called outside of a kernel thread\r\n");
+  _kthread_leave(self, KTHREAD_SLEEPING);
+}
+
+void kthread_preempt(uint64_t quantum_ns)
+{
+  struct CpuState *cpu = this_cpu();
+  KernelThread *self = cpu->current_kthread;
+  if(!self || !self->preemptible) return;
+  //anything that it has locked would stay locked until it is entered again, and whatever runs here next might want it
+  if(cpu->spinlocks_held>0 || smp_kernel_lock_depth()!=1) return;
+  if(timer_now_ns() - self->entered_ns < quantum_ns) return;
+
+  ++self->preemptions;
+  //it might be part-way through something in a process's address space, and the idle loop goes on to load others
+  vaddr pd = (vaddr)get_current_paging_directory();
+  _kthread_leave(self, KTHREAD_READY);
+  switch_paging_directory_if_required(pd);
+}
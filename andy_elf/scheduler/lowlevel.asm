@@ -2,9 +2,14 @@
 
 global exit_to_process
 global switch_out_process
+global kthread_switch
 
 extern get_current_process  ;defined in process.c  Returns the process struct for the current PID
 extern idle_loop            ;defined in kickoss.s. NOT a function, this is our "return address"
+extern tlb_counters         ;defined in mmgr/tlb.c. struct TlbStats, we update the CR3 counters, see memlayout.asm
+extern kernel_unlock        ;defined in smp/smp.c
+extern smp_kernel_stack     ;defined in smp/smp.c  Returns this processor's kernel stack pointer
+extern fpu_switch_out       ;defined in scheduler/fpu.c
 
 %include "memlayout.asm"
 
@@ -15,10 +20,8 @@ extern idle_loop            ;defined in kickoss.s. NOT a function, this is our "
 ;Does not return (to the kernel, at least!)
 exit_to_process:
   cli
+  call kernel_unlock  ;taken on the way into the kernel, or by idle_loop. Interrupts stay off until the iret.
 
-  mov eax, 0x7FFF8                  ;We are exiting the kernel, so re-set the stack to the bottom for when we re-enter
-  mov [saved_stack_pointer], eax    ;save the stack pointer to our data area so that we can get it back easily
-  
   mov edi, [esp+4]  ;grab the first argument from the stack (pointer to ProcessTableEntry)
 
   ;Set up registers for the process based on saved state in the process struct
@@ -52,8 +55,16 @@ exit_to_process:
 
   ;Get hold of the application paging directory physical address and activate it.
   sub edi, 0x28       ;Location of SavedRegisterStates32 within the ProcessTableEntry
-  mov eax, [edi+0x0C] ;Location of Page Directory Physical Address within the ProcessTableEntry
+  mov eax, cr3        ;reloading CR3 flushes the TLB, so don't do it if we are already on the right directory
+  cmp eax, [edi+0x0C] ;Location of Page Directory Physical Address within the ProcessTableEntry
+  je .pd_loaded
+  mov eax, [edi+0x0C]
   mov cr3, eax
+  inc dword [tlb_counters + TlbStatsCr3Loads]
+  jmp .pd_done
+.pd_loaded:
+  inc dword [tlb_counters + TlbStatsCr3LoadsSkipped]
+.pd_done:
 
   add edi, 0x28       ;Location of SavedRegisterStates32 within the ProcessTableEntry
   ;Set up a stack frame to return to the user-mode process.  This consists of EIP, CS, EFLAGS, ESP, SS
@@ -69,6 +80,13 @@ exit_to_process:
   mov eax, [edi+0x4C] ;EIP
   push eax
 
+  ;Make the process's first FPU instruction trap to IDevNotAvail, which loads its FPU registers. See scheduler/fpu.h
+  mov eax, cr0
+  test eax, 0x08      ;CR0.TS
+  jnz .ts_set
+  or eax, 0x08
+  mov cr0, eax
+.ts_set:
 
   ;now set eax and edi prior to return
   mov eax, [edi+0x00] ;EAX
@@ -133,6 +151,11 @@ switch_out_process:
   mov eax, [ebp+0x08]  ;EIP from the preceding stack frame
   mov [edi + 0x4C], eax
 
+  sub edi, 0x28        ;back to the start of the process table entry
+  push edi
+  call fpu_switch_out  ;saves the FPU registers if it has used them
+  add esp, 4
+
 
 .no_process:
 add esp, 0x20  ;clean up the stack from pushad
@@ -140,13 +163,41 @@ add esp, 0x20  ;clean up the stack from pushad
 pop ebp
 pop edi         ;pop the return address from the stack
 
-mov eax, 0x3000 ;FIXME: direct reference to kernel paging directory
-mov cr3, eax    ;switch to kernel page directory
+mov eax, cr3    ;interrupts that arrive while we are in the kernel are already on the kernel directory
+cmp eax, 0x3000 ;FIXME: direct reference to kernel paging directory
+je .pd_loaded
+mov eax, 0x3000
+mov cr3, eax    ;switch to kernel page directory. Kernel mappings are global, so they survive this.
+inc dword [tlb_counters + TlbStatsCr3Loads]
+jmp .pd_done
+.pd_loaded:
+inc dword [tlb_counters + TlbStatsCr3LoadsSkipped]
+.pd_done:
 
-mov esp, [saved_stack_pointer] ;restore the kernel stack pointer. This is still necessary because the kernel stack is in a different place to the app stack
+call smp_kernel_stack  ;restore the kernel stack pointer. Each processor has its own, and it is in a different place to the app stack
+mov esp, eax
 
 push edi         ;push the return address back onto the stack
 ret                ;return to the interrupt handler
 
-section .data
-saved_stack_pointer dd 0x0
+;Purpose: Switches from one kernel stack to another, see scheduler/kthread.c. The stack that is left behind gets the
+;callee-saved registers and EFLAGS pushed onto it, and new_esp must point to the same layout.
+;Arguments: 1. vaddr * to save the current stack pointer in. 2. stack pointer to switch to.
+;Returns when something switches back to the stack that was saved.
+kthread_switch:
+  mov eax, [esp+4]  ;where to save the stack pointer
+  mov edx, [esp+8]  ;stack to switch to
+  pushf
+  push ebp
+  push ebx
+  push esi
+  push edi
+  mov [eax], esp
+
+  mov esp, edx
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+  popf
+  ret
@@ -11,4 +11,11 @@
 */
 void exit_to_process(struct ProcessTableEntry *entry);
 
+/**
+;Purpose: Switches kernel stacks. Saves the callee-saved registers and EFLAGS on the current stack, writes the stack pointer
+;to `save_esp`, then picks up from the stack at `new_esp` that was left by an earlier call.
+;Returns when something switches back to the stack that was saved.
+*/
+void kthread_switch(vaddr *save_esp, vaddr new_esp);
+
 #endif
@@ -0,0 +1,116 @@
+#include <types.h>
+#include <stdio.h>
+#include <sys/ioports.h>
+#include <process.h>
+#include <sys/smp.h>
+#include <spinlock.h>
+#include <scheduler/runqueue.h>
+
+typedef struct run_queue_set {
+  uint32_t bitmap;  //bit n is set if head[n] is not NULL
+  struct ProcessTableEntry *head[SCHED_PRIORITY_LEVELS];
+  struct ProcessTableEntry *tail[SCHED_PRIORITY_LEVELS];
+} RunQueueSet;
+
+static RunQueueSet run_queues[2];
+static uint8_t active_set = 0;  //the other one is the expired set
+//processes are woken by task workers that do not have the kernel lock, so the queues have a lock of their own
+static spinlock_t runq_lock = 0;
+
+static void _enqueue(struct ProcessTableEntry *p, uint8_t set)
+{
+  RunQueueSet *q = &run_queues[set];
+  uint8_t level = p->priority;
+
+  p->runq_next = NULL;
+  p->runq_prev = q->tail[level];
+  if(q->tail[level]) {
+    q->tail[level]->runq_next = p;
+  } else {
+    q->head[level] = p;
+  }
+  q->tail[level] = p;
+  q->bitmap |= (1 << level);
+  p->runq_state = set + 1;
+}
+
+static void _dequeue(struct ProcessTableEntry *p)
+{
+  RunQueueSet *q = &run_queues[p->runq_state - 1];
+  uint8_t level = p->priority;
+
+  if(p->runq_prev) {
+    p->runq_prev->runq_next = p->runq_next;
+  } else {
+    q->head[level] = p->runq_next;
+  }
+  if(p->runq_next) {
+    p->runq_next->runq_prev = p->runq_prev;
+  } else {
+    q->tail[level] = p->runq_prev;
+  }
+  if(q->head[level]==NULL) q->bitmap &= ~(1 << level);
+
+  p->runq_next = NULL;
+  p->runq_prev = NULL;
+  p->runq_state = RUNQ_NONE;
+}
+
+void process_set_status(struct ProcessTableEntry *p, uint8_t status)
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&runq_lock);
+  if(p->runq_state!=RUNQ_NONE) _dequeue(p);
+  p->status = status;
+  if(status==PROCESS_READY && p->pid!=0) {
+    _enqueue(p, active_set);
+    smp_kick_idle_cpu();
+  }
+  release_spinlock(&runq_lock);
+  irq_restore(flags);
+}
+
+void process_quantum_expired(struct ProcessTableEntry *p)
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&runq_lock);
+  if(p->runq_state!=RUNQ_NONE) _dequeue(p);
+  p->status = PROCESS_READY;
+  _enqueue(p, active_set ^ 1);
+  smp_kick_idle_cpu();
+  release_spinlock(&runq_lock);
+  irq_restore(flags);
+}
+
+struct ProcessTableEntry *runqueue_next()
+{
+  struct ProcessTableEntry *p = NULL;
+
+  acquire_spinlock(&runq_lock);
+  if(run_queues[active_set].bitmap==0 && run_queues[active_set ^ 1].bitmap!=0) {
+    //everybody on the active set has had their turn, so the expired ones get another go
+    active_set ^= 1;
+  }
+  if(run_queues[active_set].bitmap!=0) p = run_queues[active_set].head[__builtin_ctz(run_queues[active_set].bitmap)];
+  release_spinlock(&runq_lock);
+  return p;
+}
+
+void process_set_priority(struct ProcessTableEntry *p, int32_t priority)
+{
+  if(priority < 0) priority = 0;
+  if(priority >= SCHED_PRIORITY_LEVELS) priority = SCHED_PRIORITY_LEVELS - 1;
+
+  uint32_t flags = irq_save();
+  acquire_spinlock(&runq_lock);
+  if(p->runq_state!=RUNQ_NONE) {
+    uint8_t set = p->runq_state - 1;
+    _dequeue(p);
+    p->priority = (uint8_t)priority;
+    _enqueue(p, set);
+  } else {
+    p->priority = (uint8_t)priority;
+  }
+  release_spinlock(&runq_lock);
+  irq_restore(flags);
+}
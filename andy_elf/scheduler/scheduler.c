@@ -1,103 +1,347 @@
 #include <memops.h>
 #include <scheduler/scheduler.h>
+#include <scheduler/runqueue.h>
+#include <scheduler/waitqueue.h>
+#include <scheduler/kthread.h>
+#include <scheduler/timepage.h>
 #include <sys/mmgr.h>
 #include <stdio.h>
 #include <sys/ioports.h>
+#include <sys/smp.h>
+#include <spinlock.h>
 #include "scheduler_task_internals.h"
 #include <cfuncs.h>
+#include <kernel_config.h>
 #include "../drivers/cmos/rtc.h"
+#include "../drivers/pit/pit.h"
 #include "../8259pic/picroutines.h"
 #include "../mmgr/process.h"
 #include "lowlevel.h"
 
 static SchedulerState *global_scheduler_state;
+//task workers run tasks without the kernel lock, and tasks are scheduled from anywhere, so the task lists have a lock of their own
+static spinlock_t task_queue_lock = 0;
 static pid_t last_run_pid;
-static pid_t active_process;
+static KernelThread *task_workers[SCHEDULER_MAX_WORKERS];
+static uint8_t task_worker_count = 0;
+
+static void _task_worker(KernelThread *self);
 
 void initialise_scheduler()
 {
   global_scheduler_state = (SchedulerState *)vm_alloc_pages(NULL,1, MP_READWRITE);
   memset((void *)global_scheduler_state, 0, PAGE_SIZE);
 
-  for(int i=0;i<BUFFER_COUNT;i++) {
-    global_scheduler_state->buffers[i] = new_scheduler_task_buffer();
+  global_scheduler_state->task_pool = new_scheduler_task_pool();
+  //every task comes from the pool, so heaps that can hold the whole pool can never be full and a push can't fail
+  uint32_t heap_capacity = global_scheduler_state->task_pool->capacity;
+  if(timer_heap_init(&global_scheduler_state->task_deadline_list, heap_capacity)!=0 ||
+    timer_heap_init(&global_scheduler_state->task_aftertime_list, heap_capacity)!=0) {
+    k_panic("Unable to allocate scheduler timer heaps\r\n");
   }
   last_run_pid = 0;
-  active_process = 0;
+
+  uint32_t budget_us = config_commandline_uint((struct KernelConfig *)get_kernel_config(), "taskbudget", SCHEDULER_DRAIN_BUDGET_US);
+  if(budget_us==0 || budget_us > SCHEDULER_MAX_DRAIN_BUDGET_US) {
+    kprintf("WARNING taskbudget=%d is out of range, using %d\r\n", budget_us, SCHEDULER_DRAIN_BUDGET_US);
+    budget_us = SCHEDULER_DRAIN_BUDGET_US;
+  }
+  global_scheduler_state->drain_budget_ns = budget_us * NS_PER_US;
+
+  uint32_t workers = config_commandline_uint((struct KernelConfig *)get_kernel_config(), "kworkers", SCHEDULER_DEFAULT_WORKERS);
+  if(workers==0 || workers > SCHEDULER_MAX_WORKERS) {
+    kprintf("WARNING kworkers=%d is out of range, using %d\r\n", workers, SCHEDULER_DEFAULT_WORKERS);
+    workers = SCHEDULER_DEFAULT_WORKERS;
+  }
+  for(uint32_t i=0; i<workers; i++) {
+    KernelThread *t = kthread_create("task worker", &_task_worker, NULL);
+    if(!t) break;
+    task_workers[task_worker_count++] = t;
+  }
+  if(task_worker_count==0) k_panic("Unable to start any task workers\r\n");
 }
 
+/**
+Returns 1 if there are tasks waiting to be run. Must be called with interrupts off and task_queue_lock held.
+*/
+static uint8_t _tasks_waiting()
+{
+  return global_scheduler_state->task_asap_list!=NULL || timer_heap_peek(&global_scheduler_state->task_deadline_list)!=NULL;
+}
 
-/*
-scheduler_tick is expected to be run from IRQ0, i.e. every 55ms or so.
+/**
+Wakes a task worker that is asleep, if there is one. The ones that are awake pick up the new task anyway.
+Must be called with interrupts off and task_queue_lock held.
 */
-void scheduler_tick()
+static void _wake_task_worker()
 {
-  SchedulerTask *to_run;
+  for(uint8_t i=0; i<task_worker_count; i++) {
+    if(task_workers[i]->state==KTHREAD_SLEEPING) {
+      kthread_wake(task_workers[i]);
+      return;
+    }
+  }
+}
 
-  cli();
-  //kputs(".");
-  ++global_scheduler_state->ticks_elapsed;
-  //FIXME: run deadline tasks first
-  //FIXME: run after-time tasks second
 
-  if(global_scheduler_state->tasks_in_progress>0) {
-    //we have not finished processing the last run yet!
-    return;
+/**
+Puts the task on the end of the ASAP list. Must be called with interrupts off and task_queue_lock held.
+*/
+static void _append_asap_task(SchedulerTask *t)
+{
+  t->next = NULL;
+  if(global_scheduler_state->task_asap_tail==NULL) {
+    global_scheduler_state->task_asap_list = t;
+  } else {
+    global_scheduler_state->task_asap_tail->next = t;
   }
+  global_scheduler_state->task_asap_tail = t;
+}
 
-  //run scheduler state tasks
-  if(global_scheduler_state->task_asap_list!=NULL) {
-    to_run = global_scheduler_state->task_asap_list;
-    global_scheduler_state->task_asap_list = global_scheduler_state->task_asap_list->next;
+/**
+Takes the next task to run: the deadline task with the earliest deadline if there are any, otherwise the first ASAP task.
+Returns NULL if there is nothing to do. Must be called with interrupts off and task_queue_lock held.
+*/
+static SchedulerTask *_next_task(uint64_t now)
+{
+  SchedulerTask *t = timer_heap_pop(&global_scheduler_state->task_deadline_list);
+  if(t) {
+    if(t->time_val < now) {
+      uint64_t late = now - t->time_val;
+      kprintf("WARNING Deadline task 0x%x is running %l ns late\r\n", t, late > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)late);
+    }
+    return t;
+  }
 
-    ++global_scheduler_state->tasks_in_progress;
-    //kprintf("Running task proc...\r\n");
-    (to_run->task_proc)(to_run);  //call the task_proc to do its thang
-    //kprintf("Task proc returned.\r\n");
-    --global_scheduler_state->tasks_in_progress;
+  t = global_scheduler_state->task_asap_list;
+  if(t) {
+    global_scheduler_state->task_asap_list = t->next;
+    if(global_scheduler_state->task_asap_list==NULL) global_scheduler_state->task_asap_tail = NULL;
   }
-  sti();
+  return t;
 }
 
-uint64_t get_scheduler_ticks()
+/**
+Returns 1 if the first after-time task is due. Must be called with interrupts off and task_queue_lock held.
+*/
+static uint8_t _aftertime_task_due(uint64_t now)
 {
-  return global_scheduler_state->ticks_elapsed;
+  SchedulerTask *t = timer_heap_peek(&global_scheduler_state->task_aftertime_list);
+  return t!=NULL && t->time_val <= now;
 }
 
 /**
-Creates a new SchedulerTask object in our buffer and returns it
+Adds a finished run of the worker into the drain figures.
 */
-SchedulerTask *new_scheduler_task(uint8_t task_type, void (*task_proc)(struct scheduler_task *t), void *data)
+static void _record_drain(uint32_t tasks_run, uint64_t started, uint64_t now)
+{
+  if(tasks_run==0) return;
+
+  uint32_t flags = irq_save();
+  acquire_spinlock(&task_queue_lock);
+  SchedulerDrainStats *stats = &global_scheduler_state->drain_stats;
+  uint32_t elapsed = now - started > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)(now - started);
+  stats->last_tasks_run = tasks_run;
+  stats->last_drain_ns = elapsed;
+  if(tasks_run > stats->max_tasks_run) stats->max_tasks_run = tasks_run;
+  ++stats->drains;
+  stats->tasks_run += tasks_run;
+  stats->drain_ns += elapsed;
+  release_spinlock(&task_queue_lock);
+  irq_restore(flags);
+}
+
+/*
+The task workers are kernel threads that run the deferred tasks. Each task is run with interrupts on and without the kernel
+lock, so neither interrupts nor the other processors ever wait for whatever the task is doing, however much disk and
+filesystem work is queued up. A task that needs something that only the kernel lock protects, e.g. the heap or a process's
+files, takes the lock itself for as long as it needs it. While a task is running the worker can also be preempted by the
+timer interrupt, so that processes get a go in the middle of a long task.
+Every time round, a worker runs tasks until the queues are empty or the time budget is used up. Anything queued by the tasks
+themselves, e.g. the next sector of a disk read, goes on the end and is picked up in the same pass. Once the budget is
+used up it yields, so that processes get a go before it carries on; once the queues are empty it sleeps until
+schedule_task wakes it.
+*/
+static void _task_worker(KernelThread *self)
 {
-  SchedulerTask *task_ptr;
-  unsigned int iterations = 0;
-
-  SchedulerTaskBuffer *current_buffer = global_scheduler_state->buffers[global_scheduler_state->current_buffer];
-
-  while(current_buffer->buffer_idx + sizeof(SchedulerTask) > PAGE_SIZE*TASK_BUFFER_SIZE_IN_PAGES) {
-    // Current buffer is full, switch to next buffer
-    ++global_scheduler_state->current_buffer;
-    if(global_scheduler_state->current_buffer >= BUFFER_COUNT) {
-      if(iterations>0) {  //if we have already looped back to the beginning once in order to check for space there, and not found any, we ran out :(
-        k_panic("Ran out of mem for scheduling tasks\r\n");
-        return NULL;
-      } else {
-        ++iterations;
-        global_scheduler_state->current_buffer = 0;
+  for(;;) {
+    uint64_t started = timer_now_ns();
+    uint64_t now = started;
+    uint32_t tasks_run = 0;
+    uint8_t out_of_time = 0;
+    SchedulerTask *to_run;
+
+    for(;;) {
+      uint32_t flags = irq_save();
+      acquire_spinlock(&task_queue_lock);
+      to_run = _next_task(now);
+      release_spinlock(&task_queue_lock);
+      irq_restore(flags);
+      if(to_run==NULL) break;
+
+      __sync_fetch_and_add(&global_scheduler_state->tasks_in_progress, 1);
+      kernel_unlock();
+      self->preemptible = 1;
+      sti();
+      (to_run->task_proc)(to_run);  //call the task_proc to do its thang
+      self->preemptible = 0;
+      kernel_lock();
+      __sync_fetch_and_sub(&global_scheduler_state->tasks_in_progress, 1);
+      release_scheduler_task(to_run);
+      ++tasks_run;
+
+      now = timer_now_ns();
+      if(now - started >= global_scheduler_state->drain_budget_ns) {
+        out_of_time = 1;
+        break;
       }
     }
+    _record_drain(tasks_run, started, now);
+
+    cli();
+    acquire_spinlock(&task_queue_lock);
+    uint8_t waiting = _tasks_waiting();
+    if(waiting && out_of_time) ++global_scheduler_state->drain_stats.budget_exceeded;  //the rest wait until the next time round the idle loop
+    release_spinlock(&task_queue_lock);
+    //anything scheduled from now on wakes us, and kthread_sleep stays ready if that has already happened
+    if(waiting) {
+      kthread_yield();
+    } else {
+      kthread_sleep();
+    }
+  }
+}
+
+/*
+scheduler_tick is run from the kernel idle loop, which is woken up by IRQ0 (see scheduler/timer.c) if nothing else.
+It moves any after-time tasks that have come due onto the ASAP list, then runs the kernel threads that have work to do.
+*/
+void scheduler_tick()
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&task_queue_lock);
+  ++global_scheduler_state->ticks_elapsed;
 
-    current_buffer = global_scheduler_state->buffers[global_scheduler_state->current_buffer];
-    
-    // Reset buffer when switching to it (simple task cleanup)
-    if(current_buffer->buffer_idx > 0) {
-      current_buffer->buffer_idx = 0;
-      current_buffer->waiting_tasks = 0;
+  //after-time tasks whose time has come join the ASAP list, and the timer is armed for the next one
+  uint64_t now = timer_now_ns();
+  while(_aftertime_task_due(now)) {
+    _append_asap_task(timer_heap_pop(&global_scheduler_state->task_aftertime_list));
+  }
+  SchedulerTask *next = timer_heap_peek(&global_scheduler_state->task_aftertime_list);
+  if(next) timer_arm(next->time_val);
+
+  if(_tasks_waiting()) _wake_task_worker();
+  release_spinlock(&task_queue_lock);
+  irq_restore(flags);
+
+  kthread_run_ready();
+}
+
+/**
+Returns the number of timer ticks in a quantum at the current timer rate. Always at least 1.
+*/
+static uint32_t _quantum_ticks()
+{
+  uint32_t ticks = (pit_get_hz() * SCHEDULER_QUANTUM_MS) / 1000;
+  return ticks>0 ? ticks : 1;
+}
+
+/**
+Only the BSP gets timer interrupts, so it does the accounting for the processes running on the other processors too and
+sends them an IPI_VECTOR_RESCHEDULE when their quantum is up.
+*/
+static void _tick_other_cpus(uint32_t ticks)
+{
+  struct CpuState *me = this_cpu();
+
+  for(uint8_t i=0; i<smp_cpu_count(); i++) {
+    struct CpuState *cpu = smp_get_cpu(i);
+    if(cpu==me || !cpu->online || cpu->idle || cpu->current_pid==0) continue;
+    struct ProcessTableEntry *process = get_process(cpu->current_pid);
+    //current_pid is whatever it ran last, which might have been switched out and picked up by someone else since
+    if(!process || process->status!=PROCESS_BUSY || process->cpu!=i || process->quantum_remaining==0) continue;
+
+    process->runtime_ticks += ticks;
+    if(process->quantum_remaining > ticks) {
+      process->quantum_remaining -= ticks;
+    } else {
+      process->quantum_remaining = 0;
+      smp_send_ipi(i, IPI_VECTOR_RESCHEDULE);
     }
   }
+}
+
+uint8_t scheduler_timer_tick(uint32_t interrupted_cs)
+{
+  //the one-shot fires for after-time tasks as well as for ticks, so this can be 0
+  uint32_t ticks = timer_interrupt();
+  global_scheduler_state->timer_ticks += ticks;
+  time_page_update(ticks);
+  if(ticks>0) _tick_other_cpus(ticks);
+
+  //the only kernel code that gets preempted is a task worker part-way through a task. If the kernel is idle then it is about
+  //to run scheduler_tick anyway.
+  if((interrupted_cs & 0x03)==0) {
+    kthread_preempt((uint64_t)SCHEDULER_QUANTUM_MS * NS_PER_MS);
+    return 0;
+  }
+
+  struct ProcessTableEntry *process = get_current_process();
+  if(!process || process->pid==0 || process->status!=PROCESS_BUSY) return 0;
+
+  process->runtime_ticks += ticks;
+  if(process->quantum_remaining > ticks) {
+    process->quantum_remaining -= ticks;
+    //an after-time task that has come due is run straight away rather than at the end of the quantum
+    acquire_spinlock(&task_queue_lock);
+    uint8_t due = _aftertime_task_due(timer_now_ns());
+    release_spinlock(&task_queue_lock);
+    if(!due) return 0;
+    process_set_status(process, PROCESS_READY);
+  } else {
+    process->quantum_remaining = 0;
+    ++process->preempt_count;
+    process_quantum_expired(process);
+  }
+  return 1;
+}
+
+uint8_t scheduler_reschedule_ipi(uint32_t interrupted_cs)
+{
+  if((interrupted_cs & 0x03)==0) return 0;
 
-  task_ptr = (SchedulerTask *)((vaddr)current_buffer->buffer_ptr + current_buffer->buffer_idx);
-  current_buffer->buffer_idx += sizeof(SchedulerTask);
+  struct ProcessTableEntry *process = get_current_process();
+  if(!process || process->pid==0 || process->status!=PROCESS_BUSY || process->quantum_remaining>0) return 0;
+
+  ++process->preempt_count;
+  process_quantum_expired(process);
+  return 1;
+}
+
+uint64_t get_scheduler_ticks()
+{
+  return global_scheduler_state->ticks_elapsed;
+}
+
+void scheduler_get_drain_stats(SchedulerDrainStats *out)
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&task_queue_lock);
+  memcpy(out, &global_scheduler_state->drain_stats, sizeof(SchedulerDrainStats));
+  release_spinlock(&task_queue_lock);
+  irq_restore(flags);
+}
+
+/**
+Creates a new SchedulerTask object from the pool and returns it
+*/
+SchedulerTask *new_scheduler_task(uint8_t task_type, void (*task_proc)(struct scheduler_task *t), void *data)
+{
+  SchedulerTask *task_ptr = scheduler_task_pool_alloc(global_scheduler_state->task_pool);
+  if(task_ptr==NULL) {
+    k_panic("Ran out of scheduler tasks\r\n");
+    return NULL;
+  }
   memset(task_ptr, 0, sizeof(SchedulerTask));
 
   task_ptr->task_type = task_type;
@@ -107,37 +351,58 @@ SchedulerTask *new_scheduler_task(uint8_t task_type, void (*task_proc)(struct sc
   return task_ptr;
 }
 
+void release_scheduler_task(SchedulerTask *t)
+{
+  scheduler_task_pool_release(global_scheduler_state->task_pool, t);
+}
+
+void scheduler_get_task_pool_stats(SchedulerTaskPoolStats *out)
+{
+  SchedulerTaskPool *p = global_scheduler_state->task_pool;
+  out->capacity = p->capacity;
+  out->in_use = p->in_use;
+  out->high_water = p->high_water;
+  out->exhausted = p->exhausted;
+}
+
 /**
-Adds the schedule task into one of our lists and increments the relevant buffer
+Adds the schedule task into one of our lists
 */
 void schedule_task(SchedulerTask *t)
 {
-  SchedulerTask *task_list;
+  uint32_t flags;
 
   switch(t->task_type) {
     case TASK_NONE:
       kputs("ERROR Tried to schedule an invalid task with type TASK_NONE\r\n");
       return;
     case TASK_ASAP:
-      if(global_scheduler_state->task_asap_list==NULL) {
-        global_scheduler_state->task_asap_list = t;
-      } else {
-        //find the end of the linked list
-        //for(task_list=global_scheduler_state->task_asap_list;task_list!=NULL;task_list=task_list->next);
-        task_list = global_scheduler_state->task_asap_list;
-        while(task_list->next!=NULL) {
-          task_list = task_list->next;
-        }
-        //task_list now points to the last item on the linked list
-        task_list->next = t;
-      }
-      //sti();
+      flags = irq_save();
+      acquire_spinlock(&task_queue_lock);
+      _append_asap_task(t);
+      _wake_task_worker();
+      release_spinlock(&task_queue_lock);
+      irq_restore(flags);
       return;
     case TASK_DEADLINE:
-      kputs("ERROR Deadline tasks not implemented yet\r\n");
+      flags = irq_save();
+      acquire_spinlock(&task_queue_lock);
+      if(timer_heap_push(&global_scheduler_state->task_deadline_list, t)!=0) {
+        kputs("ERROR Too many deadline tasks, running it as soon as possible instead\r\n");
+        _append_asap_task(t);
+      }
+      _wake_task_worker();
+      release_spinlock(&task_queue_lock);
+      irq_restore(flags);
       return;
     case TASK_AFTERTIME:
-      kputs("ERROR after-time tasks not implemented yet\r\n");
+      flags = irq_save();
+      acquire_spinlock(&task_queue_lock);
+      //the heap is as big as the task pool, so this can only fail if something has gone badly wrong
+      if(timer_heap_push(&global_scheduler_state->task_aftertime_list, t)!=0) k_panic("After-time task heap is full\r\n");
+      timer_arm(t->time_val);
+      release_spinlock(&task_queue_lock);
+      irq_restore(flags);
       return;
     default:
       kprintf("ERROR tried to schedule an invalid task with type %d\r\n", (uint16_t) t->task_type);
@@ -145,43 +410,34 @@ void schedule_task(SchedulerTask *t)
   }
 }
 
-//finds the next runnable process (in a round-robin fashion) and attempts to enter it
+//finds the next runnable process from the run queues and attempts to enter it
 void enter_next_process()
 {
-  pid_t i, temp;
   struct ProcessTableEntry* process = NULL;
 
   //kprintf("enter_next_process\r\n");
   cli();
-  for(i=last_run_pid+1;i<PID_MAX;i++) {
-    temp = i;
-    process = get_process(i);
-    if(process->status==PROCESS_READY) break;
-  }
-  if(process->status!=PROCESS_READY) { //still not found one? Re-start the list. Ignore process 0 as that's us (the kernel)
-    for(i=1;i<=last_run_pid;i++) {
-      temp = i;
-      process = get_process(i);
-      if(process->status==PROCESS_READY) break;
-    }
-  }
-  if(process->status!=PROCESS_READY){
+  process = runqueue_next();
+  if(process==NULL){
     sti();
     return; //OK, nothing doing. Go back to the kernel idle loop.
   }
 
   //Right, we have something.  We must switch process.
-  last_run_pid = temp;
-  active_process = temp;
+  last_run_pid = process->pid;
 
   //Update the system state to reflect the process switch
   set_current_process_id(process->pid);
-  //Update the process status so it does not accidentally get re-scheduled while running
-  process->status = PROCESS_BUSY;
+  //Update the process status so it does not accidentally get re-scheduled while running. This takes it off the run queue.
+  process_set_status(process, PROCESS_BUSY);
+  process->cpu = this_cpu()->index;
+  process->quantum_remaining = _quantum_ticks();
+  //if it was woken from a wait queue, the result of the call that it was waiting in goes into EAX
+  wait_queue_deliver_result(process);
   exit_to_process(process);
 }
 
 pid_t get_active_pid()
 {
-  return active_process;
+  return this_cpu()->current_pid;
 }
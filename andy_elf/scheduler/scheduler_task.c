@@ -1,33 +1,82 @@
 #include <sys/mmgr.h>
 #include <stdio.h>
 #include <types.h>
+#include <panic.h>
 #include <scheduler/scheduler.h>
 #include "scheduler_task_internals.h"
 
 /**
-Initialise a new SchedulerTaskBuffer instance
+Initialise a new SchedulerTaskPool instance, with every task in it free
 */
-SchedulerTaskBuffer *new_scheduler_task_buffer()
+SchedulerTaskPool *new_scheduler_task_pool()
 {
-  SchedulerTaskBuffer *b = (SchedulerTaskBuffer *)vm_alloc_pages(NULL, TASK_BUFFER_SIZE_IN_PAGES, MP_READWRITE);
-  if(b==NULL) {
-    k_panic("Unable to allocate scheduler task buffer\r\n");
+  //MPC_ZEROED makes sure that the pages are blank, so every task starts off as TASK_NONE
+  SchedulerTaskPool *p = (SchedulerTaskPool *)vm_alloc_pages(NULL, TASK_POOL_SIZE_IN_PAGES, MP_READWRITE|MPC_ZEROED);
+  if(p==NULL) {
+    k_panic("Unable to allocate scheduler task pool\r\n");
     return NULL;
   }
 
-  //make sure the page is zeroed
-  memset((void *)b, 0, TASK_BUFFER_SIZE_IN_PAGES*PAGE_SIZE);
+  p->tasks = (SchedulerTask *)((vaddr)p + sizeof(SchedulerTaskPool));
+  p->capacity = (uint32_t)(TASK_POOL_SIZE_IN_PAGES*PAGE_SIZE - sizeof(SchedulerTaskPool)) / sizeof(SchedulerTask);
+  if(p->capacity >= TASK_POOL_NO_ENTRY) p->capacity = TASK_POOL_NO_ENTRY - 1;
 
-  b->buffer_ptr = (void *)((vaddr)b + sizeof(SchedulerTaskBuffer));
-  b->task_limit = (uint32_t)(TASK_BUFFER_SIZE_IN_PAGES*PAGE_SIZE) / sizeof(SchedulerTask);
-  return b;
+  for(uint32_t i=0; i<p->capacity; i++) {
+    p->tasks[i].pool_next = i+1 < p->capacity ? (uint16_t)(i+1) : TASK_POOL_NO_ENTRY;
+  }
+  p->free_head = 0;
+  return p;
+}
+
+/**
+Takes a task off the free list. Returns NULL if there are none left.
+*/
+SchedulerTask *scheduler_task_pool_alloc(SchedulerTaskPool *p)
+{
+  uint32_t old_head, new_head, idx;
+
+  do {
+    old_head = p->free_head;
+    idx = old_head & 0xFFFF;
+    if(idx==TASK_POOL_NO_ENTRY) {
+      __sync_fetch_and_add(&p->exhausted, 1);
+      return NULL;
+    }
+    //if the task is taken by somebody else before we swap, then pool_next may be rubbish, but the generation will have moved on
+    new_head = ((old_head + 0x10000) & 0xFFFF0000) | p->tasks[idx].pool_next;
+  } while(__sync_val_compare_and_swap(&p->free_head, old_head, new_head)!=old_head);
+
+  uint32_t in_use = __sync_add_and_fetch(&p->in_use, 1);
+  uint32_t high_water;
+  while((high_water = p->high_water) < in_use) {
+    __sync_val_compare_and_swap(&p->high_water, high_water, in_use);
+  }
+  return &p->tasks[idx];
 }
 
 /**
-Frees the memory associated with this task buffer.
-The pointer should not be re-used after calling this function
+Puts a task back on the free list. It must not be on any of the scheduler's queues.
 */
-void scheduler_vacate_task_buffer(SchedulerTaskBuffer *b)
+void scheduler_task_pool_release(SchedulerTaskPool *p, SchedulerTask *t)
 {
-  vm_deallocate_physical_pages(NULL, (void *)b, TASK_BUFFER_SIZE_IN_PAGES);
+  uint32_t old_head, new_head;
+
+  if(t < p->tasks || t >= p->tasks + p->capacity) {
+    kprintf("ERROR Tried to release scheduler task 0x%x which is not from the pool\r\n", t);
+    return;
+  }
+  if(t->task_type==TASK_NONE) {
+    kprintf("ERROR Scheduler task 0x%x has been released twice\r\n", t);
+    return;
+  }
+  t->task_type = TASK_NONE;
+
+  uint32_t idx = (uint32_t)(t - p->tasks);
+  do {
+    old_head = p->free_head;
+    t->pool_next = (uint16_t)(old_head & 0xFFFF);
+    new_head = ((old_head + 0x10000) & 0xFFFF0000) | idx;
+  } while(__sync_val_compare_and_swap(&p->free_head, old_head, new_head)!=old_head);
+
+  __sync_sub_and_fetch(&p->in_use, 1);
 }
@@ -1,19 +1,25 @@
 #include <types.h>
 
-#define TASK_BUFFER_SIZE_IN_PAGES   16
+#define TASK_POOL_SIZE_IN_PAGES   16
+#define TASK_POOL_NO_ENTRY        0xFFFF  //end of the free list
 
 /*
-the task buffer manages a memory page which contains a number of task defintitions.
-once used, a memory space is not re-used; once the page has been vacated then it's
-disposed and a new one created
+A fixed pool of SchedulerTask objects. Free ones are kept on a singly-linked list threaded through their pool_next fields,
+which is pushed and popped with compare-and-swap, so allocating and releasing work from interrupt handlers and never block.
+free_head holds the index of the first free task in its low 16 bits and a generation count in its high 16 bits; the count
+changes on every push and pop, so that a task that is popped and pushed back while somebody else is part-way through a pop
+can't fool their compare-and-swap (the ABA problem).
+The pool lives at the start of its own pages, and the tasks follow it.
 */
-typedef struct scheduler_task_buffer {
-  void *buffer_ptr; //points to the buffer space following this struct
-  uint32_t waiting_tasks; //count of tasks that have not been run yet
-  uint32_t buffer_idx;  //where to put the next task in the buffer
-  uint32_t task_limit;  //maximum number of tasks we can put in
-} SchedulerTaskBuffer;
+typedef struct scheduler_task_pool {
+  SchedulerTask *tasks;
+  uint32_t capacity;
+  volatile uint32_t free_head;
+  volatile uint32_t in_use;
+  volatile uint32_t high_water;   //most tasks that have ever been in use at once
+  volatile uint32_t exhausted;    //number of times that an allocation found the pool empty
+} SchedulerTaskPool;
 
-SchedulerTaskBuffer *new_scheduler_task_buffer();
-uint8_t should_vacate_task_buffer(SchedulerTaskBuffer *b);
-void scheduler_vacate_task_buffer(SchedulerTaskBuffer *b);
+SchedulerTaskPool *new_scheduler_task_pool();
+SchedulerTask *scheduler_task_pool_alloc(SchedulerTaskPool *p);
+void scheduler_task_pool_release(SchedulerTaskPool *p, SchedulerTask *t);
@@ -0,0 +1,58 @@
+#include <types.h>
+#include <stdio.h>
+#include <kernel_config.h>
+#include <sys/mmgr.h>
+#include <sys/tlb.h>
+#include <scheduler/scheduler.h>
+#include <scheduler/timer.h>
+#include <scheduler/statslog.h>
+#include <sys/smp.h>
+
+static uint64_t stats_log_interval_ns = 0;
+
+static void _stats_log_schedule();
+
+static void _stats_log_write(SchedulerTask *t)
+{
+  struct ZeroedPoolStats zp;
+  struct TlbStats tlb;
+  SchedulerDrainStats drain;
+  SchedulerTaskPoolStats pool;
+
+  //task workers run without the kernel lock, and the console needs it
+  kernel_lock();
+  zeroed_page_pool_stats(&zp);
+  kprintf("STATS zeroed pages %d/%d, %d hits, %d misses\r\n", zp.depth, zp.capacity, zp.hits, zp.misses);
+  tlb_get_stats(&tlb);
+  kprintf("STATS tlb %d invlpg, %d batches, %d full flushes, %d global flushes, cr3 %d loaded %d skipped\r\n",
+    tlb.pages_invalidated, tlb.batches_flushed, tlb.full_flushes, tlb.global_flushes, tlb.cr3_loads, tlb.cr3_loads_skipped);
+  scheduler_get_drain_stats(&drain);
+  uint64_t drain_us = drain.drain_ns;
+  timer_div64(&drain_us, NS_PER_US);
+  kprintf("STATS task drains %d, %d tasks, %d us, most %d tasks, %d over budget, last %d tasks in %d us\r\n",
+    (uint32_t)drain.drains, (uint32_t)drain.tasks_run, (uint32_t)drain_us, drain.max_tasks_run,
+    drain.budget_exceeded, drain.last_tasks_run, drain.last_drain_ns / NS_PER_US);
+  scheduler_get_task_pool_stats(&pool);
+  kprintf("STATS task pool %d/%d in use, most %d, empty %d times\r\n", pool.in_use, pool.capacity, pool.high_water, pool.exhausted);
+
+  _stats_log_schedule();
+  kernel_unlock();
+}
+
+static void _stats_log_schedule()
+{
+  SchedulerTask *t = new_scheduler_task(TASK_AFTERTIME, &_stats_log_write, NULL);
+  t->time_val = timer_now_ns() + stats_log_interval_ns;
+  schedule_task(t);
+}
+
+void initialise_stats_log()
+{
+  uint32_t seconds = config_commandline_uint((struct KernelConfig *)get_kernel_config(), "statslog", 0);
+  if(seconds==0) return;
+  if(seconds > STATS_LOG_MAX_INTERVAL) seconds = STATS_LOG_MAX_INTERVAL;
+
+  kprintf("INFO writing kernel statistics every %d seconds\r\n", seconds);
+  stats_log_interval_ns = (uint64_t)seconds * NS_PER_SECOND;
+  _stats_log_schedule();
+}
@@ -0,0 +1,83 @@
+#include <types.h>
+#include <stdio.h>
+#include <panic.h>
+#include <memops.h>
+#include <sys/mmgr.h>
+#include <sys/ioports.h>
+#include <scheduler/timer.h>
+#include <scheduler/timepage.h>
+#include <scheduler/clocksource.h>
+
+static struct TimePage *time_page = NULL;   //the kernel's writable mapping
+static uint32_t time_page_pte = 0;
+
+void initialise_time_page()
+{
+  void *phys_ptr;
+  if(allocate_zeroed_physical_pages(1, &phys_ptr)!=1) k_panic("Could not allocate RAM for the time page\r\n");
+
+  time_page = (struct TimePage *)vm_map_next_unallocated_pages(NULL, MP_PRESENT|MP_READWRITE, &phys_ptr, 1);
+  if(!time_page) k_panic("Could not map the time page\r\n");
+  //read-only to processes, and it belongs to all of them so none of them can free it
+  time_page_pte = ((vaddr)phys_ptr & MP_ADDRESS_MASK) | MP_PRESENT | MP_USER | MPC_SHARED;
+
+  time_page->version = TIME_PAGE_VERSION;
+  time_page_update(0);
+  if(clocksource_type()==CLOCKSOURCE_TSC) time_page_set_tsc_scale(clocksource_tsc_mult(), CLOCKSOURCE_SHIFT);
+  kprintf("INFO Time page is at 0x%x\r\n", TIME_PAGE_ADDRESS);
+}
+
+uint32_t time_page_entry()
+{
+  return time_page_pte;
+}
+
+void time_page_update(uint32_t ticks)
+{
+  if(!time_page) return;
+
+  uint32_t flags = irq_save();
+  //everything comes from the one reading, so that userland's TSC arithmetic carries on from exactly where this leaves off
+  uint64_t tsc = 0;
+  uint64_t now_ns;
+  if(clocksource_type()==CLOCKSOURCE_TSC) {
+    tsc = clocksource_read_tsc();
+    now_ns = clocksource_tsc_to_ns(tsc);
+  } else {
+    now_ns = clock_monotonic_ns();
+  }
+  uint32_t seconds, nsec;
+  clock_wall_from_monotonic(now_ns, &seconds, &nsec);
+
+  ++time_page->seq;
+  asm volatile("" : : : "memory");  //x86 doesn't reorder stores with other stores, so this only has to stop the compiler
+
+  time_page->epoch_seconds = seconds;
+  time_page->epoch_nsec = nsec;
+  time_page->monotonic_ns = now_ns;
+  time_page->ticks += ticks;
+  time_page->tsc_at_update = tsc;
+
+  asm volatile("" : : : "memory");
+  ++time_page->seq;
+  irq_restore(flags);
+}
+
+void time_page_set_tsc_scale(uint32_t mult, uint32_t shift)
+{
+  if(!time_page) return;
+
+  uint32_t flags = irq_save();
+  ++time_page->seq;
+  asm volatile("" : : : "memory");
+  time_page->tsc_mult = mult;
+  time_page->tsc_shift = shift;
+  if(mult && clocksource_type()==CLOCKSOURCE_TSC) {
+    time_page->flags |= TIME_PAGE_TSC_VALID;
+  } else {
+    time_page->flags &= ~(TIME_PAGE_TSC_VALID);
+  }
+  asm volatile("" : : : "memory");
+  ++time_page->seq;
+  irq_restore(flags);
+}
@@ -0,0 +1,150 @@
+#include <types.h>
+#include <stdio.h>
+#include <sys/mmgr.h>
+#include <sys/ioports.h>
+#include <spinlock.h>
+#include <scheduler/scheduler.h>
+#include <scheduler/timer.h>
+#include "../drivers/pit/pit.h"
+
+/*
+Each one-shot starts at clock_base_ns. When it fires, or when it has to be re-armed early, the time that it ran for is added
+on and a new one is started. The few microseconds between reading the count and starting the next one-shot are lost each
+time, so the clock runs very slightly slow; that is fine for timeouts and sleeps, which is what this is for.
+*/
+static uint64_t clock_base_ns = 0;
+static uint32_t tick_ns = 0;                      //length of a scheduler tick
+static uint64_t next_tick_ns = TIMER_NEVER;
+static uint64_t armed_expiry_ns = TIMER_NEVER;
+static uint8_t timer_running = 0;
+//the clock and the PIT, which can be read and re-armed by any processor while the BSP is taking the timer interrupt
+static spinlock_t clock_lock = 0;
+
+/**
+Adds the time since the current one-shot was started onto the clock. Must be followed by _start_next_oneshot.
+*/
+static void _catch_up()
+{
+  clock_base_ns += pit_clocks_to_ns(pit_oneshot_elapsed());
+}
+
+static void _start_next_oneshot()
+{
+  uint64_t next = next_tick_ns < armed_expiry_ns ? next_tick_ns : armed_expiry_ns;
+  uint64_t delta = next > clock_base_ns ? next - clock_base_ns : 0;
+  uint32_t clocks;
+
+  if(delta >= pit_clocks_to_ns(PIT_MAX_ONESHOT_CLOCKS)) {
+    clocks = PIT_MAX_ONESHOT_CLOCKS;  //too far off for one go, we will come back and do the rest
+  } else {
+    clocks = pit_ns_to_clocks((uint32_t)delta);
+    if(clocks < PIT_MIN_ONESHOT_CLOCKS) clocks = PIT_MIN_ONESHOT_CLOCKS;
+    if(clocks > PIT_MAX_ONESHOT_CLOCKS) clocks = PIT_MAX_ONESHOT_CLOCKS;
+  }
+  pit_start_oneshot((uint16_t)clocks);
+}
+
+void initialise_timers()
+{
+  tick_ns = NS_PER_SECOND / pit_get_hz();
+  clock_base_ns = 0;
+  next_tick_ns = tick_ns;
+  armed_expiry_ns = TIMER_NEVER;
+  _start_next_oneshot();
+  timer_running = 1;
+}
+
+uint64_t timer_now_ns()
+{
+  if(!timer_running) return 0;
+  uint32_t flags = irq_save();
+  acquire_spinlock(&clock_lock);
+  uint64_t now = clock_base_ns + pit_clocks_to_ns(pit_oneshot_elapsed());
+  release_spinlock(&clock_lock);
+  irq_restore(flags);
+  return now;
+}
+
+void timer_arm(uint64_t expiry_ns)
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&clock_lock);
+  if(expiry_ns < armed_expiry_ns) {
+    armed_expiry_ns = expiry_ns;
+    //only restart the one-shot if this is going to fire before whatever it is already waiting for
+    if(timer_running && expiry_ns < next_tick_ns) {
+      _catch_up();
+      _start_next_oneshot();
+    }
+  }
+  release_spinlock(&clock_lock);
+  irq_restore(flags);
+}
+
+uint32_t timer_interrupt()
+{
+  uint32_t ticks = 0;
+
+  if(!timer_running) return 0;
+  acquire_spinlock(&clock_lock);
+  _catch_up();
+  while(clock_base_ns >= next_tick_ns) {
+    ++ticks;
+    next_tick_ns += tick_ns;
+  }
+  if(clock_base_ns >= armed_expiry_ns) armed_expiry_ns = TIMER_NEVER;
+  _start_next_oneshot();
+  release_spinlock(&clock_lock);
+  return ticks;
+}
+
+uint8_t timer_heap_init(TimerHeap *h, uint32_t capacity)
+{
+  size_t pages = (capacity * sizeof(struct scheduler_task *) + PAGE_SIZE - 1) / PAGE_SIZE;
+  h->entries = (struct scheduler_task **)vm_alloc_pages(NULL, pages, MP_READWRITE);
+  if(!h->entries) return 1;
+  h->count = 0;
+  h->capacity = pages * PAGE_SIZE / sizeof(struct scheduler_task *);
+  return 0;
+}
+
+uint8_t timer_heap_push(TimerHeap *h, struct scheduler_task *t)
+{
+  if(h->count >= h->capacity) return 1;
+
+  //sift up from the end
+  uint32_t i = h->count++;
+  while(i>0) {
+    uint32_t parent = (i-1) >> 1;
+    if(h->entries[parent]->time_val <= t->time_val) break;
+    h->entries[i] = h->entries[parent];
+    i = parent;
+  }
+  h->entries[i] = t;
+  return 0;
+}
+
+struct scheduler_task *timer_heap_peek(TimerHeap *h)
+{
+  return h->count>0 ? h->entries[0] : NULL;
+}
+
+struct scheduler_task *timer_heap_pop(TimerHeap *h)
+{
+  if(h->count==0) return NULL;
+  struct scheduler_task *top = h->entries[0];
+  struct scheduler_task *last = h->entries[--h->count];
+
+  //sift the last entry down from the top
+  uint32_t i = 0;
+  while(1) {
+    uint32_t child = (i << 1) + 1;
+    if(child >= h->count) break;
+    if(child+1 < h->count && h->entries[child+1]->time_val < h->entries[child]->time_val) ++child;
+    if(last->time_val <= h->entries[child]->time_val) break;
+    h->entries[i] = h->entries[child];
+    i = child;
+  }
+  if(h->count>0) h->entries[i] = last;
+  return top;
+}
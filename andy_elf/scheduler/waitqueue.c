@@ -0,0 +1,174 @@
+#include <types.h>
+#include <stdio.h>
+#include <panic.h>
+#include <sys/ioports.h>
+#include <spinlock.h>
+#include <process.h>
+#include <scheduler/scheduler.h>
+#include <scheduler/runqueue.h>
+#include <scheduler/waitqueue.h>
+
+static uint32_t wait_sequence = 0;
+static WaitQueueEntry wait_entries[PID_MAX];
+//processes are woken by task workers that do not have the kernel lock, so every queue and entry is protected by this
+static spinlock_t wait_lock = 0;
+
+void wait_queue_init(WaitQueue *q)
+{
+  q->head = NULL;
+  q->tail = NULL;
+}
+
+WaitQueueEntry *wait_queue_entry(struct ProcessTableEntry *p)
+{
+  if(p->pid>=PID_MAX) k_panic("wait_queue_entry PID is out of range\r\n");
+  return &wait_entries[p->pid];
+}
+
+uint8_t wait_queue_empty(WaitQueue *q)
+{
+  return q->head==NULL;
+}
+
+/**
+Takes the entry off its queue, if it is on one. Must be called with interrupts off and wait_lock held.
+*/
+static void _unlink(WaitQueueEntry *e)
+{
+  WaitQueue *q = e->queue;
+  if(!q) return;
+
+  WaitQueueEntry *prev = NULL;
+  for(WaitQueueEntry *w=q->head; w!=NULL; prev=w, w=w->next) {
+    if(w!=e) continue;
+    if(prev) {
+      prev->next = e->next;
+    } else {
+      q->head = e->next;
+    }
+    if(q->tail==e) q->tail = prev;
+    break;
+  }
+  e->next = NULL;
+  e->queue = NULL;
+}
+
+/**
+Finishes a wait and makes the process runnable again. Must be called with interrupts off and wait_lock held.
+*/
+static void _wake(WaitQueueEntry *e, uint32_t result)
+{
+  _unlink(e);
+  e->waiting = 0;
+  e->result = result;
+  e->deliver = 1;
+  if(e->process->status==PROCESS_IOWAIT) process_set_status(e->process, PROCESS_READY);
+}
+
+static void _wait_timed_out(SchedulerTask *t)
+{
+  struct ProcessTableEntry *p = get_process((pid_t)t->process_id);
+  if(!p) return;
+
+  WaitQueueEntry *e = wait_queue_entry(p);
+  uint32_t flags = irq_save();
+  acquire_spinlock(&wait_lock);
+  if(e->waiting && e->sequence==(uint32_t)t->data) _wake(e, e->result);
+  release_spinlock(&wait_lock);
+  irq_restore(flags);
+}
+
+void wait_queue_wait(WaitQueue *q, struct ProcessTableEntry *p, uint64_t timeout_ns, uint32_t timeout_result, void *data)
+{
+  WaitQueueEntry *e = wait_queue_entry(p);
+
+  uint32_t flags = irq_save();
+  acquire_spinlock(&wait_lock);
+  if(e->waiting) {
+    kprintf("ERROR Process %d is already waiting\r\n", p->pid);
+    _unlink(e);
+  }
+  e->process = p;
+  e->data = data;
+  e->result = timeout_result;
+  e->sequence = ++wait_sequence;
+  e->waiting = 1;
+  e->deliver = 0;
+  e->next = NULL;
+  e->queue = q;
+  if(q) {
+    if(q->tail) {
+      q->tail->next = e;
+    } else {
+      q->head = e;
+    }
+    q->tail = e;
+  }
+  process_set_status(p, PROCESS_IOWAIT);
+
+  if(timeout_ns!=WAIT_FOREVER) {
+    SchedulerTask *t = new_scheduler_task(TASK_AFTERTIME, &_wait_timed_out, (void *)e->sequence);
+    t->process_id = p->pid;
+    t->time_val = timer_now_ns() + timeout_ns;
+    schedule_task(t);
+  }
+  release_spinlock(&wait_lock);
+  irq_restore(flags);
+}
+
+struct ProcessTableEntry *wait_queue_wake_one(WaitQueue *q, uint32_t result)
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&wait_lock);
+  WaitQueueEntry *e = q->head;
+  if(e) _wake(e, result);
+  release_spinlock(&wait_lock);
+  irq_restore(flags);
+  return e ? e->process : NULL;
+}
+
+struct ProcessTableEntry *wait_queue_wake_data(WaitQueue *q, void *data, uint32_t result)
+{
+  uint32_t flags = irq_save();
+  acquire_spinlock(&wait_lock);
+  WaitQueueEntry *e = q->head;
+  while(e && e->data!=data) e = e->next;
+  if(e) _wake(e, result);
+  release_spinlock(&wait_lock);
+  irq_restore(flags);
+  return e ? e->process : NULL;
+}
+
+uint32_t wait_queue_wake_all(WaitQueue *q, uint32_t result)
+{
+  uint32_t count = 0;
+  uint32_t flags = irq_save();
+  acquire_spinlock(&wait_lock);
+  while(q->head) {
+    _wake(q->head, result);
+    ++count;
+  }
+  release_spinlock(&wait_lock);
+  irq_restore(flags);
+  return count;
+}
+
+void wait_queue_cancel(struct ProcessTableEntry *p)
+{
+  WaitQueueEntry *e = wait_queue_entry(p);
+  uint32_t flags = irq_save();
+  acquire_spinlock(&wait_lock);
+  _unlink(e);
+  e->waiting = 0;
+  e->deliver = 0;
+  release_spinlock(&wait_lock);
+  irq_restore(flags);
+}
+
+void wait_queue_deliver_result(struct ProcessTableEntry *p)
+{
+  WaitQueueEntry *e = wait_queue_entry(p);
+  if(!e->deliver) return;
+  p->saved_regs.eax = e->result;
+  e->deliver = 0;
+}
@@ -0,0 +1,200 @@
+[BITS 32]
+
+section .text
+global ap_trampoline_start
+global ap_trampoline_params
+global ap_trampoline_end
+global smp_configure_interrupts
+
+%include "memlayout.asm"
+
+extern CreateIA32IDTEntry         ;exceptions.s
+extern smp_ap_main                ;smp.c
+extern smp_ipi_received           ;smp.c  Counts the IPI and sends the EOI
+extern smp_tlb_shootdown_interrupt ;smp.c
+extern kernel_lock                ;smp.c
+extern kernel_unlock              ;smp.c
+extern scheduler_reschedule_ipi   ;scheduler/scheduler.c
+extern switch_out_process         ;scheduler/lowlevel.asm
+extern idle_loop                  ;kickoff.s. NOT a function, this is where preempted processes return to
+
+%define IPI_VECTOR_RESCHEDULE     0x40  ;must match include/sys/smp.h
+%define IPI_VECTOR_TLB_SHOOTDOWN  0x41
+%define LAPIC_SPURIOUS_VECTOR     0xFF  ;must match include/acpi/lapic.h
+
+;The trampoline is copied down to APTrampolinePage before it is used, so absolute addresses in it have to be worked out from there
+%define TRAMPOLINE_ADDR(label) (APTrampolinePage + ((label) - ap_trampoline_start))
+
+;Purpose: attaches the IPI handlers to the IDT. Called by smp_initialise.
+smp_configure_interrupts:
+  push ebp
+  mov ebp, esp
+  push ebx
+  push esi
+  push edi
+  push es
+
+  mov ax, 0x08      ;kernel CS
+  mov es, ax
+
+  mov esi, IDTOffset + IPI_VECTOR_RESCHEDULE*8
+  mov edi, IReschedule
+  mov bl, 0x0E      ;interrupt gate
+  xor ecx, ecx
+  call CreateIA32IDTEntry
+  ;esi now points to the next entry, which is IPI_VECTOR_TLB_SHOOTDOWN
+  mov edi, ITlbShootdown
+  mov bl, 0x0E
+  xor ecx, ecx
+  call CreateIA32IDTEntry
+
+  mov esi, IDTOffset + LAPIC_SPURIOUS_VECTOR*8
+  mov edi, ILapicSpurious
+  mov bl, 0x0E
+  xor ecx, ecx
+  call CreateIA32IDTEntry
+
+  pop es
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+  ret
+
+IReschedule:  ;another processor has put a process onto the run queues, or the BSP has seen our process's quantum run out
+  push ebp
+  mov ebp, esp
+  push eax
+  push ecx
+  push edx
+  push ebx
+  push ds
+  push es
+  push fs
+  push gs
+
+  mov ax, 0x10
+  mov ds, ax
+  mov es, ax
+  mov fs, ax
+  mov gs, ax
+
+  call smp_ipi_received
+
+  mov eax, [ebp+8]      ;CS of the interrupted code
+  test eax, 0x03
+  jz .done              ;we woke up out of idle_loop, which goes on to enter_next_process anyway
+
+  call kernel_lock      ;kept hold of if we preempt, idle_loop expects to have it
+  mov eax, [ebp+8]
+  push eax
+  call scheduler_reschedule_ipi
+  add esp, 4
+  test al, al
+  jnz .preempt
+  call kernel_unlock
+
+  .done:
+  pop gs
+  pop fs
+  pop es
+  pop ds
+  pop ebx
+  pop edx
+  pop ecx
+  pop eax
+  pop ebp
+  iret
+
+  .preempt:
+  ;the same as ITimer, put the process's registers back so that switch_out_process can save them and then go to the idle loop
+  pop gs
+  pop fs
+  pop es
+  pop ds
+  pop ebx
+  pop edx
+  pop ecx
+  pop eax
+  pop ebp
+  call switch_out_process
+  pushf
+  xor eax, eax
+  mov eax, cs
+  push eax
+  mov eax, idle_loop
+  push eax
+  iret
+
+ITlbShootdown:  ;drop cached translations. No kernel lock, the processor that sent this is holding it while it waits for us
+  push eax
+  push ecx
+  push edx
+  push ds
+  push es
+
+  mov ax, 0x10
+  mov ds, ax
+  mov es, ax
+
+  call smp_tlb_shootdown_interrupt
+
+  pop es
+  pop ds
+  pop edx
+  pop ecx
+  pop eax
+  iret
+
+ILapicSpurious: ;spurious local APIC interrupts must not get an EOI
+  iret
+
+;Purpose: application processor startup code. smp_initialise copies this to APTrampolinePage and sends a startup IPI that
+;points to it, so each processor starts here in real mode with CS = APTrampolinePage >> 4 and IP = 0.
+;Everything is position-independent until paging is on, after that it only uses absolute addresses.
+[BITS 16]
+ap_trampoline_start:
+  cli
+  cld
+  xor ax, ax
+  mov ds, ax
+  o32 lgdt [FullGDTPtr]   ;the BSP's GDT to begin with. smp_ap_main moves on to this processor's own one.
+  mov eax, cr0
+  or eax, 1               ;protected mode
+  mov cr0, eax
+  jmp dword 0x08:TRAMPOLINE_ADDR(ap_trampoline_pmode)
+
+[BITS 32]
+ap_trampoline_pmode:
+  mov ax, 0x10
+  mov ds, ax
+  mov es, ax
+  mov fs, ax
+  mov gs, ax
+  mov ss, ax
+  lidt [IDTPtr]
+
+  ;the same paging setup as the BSP. This page is identity-mapped, so we carry straight on once paging is switched on.
+  mov eax, [TRAMPOLINE_ADDR(ap_trampoline_params) + 0x08]  ;CR4
+  mov cr4, eax
+  mov eax, [TRAMPOLINE_ADDR(ap_trampoline_params) + 0x04]  ;CR3
+  mov cr3, eax
+  mov eax, [TRAMPOLINE_ADDR(ap_trampoline_params)]         ;CR0
+  mov cr0, eax
+
+  mov esp, [TRAMPOLINE_ADDR(ap_trampoline_params) + 0x0C]  ;kernel stack
+  push dword [TRAMPOLINE_ADDR(ap_trampoline_params) + 0x10] ;struct CpuState *
+  mov eax, smp_ap_main    ;a relative call would be wrong now that the code has been moved
+  call eax
+  add esp, 4
+  mov eax, idle_loop      ;smp_ap_main returns holding the kernel lock, which is what idle_loop expects
+  jmp eax
+
+align 4
+ap_trampoline_params:     ;struct ApTrampolineParams in smp.c, filled in for each processor before it is started
+  dd 0  ;CR0
+  dd 0  ;CR3
+  dd 0  ;CR4
+  dd 0  ;kernel stack
+  dd 0  ;struct CpuState *
+ap_trampoline_end:
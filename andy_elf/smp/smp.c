@@ -0,0 +1,371 @@
+#include <types.h>
+#include <stdio.h>
+#include <panic.h>
+#include <memops.h>
+#include <kernel_config.h>
+#include <sys/mmgr.h>
+#include <sys/ioports.h>
+#include <sys/gdt.h>
+#include <sys/tlb.h>
+#include <sys/smp.h>
+#include <acpi/lapic.h>
+#include <scheduler/timer.h>
+#include <scheduler/fpu.h>
+#include <native_api/sysenter.h>
+
+//defined in smp/lowlevel.asm
+extern char ap_trampoline_start[];
+extern char ap_trampoline_params[];
+extern char ap_trampoline_end[];
+void smp_configure_interrupts();
+
+/**
+Filled in by the BSP before it starts each application processor, and read by the trampoline.
+Must match ap_trampoline_params in smp/lowlevel.asm.
+*/
+struct ApTrampolineParams {
+  uint32_t cr0;
+  uint32_t cr3;
+  uint32_t cr4;
+  uint32_t stack;
+  uint32_t cpu;     //struct CpuState * that is passed to smp_ap_main
+} __attribute__((packed));
+
+#define BSP_KERNEL_STACK  0x7FFF8   //see the TSS set up in kickoff.s
+
+static struct CpuState cpus[SMP_MAX_CPUS] = {
+  { .index = 0, .online = 1, .kernel_stack = BSP_KERNEL_STACK },
+};
+static uint8_t cpu_count = 1;
+
+//processors found in the MADT. Which one of them is us isn't known until the local APIC is mapped.
+static uint8_t madt_apic_ids[SMP_MAX_CPUS];
+static uint8_t madt_cpu_count = 0;
+
+static volatile uint32_t kernel_lock_owner = SMP_NO_CPU;
+static uint32_t kernel_lock_depth = 0;
+
+/*
+There is only ever one shootdown going on at once, because only the processor with the kernel lock can start one.
+*/
+static struct {
+  const vaddr *pages;
+  size_t page_count;          //0 means everything
+  uint8_t include_global;
+  volatile uint32_t pending;  //bit n is set until processor n has done it
+} shootdown;
+
+void smp_add_processor(uint8_t apic_id)
+{
+  if(madt_cpu_count>=SMP_MAX_CPUS) {
+    kprintf("WARNING Ignoring processor with APIC ID %d, only %d are supported\r\n", (uint32_t)apic_id, SMP_MAX_CPUS);
+    return;
+  }
+  madt_apic_ids[madt_cpu_count++] = apic_id;
+}
+
+struct CpuState *this_cpu()
+{
+  struct {
+    uint16_t limit;
+    uint32_t base;
+  } __attribute__((packed)) gdtr;
+
+  //every processor apart from the BSP runs on the GDT at the start of its own CpuState
+  asm volatile("sgdt %0" : "=m"(gdtr));
+  if(gdtr.base==FULL_GDT_ADDRESS) return &cpus[0];
+  return (struct CpuState *)gdtr.base;
+}
+
+uint8_t smp_cpu_count()
+{
+  return cpu_count;
+}
+
+struct CpuState *smp_get_cpu(uint8_t index)
+{
+  return index<cpu_count ? &cpus[index] : NULL;
+}
+
+vaddr smp_kernel_stack()
+{
+  return this_cpu()->kernel_stack;
+}
+
+void smp_send_ipi(uint8_t index, uint8_t vector)
+{
+  plapic_send_ipi(cpus[index].apic_id, ICR_DELIVERY_FIXED | vector);
+}
+
+/**
+Called by the IPI handlers in lowlevel.asm
+*/
+void smp_ipi_received()
+{
+  ++this_cpu()->ipis_received;
+  plapic_send_eoi();
+}
+
+void smp_kick_idle_cpu()
+{
+  struct CpuState *me = this_cpu();
+
+  for(uint8_t i=0; i<cpu_count; i++) {
+    struct CpuState *cpu = &cpus[i];
+    if(cpu==me || !cpu->online) continue;
+    //as far as anybody else is concerned it is busy now, so that the next process to become ready wakes somebody else.
+    //Two processors can get here at once, so only the one that clears the flag sends the IPI.
+    if(!__sync_bool_compare_and_swap(&cpu->idle, 1, 0)) continue;
+    smp_send_ipi(i, IPI_VECTOR_RESCHEDULE);
+    return;
+  }
+}
+
+static void _service_tlb_shootdown(uint8_t index)
+{
+  uint32_t bit = 1 << index;
+  if(!(shootdown.pending & bit)) return;
+  tlb_apply_shootdown(shootdown.pages, shootdown.page_count, shootdown.include_global);
+  __sync_fetch_and_and(&shootdown.pending, ~bit);
+}
+
+/**
+Called by the IPI_VECTOR_TLB_SHOOTDOWN handler. This doesn't take the kernel lock, because the processor that sent it is
+holding the lock while it waits for us.
+*/
+void smp_tlb_shootdown_interrupt()
+{
+  struct CpuState *cpu = this_cpu();
+  ++cpu->ipis_received;
+  _service_tlb_shootdown(cpu->index);
+  plapic_send_eoi();
+}
+
+void smp_tlb_shootdown(const vaddr *pages, size_t page_count, uint8_t include_global)
+{
+  if(cpu_count<2) return;
+
+  //this has to finish before anything else can start one, including an interrupt handler on this processor
+  uint32_t flags = irq_save();
+  uint8_t me = this_cpu()->index;
+  uint32_t targets = 0;
+  for(uint8_t i=0; i<cpu_count; i++) {
+    if(i!=me && cpus[i].online) targets |= (1 << i);
+  }
+
+  if(targets) {
+    shootdown.pages = pages;
+    shootdown.page_count = page_count;
+    shootdown.include_global = include_global;
+    __sync_synchronize();
+    shootdown.pending = targets;
+    for(uint8_t i=0; i<cpu_count; i++) {
+      if(targets & (1 << i)) smp_send_ipi(i, IPI_VECTOR_TLB_SHOOTDOWN);
+    }
+    //the others either take the IPI, or see the request while they spin in kernel_lock
+    while(shootdown.pending) asm volatile("pause");
+  }
+  irq_restore(flags);
+}
+
+void kernel_lock()
+{
+  uint32_t flags = irq_save();
+  uint8_t me = this_cpu()->index;
+
+  if(kernel_lock_owner==me) {
+    ++kernel_lock_depth;
+  } else {
+    while(!__sync_bool_compare_and_swap(&kernel_lock_owner, SMP_NO_CPU, me)) {
+      //whoever has got it might be waiting for us to drop some translations
+      _service_tlb_shootdown(me);
+      asm volatile("pause");
+    }
+    kernel_lock_depth = 1;
+  }
+  irq_restore(flags);
+}
+
+void kernel_unlock()
+{
+  uint32_t flags = irq_save();
+  if(kernel_lock_owner!=this_cpu()->index) k_panic("kernel_unlock called by a processor that does not hold the kernel lock\r\n");
+
+  if(--kernel_lock_depth==0) {
+    __sync_synchronize();
+    kernel_lock_owner = SMP_NO_CPU;
+  }
+  irq_restore(flags);
+}
+
+uint32_t smp_kernel_lock_depth()
+{
+  uint32_t flags = irq_save();
+  uint32_t depth = kernel_lock_owner==this_cpu()->index ? kernel_lock_depth : 0;
+  irq_restore(flags);
+  return depth;
+}
+
+void smp_idle_enter()
+{
+  struct CpuState *cpu = this_cpu();
+  //everything that leads back to idle_loop comes from user mode, so nothing else can be holding the lock on top of it
+  if(kernel_lock_depth!=1) {
+    kprintf("ERROR Processor %d is in the idle loop with the kernel lock taken %d times\r\n", (uint32_t)cpu->index, kernel_lock_depth);
+    k_panic("Kernel lock is unbalanced\r\n");
+  }
+  cpu->idle = 1;
+  kernel_unlock();
+}
+
+void smp_idle_exit()
+{
+  kernel_lock();
+  this_cpu()->idle = 0;
+}
+
+static void _delay_us(uint32_t us)
+{
+  uint64_t until = timer_now_ns() + (uint64_t)us * NS_PER_US;
+  while(timer_now_ns() < until) asm volatile("pause");
+}
+
+static void _set_tss_descriptor(uint64_t *entry, vaddr base)
+{
+  uint8_t *d = (uint8_t *)entry;
+  d[0] = 0x68;            //limit bits 0-7, the same as kickoff.s uses
+  d[1] = 0x00;            //limit bits 8-15
+  d[2] = (uint8_t)(base & 0xFF);
+  d[3] = (uint8_t)((base >> 8) & 0xFF);
+  d[4] = (uint8_t)((base >> 16) & 0xFF);
+  d[5] = GDT_TSS_AVAILABLE;
+  d[6] = 0x40;
+  d[7] = (uint8_t)((base >> 24) & 0xFF);
+}
+
+/**
+Sets up the GDT, TSS and kernel stack for an application processor, before it is started.
+Returns 0 on success or 1 if there is no memory for the stack.
+*/
+static uint8_t _prepare_cpu(struct CpuState *cpu, uint8_t index, uint8_t apic_id)
+{
+  memset(cpu, 0, sizeof(struct CpuState));
+  cpu->index = index;
+  cpu->apic_id = apic_id;
+
+  cpu->stack_base = vm_alloc_pages(NULL, SMP_AP_STACK_PAGES, MP_READWRITE);
+  if(!cpu->stack_base) {
+    kprintf("ERROR Not enough memory for a kernel stack for processor %d\r\n", (uint32_t)index);
+    return 1;
+  }
+  vaddr stack_top = (vaddr)cpu->stack_base + SMP_AP_STACK_PAGES*PAGE_SIZE;
+  //the same gaps at the top as the BSP has, see exit_to_process and kickoff.s
+  cpu->kernel_stack = stack_top - 0x08;
+
+  //the same segments as the BSP, apart from the TSS which must be a different one for each processor
+  memcpy(cpu->gdt, (void *)FULL_GDT_ADDRESS, sizeof(cpu->gdt));
+  _set_tss_descriptor(&cpu->gdt[GDT_TSS >> 3], (vaddr)&cpu->tss);
+  cpu->tss.esp0 = stack_top - 0x10;
+  cpu->tss.ss0 = GDT_KERNEL_DS;
+  cpu->tss.iomap_base = sizeof(struct TaskStateSegment);
+  return 0;
+}
+
+/**
+Wakes up an application processor with INIT-SIPI-SIPI and waits for it to say that it is running.
+Returns 0 if it came up or 1 if it did not.
+*/
+static uint8_t _start_cpu(struct CpuState *cpu)
+{
+  plapic_send_ipi(cpu->apic_id, ICR_DELIVERY_INIT | ICR_LEVEL_ASSERT | ICR_TRIGGER_LEVEL);
+  _delay_us(200);
+  plapic_send_ipi(cpu->apic_id, ICR_DELIVERY_INIT | ICR_TRIGGER_LEVEL); //de-assert, only old discrete APICs need this
+  _delay_us(10000);
+
+  //the second startup IPI is only for processors that missed the first one, it is ignored by ones that are already running
+  for(uint8_t attempt=0; attempt<2 && !cpu->online; attempt++) {
+    plapic_send_ipi(cpu->apic_id, ICR_DELIVERY_STARTUP | (SMP_TRAMPOLINE_ADDRESS >> 12));
+    _delay_us(200);
+  }
+
+  uint64_t give_up = timer_now_ns() + (uint64_t)SMP_STARTUP_TIMEOUT_MS * NS_PER_MS;
+  while(!cpu->online && timer_now_ns() < give_up) asm volatile("pause");
+  if(cpu->online) return 0;
+
+  //put it back to sleep, so that it can't wake up later on and use the next processor's stack
+  plapic_send_ipi(cpu->apic_id, ICR_DELIVERY_INIT | ICR_LEVEL_ASSERT | ICR_TRIGGER_LEVEL);
+  return 1;
+}
+
+/**
+The first C code that an application processor runs, called from the trampoline once paging is on. Returns holding the
+kernel lock, and the trampoline then goes on to idle_loop.
+*/
+void smp_ap_main(struct CpuState *cpu)
+{
+  struct {
+    uint16_t limit;
+    uint32_t base;
+  } __attribute__((packed)) gdtr = { sizeof(cpu->gdt) - 1, (uint32_t)cpu->gdt };
+
+  //the selectors are the same as the ones the trampoline loaded from the BSP's GDT, so the segment registers can stay as they are
+  asm volatile("lgdt %0" : : "m"(gdtr));
+  asm volatile("ltr %w0" : : "r"((uint16_t)GDT_TSS));
+  enable_plapic(plapic_get_base(), cpu->apic_id, 0);
+  fpu_initialise_cpu();
+  sysenter_initialise_cpu();
+
+  cpu->online = 1;
+  kernel_lock();
+  kprintf("INFO Processor %d (APIC ID %d) is running\r\n", (uint32_t)cpu->index, (uint32_t)cpu->apic_id);
+}
+
+void smp_initialise()
+{
+  uint32_t max_cpus = config_commandline_uint((struct KernelConfig *)get_kernel_config(), "maxcpus", SMP_MAX_CPUS);
+  if(max_cpus==0 || max_cpus>SMP_MAX_CPUS) {
+    kprintf("WARNING maxcpus=%d is out of range, using %d\r\n", max_cpus, SMP_MAX_CPUS);
+    max_cpus = SMP_MAX_CPUS;
+  }
+
+  if(madt_cpu_count<2 || max_cpus<2) {
+    kprintf("INFO Only using the boot processor, %d found in the MADT\r\n", (uint32_t)madt_cpu_count);
+    return;
+  }
+  if(plapic_map()!=0) return;
+
+  struct CpuState *bsp = &cpus[0];
+  bsp->apic_id = plapic_get_id();
+  enable_plapic(plapic_get_base(), bsp->apic_id, 0);
+  smp_configure_interrupts();
+
+  uint32_t cr0, cr3, cr4;
+  asm volatile("mov %%cr0, %0" : "=r"(cr0));
+  asm volatile("mov %%cr3, %0" : "=r"(cr3));
+  asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+  memcpy((void *)SMP_TRAMPOLINE_ADDRESS, ap_trampoline_start, (size_t)(ap_trampoline_end - ap_trampoline_start));
+  struct ApTrampolineParams *params = (struct ApTrampolineParams *)(SMP_TRAMPOLINE_ADDRESS + (ap_trampoline_params - ap_trampoline_start));
+  params->cr0 = cr0;
+  params->cr3 = cr3;
+  params->cr4 = cr4;
+
+  uint8_t online = 1;
+  for(uint8_t i=0; i<madt_cpu_count && cpu_count<max_cpus; i++) {
+    if(madt_apic_ids[i]==bsp->apic_id) continue;
+
+    struct CpuState *cpu = &cpus[cpu_count];
+    if(_prepare_cpu(cpu, cpu_count, madt_apic_ids[i])!=0) break;
+    ++cpu_count;
+
+    params->stack = (uint32_t)cpu->kernel_stack;
+    params->cpu = (uint32_t)cpu;
+    mb();
+    if(_start_cpu(cpu)==0) {
+      ++online;
+    } else {
+      kprintf("WARNING Processor with APIC ID %d did not start\r\n", (uint32_t)cpu->apic_id);
+    }
+  }
+  kprintf("INFO %d processors are running\r\n", (uint32_t)online);
+}
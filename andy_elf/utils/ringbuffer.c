@@ -1,15 +1,28 @@
 #include <types.h>
 #include <malloc.h>
+#include <slab.h>
+#include <panic.h>
 #include <utils/ringbuffer.h>
 
+//every open console file gets a ring buffer, so the headers come from a slab cache
+static SlabCache *ring_buffer_cache = NULL;
+
+void ring_buffer_init()
+{
+    ring_buffer_cache = slab_cache_create("RingBuffer", sizeof(RingBuffer));
+    if(!ring_buffer_cache) {
+        k_panic("Unable to create ring buffer cache\r\n");
+    }
+}
+
 RingBuffer* ring_buffer_new(size_t len)
 {
-    RingBuffer *rb = (RingBuffer *)malloc(sizeof(RingBuffer));
+    RingBuffer *rb = (RingBuffer *)slab_alloc(ring_buffer_cache);
     if(rb==NULL) return NULL;
 
     rb->buf = (char *)malloc(len);
     if(rb->buf==NULL) {
-        free(rb);
+        slab_free(ring_buffer_cache, rb);
         return NULL;
     }
 
@@ -23,7 +36,10 @@ RingBuffer* ring_buffer_new(size_t len)
 void ring_buffer_unref(RingBuffer *rb)
 {
     --rb->refcount;
-    if(rb->refcount==0) free(rb);
+    if(rb->refcount==0) {
+        free(rb->buf);
+        slab_free(ring_buffer_cache, rb);
+    }
 }
 
 void ring_buffer_ref(RingBuffer *rb)
@@ -1,5 +1,12 @@
 #include <types.h>
 #include <spinlock.h>
+#include <sys/smp.h>
+#include <sys/ioports.h>
+
+/*
+Each processor counts the spinlocks that it is holding, so that a kernel thread is never preempted while it has one;
+whatever ran next on that processor could then spin on it forever. See kthread_preempt.
+*/
 
 /** 
  * Atomically acquire the given lock if it's free, or loop until it is available
@@ -9,9 +16,13 @@ void acquire_spinlock(volatile spinlock_t *lock) {
     kprintf("DEBUG acquiring spinlock 0x%x\r\n", lock);
     #endif
 
-    if(*lock != 0) {
-        kprintf("WARNING attempting to acquire spinlock 0x%x that is already asserted\r\n", lock);
-    }
+    //finding the lock taken is normal now that processors contend for it, so there is no warning for that here; it would
+    //be printed with interrupts off and without the kernel lock that the console needs
+    //counted before the lock is taken, so that there is no moment when it is held but not counted. Interrupts are off so
+    //that we can't be preempted onto another processor part-way through.
+    uint32_t flags = irq_save();
+    ++this_cpu()->spinlocks_held;
+    irq_restore(flags);
     asm volatile (
         ".acquire%=:\n\t"
         "lock bts $0, (%0)\n\t"        //bts is "bit switch". This will set bit 0 to 1 and return the previous value in the "carry" flag
@@ -32,4 +43,5 @@ void release_spinlock(volatile spinlock_t *lock) {
     asm volatile (
         "lock btc $0, (%0)\n\t" : : "r"(lock) : "memory"
     );
+    --this_cpu()->spinlocks_held;
 }
\ No newline at end of file
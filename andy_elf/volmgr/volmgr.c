@@ -4,6 +4,7 @@
 #include <memops.h>
 #include <fs/vfat.h>
 #include <fs/fat_fs.h>
+#include <fs/fat_fileops.h>
 #include <errors.h>
 #include <kernel_config.h>
 #include <panic.h>
@@ -17,6 +18,7 @@ volatile spinlock_t volmgr_lock = 0;
 
 void volmgr_init(struct KernelConfig *config) {
     kputs("volmgr: Initialising Volume Manager\r\n");
+    vfat_init_caches();
     volmgr_state = (struct VolMgr_GlobalState *)malloc(sizeof(struct VolMgr_GlobalState));
     kprintf("volmgr: Allocated global state at 0x%x\r\n", volmgr_state);
     kprintf("volmgr: spinlock at 0x%x\r\n", &volmgr_lock);
@@ -1,21 +1,59 @@
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include "syscalls.h"
 
+#ifndef CLOCK_REALTIME
+#define CLOCK_REALTIME (clockid_t)1
+#endif
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC (clockid_t)4
+#endif
+
+#define CPUID_FEAT_EDX_SEP (1 << 11)
+
+/* -1 until the first syscall has asked cpuid, then whether SYSENTER can be used */
+static int __use_sysenter = -1;
+
+static int __has_sysenter(void) {
+  uint32_t eax = 1, ebx, ecx = 0, edx;
+  __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+  return (edx & CPUID_FEAT_EDX_SEP) ? 1 : 0;
+}
+
 /**
  * Private function to perform a syscall with up to six arguments.
- * Handles interrupt version only at the moment
+ * Uses SYSENTER if the processor has it and int 0x60 if not. SYSENTER
+ * doesn't save a return address, so one is pushed and the stack pointer
+ * is handed over in ebp. SYSEXIT uses ecx and edx to come back, so they
+ * are treated as clobbered either way.
  */
 static inline uint32_t __syscall(uint32_t num, uint32_t ebx, uint32_t ecx,
                           uint32_t edx, uint32_t esi, uint32_t edi) {
-  uint32_t ret;
-
-  __asm__ volatile(
-    "int $0x60"
-      : "=a"(ret)
-      : "a"(num), "b"(ebx), "c"(ecx), "d"(edx), "S"(esi), "D"(edi)
-      : "memory", "cc");
-  return ret;
+  if (__use_sysenter < 0)
+    __use_sysenter = __has_sysenter();
+
+  if (__use_sysenter) {
+    __asm__ volatile(
+      "pushl %%ebp\n\t"
+      "pushl $1f\n\t"
+      "movl %%esp, %%ebp\n\t"
+      "sysenter\n"
+      "1:\n\t"
+      "popl %%ebp"
+        : "+a"(num), "+b"(ebx), "+c"(ecx), "+d"(edx), "+S"(esi), "+D"(edi)
+        :
+        : "memory", "cc");
+  } else {
+    __asm__ volatile(
+      "int $0x60"
+        : "+a"(num), "+b"(ebx), "+c"(ecx), "+d"(edx), "+S"(esi), "+D"(edi)
+        :
+        : "memory", "cc");
+  }
+  return num;
 }
 
 /**
@@ -56,18 +94,112 @@ int ioctl(int fd, unsigned long request, void *argp) {
     return __syscall(API_IOCTL, fd, request, 0, (uint32_t)argp, 0);
 }
 
+/**
+ * Private function to read the time page that the kernel maps into every
+ * process. Gives back the wall clock (seconds since Jan 1, 2000 and
+ * nanoseconds) and the monotonic clock in nanoseconds. If the kernel says
+ * that the TSC can be used, the time since the page was last updated is
+ * added on; otherwise they are as of the last timer interrupt.
+ */
+static void __read_time_page(uint32_t *seconds, uint32_t *nsec, uint64_t *monotonic_ns) {
+  const volatile struct silly_time_page *tp = (const volatile struct silly_time_page *)SILLY_TIME_PAGE_ADDRESS;
+  uint32_t seq, sec;
+  uint64_t ns, mono, since;
+
+  do {
+    seq = tp->seq;
+    __asm__ volatile("" : : : "memory");
+    sec = tp->epoch_seconds;
+    ns = tp->epoch_nsec;
+    mono = tp->monotonic_ns;
+    since = 0;
+    if (tp->flags & SILLY_TIME_PAGE_TSC_VALID) {
+      uint32_t low, high;
+      __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+      uint64_t cycles = (((uint64_t)high << 32) | low) - tp->tsc_at_update;
+      if (cycles >> 32)
+        cycles = 0xFFFFFFFF;  /* the page is updated far more often than this, the kernel must be very busy */
+      since = ((uint64_t)(uint32_t)cycles * tp->tsc_mult) >> tp->tsc_shift;
+    }
+    __asm__ volatile("" : : : "memory");
+  } while ((seq & 1) || seq != tp->seq);
+
+  ns += since;
+  while (ns >= 1000000000) {
+    ns -= 1000000000;
+    ++sec;
+  }
+  if (seconds)
+    *seconds = sec;
+  if (nsec)
+    *nsec = (uint32_t)ns;
+  if (monotonic_ns)
+    *monotonic_ns = mono + since;
+}
+
 /**
  * Returns the current time as the number of seconds since Jan 1, 2000.
  * If tloc is non-null, also stores this value at the location pointed to by tloc.
+ * Read from the time page, so this doesn't need to call the kernel.
  */
 long time(long *tloc) {
-    uint32_t seconds = __syscall(API_GET_TIME, 0, 0, 0, 0, 0);
+    uint32_t seconds;
+    __read_time_page(&seconds, NULL, NULL);
     if (tloc) {
         *tloc = (long)seconds;
     }
     return (long)seconds;
 }
 
+/**
+ * Gets the current time since the Unix epoch. tz is ignored.
+ */
+int gettimeofday(struct timeval *tv, void *tz) {
+    uint32_t seconds, nsec;
+    __read_time_page(&seconds, &nsec, NULL);
+    if (tv) {
+        tv->tv_sec = (time_t)seconds + SILLY_UNIX_OFFSET;
+        tv->tv_usec = nsec / 1000;
+    }
+    return 0;
+}
+
+/**
+ * Gets the time from CLOCK_REALTIME, since the Unix epoch, or from
+ * CLOCK_MONOTONIC, since the kernel started its timer.
+ */
+int clock_gettime(clockid_t clock_id, struct timespec *tp) {
+    uint32_t seconds, nsec;
+    uint64_t monotonic_ns;
+
+    if (!tp) {
+        errno = EFAULT;
+        return -1;
+    }
+    __read_time_page(&seconds, &nsec, &monotonic_ns);
+    if (clock_id == CLOCK_REALTIME) {
+        tp->tv_sec = (time_t)seconds + SILLY_UNIX_OFFSET;
+        tp->tv_nsec = nsec;
+    } else if (clock_id == CLOCK_MONOTONIC) {
+        tp->tv_sec = (time_t)(monotonic_ns / 1000000000);
+        tp->tv_nsec = (long)(monotonic_ns % 1000000000);
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Fills in info with how many times the API call code has been made and
+ * how long it took, in TSC cycles. Returns 0, or -1 if the kernel has no
+ * such call.
+ */
+int silly_api_call_info(uint32_t code, struct silly_api_call_info *info) {
+    uint32_t rtn = __syscall(API_CALL_INFO, code, sizeof(struct silly_api_call_info), 0, (uint32_t)info, 0);
+    return rtn == 0 ? 0 : -1;
+}
+
 /**
  * Terminates the calling process with the given exit status.
  */
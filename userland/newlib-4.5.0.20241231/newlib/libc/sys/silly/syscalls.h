@@ -31,7 +31,43 @@
 #define API_DUP             0x0000000C
 #define API_IOCTL           0x0000000D
 #define API_GET_TIME        0x00000010    /* Return time as number of seconds since Jan 1, 2000 */
+#define API_CALL_INFO       0x00000014    /* Get the counters that the kernel keeps for one API code */
 
 
 #define API_ERR_NOTFOUND    0x80000001    /* No such api code found */
+
+/* Must match struct NativeApiCallInfo in the kernel's include/native_api/dispatch.h */
+#define SILLY_API_NAME_LENGTH        16
+#define SILLY_API_HISTOGRAM_BUCKETS  16
+#define SILLY_API_HISTOGRAM_SHIFT    8   /* bucket 0 is under 2^8 TSC cycles, each one after is twice as wide */
+
+struct silly_api_call_info {
+  uint32_t code;
+  char name[SILLY_API_NAME_LENGTH];
+  uint32_t count;
+  uint64_t total_cycles;
+  uint64_t max_cycles;
+  uint32_t histogram[SILLY_API_HISTOGRAM_BUCKETS];
+} __attribute__((packed));
+
+int silly_api_call_info(uint32_t code, struct silly_api_call_info *info);
+
+/* Must match struct TimePage in the kernel's include/scheduler/timepage.h */
+#define SILLY_TIME_PAGE_ADDRESS   0xFFC00000
+#define SILLY_TIME_PAGE_TSC_VALID (1 << 0)
+#define SILLY_UNIX_OFFSET         946684800   /* seconds from the Unix epoch to Jan 1, 2000 */
+
+struct silly_time_page {
+  uint32_t seq;
+  uint32_t version;
+  uint32_t flags;
+  uint32_t epoch_seconds;
+  uint32_t epoch_nsec;
+  uint32_t reserved;
+  uint64_t monotonic_ns;
+  uint64_t ticks;
+  uint64_t tsc_at_update;
+  uint32_t tsc_mult;
+  uint32_t tsc_shift;
+} __attribute__((packed));
 #endif /* _SILLY_SYSCALLS_H_ */
\ No newline at end of file
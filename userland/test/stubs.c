@@ -1,26 +1,90 @@
 #include <unistd.h>
 
+/*
+The kernel can be entered with SYSENTER if the processor has it (cpuid leaf 1, EDX bit 11), which is quicker than int 0x60.
+SYSENTER doesn't save a return address, so we push one and hand over our stack pointer in ebp; SYSEXIT comes back
+with ecx and edx used up, so those can't be relied on afterwards whichever way we went in.
+*/
+#define CPUID_SEP	(1 << 11)
+
+static int use_sysenter = -1;
+
+static int has_sysenter(void) {
+	unsigned int eax = 1, ebx, ecx = 0, edx;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+	return (edx & CPUID_SEP) ? 1 : 0;
+}
+
+static unsigned int native_call(unsigned int fn, unsigned int ebx, unsigned int ecx, unsigned int edx, unsigned int esi) {
+	if(use_sysenter < 0) use_sysenter = has_sysenter();
+	if(use_sysenter) {
+		asm volatile(
+				"pushl %%ebp\n\t"
+				"pushl $1f\n\t"	//where the kernel comes back to
+				"movl %%esp, %%ebp\n\t"
+				"sysenter\n"
+				"1:\n\t"
+				"popl %%ebp\n\t"
+				: "+a"(fn), "+b"(ebx), "+c"(ecx), "+d"(edx), "+S"(esi)
+				: : "memory", "cc"
+		);
+	} else {
+		asm volatile(
+				"int $0x60"
+				: "+a"(fn), "+b"(ebx), "+c"(ecx), "+d"(edx), "+S"(esi)
+				: : "memory", "cc"
+		);
+	}
+	return fn;
+}
+
 int write(int fd, const void *buf, size_t count) {
-	int ret;
-	asm volatile(
-			"movl %[fd], %%ebx\n\t"
-			"movl %[buf], %%esi\n\t"
-			"movl %[count], %%ecx\n\t"
-			"movl $0x0B, %%eax\n\t"	//function id
-			"int $0x60\n\t" 
-			"movl %%eax, %[ret]\n\t"
-			: [ret] "=r"(ret)
-			: [fd] "rm"(fd), [buf] "rm"(buf), [count] "rm"(count)
-			: "eax", "ebx", "esi", "ecx"
-	);
-	return ret;
+	return (int)native_call(0x0B, fd, count, 0, (unsigned int)buf);
 }
 
 void _exit(int status) {
-	asm volatile(
-			"movl $0x01, %%eax\n\t"	//function id
-			"int $0x60"			//does not return
-			: : "b"(status) : "eax"
-	);
+	native_call(0x01, status, 0, 0, 0);	//does not return
 	while(1) { }	//perma-loop just in case it does return
 }
+
+#ifndef PROT_WRITE
+#define PROT_WRITE	0x2
+#endif
+#define MAP_FAILED	((void *) -1)
+
+/*
+Only private mappings of whole files from a page-aligned offset are supported. The kernel returns an
+error code rather than an address if it fails; those are never page-aligned.
+*/
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	unsigned int ret = native_call(0x11, fd, length, (unsigned int)offset, (prot & PROT_WRITE) ? 1 : 0);
+	if(ret & 0xFFF) return MAP_FAILED;
+	return (void *)ret;
+}
+
+int munmap(void *addr, size_t length) {
+	int ret = (int)native_call(0x12, (unsigned int)addr, length, 0, 0);
+	return ret==0 ? 0 : -1;
+}
+
+/*
+The kernel returns the new nice value, or one of its error codes; those are far below -16 when read as a signed number.
+*/
+int nice(int inc) {
+	int ret = (int)native_call(0x13, inc, 0, 0, 0);
+	return ret < -16 ? -1 : ret;
+}
+
+int usleep(useconds_t usec) {
+	native_call(0x03, usec, 0, 0, 0);
+	return 0;
+}
+
+unsigned int sleep(unsigned int seconds) {
+	while(seconds > 0) {
+		unsigned int chunk = seconds > 4000 ? 4000 : seconds;	//keep the microseconds inside 32 bits
+		usleep(chunk * 1000000);
+		seconds -= chunk;
+	}
+	return 0;
+}